@@ -16,12 +16,17 @@
 #include <string>
 #include <list>
 #include <map>
+#include <mutex>
 #include <stdio.h>
 #include <stdlib.h>
 #include "rapidjson/writer.h"
 #include "rapidjson/document.h"
 #include "associated_uris.h"
+#include "binary_serialization.h"
+#include "arena.h"
+#include "interned_string.h"
 #include <boost/optional.hpp>
+#include <boost/container/flat_map.hpp>
 
 /// JSON serialization constants.
 /// These live here, as the core logic of serialization lives in the AoR
@@ -58,13 +63,19 @@ public:
   Binding(const Binding& other);
   Binding& operator= (Binding const& other);
 
+  /// Moving a binding takes its strings and containers, rather than copying
+  /// them.
+  Binding(Binding&& other) = default;
+  Binding& operator= (Binding&& other) = default;
+
   // Compares the contents of this class instance to another, to see
   // if they are the same.
   bool operator==(const Binding& other) const;
   bool operator!=(const Binding& other) const;
 
-  /// The address of record, e.g. "sip:name@example.com".
-  std::string _address_of_record;
+  /// The address of record, e.g. "sip:name@example.com". This is the same
+  /// for every binding in an AoR, so is interned.
+  InternedString _address_of_record;
 
   /// The registered contact URI, e.g.,
   /// "sip:2125551212@192.168.0.1:55491;transport=TCP;rinstance=fad34fbcdea6a931"
@@ -97,15 +108,18 @@ public:
   std::map<std::string, std::string> _params;
 
   /// The private ID this binding was registered with.
-  std::string _private_id;
+  InternedString _private_id;
 
   /// Whether this is an emergency registration.
   bool _emergency_registration;
 
   /// Serialize the binding as a JSON object.
   ///
-  /// @param writer - a rapidjson writer to write to.
-  void to_json(rapidjson::Writer<rapidjson::StringBuffer>& writer) const;
+  /// @param writer - a rapidjson writer to write to. This can be a
+  ///                 rapidjson::Writer<rapidjson::StringBuffer> or a
+  ///                 JsonStringWriter.
+  template <class JsonWriter>
+  void to_json(JsonWriter& writer) const;
 
   // Deserialize a binding from a JSON object.
   //
@@ -114,11 +128,30 @@ public:
   // @return      - Nothing. If this function fails (because the JSON is not
   //                semantically valid) this method throws JsonFormError.
   void from_json(const rapidjson::Value& b_obj);
+
+  /// Serialize the binding in the compact binary format.
+  ///
+  /// @param writer - a binary writer to write to.
+  void to_binary(BinaryWriter& writer) const;
+
+  // Deserialize a binding from the compact binary format.
+  //
+  // @param reader - a binary reader positioned at the start of the binding.
+  //
+  // @return       - Nothing. If this function fails (because the data is
+  //                 truncated or corrupt) this method throws BinaryFormatError.
+  void from_binary(BinaryReader& reader);
 };
 
 /// Typedef the map Bindings and the pair BindingPair. First is sometimes the
 /// contact URI, but not always. Second is a pointer to a Binding.
-typedef std::map<std::string, Binding*> Bindings;
+///
+/// An AoR typically only has a handful of bindings, so these are held in a
+/// sorted vector rather than a tree. This needs a single allocation for all
+/// the entries, and lookups don't have to chase pointers between nodes. The
+/// Binding objects themselves are still allocated separately, so pointers
+/// returned by AoR::get_binding stay valid when other bindings are added.
+typedef boost::container::flat_map<std::string, Binding*> Bindings;
 typedef std::pair<std::string, Binding*> BindingPair;
 
 /// @class Subscription
@@ -133,6 +166,11 @@ public:
   Subscription(const Subscription& other);
   Subscription& operator= (Subscription const& other);
 
+  /// Moving a subscription takes its strings and containers, rather than
+  /// copying them.
+  Subscription(Subscription&& other) = default;
+  Subscription& operator= (Subscription&& other) = default;
+
   // Compares the contents of this class instance to another, to see
   // if they are the same.
   bool operator==(const Subscription& other) const;
@@ -173,8 +211,11 @@ public:
 
   /// Serialize the subscription as a JSON object.
   ///
-  /// @param writer - a rapidjson writer to write to.
-  void to_json(rapidjson::Writer<rapidjson::StringBuffer>& writer) const;
+  /// @param writer - a rapidjson writer to write to. This can be a
+  ///                 rapidjson::Writer<rapidjson::StringBuffer> or a
+  ///                 JsonStringWriter.
+  template <class JsonWriter>
+  void to_json(JsonWriter& writer) const;
 
   // Deserialize a subscription from a JSON object.
   //
@@ -183,12 +224,36 @@ public:
   // @return      - Nothing. If this function fails (because the JSON is not
   //                semantically valid) this method throws JsonFormError.
   void from_json(const rapidjson::Value& s_obj);
+
+  /// Serialize the subscription in the compact binary format.
+  ///
+  /// @param writer - a binary writer to write to.
+  void to_binary(BinaryWriter& writer) const;
+
+  // Deserialize a subscription from the compact binary format.
+  //
+  // @param reader - a binary reader positioned at the start of the
+  //                 subscription.
+  //
+  // @return       - Nothing. If this function fails (because the data is
+  //                 truncated or corrupt) this method throws BinaryFormatError.
+  void from_binary(BinaryReader& reader);
+
+  // Skip over a subscription in the compact binary format without decoding
+  // it.
+  //
+  // @param reader - a binary reader positioned at the start of the
+  //                 subscription.
+  //
+  // @return       - The expiry time of the subscription. If the data is
+  //                 truncated or corrupt this method throws BinaryFormatError.
+  static int skip_binary(BinaryReader& reader);
 };
 
 /// Typedef the map Subscriptions and the pair SubscriptionPair. First is
 /// sometimes the To tag, but not always. Second is a pointer to a
-/// Subscription.
-typedef std::map<std::string, Subscription*> Subscriptions;
+/// Subscription. This is a sorted vector for the same reasons as Bindings.
+typedef boost::container::flat_map<std::string, Subscription*> Subscriptions;
 typedef std::pair<std::string, Subscription*> SubscriptionPair;
 
 class PatchObject
@@ -204,24 +269,43 @@ public:
   PatchObject(const PatchObject& other);
   PatchObject& operator= (PatchObject const& other);
 
-  /// Public functions to get the member variables
-  inline const Bindings get_update_bindings() const { return _update_bindings; }
-  inline const std::vector<std::string> get_remove_bindings() const { return _remove_bindings; }
-  inline const Subscriptions get_update_subscriptions() const { return _update_subscriptions; }
-  inline const std::vector<std::string> get_remove_subscriptions() const { return _remove_subscriptions; }
-  inline const boost::optional<AssociatedURIs> get_associated_uris() const { return _associated_uris; }
+  /// Moving a PatchObject transfers ownership of its bindings and
+  /// subscriptions without copying them.
+  PatchObject(PatchObject&& other);
+  PatchObject& operator= (PatchObject&& other);
+
+  /// Public functions to get the member variables. These return references
+  /// to the PatchObject's own containers, which are only valid for as long as
+  /// the PatchObject is.
+  inline const Bindings& get_update_bindings() const { return _update_bindings; }
+  inline const std::vector<std::string>& get_remove_bindings() const { return _remove_bindings; }
+  inline const Subscriptions& get_update_subscriptions() const { return _update_subscriptions; }
+  inline const std::vector<std::string>& get_remove_subscriptions() const { return _remove_subscriptions; }
+  inline const boost::optional<AssociatedURIs>& get_associated_uris() const { return _associated_uris; }
+  inline const boost::optional<std::string>& get_timer_id() const { return _timer_id; }
   inline const int get_minimum_cseq() const { return _minimum_cseq; }
   inline const bool get_increment_cseq() const { return _increment_cseq; }
 
-  /// Public functions to set the member variables
-  inline void set_update_bindings(Bindings bindings) { _update_bindings = bindings; }
-  inline void set_remove_bindings(std::vector<std::string> bindings) { _remove_bindings = bindings; }
-  inline void set_update_subscriptions(Subscriptions subscriptions) { _update_subscriptions = subscriptions; }
-  inline void set_remove_subscriptions(std::vector<std::string> subscriptions) { _remove_subscriptions = subscriptions; }
-  inline void set_associated_uris(AssociatedURIs associated_uris) { _associated_uris = associated_uris; }
+  /// Public functions to set the member variables. The PatchObject takes
+  /// ownership of any bindings and subscriptions. Pass the containers with
+  /// std::move to avoid copying them.
+  inline void set_update_bindings(Bindings bindings) { _update_bindings = std::move(bindings); }
+  inline void set_remove_bindings(std::vector<std::string> bindings) { _remove_bindings = std::move(bindings); }
+  inline void set_update_subscriptions(Subscriptions subscriptions) { _update_subscriptions = std::move(subscriptions); }
+  inline void set_remove_subscriptions(std::vector<std::string> subscriptions) { _remove_subscriptions = std::move(subscriptions); }
+  inline void set_associated_uris(AssociatedURIs associated_uris) { _associated_uris = std::move(associated_uris); }
+  inline void set_timer_id(std::string timer_id) { _timer_id = std::move(timer_id); }
   inline void set_minimum_cseq(int minimum) { _minimum_cseq = minimum; }
   inline void set_increment_cseq(bool increment) { _increment_cseq = increment; }
 
+  /// Merge a later patch into this one, so that applying this patch has the
+  /// same effect as applying this patch and then the later one. The only
+  /// exception is the CSeq increment - the merged patch increments the CSeq
+  /// at most once.
+  ///
+  /// @param later - The patch to merge in. This is copied.
+  void merge(const PatchObject& later);
+
 private:
   // Common code between copy and assignment
   void common_constructor(const PatchObject& other);
@@ -247,6 +331,12 @@ private:
   /// we want to apply.
   boost::optional<AssociatedURIs> _associated_uris;
 
+  /// The Chronos timer ID to set on the AoR, if it should be changed. Patches
+  /// from clients don't set this - it's used when S4 replicates the ID of a
+  /// timer that was created after the AoR was written (see
+  /// S4::store_timer_id).
+  boost::optional<std::string> _timer_id;
+
   /// What's the minimum value of the AoR CSeq after this patch has been
   /// applied. This is used when S4 sends a PatchObhect to another S4. On this
   /// interface we want the local and remote S4s to end up with the same CSeq
@@ -289,6 +379,11 @@ public:
   // Make sure assignment is deep!
   AoR& operator= (AoR const& other);
 
+  /// Moving an AoR transfers ownership of its bindings, subscriptions and
+  /// any arena without copying them. The moved-from AoR is left empty.
+  AoR(AoR&& other);
+  AoR& operator= (AoR&& other);
+
   // Compares the contents of this class instance to another, to see
   // if they are the same.
   bool operator==(const AoR& other) const;
@@ -297,6 +392,9 @@ public:
   // Common code between copy and assignment
   void common_constructor(const AoR& other);
 
+  // Common code between move construction and move assignment
+  void move_constructor(AoR& other);
+
   /// Clear all the bindings and subscriptions from this object.
   void clear(bool clear_associated_uris);
 
@@ -318,17 +416,38 @@ public:
   /// Retrieve all the bindings.
   inline const Bindings& bindings() const { return _bindings; }
 
+  /// Remove all the subscriptions, without decoding them if they haven't
+  /// been decoded yet.
+  void clear_subscriptions();
+
   /// Retrieve all the subscriptions.
-  inline const Subscriptions& subscriptions() const { return _subscriptions; }
+  inline const Subscriptions& subscriptions() const
+  {
+    decode_subscriptions();
+    return _subscriptions;
+  }
+
+  /// Retrieve the associated URIs for this IRS.
+  inline AssociatedURIs& associated_uris()
+  {
+    decode_associated_uris();
+    return _associated_uris;
+  }
+
+  inline const AssociatedURIs& associated_uris() const
+  {
+    decode_associated_uris();
+    return _associated_uris;
+  }
 
   // Return the number of bindings in the AoR.
   inline uint32_t get_bindings_count() const { return _bindings.size(); }
 
   // Return the number of subscriptions in the AoR.
-  inline uint32_t get_subscriptions_count() const { return _subscriptions.size(); }
+  uint32_t get_subscriptions_count() const;
 
   // Return the expiry time of the binding or subscription due to expire next.
-  int get_next_expires();
+  int get_next_expires() const;
 
   /// This returns the expiry time of the binding or subscription due to expire
   /// last.
@@ -340,6 +459,14 @@ public:
   ///         expire last.
   int get_last_expires() const;
 
+  /// Work out the next and last expiry times of the bindings and
+  /// subscriptions, in a single pass over them. Use this rather than calling
+  /// both get_next_expires and get_last_expires.
+  ///
+  /// @param next_expires[out] - As returned by get_next_expires.
+  /// @param last_expires[out] - As returned by get_last_expires.
+  void get_expires(int& next_expires, int& last_expires) const;
+
   /// Copy all site agnostic values from one AoR to this AoR. This copies basically
   /// everything, but importantly not the CAS. It doesn't remove any bindings
   /// or subscriptions that may have been in the existing AoR but not in the copied
@@ -377,22 +504,138 @@ public:
   /// Map holding the bindings for a particular AoR indexed by binding ID.
   Bindings _bindings;
 
-  /// Map holding the subscriptions for this AoR, indexed by the To tag
-  /// generated when the subscription dialog was established.
-  Subscriptions _subscriptions;
-
-  // Associated URIs class, to hold the associated URIs for this IRS.
-  AssociatedURIs _associated_uris;
-
   /// CAS value for this AoR record.  Used when updating an existing record.
   /// Zero for a new record that has not yet been written to a store.
   uint64_t _cas;
 
+  /// Size of this AoR's record when it was last read from or written to the
+  /// store, or zero if it hasn't been. This is used to size the buffer when
+  /// the AoR is next serialized.
+  size_t _serialized_size;
+
   // SIP URI for this AoR
   std::string _uri;
 
+  /// Hold the subscriptions and Associated URIs sections of a binary record
+  /// without decoding them. Each section is decoded the first time it is
+  /// used, and a section that is never used can be written back to the store
+  /// unchanged. The sections are checked to be well formed here, so that
+  /// corrupt records are still spotted when they are read.
+  ///
+  /// @param subscriptions   - The subscriptions section, including its
+  ///                          length prefix.
+  /// @param associated_uris - The Associated URIs section, including its
+  ///                          length prefix.
+  ///
+  /// @return                - Nothing. If either section is corrupt this
+  ///                          method throws BinaryFormatError.
+  void set_binary_sections(const std::string& subscriptions,
+                           const std::string& associated_uris);
+
+  /// Write out the undecoded subscriptions or Associated URIs section passed
+  /// to set_binary_sections, exactly as it was passed in.
+  ///
+  /// @return - Whether the section was written. This is false if the section
+  ///           has since been decoded (and so may have been changed), in which
+  ///           case the caller must encode it instead.
+  bool write_binary_subscriptions(BinaryWriter& writer) const;
+  bool write_binary_associated_uris(BinaryWriter& writer) const;
+
+  /// Allocate this AoR's bindings and subscriptions from an arena owned by
+  /// the AoR, rather than one at a time from the heap. The memory is then
+  /// freed in one go when the AoR is cleared or destroyed (although memory
+  /// for bindings and subscriptions that are removed before then is not
+  /// reused). This only has an effect if the AoR doesn't have any bindings or
+  /// subscriptions yet.
+  ///
+  /// @param first_block_size - The size of the arena's first block. This
+  ///                           should be enough for the bindings and
+  ///                           subscriptions that the AoR is expected to
+  ///                           hold (see arena_size). If this is 0, no arena
+  ///                           is used.
+  void use_arena(size_t first_block_size);
+
+  /// The amount of arena memory needed to hold the given number of bindings
+  /// and subscriptions.
+  static size_t arena_size(size_t num_bindings, size_t num_subscriptions);
+
   /// Store code is allowed to manipulate bindings and subscriptions directly.
   friend class AoRStore;
+
+private:
+  /// Apply a patch's updates and removals to the AoR's bindings or
+  /// subscriptions. Each entry is found by a keyed lookup, and existing
+  /// entries are updated in place.
+  ///
+  /// @param entries  - The AoR's bindings or subscriptions.
+  /// @param updates  - The entries to add or replace.
+  /// @param removals - The IDs of the entries to remove.
+  /// @param type     - The type of entry, for logging.
+  template <class T>
+  void patch_entries(boost::container::flat_map<std::string, T*>& entries,
+                     const boost::container::flat_map<std::string, T*>& updates,
+                     const std::vector<std::string>& removals,
+                     const char* type);
+
+  /// Create or destroy a binding or subscription belonging to this AoR, using
+  /// the arena if there is one.
+  template <class T, class... Args>
+  T* create(Args&&... args) const
+  {
+    return (_arena != NULL) ? _arena->create<T>(std::forward<Args>(args)...) :
+                              new T(std::forward<Args>(args)...);
+  }
+
+  template <class T>
+  void destroy(T* object) const
+  {
+    if (_arena != NULL)
+    {
+      Arena::destroy(object);
+    }
+    else
+    {
+      delete object;
+    }
+  }
+
+  /// Decode the subscriptions or Associated URIs section, if it is being held
+  /// undecoded. Once decoded, the section is re-encoded when the AoR is next
+  /// written, as the caller may have changed it.
+  ///
+  /// These are called from const methods, so several threads reading the same
+  /// AoR may try to decode a section at once. _decode_lock makes sure that
+  /// only one of them does, and that the others see the decoded section.
+  void decode_subscriptions() const;
+  void decode_associated_uris() const;
+
+  /// Map holding the subscriptions for this AoR, indexed by the To tag
+  /// generated when the subscription dialog was established. This is only
+  /// valid once any binary subscriptions section has been decoded.
+  mutable Subscriptions _subscriptions;
+
+  // Associated URIs class, to hold the associated URIs for this IRS. This is
+  // only valid once any binary Associated URIs section has been decoded.
+  mutable AssociatedURIs _associated_uris;
+
+  /// Undecoded binary sections (see set_binary_sections). These are empty
+  /// if there is no section being held.
+  mutable std::string _binary_subscriptions;
+  mutable std::string _binary_associated_uris;
+
+  /// Summary of the undecoded subscriptions, so that the expiry times and
+  /// number of subscriptions are known without decoding them.
+  uint32_t _binary_subscriptions_count;
+  int _binary_subscriptions_next_expires;
+  int _binary_subscriptions_last_expires;
+
+  /// Lock held while a binary section is decoded, and while reading anything
+  /// that decoding a section changes without first decoding it.
+  mutable std::mutex _decode_lock;
+
+  /// Arena holding the bindings and subscriptions, or NULL if they are
+  /// allocated from the heap.
+  Arena* _arena;
 };
 
 /// Convert an AoR to a PatchObject.
@@ -401,4 +644,12 @@ public:
 /// @param po  - PatchObject to be populated with the AoR info
 void convert_aor_to_patch(const AoR& aor, PatchObject& po);
 
+/// Convert an AoR that is no longer needed to a PatchObject. This moves the
+/// contents of the AoR's bindings, subscriptions and Associated URIs into
+/// the PatchObject instead of copying them, and leaves the AoR empty.
+///
+/// @param aor - AoR to convert to a PatchObject
+/// @param po  - PatchObject to be populated with the AoR info
+void convert_aor_to_patch(AoR&& aor, PatchObject& po);
+
 #endif
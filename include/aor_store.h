@@ -14,7 +14,9 @@
 #define AOR_STORE_H__
 
 
+#include <functional>
 #include <string>
+#include <vector>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -28,6 +30,14 @@
 class AoRStore
 {
 public:
+  /// Called when an asynchronous get completes, with the result that
+  /// get_aor_data would have returned. The callback owns the result.
+  typedef std::function<void(AoR*)> GetCallback;
+
+  /// Called when an asynchronous set completes, with the result that
+  /// set_aor_data would have returned.
+  typedef std::function<void(Store::Status)> SetCallback;
+
   /// AoRSore constructor.
   AoRStore(){}
 
@@ -43,6 +53,27 @@ public:
   /// @param trail     SAS trail
   virtual AoR* get_aor_data(const std::string& aor_id, SAS::TrailId trail) = 0;
 
+  /// Get the data for several addresses of record at once. Each result is
+  /// the same as get_aor_data would return for that AoR. This gets each AoR in
+  /// turn - stores that can fetch several records at once should override it.
+  ///
+  /// @param aor_ids   The AoRs to retrieve
+  /// @param aors      Filled in with the result for each AoR, in the same
+  ///                  order as aor_ids. Each result is owned by the caller.
+  /// @param trail     SAS trail
+  virtual void get_aor_data_multi(const std::vector<std::string>& aor_ids,
+                                  std::vector<AoR*>& aors,
+                                  SAS::TrailId trail)
+  {
+    aors.clear();
+    aors.reserve(aor_ids.size());
+
+    for (const std::string& aor_id : aor_ids)
+    {
+      aors.push_back(get_aor_data(aor_id, trail));
+    }
+  }
+
   /// Update the data for a particular address of record.
   /// if the update succeeds, this returns true.
   ///
@@ -54,6 +85,40 @@ public:
                                      AoR* aor,
                                      int expiry,
                                      SAS::TrailId trail) = 0;
+
+  /// Start getting the data for an address of record, without waiting for
+  /// the result. The callback may be called on another thread, or on this
+  /// one before this returns. This calls get_aor_data and then the callback
+  /// - stores that can have several requests in flight should override it.
+  ///
+  /// @param aor_id    The AoR to retrieve
+  /// @param trail     SAS trail
+  /// @param callback  Called with the result
+  virtual void get_aor_data_async(const std::string& aor_id,
+                                  SAS::TrailId trail,
+                                  GetCallback callback)
+  {
+    callback(get_aor_data(aor_id, trail));
+  }
+
+  /// Start updating the data for an address of record, without waiting for
+  /// the result. The AoR is still owned by the caller, but must not be used
+  /// or deleted until the callback is called. As with get_aor_data_async,
+  /// this calls set_aor_data and then the callback unless it is overridden.
+  ///
+  /// @param aor_id    The AoR ID to set
+  /// @param aor       The AoR to set data from
+  /// @param expiry    The expiry time associated with the AoR
+  /// @param trail     SAS trail
+  /// @param callback  Called with the result
+  virtual void set_aor_data_async(const std::string& aor_id,
+                                  AoR* aor,
+                                  int expiry,
+                                  SAS::TrailId trail,
+                                  SetCallback callback)
+  {
+    callback(set_aor_data(aor_id, aor, expiry, trail));
+  }
 };
 
 #endif
@@ -0,0 +1,81 @@
+/**
+ * @file arena.h Monotonic arena allocator.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef ARENA_H__
+#define ARENA_H__
+
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+/// @class Arena
+///
+/// Hands out memory from a small number of large blocks. Memory is never
+/// given back to the arena individually - it is all freed in one go when the
+/// arena is reset or destroyed. This suits objects that are built up together and
+/// thrown away together, as it avoids lots of small allocations competing
+/// for the allocator's locks.
+///
+/// An arena is not thread-safe.
+class Arena
+{
+public:
+  /// Constructor.
+  ///
+  /// @param block_size - The size of the first block to allocate. Each block
+  ///                     after that is twice the size of the one before.
+  Arena(size_t block_size = 4096);
+
+  /// Destructor. Frees every block. This doesn't run the destructors of any
+  /// objects created in the arena - use destroy for that.
+  ~Arena();
+
+  /// Free every block, so that the arena starts again from a first block of
+  /// the size it was constructed with. Every object created in the arena
+  /// must have been destroyed first.
+  void reset();
+
+  /// Allocate some memory from the arena.
+  ///
+  /// @param size  - The number of bytes to allocate.
+  /// @param align - The alignment of the memory (which must be a power of 2).
+  void* allocate(size_t size, size_t align);
+
+  /// Construct an object in the arena.
+  template <class T, class... Args>
+  T* create(Args&&... args)
+  {
+    return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+  }
+
+  /// Run the destructor of an object created in the arena. Its memory is
+  /// not reused until the arena is reset or destroyed.
+  template <class T>
+  static void destroy(T* object)
+  {
+    object->~T();
+  }
+
+private:
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  std::vector<char*> _blocks;
+  size_t _first_block_size;
+  size_t _next_block_size;
+
+  /// The free space in the current block.
+  char* _next;
+  size_t _remaining;
+};
+
+#endif
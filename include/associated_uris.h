@@ -15,8 +15,12 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <memory>
 #include "rapidjson/writer.h"
 #include "rapidjson/document.h"
+#include "binary_serialization.h"
+#include "wildcard_matcher.h"
 
 /// JSON Serialization constants
 static const char* const JSON_URI = "uri";
@@ -33,24 +37,32 @@ public:
   AssociatedURIs();
   ~AssociatedURIs();
 
+  AssociatedURIs(const AssociatedURIs& other) = default;
+  AssociatedURIs& operator= (const AssociatedURIs& other) = default;
+  AssociatedURIs(AssociatedURIs&& other) = default;
+  AssociatedURIs& operator= (AssociatedURIs&& other) = default;
+
   /// Gets the default IMPU from an implicit registration set.
   bool get_default_impu(std::string& uri,
-                        bool emergency);
+                        bool emergency) const;
 
   /// Checks if a URI is in the list of associated URIs.
-  bool contains_uri(std::string uri);
+  bool contains_uri(const std::string& uri) const;
 
   /// Adds to the list of associated URIs.
-  void add_uri(std::string uri, bool barred);
+  void add_uri(const std::string& uri, bool barred);
 
   /// Adds the barring status of a URI.
-  void add_barring_status(std::string uri, bool barred);
+  void add_barring_status(const std::string& uri, bool barred);
 
   /// Clears this structure.
   void clear_uris();
 
-  /// Returns whether a URI is barred or not.
-  bool is_impu_barred(std::string uri);
+  /// Returns whether a URI is barred or not. If there is no barring state
+  /// for the URI itself, this checks whether it belongs to any of the
+  /// wildcarded IMPUs that we have barring state for. A URI is only treated
+  /// as a wildcarded IMPU if it is the wildcard in a wildcard mapping.
+  bool is_impu_barred(const std::string& uri) const;
 
   /// Returns all the unbarred URIs.
   std::vector<std::string> get_unbarred_uris() const;
@@ -59,18 +71,22 @@ public:
   std::vector<std::string> get_barred_uris() const;
 
   /// Returns all URIs.
-  std::vector<std::string> get_all_uris();
+  const std::vector<std::string>& get_all_uris() const;
 
   /// Returns the wildcard mappings.
-  std::map<std::string, std::string> get_wildcard_mapping();
+  const std::map<std::string, std::string>& get_wildcard_mapping() const;
 
   /// Add a mapping between a distinct IMPU and the wildcard it belongs to
-  void add_wildcard_mapping(std::string wildcard, std::string distinct);
+  void add_wildcard_mapping(const std::string& wildcard,
+                            const std::string& distinct);
 
   /// Serialize the associated URIs as a JSON object.
   ///
-  /// @param writer - a rapidjson writer to write to.
-  void to_json(rapidjson::Writer<rapidjson::StringBuffer>& writer);
+  /// @param writer - a rapidjson writer to write to. This can be a
+  ///                 rapidjson::Writer<rapidjson::StringBuffer> or a
+  ///                 JsonStringWriter.
+  template <class JsonWriter>
+  void to_json(JsonWriter& writer) const;
 
   // Deserialize associated URIs from a JSON object.
   //
@@ -80,17 +96,87 @@ public:
   //                semantically valid) this method throws JsonFormError.
   void from_json(const rapidjson::Value& s_obj);
 
+  /// Serialize the associated URIs in the compact binary format.
+  ///
+  /// @param writer - a binary writer to write to.
+  void to_binary(BinaryWriter& writer) const;
+
+  // Deserialize associated URIs from the compact binary format.
+  //
+  // @param reader - a binary reader positioned at the start of the associated
+  //                 URIs.
+  //
+  // @return       - Nothing. If this function fails (because the data is
+  //                 truncated or corrupt) this method throws BinaryFormatError.
+  void from_binary(BinaryReader& reader);
+
+  // Skip over associated URIs in the compact binary format without decoding
+  // them.
+  //
+  // @param reader - a binary reader positioned at the start of the associated
+  //                 URIs.
+  //
+  // @return       - Nothing. If the data is truncated or corrupt this method
+  //                 throws BinaryFormatError.
+  static void skip_binary(BinaryReader& reader);
+
   // Compares the contents of this class instance to another, to see
-  // if they are the same.
-  bool operator==(AssociatedURIs other) const;
-  bool operator!=(AssociatedURIs other) const;
+  // if they are the same. This ignores the order of the URIs.
+  bool operator==(const AssociatedURIs& other) const;
+  bool operator!=(const AssociatedURIs& other) const;
 
 private:
+  /// Update the barring state of the associated URI at a position in
+  /// _associated_uris, and the cached first unbarred URI.
+  void set_barred(size_t position, bool barred);
+
+  /// The contribution of an associated URI and its barring state to
+  /// _content_hash.
+  static uint64_t hash_entry(const std::string& uri, bool barred);
+
+  /// Add a wildcarded IMPU that we have barring state for to _wildcards, and
+  /// rebuild _wildcard_matcher.
+  void add_wildcard(const std::string& wildcard);
+
   /// A vector of associated URIs.
   std::vector<std::string> _associated_uris;
 
-  /// A map from the associated URIs to their barring state.
-  std::map<std::string, bool> _barred_map;
+  /// Index from each associated URI to its (first) position in
+  /// _associated_uris.
+  std::unordered_map<std::string, size_t> _uri_index;
+
+  /// The barring state of each associated URI, in the same order as
+  /// _associated_uris. This is kept in step with _barred_map.
+  std::vector<bool> _barred;
+
+  /// Position in _associated_uris of the first unbarred URI (the default
+  /// IMPU), or _associated_uris.size() if they are all barred.
+  size_t _first_unbarred;
+
+  /// Whether any URI appears in _associated_uris more than once. This is
+  /// unusual, and means that changing a URI's barring state has to look for
+  /// all its positions.
+  bool _has_duplicate_uris;
+
+  /// Hash of the associated URIs and their barring states, which doesn't
+  /// depend on the order of the URIs. This is the sum of hash_entry for each
+  /// URI, so it can be kept up to date as URIs are added or barred.
+  uint64_t _content_hash;
+
+  /// A map from the associated URIs to their barring state. This also holds
+  /// the barring state of URIs that aren't associated URIs (e.g. non-distinct
+  /// IMPUs).
+  std::unordered_map<std::string, bool> _barred_map;
+
+  /// The wildcarded IMPUs in _barred_map, in the order they were added.
+  /// These are the URIs that are both in _barred_map and the wildcard in a
+  /// wildcard mapping.
+  std::vector<std::string> _wildcards;
+
+  /// Matcher for _wildcards, or NULL if there aren't any. This is rebuilt
+  /// whenever a wildcard is added, and is never changed once built, so
+  /// copies of this object can share it.
+  std::shared_ptr<const WildcardMatcher> _wildcard_matcher;
 
   /// A map of distinct IMPUs to their wildcards
   std::map<std::string, std::string> _distinct_to_wildcard;
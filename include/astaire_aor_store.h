@@ -14,21 +14,53 @@
 #define ASTAIRE_AOR_STORE_H__
 
 
+#include <functional>
 #include <string>
 #include <stdio.h>
 #include <stdlib.h>
+#include <vector>
 
 
 #include "aor_store.h"
+#include "worker_pool.h"
 
 // Implementation of the AoRStore specific to our use of Memcached under Astaire
 class AstaireAoRStore: public AoRStore
 {
 public:
+  /// The formats that AoRs can be written to the store in. Records in any of
+  /// these formats can always be read, whichever format is being written, so
+  /// a deployment can switch format without losing any stored data.
+  enum class SerializationFormat
+  {
+    JSON,
+    BINARY
+  };
+
+  /// The default number of threads that carry out asynchronous requests.
+  static const int DEFAULT_NUM_ASYNC_THREADS = 8;
+
+  /// The most asynchronous requests that can be waiting for a thread. Any
+  /// more are carried out on the thread that makes them.
+  static const size_t MAX_QUEUED_ASYNC_REQUESTS = 256;
+
   /// Constructor.
-  AstaireAoRStore(Store* store);
+  ///
+  /// @param store             - The underlying data store.
+  /// @param format            - The format to write AoRs to the store in.
+  /// @param num_async_threads - The number of threads that carry out
+  ///                            asynchronous requests. They aren't started
+  ///                            until the first asynchronous request.
+  /// @param use_arenas        - Whether AoRs read from the store allocate
+  ///                            their bindings and subscriptions from an
+  ///                            arena (see AoR::use_arena).
+  AstaireAoRStore(Store* store,
+                  SerializationFormat format = SerializationFormat::JSON,
+                  int num_async_threads = DEFAULT_NUM_ASYNC_THREADS,
+                  bool use_arenas = false);
 
-  /// Destructor.
+  /// Destructor. This waits for any asynchronous requests that have been
+  /// started to complete.
   virtual ~AstaireAoRStore();
 
   /// Get the data for a particular address of record (registered SIP URI,
@@ -40,6 +72,21 @@ public:
   /// @param trail     SAS trail
   virtual AoR* get_aor_data(const std::string& aor_id, SAS::TrailId trail) override;
 
+  /// Get the data for several addresses of record at once. This starts
+  /// asynchronous gets for them and waits for them all, so their round trips
+  /// to the store overlap. At most one get per asynchronous request thread is
+  /// in flight for each call, so a large multi-get doesn't hold up other
+  /// callers for long. If this is called from the callback of an asynchronous
+  /// request, the gets are done one after another on the calling thread.
+  ///
+  /// @param aor_ids   The AoRs to retrieve
+  /// @param aors      Filled in with the result for each AoR, in the same
+  ///                  order as aor_ids
+  /// @param trail     SAS trail
+  virtual void get_aor_data_multi(const std::vector<std::string>& aor_ids,
+                                  std::vector<AoR*>& aors,
+                                  SAS::TrailId trail) override;
+
   /// Update the data for a particular address of record.
   /// if the update succeeds, this returns true.
   ///
@@ -52,20 +99,40 @@ public:
                                      int expiry,
                                      SAS::TrailId trail) override;
 
+  /// Start getting the data for an address of record. The request is queued
+  /// for one of the asynchronous request threads, and the callback is called
+  /// on that thread. If this is called from one of those threads, or too
+  /// many requests are already queued, the request is carried out before
+  /// this returns. See AoRStore::get_aor_data_async.
+  virtual void get_aor_data_async(const std::string& aor_id,
+                                  SAS::TrailId trail,
+                                  GetCallback callback) override;
 
-  /// Class used by the AstaireAoRStore to serialize AoRs from C++
-  /// objects to the JSON format used in the store, and deserialize them.
-  class JsonSerializerDeserializer
+  /// Start updating the data for an address of record. This is queued in the
+  /// same way as get_aor_data_async. See AoRStore::set_aor_data_async.
+  virtual void set_aor_data_async(const std::string& aor_id,
+                                  AoR* aor,
+                                  int expiry,
+                                  SAS::TrailId trail,
+                                  SetCallback callback) override;
+
+
+  /// Interface used by the AstaireAoRStore to serialize AoRs from C++ objects
+  /// to the format used in the store, and deserialize them.
+  class SerializerDeserializer
   {
   public:
     /// Destructor.
-    ~JsonSerializerDeserializer() {}
+    virtual ~SerializerDeserializer() {}
 
     /// Serialize an AoR object to the format used in the store.
     ///
     /// @param aor_data - The AoR object to serialize.
-    /// @return         - The serialized form.
-    std::string serialize_aor(AoR* aor_data);
+    /// @param data     - Buffer to write the serialized form to. Any existing
+    ///                   contents are replaced, but the buffer's capacity is
+    ///                   reused, so passing the same buffer to each call
+    ///                   avoids allocating memory for every write.
+    virtual void serialize_aor(AoR* aor_data, std::string& data) = 0;
 
     /// Deserialize some data from the store into an AoR object.
     ///
@@ -74,9 +141,73 @@ public:
     /// @param s      - The data to deserialize.
     ///
     /// @return       - An AoR object, or NULL if the data could not be
-    ///                 deserialized (e.g. because it is corrupt).
+    ///                 deserialized (e.g. because it is corrupt, or it is in a
+    ///                 different format).
+    virtual AoR* deserialize_aor(const std::string& aor_id,
+                                 const std::string& s) = 0;
+
+    /// @return - The format of the serialized data, for SAS logging.
+    virtual Store::Format store_format() = 0;
+  };
+
+  /// Class used by the AstaireAoRStore to serialize AoRs from C++
+  /// objects to the JSON format used in the store, and deserialize them.
+  class JsonSerializerDeserializer : public SerializerDeserializer
+  {
+  public:
+    /// Constructor.
+    ///
+    /// @param use_arenas - Whether deserialized AoRs use an arena, with a
+    ///                     first block sized from the record.
+    JsonSerializerDeserializer(bool use_arenas = false) :
+      _use_arenas(use_arenas)
+    {}
+
+    /// Destructor.
+    ~JsonSerializerDeserializer() {}
+
+    void serialize_aor(AoR* aor_data, std::string& data) override;
+
     AoR* deserialize_aor(const std::string& aor_id,
-                         const std::string& s);
+                         const std::string& s) override;
+
+    Store::Format store_format() override { return Store::Format::JSON; }
+
+  private:
+    bool _use_arenas;
+  };
+
+  /// Class used by the AstaireAoRStore to serialize AoRs from C++ objects to
+  /// a compact, versioned binary format, and deserialize them. This holds the
+  /// same information as the JSON format, but without any key names, and
+  /// with varint encoded numbers and length-prefixed strings and sections.
+  /// Every record starts with a format byte (BINARY_FORMAT_V1), which can
+  /// never start a JSON record.
+  class BinarySerializerDeserializer : public SerializerDeserializer
+  {
+  public:
+    /// Constructor.
+    ///
+    /// @param use_arenas - Whether deserialized AoRs use an arena, with a
+    ///                     first block sized for the record's bindings.
+    BinarySerializerDeserializer(bool use_arenas = false) :
+      _use_arenas(use_arenas)
+    {}
+
+    /// Destructor.
+    ~BinarySerializerDeserializer() {}
+
+    void serialize_aor(AoR* aor_data, std::string& data) override;
+
+    /// Returns NULL immediately if the data doesn't start with the binary
+    /// format byte, so it is cheap to try this before the JSON deserializer.
+    AoR* deserialize_aor(const std::string& aor_id,
+                         const std::string& s) override;
+
+    Store::Format store_format() override { return Store::Format::BINARY; }
+
+  private:
+    bool _use_arenas;
   };
 
   /// Provides the interface to the data store. This is responsible for
@@ -85,8 +216,12 @@ public:
   /// functions in case of failure.
   class Connector
   {
+    /// The connector takes ownership of the serializer and deserializers.
+    /// Records are written using the serializer. When reading a record, each
+    /// deserializer is tried in turn until one of them succeeds.
     Connector(Store* data_store,
-              JsonSerializerDeserializer*& serializer_deserializer);
+              SerializerDeserializer*& serializer,
+              std::vector<SerializerDeserializer*>& deserializers);
 
     ~Connector();
 
@@ -103,11 +238,26 @@ public:
     friend class AstaireAoRStore;
 
   private:
-    JsonSerializerDeserializer* _serializer_deserializer;
+    /// The largest serialization buffer that is kept for reuse by the next
+    /// write on the same thread.
+    static const size_t MAX_REUSED_BUFFER_SIZE = 64 * 1024;
+
+    SerializerDeserializer* _serializer;
+    std::vector<SerializerDeserializer*> _deserializers;
   };
 
 public:
   Connector* _connector;
+
+private:
+  /// Queue a request for the asynchronous request threads, or carry it out
+  /// now if it can't be queued.
+  void start_async(std::function<void()> request);
+
+  /// The threads that carry out asynchronous requests. The Store interface
+  /// is blocking, so each thread has one request in flight to the store at a
+  /// time.
+  WorkerPool* _async_pool;
 };
 
 #endif
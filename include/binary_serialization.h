@@ -0,0 +1,105 @@
+/**
+ * @file binary_serialization.h Helpers for the compact binary AoR format.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef BINARY_SERIALIZATION_H__
+#define BINARY_SERIALIZATION_H__
+
+#include <string>
+#include <stdint.h>
+
+/// Format byte that starts every binary AoR record. This can never be the
+/// first byte of a JSON document, so records in either format can be told
+/// apart by looking at their first byte.
+static const uint8_t BINARY_FORMAT_V1 = 0x01;
+
+/// Exception thrown when a binary record is truncated or otherwise malformed.
+/// This plays the same role for the binary format as JsonFormatError does for
+/// JSON.
+struct BinaryFormatError
+{
+  BinaryFormatError(const char* file, int line) : _file(file), _line(line) {}
+
+  const char* _file;
+  int _line;
+};
+
+#define BINARY_FORMAT_ERROR() throw BinaryFormatError(__FILE__, __LINE__)
+
+/// @class BinaryWriter
+///
+/// Appends values to a buffer in the binary AoR format. Unsigned integers and
+/// lengths are written as base-128 varints, signed integers are zig-zag
+/// encoded first, and strings are length-prefixed. Sections are prefixed with
+/// a fixed width 32 bit length so that a reader can skip over them without
+/// decoding their contents.
+class BinaryWriter
+{
+public:
+  BinaryWriter(std::string& buffer) : _buffer(buffer) {}
+
+  void write_byte(uint8_t value) { _buffer.push_back((char)value); }
+  void write_bool(bool value) { write_byte(value ? 1 : 0); }
+  void write_uint(uint64_t value);
+  void write_int(int value);
+  void write_string(const std::string& value);
+
+  /// Append bytes that are already in the binary format (for example a
+  /// section returned by BinaryReader::read_raw_section).
+  void write_raw(const std::string& value) { _buffer.append(value); }
+
+  /// Start a length-prefixed section. The returned offset must be passed to
+  /// end_section once the section's contents have been written.
+  size_t start_section();
+  void end_section(size_t start);
+
+private:
+  std::string& _buffer;
+};
+
+/// @class BinaryReader
+///
+/// Reads values written by a BinaryWriter from a buffer. The buffer is not
+/// copied, so it must outlive the reader. Every method throws
+/// BinaryFormatError if the data is truncated or malformed.
+class BinaryReader
+{
+public:
+  BinaryReader(const char* data, size_t length) :
+    _data(data), _length(length), _offset(0)
+  {}
+
+  uint8_t read_byte();
+  bool read_bool();
+  uint64_t read_uint();
+  int read_int();
+  void read_string(std::string& value);
+
+  /// Skip over a string without copying it.
+  void skip_string();
+
+  /// Read a length-prefixed section, returning a reader over just the
+  /// section's contents. This reader is advanced past the whole section.
+  BinaryReader read_section();
+
+  /// Copy out a length-prefixed section, including its length prefix, without
+  /// decoding it. The copy can be read later with read_section, or written
+  /// back unchanged with BinaryWriter::write_raw.
+  void read_raw_section(std::string& raw);
+
+  bool at_end() const { return _offset == _length; }
+
+private:
+  const char* _data;
+  size_t _length;
+  size_t _offset;
+};
+
+#endif
@@ -0,0 +1,195 @@
+/**
+ * @file caching_aor_store.h AoRStore that keeps recently used AoRs in memory.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef CACHING_AOR_STORE_H__
+#define CACHING_AOR_STORE_H__
+
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "aor_store.h"
+
+/// @class CachingAoRStore
+///
+/// Sits in front of another AoRStore, and caches reads of AoRs that haven't
+/// been written since, in a sharded LRU cache. Reads are served from the
+/// cache where possible.
+///
+/// The cache can only be kept up to date with writes made through it, so:
+///   - Entries expire after a short time, which bounds how out of date a read
+///     can be when the AoR has been written elsewhere.
+///   - An out of date entry has an out of date CAS, so a write based on it
+///     fails with DATA_CONTENTION. The entry is then dropped, and the caller's
+///     retry reads from the underlying store.
+///   - A successful write drops the cached copy, unless the underlying store
+///     updated the AoR's CAS to the new value, in which case the written AoR
+///     is cached instead.
+///
+/// AstaireAoRStore doesn't update the CAS (the underlying Store doesn't
+/// return it), so in front of it every write drops the cached copy, and the
+/// cache only saves the reads of an AoR that hasn't been written since it was
+/// last read, such as a GET followed by a PATCH or DELETE. Only stores that
+/// update the CAS, such as MemoryAoRStore, have their writes cached.
+///
+/// S4 doesn't create a cache itself. To use one, wrap the AoRStore that is
+/// passed to S4.
+///
+/// Empty AoRs (meaning the store has no record) are never cached.
+class CachingAoRStore : public AoRStore
+{
+public:
+  /// Constructor.
+  ///
+  /// @param store[in]      - The underlying store. This is not owned by the
+  ///                         cache.
+  /// @param capacity[in]   - The most AoRs to cache.
+  /// @param ttl_ms[in]     - How long an AoR can be served from the cache.
+  /// @param num_shards[in] - The number of independently locked shards to
+  ///                         split the cache into.
+  CachingAoRStore(AoRStore* store,
+                  size_t capacity,
+                  int ttl_ms,
+                  size_t num_shards = 16);
+
+  /// Destructor.
+  virtual ~CachingAoRStore();
+
+  /// Get the data for an AoR, from the cache if it has an up to date copy or
+  /// from the underlying store if not. See AoRStore::get_aor_data.
+  virtual AoR* get_aor_data(const std::string& aor_id,
+                            SAS::TrailId trail) override;
+
+  /// Get the data for several AoRs, from the cache where it has up to date
+  /// copies, and from the underlying store (in a single multi-get) for the
+  /// rest. See AoRStore::get_aor_data_multi.
+  virtual void get_aor_data_multi(const std::vector<std::string>& aor_ids,
+                                  std::vector<AoR*>& aors,
+                                  SAS::TrailId trail) override;
+
+  /// Update the data for an AoR in the underlying store, and in the cache if
+  /// the underlying store gives the new CAS. See AoRStore::set_aor_data.
+  virtual Store::Status set_aor_data(const std::string& aor_id,
+                                     AoR* aor,
+                                     int expiry,
+                                     SAS::TrailId trail) override;
+
+  /// Start getting the data for an AoR. If the cache has an up to date copy,
+  /// the callback is called with it before this returns. Otherwise the
+  /// underlying store is asked for it asynchronously.
+  virtual void get_aor_data_async(const std::string& aor_id,
+                                  SAS::TrailId trail,
+                                  GetCallback callback) override;
+
+  /// Start updating the data for an AoR in the underlying store. The cache is
+  /// updated when the underlying store completes, before the callback is
+  /// called.
+  virtual void set_aor_data_async(const std::string& aor_id,
+                                  AoR* aor,
+                                  int expiry,
+                                  SAS::TrailId trail,
+                                  SetCallback callback) override;
+
+  /// The number of reads served from the cache.
+  uint64_t hits() const { return _hits.load(); }
+
+  /// The number of reads passed to the underlying store.
+  uint64_t misses() const { return _misses.load(); }
+
+  /// The number of cached AoRs dropped because they no longer matched the
+  /// underlying store.
+  uint64_t invalidations() const { return _invalidations.load(); }
+
+private:
+  CachingAoRStore(const CachingAoRStore&) = delete;
+  CachingAoRStore& operator=(const CachingAoRStore&) = delete;
+
+  /// The cached AoR is shared, so that a lookup can copy it after releasing
+  /// the shard's lock.
+  struct Entry
+  {
+    std::string _aor_id;
+    std::shared_ptr<const AoR> _aor;
+    std::chrono::steady_clock::time_point _expires;
+  };
+
+  /// The reads of an AoR from the underlying store that are in flight.
+  struct Read
+  {
+    int _count;
+
+    /// Set if the AoR has been written since the first of these reads
+    /// started. None of them are then cached, as they may have read the AoR
+    /// from before the write.
+    bool _stale;
+  };
+
+  /// One part of the cache, with its own lock. The list is in least recently
+  /// used order, most recent first.
+  struct Shard
+  {
+    std::mutex _lock;
+    std::list<Entry> _entries;
+    std::unordered_map<std::string, std::list<Entry>::iterator> _index;
+    std::unordered_map<std::string, Read> _reads;
+  };
+
+  Shard& shard_for(const std::string& aor_id);
+
+  /// Get a copy of an AoR from the cache.
+  ///
+  /// @return The copy, or NULL if there isn't an up to date one.
+  AoR* lookup(const std::string& aor_id);
+
+  /// Note that a read from the underlying store is starting. Every call must
+  /// be followed by a call to got_from_store.
+  void start_read(const std::string& aor_id);
+
+  /// Update the cache after a read from the underlying store.
+  void got_from_store(const std::string& aor_id, AoR* aor);
+
+  /// Update the cache after a write to the underlying store.
+  ///
+  /// @param old_cas[in] - The AoR's CAS before the write.
+  void set_in_store(const std::string& aor_id,
+                    AoR* aor,
+                    uint64_t old_cas,
+                    Store::Status rc);
+
+  /// Cache a copy of an AoR, replacing any copy already cached. The shard's
+  /// lock must be held.
+  void insert(Shard& shard,
+              const std::string& aor_id,
+              std::shared_ptr<const AoR> aor);
+
+  /// Drop the cached copy of an AoR, if there is one. The shard's lock must
+  /// be held.
+  void invalidate(Shard& shard, const std::string& aor_id);
+
+  /// Remove an entry from a shard. The shard's lock must be held.
+  static void erase(Shard& shard, std::list<Entry>::iterator entry);
+
+  AoRStore* _store;
+  std::vector<Shard*> _shards;
+  size_t _capacity_per_shard;
+  std::chrono::milliseconds _ttl;
+
+  std::atomic<uint64_t> _hits;
+  std::atomic<uint64_t> _misses;
+  std::atomic<uint64_t> _invalidations;
+};
+
+#endif
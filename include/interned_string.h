@@ -0,0 +1,98 @@
+/**
+ * @file interned_string.h Reference-counted strings shared through a pool.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef INTERNED_STRING_H__
+#define INTERNED_STRING_H__
+
+#include <memory>
+#include <ostream>
+#include <string>
+
+/// @class InternedString
+///
+/// An immutable string that is shared with every other InternedString holding
+/// the same value. The values are kept in a process-wide pool, and a value is
+/// removed from the pool when the last InternedString holding it goes away.
+///
+/// This is used for values that are repeated across many bindings, such as
+/// the address of record and private ID, so that each AoR in memory doesn't
+/// hold its own copy of them. As equal values share the same storage,
+/// comparing two InternedStrings is usually just a pointer comparison.
+///
+/// An InternedString converts to and from std::string, so it can be used in
+/// most places a std::string can. It can be compared with and appended to
+/// std::strings and C strings from either side.
+///
+/// Creating an InternedString from a non-empty value takes the lock on one
+/// shard of the pool, as does destroying the last InternedString holding a
+/// value. Copying an InternedString doesn't.
+class InternedString
+{
+public:
+  InternedString() : _value() {}
+  InternedString(const std::string& value) : _value(intern(value)) {}
+  InternedString(const char* value) : _value(intern(value)) {}
+
+  /// @return - The value of the string.
+  inline const std::string& str() const
+  {
+    return (_value != NULL) ? *_value : empty_string();
+  }
+
+  inline operator const std::string&() const { return str(); }
+  inline const char* c_str() const { return str().c_str(); }
+  inline bool empty() const { return str().empty(); }
+  inline size_t size() const { return str().size(); }
+
+  inline bool operator==(const InternedString& other) const
+  {
+    // Live strings with the same value always share storage, so this only
+    // needs to compare the strings themselves if the pointers differ.
+    return (_value == other._value) || (str() == other.str());
+  }
+
+  inline bool operator!=(const InternedString& other) const
+  {
+    return !(operator==(other));
+  }
+
+  inline bool operator==(const std::string& other) const { return str() == other; }
+  inline bool operator!=(const std::string& other) const { return str() != other; }
+  inline bool operator==(const char* other) const { return str() == other; }
+  inline bool operator!=(const char* other) const { return str() != other; }
+
+private:
+  /// Find the pooled copy of a value, adding it to the pool if necessary.
+  /// The empty string isn't pooled.
+  static std::shared_ptr<const std::string> intern(const std::string& value);
+
+  static const std::string& empty_string();
+
+  std::shared_ptr<const std::string> _value;
+};
+
+inline bool operator==(const std::string& lhs, const InternedString& rhs) { return rhs == lhs; }
+inline bool operator!=(const std::string& lhs, const InternedString& rhs) { return rhs != lhs; }
+inline bool operator==(const char* lhs, const InternedString& rhs) { return rhs == lhs; }
+inline bool operator!=(const char* lhs, const InternedString& rhs) { return rhs != lhs; }
+
+inline std::string operator+(const InternedString& lhs, const InternedString& rhs) { return lhs.str() + rhs.str(); }
+inline std::string operator+(const InternedString& lhs, const std::string& rhs) { return lhs.str() + rhs; }
+inline std::string operator+(const std::string& lhs, const InternedString& rhs) { return lhs + rhs.str(); }
+inline std::string operator+(const InternedString& lhs, const char* rhs) { return lhs.str() + rhs; }
+inline std::string operator+(const char* lhs, const InternedString& rhs) { return lhs + rhs.str(); }
+
+inline std::ostream& operator<<(std::ostream& os, const InternedString& value)
+{
+  return os << value.str();
+}
+
+#endif
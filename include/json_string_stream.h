@@ -0,0 +1,40 @@
+/**
+ * @file json_string_stream.h rapidjson output stream that writes to a string.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef JSON_STRING_STREAM_H__
+#define JSON_STRING_STREAM_H__
+
+#include <string>
+#include "rapidjson/writer.h"
+
+/// @class JsonStringStream
+///
+/// rapidjson output stream that appends to a std::string. This lets a JSON
+/// document be written straight into the caller's string, rather than into a
+/// rapidjson::StringBuffer that then has to be copied out.
+class JsonStringStream
+{
+public:
+  typedef char Ch;
+
+  JsonStringStream(std::string& buffer) : _buffer(buffer) {}
+
+  void Put(char c) { _buffer.push_back(c); }
+  void Flush() {}
+
+private:
+  std::string& _buffer;
+};
+
+/// Writer for JSON documents written through a JsonStringStream.
+typedef rapidjson::Writer<JsonStringStream> JsonStringWriter;
+
+#endif
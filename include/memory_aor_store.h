@@ -0,0 +1,118 @@
+/**
+ * @file memory_aor_store.h AoRStore that keeps AoRs in local memory.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef MEMORY_AOR_STORE_H__
+#define MEMORY_AOR_STORE_H__
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <time.h>
+#include <unordered_map>
+#include <vector>
+
+#include "aor_store.h"
+
+/// @class MemoryAoRStore
+///
+/// Keeps AoRs in a hash table in this process, rather than in an external
+/// store. This needs no other services, so it suits tests, benchmarks and
+/// single node deployments. Nothing is persisted or shared with other
+/// processes.
+///
+/// Reads and writes behave as they do with the AstaireAoRStore:
+///   - Reading an AoR that isn't stored gives an empty AoR with a CAS of 0.
+///   - A write with a CAS of 0 only succeeds if the AoR isn't stored. Any
+///     other write only succeeds if the CAS matches the stored AoR. Otherwise
+///     the write fails with DATA_CONTENTION.
+///   - The expiry is a number of seconds from now, or an absolute time if it
+///     is more than 30 days (as with memcached). An expiry of 0 (or one in the
+///     past) removes the AoR.
+///
+/// Unlike the AstaireAoRStore, a successful write that stores the AoR updates
+/// the AoR's CAS to the new value.
+///
+/// The table is split into independently locked stripes.
+class MemoryAoRStore : public AoRStore
+{
+public:
+  /// Constructor.
+  ///
+  /// @param num_stripes[in] - The number of independently locked stripes to
+  ///                          split the table into.
+  MemoryAoRStore(size_t num_stripes = 64);
+
+  /// Destructor.
+  virtual ~MemoryAoRStore();
+
+  /// Get the data for an AoR. See AoRStore::get_aor_data.
+  virtual AoR* get_aor_data(const std::string& aor_id,
+                            SAS::TrailId trail) override;
+
+  /// Update the data for an AoR. See AoRStore::set_aor_data.
+  virtual Store::Status set_aor_data(const std::string& aor_id,
+                                     AoR* aor,
+                                     int expiry,
+                                     SAS::TrailId trail) override;
+
+  /// The number of AoRs stored, including any that have expired but not yet
+  /// been cleared out.
+  size_t size();
+
+private:
+  MemoryAoRStore(const MemoryAoRStore&) = delete;
+  MemoryAoRStore& operator=(const MemoryAoRStore&) = delete;
+
+  /// Expiries longer than this are absolute times.
+  static const int MAX_RELATIVE_EXPIRY = 60 * 60 * 24 * 30;
+
+  /// Stripes are cleared of expired records when they reach this size, and
+  /// then whenever they double in size since the last time.
+  static const size_t MIN_SWEEP_SIZE = 64;
+
+  /// The stored AoR is shared, so that a read can copy it after releasing
+  /// the stripe's lock. It is never changed once stored.
+  struct Record
+  {
+    std::shared_ptr<const AoR> _aor;
+    uint64_t _cas;
+
+    /// When the record expires.
+    time_t _expires;
+  };
+
+  struct Stripe
+  {
+    std::mutex _lock;
+    std::unordered_map<std::string, Record> _records;
+    size_t _sweep_size;
+  };
+
+  Stripe& stripe_for(const std::string& aor_id);
+
+  /// Find an unexpired record, clearing it out if it has expired. The
+  /// stripe's lock must be held.
+  ///
+  /// @return The record, or NULL if there isn't one.
+  static Record* find(Stripe& stripe, const std::string& aor_id, time_t now);
+
+  /// Clear expired records out of a stripe if it has grown enough since the
+  /// last time. The stripe's lock must be held.
+  static void sweep(Stripe& stripe, time_t now);
+
+  std::vector<Stripe*> _stripes;
+
+  /// The CAS to give the next record that is written.
+  std::atomic<uint64_t> _next_cas;
+};
+
+#endif
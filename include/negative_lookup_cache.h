@@ -0,0 +1,74 @@
+/**
+ * @file negative_lookup_cache.h Short-lived record of subscribers that
+ * weren't found.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef NEGATIVE_LOOKUP_CACHE_H__
+#define NEGATIVE_LOOKUP_CACHE_H__
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/// @class NegativeLookupCache
+///
+/// Remembers, for a short time, which subscribers couldn't be found on any
+/// site, so that repeated lookups for them don't have to ask every remote
+/// site again. The cache is split into independently locked shards.
+class NegativeLookupCache
+{
+public:
+  /// Constructor.
+  ///
+  /// @param ttl_ms[in]   - How long to remember that a subscriber wasn't
+  ///                       found.
+  /// @param capacity[in] - The most subscribers to remember. Once this is
+  ///                       reached, expired entries are cleared out, and if
+  ///                       that isn't enough, the shard is emptied.
+  NegativeLookupCache(int ttl_ms, size_t capacity);
+
+  ~NegativeLookupCache();
+
+  /// Record that a subscriber wasn't found.
+  void add(const std::string& sub_id);
+
+  /// Whether a subscriber was recently not found. This counts as a hit if so.
+  bool contains(const std::string& sub_id);
+
+  /// Forget that a subscriber wasn't found (because it's been added).
+  void remove(const std::string& sub_id);
+
+  /// The number of lookups that found the subscriber in the cache.
+  uint64_t hits() const { return _hits.load(); }
+
+private:
+  NegativeLookupCache(const NegativeLookupCache&) = delete;
+  NegativeLookupCache& operator=(const NegativeLookupCache&) = delete;
+
+  static const size_t NUM_SHARDS = 16;
+
+  struct Shard
+  {
+    std::mutex _lock;
+    std::unordered_map<std::string, std::chrono::steady_clock::time_point> _expiries;
+  };
+
+  Shard& shard_for(const std::string& sub_id);
+
+  std::chrono::milliseconds _ttl;
+  size_t _capacity_per_shard;
+  std::vector<Shard*> _shards;
+  std::atomic<uint64_t> _hits;
+};
+
+#endif
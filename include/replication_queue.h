@@ -0,0 +1,183 @@
+/**
+ * @file replication_queue.h Queue of updates waiting to be sent to a remote
+ * site.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef REPLICATION_QUEUE_H__
+#define REPLICATION_QUEUE_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "sas.h"
+#include "aor.h"
+
+class S4;
+
+/// A PUT, PATCH or DELETE of a subscriber, sent from one S4 to another.
+struct ReplicationRequest
+{
+  enum Type { PUT, PATCH, DELETE };
+
+  ReplicationRequest(Type type, const std::string& sub_id, SAS::TrailId trail);
+
+  /// Destructor. This deletes the AoR and the patch.
+  ~ReplicationRequest();
+
+  Type _type;
+  std::string _sub_id;
+
+  /// The AoR to PUT. For a PATCH, this is the AoR to PUT instead if the
+  /// subscriber doesn't exist. This is NULL for a DELETE.
+  AoR* _aor;
+
+  /// The patch to apply. This is NULL unless this is a PATCH.
+  PatchObject* _po;
+
+  SAS::TrailId _trail;
+
+private:
+  ReplicationRequest(const ReplicationRequest&) = delete;
+  ReplicationRequest& operator=(const ReplicationRequest&) = delete;
+};
+
+/// @class ReplicationQueue
+///
+/// Sends PUTs, PATCHes and DELETEs to one remote S4 on a pool of worker
+/// threads, so that the local S4 can answer its client as soon as the local
+/// write has succeeded.
+///
+/// Every update for a subscriber is handled by the same worker, in the order
+/// it was queued, so a remote site never sees a subscriber's updates out of
+/// order. Each worker sends everything that's waiting for it to the remote S4
+/// as one batch. Updates that fail with a server error are retried by the
+/// worker before it moves on to the next batch.
+///
+/// An update for a subscriber that already has one waiting is merged into
+/// the waiting one, rather than sent separately. This cuts the number of
+/// requests to the remote site when a subscriber is updated several times in
+/// quick succession:
+///   - A DELETE replaces the waiting update.
+///   - A PUT replaces a waiting PUT or PATCH with a PUT of the latest state of
+///     the subscriber.
+///   - A PATCH is merged into a waiting PUT or PATCH. The result is a single
+///     PATCH, which is turned into a PUT of the latest state of the
+///     subscriber if the subscriber doesn't exist on the remote site.
+///   - A PUT or PATCH after a waiting DELETE is queued separately.
+///
+/// The queue is bounded. If it's full, new updates are dropped, in the same
+/// way that a failed synchronous update to a remote site is ignored.
+class ReplicationQueue
+{
+public:
+  /// Constructor.
+  ///
+  /// @param remote_s4[in]         - The remote S4 to send updates to.
+  /// @param num_workers[in]       - The number of worker threads.
+  /// @param max_depth[in]         - The most updates that can be waiting to
+  ///                                be sent at once.
+  /// @param max_batch_size[in]    - The most updates to send to the remote
+  ///                                S4 in one batch.
+  /// @param max_retries[in]       - How many times to retry an update that
+  ///                                fails with a server error.
+  /// @param retry_interval_ms[in] - How long to wait before each retry.
+  ReplicationQueue(S4* remote_s4,
+                   int num_workers,
+                   size_t max_depth,
+                   size_t max_batch_size,
+                   int max_retries,
+                   int retry_interval_ms);
+
+  /// Destructor. This sends any updates that are still queued before
+  /// stopping the worker threads.
+  ~ReplicationQueue();
+
+  /// Queue a PUT. The AoR is copied.
+  void put(const std::string& sub_id,
+           const AoR& aor,
+           SAS::TrailId trail);
+
+  /// Queue a PATCH. The patch and the AoR (which is PUT instead if the
+  /// subscriber doesn't exist on the remote site) are copied.
+  void patch(const std::string& sub_id,
+             const PatchObject& po,
+             const AoR& aor,
+             SAS::TrailId trail);
+
+  /// Queue a DELETE.
+  void remove(const std::string& sub_id,
+              SAS::TrailId trail);
+
+  /// The number of updates that are waiting to be sent.
+  size_t depth() const { return _depth.load(); }
+
+  /// The number of updates that have been dropped because the queue was full.
+  uint64_t drops() const { return _drops.load(); }
+
+  /// The number of times an update has been retried.
+  uint64_t retries() const { return _retries.load(); }
+
+  /// The number of updates that have been merged into a waiting update.
+  uint64_t coalesced() const { return _coalesced.load(); }
+
+private:
+  ReplicationQueue(const ReplicationQueue&) = delete;
+  ReplicationQueue& operator=(const ReplicationQueue&) = delete;
+
+  /// A worker thread and the updates waiting for it.
+  struct Worker
+  {
+    std::mutex _lock;
+    std::condition_variable _cond;
+    std::deque<ReplicationRequest*> _requests;
+
+    /// The latest waiting update for each subscriber on this worker.
+    std::unordered_map<std::string, ReplicationRequest*> _latest;
+
+    bool _stopping;
+    std::thread _thread;
+  };
+
+  /// Queue an update on the worker for its subscriber. This takes ownership
+  /// of the request, and deletes it if the queue is full.
+  void enqueue(ReplicationRequest* request);
+
+  /// Merge an update into the waiting update for the same subscriber, if
+  /// possible.
+  ///
+  /// @return Whether the update was merged. If so, the caller must delete it.
+  static bool coalesce(ReplicationRequest* waiting, ReplicationRequest* request);
+
+  void worker_thread(Worker* worker);
+
+  /// Send a batch of updates to the remote S4, retrying any that fail with a
+  /// server error.
+  void process(const std::vector<ReplicationRequest*>& batch);
+
+  S4* _remote_s4;
+  std::vector<Worker*> _workers;
+  const size_t _max_depth;
+  const size_t _max_batch_size;
+  const int _max_retries;
+  const int _retry_interval_ms;
+
+  std::atomic<size_t> _depth;
+  std::atomic<uint64_t> _drops;
+  std::atomic<uint64_t> _retries;
+  std::atomic<uint64_t> _coalesced;
+};
+
+#endif
@@ -0,0 +1,125 @@
+/**
+ * @file retry_policy.h Policy for retrying writes that hit CAS contention.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef RETRY_POLICY_H__
+#define RETRY_POLICY_H__
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdint.h>
+
+/// @class RetryPolicy
+///
+/// Decides whether a read-modify-write that lost a CAS race should try again,
+/// and how long it should wait first. A policy can limit:
+///   - The number of retries for each request.
+///   - The delay before each retry. This grows exponentially with the number
+///     of retries so far, up to a maximum, and is jittered so that requests
+///     that collided don't collide again.
+///   - The number of retries by everything that uses the policy, as a budget
+///     of retries per second. Once the budget is spent, requests give up rather
+///     than retry, which stops hot subscribers from overloading the store.
+///
+/// By default there are no limits and no delay, so requests retry
+/// immediately until they succeed.
+///
+/// The policy also counts how often contention happens, and how many
+/// retries requests need.
+class RetryPolicy
+{
+public:
+  /// The number of buckets in the retries histogram. Bucket N counts requests
+  /// that needed N retries, apart from the last bucket, which counts all
+  /// requests that needed at least that many.
+  static const int NUM_HISTOGRAM_BUCKETS = 8;
+
+  RetryPolicy();
+
+  /// Change the policy. This must not be called while the policy is in use.
+  ///
+  /// @param max_retries[in]     - The most times a request can retry, or -1
+  ///                              for no limit.
+  /// @param base_backoff_ms[in] - The longest delay before the first retry.
+  ///                              This doubles for each retry after that.
+  ///                              0 means retry immediately.
+  /// @param max_backoff_ms[in]  - The longest delay before any retry.
+  /// @param budget_per_sec[in]  - The most retries a second by everything
+  ///                              that uses the policy, or 0 for no limit.
+  /// @param jitter[in]          - Whether to wait for a random time up to the
+  ///                              backoff, or for exactly the backoff (for
+  ///                              tests).
+  void configure(int max_retries,
+                 int base_backoff_ms,
+                 int max_backoff_ms,
+                 int budget_per_sec,
+                 bool jitter = true);
+
+  /// Called when a request hits contention. If the request should retry,
+  /// this waits for the backoff before returning.
+  ///
+  /// @param retries[in] - The number of times the request has already
+  ///                      retried.
+  ///
+  /// @return Whether the request should retry.
+  bool retry_after_contention(int retries);
+
+  /// Called when a request that hit contention finishes, whether it
+  /// succeeded or gave up.
+  ///
+  /// @param retries[in] - The number of times the request retried.
+  void record_request(int retries);
+
+  /// The number of times requests have hit contention.
+  uint64_t contentions() const { return _contentions.load(); }
+
+  /// The number of times requests have retried.
+  uint64_t retries() const { return _retries.load(); }
+
+  /// The number of requests that gave up because they ran out of retries, or
+  /// because the retry budget was spent.
+  uint64_t exhausted() const { return _exhausted.load(); }
+
+  /// The number of requests that hit contention and needed the given number
+  /// of retries (see NUM_HISTOGRAM_BUCKETS).
+  uint64_t requests_with_retries(int bucket) const
+  {
+    return _histogram[bucket].load();
+  }
+
+private:
+  RetryPolicy(const RetryPolicy&) = delete;
+  RetryPolicy& operator=(const RetryPolicy&) = delete;
+
+  /// Take a retry from the budget.
+  ///
+  /// @return Whether there was one to take.
+  bool take_from_budget();
+
+  int _max_retries;
+  int _base_backoff_ms;
+  int _max_backoff_ms;
+  int _budget_per_sec;
+  bool _jitter;
+
+  /// The budget is a token bucket, which holds up to a second's worth of
+  /// retries.
+  std::mutex _budget_lock;
+  double _budget_tokens;
+  std::chrono::steady_clock::time_point _budget_refilled;
+
+  std::atomic<uint64_t> _contentions;
+  std::atomic<uint64_t> _retries;
+  std::atomic<uint64_t> _exhausted;
+  std::atomic<uint64_t> _histogram[NUM_HISTOGRAM_BUCKETS];
+};
+
+#endif
@@ -14,7 +14,9 @@
 
 #include <string>
 #include <list>
+#include <vector>
 #include <map>
+#include <mutex>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -23,6 +25,11 @@
 #include "astaire_aor_store.h"
 #include "httpclient.h"
 #include "chronosconnection.h"
+#include "replication_queue.h"
+#include "negative_lookup_cache.h"
+#include "retry_policy.h"
+#include "striped_lock.h"
+#include "worker_pool.h"
 
 class S4
 {
@@ -61,14 +68,31 @@ public:
     /// @param sub_id       The AoR ID
     //  @param callback_uri Callback URI for Chronos timer
     /// @param aor_pair     The AoR pair to send Chronos requests for
+    /// @param next_expires When the AoR's next binding or subscription
+    ///                     expires (see AoR::get_expires)
     /// @param now          The current time
     /// @param trail        SAS trail
     virtual void send_timers(const std::string& sub_id,
                              const std::string& callback_uri,
                              AoR* aor,
+                             int next_expires,
                              int now,
                              SAS::TrailId trail);
 
+    /// Create and send any appropriate Chronos requests, working out when the
+    /// AoR next expires from the AoR itself.
+    ///
+    /// @param sub_id       The AoR ID
+    //  @param callback_uri Callback URI for Chronos timer
+    /// @param aor_pair     The AoR pair to send Chronos requests for
+    /// @param now          The current time
+    /// @param trail        SAS trail
+    void send_timers(const std::string& sub_id,
+                     const std::string& callback_uri,
+                     AoR* aor,
+                     int now,
+                     SAS::TrailId trail);
+
     /// S4 is the only class that can use ChronosTimerRequestSender
     friend class S4;
 
@@ -122,13 +146,136 @@ public:
 
   /// Destructor.
   ///
-  /// S4 doesn't own the memory for its pointer member variables, so there's
-  /// nothing to do to clean up.
+  /// S4 doesn't own the memory for its pointer member variables, apart from
+  /// the replication queues and the threads that ask the remote S4s for
+  /// subscribers. Any updates still on the queues are sent, and any
+  /// outstanding remote GETs finish, before they are destroyed, so the remote
+  /// S4s must outlive this S4.
   virtual ~S4();
 
   /// Registers a class to receive timer pops from S4.
   void register_timer_pop_consumer(TimerPopConsumer* timer_pop_consumer);
 
+  /// The default number of threads asking each remote S4 for subscribers when
+  /// they're asked in parallel.
+  static const int DEFAULT_REMOTE_GET_THREADS = 4;
+
+  /// The default number of GETs that can be waiting for each remote S4 when
+  /// they're asked in parallel.
+  static const size_t DEFAULT_MAX_OUTSTANDING_REMOTE_GETS = 64;
+
+  /// Ask all the remote S4s for a subscriber at once when it isn't in the
+  /// local store, rather than one at a time. The first remote S4 to return
+  /// the subscriber is used, and any answers after that are ignored.
+  ///
+  /// Each remote S4 is asked from its own small pool of threads. A GET that
+  /// times out keeps its thread until the remote S4 answers, so if a remote
+  /// S4 stops answering its pool fills up, and further GETs treat that
+  /// remote S4 as having failed rather than starting more threads. This
+  /// applies even when there's only one remote S4, so that its timeout and
+  /// bound on outstanding GETs still hold.
+  ///
+  /// This must be called before any requests are handled.
+  ///
+  /// @param timeouts_ms[in]     - How long to wait for each remote S4, in the
+  ///                              same order as the remote S4s passed to the
+  ///                              constructor. Any remote S4 without a
+  ///                              timeout here uses the last one given. Pass
+  ///                              an empty vector to go back to asking the
+  ///                              remote S4s one at a time (the default).
+  /// @param threads[in]         - The number of threads asking each remote S4.
+  /// @param max_outstanding[in] - The most GETs that can be waiting for each
+  ///                              remote S4, including ones that have timed
+  ///                              out.
+  void set_parallel_remote_gets(const std::vector<int>& timeouts_ms,
+                                int threads = DEFAULT_REMOTE_GET_THREADS,
+                                size_t max_outstanding =
+                                        DEFAULT_MAX_OUTSTANDING_REMOTE_GETS);
+
+  /// Send PUTs, PATCHes and DELETEs to the remote S4s from a queue for each
+  /// remote site, rather than on the client's thread. The client is answered
+  /// as soon as the local write succeeds. By default updates are sent to the
+  /// remote sites before the client is answered.
+  ///
+  /// This must be called before any requests are handled.
+  ///
+  /// @param num_workers[in]       - The number of worker threads for each
+  ///                                remote site.
+  /// @param max_depth[in]         - The most updates that can be waiting for
+  ///                                each remote site. Updates are dropped if
+  ///                                the queue is full.
+  /// @param max_batch_size[in]    - The most updates to send to a remote S4
+  ///                                in one batch.
+  /// @param max_retries[in]       - How many times to retry an update that
+  ///                                fails with a server error.
+  /// @param retry_interval_ms[in] - How long to wait before each retry.
+  void set_async_replication(int num_workers,
+                             size_t max_depth,
+                             size_t max_batch_size,
+                             int max_retries,
+                             int retry_interval_ms);
+
+  /// Remember for a short time which subscribers weren't found on any site.
+  /// While a subscriber is remembered, a GET that doesn't find it in the local
+  /// store returns NOT_FOUND without asking the remote S4s. A subscriber is
+  /// only remembered if every remote S4 answered NOT_FOUND, and is forgotten
+  /// when it's PUT or PATCHed through this S4. By default nothing is
+  /// remembered.
+  ///
+  /// This must be called before any requests are handled.
+  ///
+  /// @param ttl_ms[in]   - How long to remember each subscriber.
+  /// @param capacity[in] - The most subscribers to remember.
+  void set_negative_lookup_cache(int ttl_ms, size_t capacity);
+
+  /// Gets the negative lookup cache, for reading its statistics. This is NULL
+  /// unless set_negative_lookup_cache has been called.
+  const NegativeLookupCache* get_negative_lookup_cache() const
+  {
+    return _negative_lookup_cache;
+  }
+
+  /// Limit how S4 retries when a write to the local store hits contention
+  /// (see RetryPolicy). By default S4 retries immediately until the write
+  /// succeeds. A request that gives up returns SERVER_ERROR.
+  ///
+  /// This must be called before any requests are handled.
+  ///
+  /// @param max_retries[in]     - The most times a request can retry, or -1
+  ///                              for no limit.
+  /// @param base_backoff_ms[in] - The longest delay before the first retry.
+  ///                              This doubles for each retry after that.
+  /// @param max_backoff_ms[in]  - The longest delay before any retry.
+  /// @param budget_per_sec[in]  - The most retries a second across this S4,
+  ///                              or 0 for no limit.
+  /// @param jitter[in]          - Whether to jitter the delay before each
+  ///                              retry (see RetryPolicy::configure).
+  void set_contention_retry_policy(int max_retries,
+                                   int base_backoff_ms,
+                                   int max_backoff_ms,
+                                   int budget_per_sec,
+                                   bool jitter = true);
+
+  /// Gets the contention retry policy, for reading its statistics.
+  const RetryPolicy& get_contention_retry_policy() const
+  {
+    return _contention_retry_policy;
+  }
+
+  /// Gets the replication queues, in the same order as the remote S4s. This is
+  /// empty unless set_async_replication has been called.
+  ///
+  /// @return The replication queues, for reading their statistics.
+  const std::vector<ReplicationQueue*>& get_replication_queues() const
+  {
+    return _replication_queues;
+  }
+
+  /// Gets the ID of this S4. This is only used for logging.
+  ///
+  /// @return The ID of this S4.
+  inline std::string get_id() const { return _s4_id; }
+
   /// This sends a request to S4 to get the data for a subscriber. This looks
   /// in the local store. If the local store returns NOT_FOUND, this asks the
   /// remote S4s. If a remote S4 has data, this writes that data back into the
@@ -155,6 +302,28 @@ public:
                               uint64_t& version,
                               SAS::TrailId trail);
 
+  /// This gets the data for several subscribers at once. The local store is
+  /// asked for all of them together. The subscribers that aren't in the local
+  /// store are then asked for together from each remote S4, and whatever is
+  /// found is copied to the local store with all the writes in flight at
+  /// once. The result for each subscriber is the same as handle_get would
+  /// give.
+  ///
+  /// @param sub_ids[in]   - The IDs of the subscribers. These must be the
+  ///                        default public identities.
+  /// @param aors[out]     - The retrieved data for each subscriber, in the
+  ///                        same order as sub_ids. Each AoR is only valid if
+  ///                        its return code is OK. The caller must delete the
+  ///                        AoRs.
+  /// @param versions[out] - The version of each retrieved AoR.
+  /// @param rcs[out]      - The result for each subscriber (see handle_get).
+  /// @param trail[in]     - The SAS trail ID.
+  virtual void handle_get_multi(const std::vector<std::string>& sub_ids,
+                                std::vector<AoR*>& aors,
+                                std::vector<uint64_t>& versions,
+                                std::vector<HTTPCode>& rcs,
+                                SAS::TrailId trail);
+
   /// This deletes the subscriber from the deployment. The delete takes a
   /// version - if the current subscriber data has a different version than
   /// the passed in version the delete fails. The subscriber is deleted from
@@ -225,6 +394,25 @@ public:
                                 AoR** aor,
                                 SAS::TrailId trail);
 
+  /// This applies a batch of PUTs, PATCHes and DELETEs from another S4 to the
+  /// local site, in order. A PUT of a subscriber that already exists is
+  /// turned into a PATCH, and a PATCH of a subscriber that doesn't exist is
+  /// turned into a PUT. This should only be called from another S4, not a
+  /// client.
+  ///
+  /// The subscribers in the batch are read with one multi-get, and their
+  /// writes are all in flight at once. If an update hits contention, only
+  /// that update is tried again. If an update fails, every later update for
+  /// the same subscriber fails too without being applied, so the caller can
+  /// retry just the failed updates and still apply them in order.
+  ///
+  /// @param requests[in] - The updates to apply.
+  /// @param rcs[out]     - The result of each update, in the same order as
+  ///                       the requests. A DELETE returns NO_CONTENT if the
+  ///                       subscriber is no longer on the local site.
+  virtual void handle_batch(const std::vector<ReplicationRequest*>& requests,
+                            std::vector<HTTPCode>& rcs);
+
   /// Handle a timer pop by notifying Subscriber Manager.
   ///
   /// @param[in]  sub_id        The AoR ID to handle a timer pop for
@@ -248,15 +436,56 @@ private:
   virtual void handle_remote_delete(const std::string& sub_id,
                                     SAS::TrailId trail);
 
+  /// This adds a subscriber to the local site on behalf of another S4. If the
+  /// subscriber already exists, it's PATCHed to match the AoR instead. This
+  /// should only be called from another S4, not a client.
+  ///
+  /// @param sub_id[in] - The ID of the subscriber. This must be the default
+  ///                     public identity.
+  /// @param aor[in]    - The AoR object to update the subscriber with.
+  /// @param trail[in]  - The SAS trail ID.
+  ///
+  /// @return The result of the PUT, or of the PATCH if one was needed.
+  HTTPCode handle_replicated_put(const std::string& sub_id,
+                                 const AoR& aor,
+                                 SAS::TrailId trail);
+
+  /// This updates a subscriber on the local site on behalf of another S4. If
+  /// the subscriber doesn't exist, it's PUT instead. This should only be
+  /// called from another S4, not a client.
+  ///
+  /// @param sub_id[in] - The ID of the subscriber. This must be the default
+  ///                     public identity.
+  /// @param po[in]     - The patch object to update the subscriber with.
+  /// @param aor[in]    - The AoR object to add the subscriber with if it
+  ///                     doesn't exist.
+  /// @param trail[in]  - The SAS trail ID.
+  ///
+  /// @return The result of the PATCH, or of the PUT if one was needed.
+  HTTPCode handle_replicated_patch(const std::string& sub_id,
+                                   const PatchObject& po,
+                                   const AoR& aor,
+                                   SAS::TrailId trail);
+
   /// This replicates a DELETE request from a client to the remote S4s. This
   /// doesn't return anything as the local S4 won't do anything if any
   /// remote DELETE fails (this function handles the different failure cases
   /// itself).
   ///
+  /// The replicate functions are called with the subscriber's write lock held
+  /// once the local store has been updated, and release it. An update for a
+  /// replication queue is queued before the lock is released, so that the
+  /// remote sites get the subscriber's updates in the same order as they were
+  /// made to the local store. Updates sent on the client's thread are sent
+  /// after the lock is released, so that they don't hold up other updates to
+  /// the subscriber.
+  ///
   /// @param sub_id[in] - The ID of the subscriber. This must be the default
   ///                     public identity.
+  /// @param lock[in]   - The subscriber's write lock, which this releases.
   /// @param trail[in]  - The SAS trail ID.
   void replicate_delete_cross_site(const std::string& sub_id,
+                                   std::unique_lock<std::recursive_mutex>& lock,
                                    SAS::TrailId trail);
 
   /// This replicates a PATCH request from a client to the remote S4s. This
@@ -273,10 +502,13 @@ private:
   ///                     PRECONDITION_FAILED (i.e. the subscriber doesn't exist
   ///                     on the remote site). In this case we send a PUT to
   ///                     that site with the aor to recreate the subscriber.
+  /// @param lock[in]   - The subscriber's write lock, which this releases (see
+  ///                     replicate_delete_cross_site).
   /// @param trail[in]  - The SAS trail ID.
   void replicate_patch_cross_site(const std::string& sub_id,
                                   const PatchObject& po,
                                   const AoR& aor,
+                                  std::unique_lock<std::recursive_mutex>& lock,
                                   SAS::TrailId trail);
 
   /// This replicates a PUT request from a client to the remote S4s. This
@@ -287,11 +519,56 @@ private:
   /// @param sub_id[in] - The ID of the subscriber. This must be the default
   ///                     public identity.
   /// @param aor[in]    - The AoR object to update the subscriber with.
+  /// @param lock[in]   - The subscriber's write lock, which this releases (see
+  ///                     replicate_delete_cross_site).
   /// @param trail[in]  - The SAS trail ID.
   void replicate_put_cross_site(const std::string& sub_id,
                                 const AoR& aor,
+                                std::unique_lock<std::recursive_mutex>& lock,
                                 SAS::TrailId trail);
 
+  /// This asks the remote S4s for a subscriber, either one at a time or all at
+  /// once (see set_parallel_remote_gets).
+  ///
+  /// @param sub_id[in]         - The ID of the subscriber to get data for.
+  /// @param all_not_found[out] - Whether every remote S4 answered NOT_FOUND
+  ///                             (rather than failing or timing out).
+  /// @param trail[in]          - The SAS trail ID.
+  ///
+  /// @return The subscriber's data from the first remote S4 that had it, or
+  ///         NULL if none of them did. The caller must delete the AoR.
+  AoR* get_from_remote_s4s(const std::string& sub_id,
+                           bool& all_not_found,
+                           SAS::TrailId trail);
+
+  /// As get_from_remote_s4s, but asks all the remote S4s at once.
+  AoR* get_from_remote_s4s_in_parallel(const std::string& sub_id,
+                                       bool& all_not_found,
+                                       SAS::TrailId trail);
+
+  /// This asks the remote S4s for several subscribers, as get_from_remote_s4s
+  /// does for one. Each remote S4 is asked for all of the subscribers it
+  /// might have in one multi-get.
+  ///
+  /// @param sub_ids[in]        - The IDs of the subscribers to get data for.
+  /// @param remote_aors[out]   - Each subscriber's data from the first remote
+  ///                             S4 that had it, or NULL if none of them did.
+  ///                             The caller must delete the AoRs.
+  /// @param all_not_found[out] - Whether every remote S4 answered NOT_FOUND
+  ///                             for each subscriber.
+  /// @param trail[in]          - The SAS trail ID.
+  void get_multi_from_remote_s4s(const std::vector<std::string>& sub_ids,
+                                 std::vector<AoR*>& remote_aors,
+                                 std::vector<bool>& all_not_found,
+                                 SAS::TrailId trail);
+
+  /// As get_multi_from_remote_s4s, but asks all the remote S4s at once.
+  void get_multi_from_remote_s4s_in_parallel(
+                                       const std::vector<std::string>& sub_ids,
+                                       std::vector<AoR*>& remote_aors,
+                                       std::vector<bool>& all_not_found,
+                                       SAS::TrailId trail);
+
   /// This gets data from memcached (calling into the underlying data store),
   /// and returns whether the get was successful. This only calls into the local
   /// store.
@@ -314,11 +591,17 @@ private:
 
   /// This writes data to memcached (calling into the underlying data store),
   /// and returns whether the write was successful. This only calls into the
-  /// local store.
+  /// local store. It doesn't send any timers, so it's cheap enough to call
+  /// with the subscriber's write lock held - see update_timers.
   ///
-  /// @param sub_id[in] - The ID of the subscriber to update.
-  /// @param aor[in]    - The AoR object to write.
-  /// @param trail[in]  - The SAS trail ID.
+  /// The AoR's expiry times are worked out once here, and the next one is
+  /// passed back for updating the timers.
+  ///
+  /// @param sub_id[in]        - The ID of the subscriber to update.
+  /// @param aor[in]           - The AoR object to write.
+  /// @param next_expires[out] - When the AoR's next binding or subscription
+  ///                            expires.
+  /// @param trail[in]         - The SAS trail ID.
   ///
   /// @return Whether the AoR was successfully written. This can be one of:
   ///   OK - The AoR was successfully written.
@@ -327,8 +610,135 @@ private:
   ///                     CAS conflict. We can try the write again.
   Store::Status write_aor(const std::string& sub_id,
                           AoR& aor,
+                          int& next_expires,
                           SAS::TrailId trail);
 
+  /// As write_aor, for an AoR that has already been tidied up (see tidy_aor),
+  /// and whose expiry times have already been worked out.
+  ///
+  /// @param last_expires[in] - When the AoR's last binding or subscription
+  ///                           expires.
+  Store::Status write_tidied_aor(const std::string& sub_id,
+                                 AoR& aor,
+                                 int last_expires,
+                                 SAS::TrailId trail);
+
+  /// This writes several AoRs to the local store at once, as write_aor does
+  /// for one, and waits for all the writes to finish.
+  ///
+  /// @param sub_ids[in] - The IDs of the subscribers to update.
+  /// @param aors[in]    - The AoR to write for each subscriber. Subscribers
+  ///                      whose AoR is NULL aren't written.
+  /// @param trails[in]  - The SAS trail ID for each write.
+  /// @param rcs[out]          - The result of each write (see write_aor).
+  ///                            This is OK for subscribers that weren't
+  ///                            written.
+  /// @param next_expires[out] - When each AoR's next binding or subscription
+  ///                            expires (see write_aor).
+  void write_aors(const std::vector<std::string>& sub_ids,
+                  const std::vector<AoR*>& aors,
+                  const std::vector<SAS::TrailId>& trails,
+                  std::vector<Store::Status>& rcs,
+                  std::vector<int>& next_expires);
+
+  /// This tidies up an AoR before it's written: subscriptions are removed if
+  /// there are no bindings, or only emergency bindings.
+  ///
+  /// @param aor[in] - The AoR to tidy up.
+  void tidy_aor(AoR& aor);
+
+  /// This works out when the store should expire an AoR.
+  ///
+  /// @param last_expires[in] - When the AoR's last binding or subscription
+  ///                           expires.
+  ///
+  /// @return The expiry to write the AoR with.
+  static int get_store_expiry(int last_expires);
+
+  /// This applies an update from a batch to the AoR read from the local
+  /// store. A PUT of a subscriber that already exists is applied as a PATCH,
+  /// and a PATCH of a subscriber that doesn't exist is applied as a PUT.
+  ///
+  /// @param request[in] - The update to apply.
+  /// @param aor[in/out] - The AoR read from the store. This may be replaced
+  ///                      with a new AoR, which keeps the CAS of the old one.
+  ///
+  /// @return Whether the AoR needs writing. It doesn't if the update is a
+  ///         DELETE of a subscriber that isn't on the local site.
+  bool apply_replicated_update(const ReplicationRequest& request,
+                               AoR** aor);
+
+  /// This fails an update in a batch, and every later update for the same
+  /// subscriber that hasn't been applied yet.
+  ///
+  /// @param requests[in] - The batch.
+  /// @param failed[in]   - The index of the update that failed.
+  /// @param done[in/out] - Which updates in the batch are finished.
+  /// @param rcs[in/out]  - The result of each update in the batch.
+  void fail_batch_updates(const std::vector<ReplicationRequest*>& requests,
+                          size_t failed,
+                          std::vector<bool>& done,
+                          std::vector<HTTPCode>& rcs);
+
+  /// This updates the Chronos timer for a subscriber after its AoR has been
+  /// written, and mimics a timer pop if any binding has already expired. This
+  /// must be called without the subscriber's write lock held, as it sends
+  /// requests to Chronos and can call back into the subscriber manager.
+  ///
+  /// Updates that were written one after another can update the timer in
+  /// either order, but the timer is checked against the stored AoR when it
+  /// pops, so a timer set for older data only means the pop is early or late.
+  ///
+  /// A PUT sends its timer before the write instead (see handle_put), so a
+  /// new subscriber's timer ID is written and replicated with it. This is
+  /// only used for the timers of existing subscribers, which normally
+  /// already have one.
+  ///
+  /// @param sub_id[in]       - The ID of the subscriber that was written.
+  /// @param aor[in]          - The AoR that was written. If a new timer is
+  ///                           created, its ID is set on the AoR and stored
+  ///                           (see store_timer_id).
+  /// @param next_expires[in] - When the AoR's next binding or subscription
+  ///                           expires, as worked out for the write.
+  /// @param trail[in]        - The SAS trail ID.
+  void update_timers(const std::string& sub_id,
+                     AoR& aor,
+                     int next_expires,
+                     SAS::TrailId trail);
+
+  /// This mimics a timer pop if any of the subscriber's bindings has already
+  /// expired. As with update_timers, this must be called without the
+  /// subscriber's write lock held.
+  ///
+  /// @param sub_id[in]       - The ID of the subscriber that was written.
+  /// @param aor[in]          - The AoR that was written.
+  /// @param next_expires[in] - When the AoR's next binding or subscription
+  ///                           expires.
+  /// @param now[in]          - The current time.
+  /// @param trail[in]        - The SAS trail ID.
+  void mimic_timer_pop_if_expired(const std::string& sub_id,
+                                  const AoR& aor,
+                                  int next_expires,
+                                  int now,
+                                  SAS::TrailId trail);
+
+  /// This stores the ID of a new timer for a subscriber. The stored AoR is
+  /// only updated if it still has the timer ID that the AoR had before the
+  /// timer was created. Otherwise another update has already stored its own
+  /// timer (or deleted the subscriber), so the new timer is deleted, and the
+  /// stored timer is updated to match the stored AoR. A new timer ID that is
+  /// stored is replicated to the remote sites as a PATCH.
+  ///
+  /// @param sub_id[in]       - The ID of the subscriber.
+  /// @param old_timer_id[in] - The timer ID that the AoR had before the new
+  ///                           timer was created.
+  /// @param aor[in]          - The AoR, with the new timer ID.
+  /// @param trail[in]        - The SAS trail ID.
+  void store_timer_id(const std::string& sub_id,
+                      const std::string& old_timer_id,
+                      AoR& aor,
+                      SAS::TrailId trail);
+
   /// This creates a mimic of timer pop from Chronos request, and put it on the
   /// worker thread. It's used whenever S4 finds that a binding has expired
   /// processing other task, so that the timer pop will trigger off a task in
@@ -336,11 +746,6 @@ private:
   void mimic_timer_pop(const std::string& sub_id,
                        SAS::TrailId trail);
 
-  /// Gets the ID of this S4. This is only used for logging.
-  ///
-  /// @return The ID of this S4.
-  inline std::string get_id() { return _s4_id; }
-
   /// The ID of this S4.
   const std::string _s4_id;
 
@@ -361,6 +766,35 @@ private:
 
   /// For local S4 to store a reference to the object that receives timer pops.
   TimerPopConsumer* _timer_pop_consumer;
+
+  /// Timeouts for asking the remote S4s for a subscriber in parallel. This is
+  /// empty if the remote S4s are asked one at a time.
+  std::vector<int> _parallel_remote_get_timeouts_ms;
+
+  /// The threads asking each remote S4 for subscribers in parallel, in the
+  /// same order as _remote_s4s. This is empty if the remote S4s are asked one
+  /// at a time.
+  std::vector<WorkerPool*> _remote_get_pools;
+
+  /// The queues of updates waiting to be sent to each remote S4, in the same
+  /// order as _remote_s4s. This is empty if updates are sent to the remote
+  /// S4s on the client's thread.
+  std::vector<ReplicationQueue*> _replication_queues;
+
+  /// Decides whether to retry writes that hit contention.
+  RetryPolicy _contention_retry_policy;
+
+  /// Subscribers that recently weren't found on any site. This is NULL if
+  /// they aren't remembered.
+  NegativeLookupCache* _negative_lookup_cache;
+
+  /// Locks held while reading, updating and writing back a subscriber, so
+  /// that threads in this process updating the same subscriber take turns
+  /// rather than racing each other for the CAS. A batch of replicated
+  /// updates holds the locks of all the subscribers in each round at once
+  /// (see handle_batch), taking them in address order so that two batches
+  /// can't deadlock. Nothing else holds more than one stripe at a time.
+  StripedLock _write_locks;
 };
 
 #endif
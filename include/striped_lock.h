@@ -0,0 +1,46 @@
+/**
+ * @file striped_lock.h Fixed-size table of locks shared between keys.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef STRIPED_LOCK_H__
+#define STRIPED_LOCK_H__
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// @class StripedLock
+///
+/// Gives each key a lock from a fixed-size table, so that work on one key can
+/// be serialised without keeping a lock for every key. Keys that hash to the
+/// same stripe share a lock, so a larger table means less false sharing.
+///
+/// The locks are recursive, so a thread that already holds a key's lock can
+/// take it again (for example, if handling a request for one subscriber leads
+/// to another request for the same subscriber on the same thread).
+class StripedLock
+{
+public:
+  /// Constructor.
+  ///
+  /// @param num_stripes - The number of locks in the table.
+  StripedLock(size_t num_stripes);
+
+  /// Get the lock for a key.
+  std::recursive_mutex& get(const std::string& key);
+
+private:
+  StripedLock(const StripedLock&) = delete;
+  StripedLock& operator=(const StripedLock&) = delete;
+
+  std::vector<std::recursive_mutex> _stripes;
+};
+
+#endif
@@ -0,0 +1,82 @@
+/**
+ * @file wildcard_matcher.h Matches IMPUs against wildcarded IMPUs.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef WILDCARD_MATCHER_H__
+#define WILDCARD_MATCHER_H__
+
+#include <map>
+#include <memory>
+#include <regex>
+#include <string>
+#include <vector>
+
+/// @class WildcardMatcher
+///
+/// Finds which of a set of wildcarded IMPUs (as defined in TS 23.003, e.g.
+/// "sip:!.*!@example.com") an IMPU belongs to.
+///
+/// Each wildcard is split into a literal prefix (before the first '!'), a
+/// regular expression (between the '!'s) and a literal suffix (after the
+/// second '!'). The wildcards are held in a trie keyed on the suffix read
+/// backwards, so a lookup walks back from the end of the IMPU once to find
+/// the wildcards whose suffix (usually the domain) matches. Only those
+/// wildcards have their prefix compared, and only wildcards whose prefix and
+/// suffix both match have their regular expression run, against just the
+/// middle of the IMPU.
+///
+/// This doesn't decide which URIs are wildcards, as '!' is also allowed in
+/// the user part of an ordinary SIP URI - the caller must only pass URIs
+/// that are known to be wildcards.
+class WildcardMatcher
+{
+public:
+  /// Constructor.
+  ///
+  /// @param wildcards - The wildcarded IMPUs. If an IMPU matches more than
+  ///                    one of these, the first is used. Any that don't have
+  ///                    a part delimited by '!' characters holding a valid
+  ///                    regular expression are ignored.
+  WildcardMatcher(const std::vector<std::string>& wildcards);
+
+  /// Find the wildcard that an IMPU belongs to.
+  ///
+  /// @param impu     - The IMPU to look up.
+  /// @param wildcard - Set to the matching wildcard, if there is one.
+  ///
+  /// @return         - Whether the IMPU matched a wildcard.
+  bool match(const std::string& impu, std::string& wildcard) const;
+
+private:
+  struct Entry
+  {
+    std::string _wildcard;
+
+    /// The literal text before the first '!'.
+    std::string _prefix;
+
+    /// Regular expression that the part of the IMPU between the literal
+    /// prefix and suffix must match.
+    std::regex _middle;
+  };
+
+  struct Node
+  {
+    std::map<char, std::unique_ptr<Node>> _children;
+
+    /// The entries whose literal suffix (read backwards) ends at this node.
+    std::vector<size_t> _entries;
+  };
+
+  std::vector<Entry> _entries;
+  Node _root;
+};
+
+#endif
@@ -0,0 +1,86 @@
+/**
+ * @file worker_pool.h Bounded pool of threads that run queued work.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#ifndef WORKER_POOL_H__
+#define WORKER_POOL_H__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// @class WorkerPool
+///
+/// A fixed number of threads that run work in the order it is submitted. The
+/// threads aren't started until the first piece of work arrives, so a pool
+/// that is never used costs nothing. The amount of work that can be
+/// outstanding (queued or running) is capped, and work that would go over the
+/// cap is refused rather than queued, so that a slow consumer can't build up
+/// an unbounded backlog.
+class WorkerPool
+{
+public:
+  /// Constructor.
+  ///
+  /// @param num_threads     - The number of threads that run the work.
+  /// @param max_outstanding - The most pieces of work that can be queued or
+  ///                          running at once.
+  WorkerPool(int num_threads, size_t max_outstanding);
+
+  /// Destructor. This runs any work that has already been submitted, then
+  /// waits for the threads to finish, so anything the work refers to must
+  /// outlive the pool.
+  ~WorkerPool();
+
+  /// Queue some work for the pool's threads, starting the threads if this is
+  /// the first piece of work.
+  ///
+  /// @param work - The work to run.
+  ///
+  /// @return Whether the work was queued. This is false if the pool already
+  ///         has max_outstanding pieces of work, or is being destroyed, in
+  ///         which case the work is not run.
+  bool submit(std::function<void()> work);
+
+  /// Whether the calling thread is one of this pool's threads. Work running
+  /// on the pool that needs to wait for other work on the same pool should
+  /// run that work itself instead, as there may be no free thread to run it.
+  bool on_pool_thread() const;
+
+  /// The number of threads that run the work.
+  int num_threads() const { return _num_threads; }
+
+private:
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  void worker_thread();
+
+  const int _num_threads;
+  const size_t _max_outstanding;
+
+  std::mutex _lock;
+  std::condition_variable _cond;
+  std::deque<std::function<void()>> _work;
+
+  /// The work that is queued or running.
+  size_t _outstanding;
+
+  bool _stopping;
+  std::vector<std::thread> _threads;
+
+  /// The pool that the current thread belongs to, if any.
+  static thread_local const WorkerPool* _current_pool;
+};
+
+#endif
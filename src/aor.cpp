@@ -10,9 +10,11 @@
  */
 
 #include <limits.h>
+#include <algorithm>
 
 #include "log.h"
 #include "aor.h"
+#include "json_string_stream.h"
 #include "json_parse_utils.h"
 #include "rapidjson/error/en.h"
 
@@ -22,10 +24,17 @@ AoR::AoR(std::string sip_uri) :
   _timer_id(""),
   _scscf_uri(""),
   _bindings(),
+  _cas(0),
+  _serialized_size(0),
+  _uri(sip_uri),
   _subscriptions(),
   _associated_uris(),
-  _cas(0),
-  _uri(sip_uri)
+  _binary_subscriptions(),
+  _binary_associated_uris(),
+  _binary_subscriptions_count(0),
+  _binary_subscriptions_next_expires(0),
+  _binary_subscriptions_last_expires(0),
+  _arena(NULL)
 {
 }
 
@@ -33,12 +42,14 @@ AoR::AoR(std::string sip_uri) :
 AoR::~AoR()
 {
   clear(true);
+  delete _arena; _arena = NULL;
 }
 
 
 /// Copy constructor.
 // LCOV_EXCL_START
-AoR::AoR(const AoR& other)
+AoR::AoR(const AoR& other) :
+  _arena(NULL)
 {
   common_constructor(other);
 }
@@ -54,7 +65,57 @@ AoR& AoR::operator= (AoR const& other)
 
   return *this;
 }
+// LCOV_EXCL_STOP
+
+/// Move constructor.
+AoR::AoR(AoR&& other) :
+  _arena(NULL)
+{
+  move_constructor(other);
+}
+
+AoR& AoR::operator= (AoR&& other)
+{
+  if (this != &other)
+  {
+    clear(true);
+    delete _arena; _arena = NULL;
+    move_constructor(other);
+  }
+
+  return *this;
+}
+
+void AoR::move_constructor(AoR& other)
+{
+  // The bindings and subscriptions may have been allocated from the other
+  // AoR's arena, so take that too.
+  _bindings = std::move(other._bindings);
+  _subscriptions = std::move(other._subscriptions);
+  _arena = other._arena;
+  other._bindings.clear();
+  other._subscriptions.clear();
+  other._arena = NULL;
+
+  _associated_uris = std::move(other._associated_uris);
+  _binary_subscriptions = std::move(other._binary_subscriptions);
+  _binary_associated_uris = std::move(other._binary_associated_uris);
+  other._associated_uris.clear_uris();
+  other._binary_subscriptions.clear();
+  other._binary_associated_uris.clear();
+
+  _binary_subscriptions_count = other._binary_subscriptions_count;
+  _binary_subscriptions_next_expires = other._binary_subscriptions_next_expires;
+  _binary_subscriptions_last_expires = other._binary_subscriptions_last_expires;
+  _notify_cseq = other._notify_cseq;
+  _timer_id = std::move(other._timer_id);
+  _cas = other._cas;
+  _serialized_size = other._serialized_size;
+  _uri = std::move(other._uri);
+  _scscf_uri = std::move(other._scscf_uri);
+}
 
+// LCOV_EXCL_START
 bool AoR::operator==(const AoR& other) const
 {
   bool bindings_equal = false;
@@ -77,6 +138,8 @@ bool AoR::operator==(const AoR& other) const
   }
 
   bool subscriptions_equal = false;
+  decode_subscriptions();
+  other.decode_subscriptions();
 
   if (_subscriptions.size() == other._subscriptions.size())
   {
@@ -100,7 +163,7 @@ bool AoR::operator==(const AoR& other) const
       (_scscf_uri != other._scscf_uri) ||
       (!bindings_equal) ||
       (!subscriptions_equal) ||
-      (_associated_uris != other._associated_uris) ||
+      (associated_uris() != other.associated_uris()) ||
       (_cas != other._cas))
   {
     return false;
@@ -116,11 +179,23 @@ bool AoR::operator!=(const AoR& other) const
 
 void AoR::common_constructor(const AoR& other)
 {
+  // Stop another thread decoding the other AoR's sections while they are
+  // copied.
+  std::lock_guard<std::mutex> other_lock(other._decode_lock);
+
+  if (other._arena != NULL)
+  {
+    use_arena(arena_size(other._bindings.size(), other._subscriptions.size()));
+  }
+
+  _bindings.reserve(other._bindings.size());
+  _subscriptions.reserve(other._subscriptions.size());
+
   for (Bindings::const_iterator i = other._bindings.begin();
        i != other._bindings.end();
        ++i)
   {
-    Binding* bb = new Binding(*i->second);
+    Binding* bb = create<Binding>(*i->second);
     _bindings.insert(std::make_pair(i->first, bb));
   }
 
@@ -128,14 +203,21 @@ void AoR::common_constructor(const AoR& other)
        i != other._subscriptions.end();
        ++i)
   {
-    Subscription* ss = new Subscription(*i->second);
+    Subscription* ss = create<Subscription>(*i->second);
     _subscriptions.insert(std::make_pair(i->first, ss));
   }
 
+  // Any undecoded sections are copied as they are.
   _associated_uris = AssociatedURIs(other._associated_uris);
+  _binary_subscriptions = other._binary_subscriptions;
+  _binary_associated_uris = other._binary_associated_uris;
+  _binary_subscriptions_count = other._binary_subscriptions_count;
+  _binary_subscriptions_next_expires = other._binary_subscriptions_next_expires;
+  _binary_subscriptions_last_expires = other._binary_subscriptions_last_expires;
   _notify_cseq = other._notify_cseq;
   _timer_id = other._timer_id;
   _cas = other._cas;
+  _serialized_size = other._serialized_size;
   _uri = other._uri;
   _scscf_uri = other._scscf_uri;
 }
@@ -146,23 +228,57 @@ void AoR::clear(bool remove_associated_uris)
 {
   for (BindingPair binding : _bindings)
   {
-    delete binding.second;
-  }
-
-  for (SubscriptionPair subscription : _subscriptions)
-  {
-    delete subscription.second;
+    destroy(binding.second);
   }
 
   _bindings.clear();
-  _subscriptions.clear();
+  clear_subscriptions();
 
   if (remove_associated_uris)
   {
     _associated_uris.clear_uris();
+    _binary_associated_uris.clear();
+  }
+
+  // Every binding and subscription has gone, so the arena's memory can be
+  // freed.
+  if (_arena != NULL)
+  {
+    _arena->reset();
   }
 }
 
+void AoR::use_arena(size_t first_block_size)
+{
+  if ((_arena == NULL) &&
+      (first_block_size > 0) &&
+      _bindings.empty() &&
+      _subscriptions.empty())
+  {
+    _arena = new Arena(first_block_size);
+  }
+}
+
+size_t AoR::arena_size(size_t num_bindings, size_t num_subscriptions)
+{
+  // Allow for each object being padded out to its alignment.
+  return (num_bindings * (sizeof(Binding) + alignof(Binding))) +
+         (num_subscriptions * (sizeof(Subscription) + alignof(Subscription)));
+}
+
+/// Remove all the subscriptions. Any undecoded subscriptions are simply
+/// dropped.
+void AoR::clear_subscriptions()
+{
+  for (SubscriptionPair subscription : _subscriptions)
+  {
+    destroy(subscription.second);
+  }
+
+  _subscriptions.clear();
+  _binary_subscriptions.clear();
+}
+
 /// Retrieve a binding by binding identifier, creating an empty one if
 /// necessary.  The created binding is completely empty, even the Contact URI
 /// field.
@@ -177,7 +293,7 @@ Binding* AoR::get_binding(const std::string& binding_id)
   else
   {
     // No existing binding with this id, so create a new one.
-    b = new Binding(_uri);
+    b = create<Binding>(_uri);
     b->_expires = 0;
     _bindings.insert(std::make_pair(binding_id, b));
   }
@@ -192,7 +308,7 @@ void AoR::remove_binding(const std::string& binding_id)
   Bindings::iterator i = _bindings.find(binding_id);
   if (i != _bindings.end())
   {
-    delete i->second;
+    destroy(i->second);
     _bindings.erase(i);
   }
 }
@@ -201,6 +317,8 @@ void AoR::remove_binding(const std::string& binding_id)
 /// necessary.
 Subscription* AoR::get_subscription(const std::string& to_tag)
 {
+  decode_subscriptions();
+
   Subscription* s;
   Subscriptions::const_iterator i = _subscriptions.find(to_tag);
   if (i != _subscriptions.end())
@@ -210,7 +328,7 @@ Subscription* AoR::get_subscription(const std::string& to_tag)
   else
   {
     // No existing subscription with this tag, so create a new one.
-    s = new Subscription;
+    s = create<Subscription>();
     _subscriptions.insert(std::make_pair(to_tag, s));
   }
   return s;
@@ -221,10 +339,12 @@ Subscription* AoR::get_subscription(const std::string& to_tag)
 /// subscription, does nothing.
 void AoR::remove_subscription(const std::string& to_tag)
 {
+  decode_subscriptions();
+
   Subscriptions::iterator i = _subscriptions.find(to_tag);
   if (i != _subscriptions.end())
   {
-    delete i->second;
+    destroy(i->second);
     _subscriptions.erase(i);
   }
 }
@@ -310,8 +430,8 @@ bool Binding::operator!=(const Binding& other) const
 }
 // LCOV_EXCL_STOP
 
-void Binding::
-  to_json(rapidjson::Writer<rapidjson::StringBuffer>& writer) const
+template <class JsonWriter>
+void Binding::to_json(JsonWriter& writer) const
 {
   writer.StartObject();
   {
@@ -351,6 +471,10 @@ void Binding::
   writer.EndObject();
 }
 
+// to_json is used with both rapidjson's StringBuffer and a JsonStringStream.
+template void Binding::to_json(rapidjson::Writer<rapidjson::StringBuffer>&) const;
+template void Binding::to_json(JsonStringWriter&) const;
+
 void Binding::from_json(const rapidjson::Value& b_obj)
 {
 
@@ -390,6 +514,64 @@ void Binding::from_json(const rapidjson::Value& b_obj)
   JSON_GET_BOOL_MEMBER(b_obj, JSON_EMERGENCY_REG, _emergency_registration);
 }
 
+void Binding::to_binary(BinaryWriter& writer) const
+{
+  writer.write_string(_uri);
+  writer.write_string(_cid);
+  writer.write_int(_cseq);
+  writer.write_int(_expires);
+  writer.write_int(_priority);
+
+  writer.write_uint(_params.size());
+  for (std::map<std::string, std::string>::const_iterator p = _params.begin();
+       p != _params.end();
+       ++p)
+  {
+    writer.write_string(p->first);
+    writer.write_string(p->second);
+  }
+
+  writer.write_uint(_path_headers.size());
+  for (std::list<std::string>::const_iterator p = _path_headers.begin();
+       p != _path_headers.end();
+       ++p)
+  {
+    writer.write_string(*p);
+  }
+
+  writer.write_string(_private_id);
+  writer.write_bool(_emergency_registration);
+}
+
+void Binding::from_binary(BinaryReader& reader)
+{
+  reader.read_string(_uri);
+  reader.read_string(_cid);
+  _cseq = reader.read_int();
+  _expires = reader.read_int();
+  _priority = reader.read_int();
+
+  uint64_t num_params = reader.read_uint();
+  for (uint64_t ii = 0; ii < num_params; ii++)
+  {
+    std::string name;
+    reader.read_string(name);
+    reader.read_string(_params[name]);
+  }
+
+  uint64_t num_path_headers = reader.read_uint();
+  for (uint64_t ii = 0; ii < num_path_headers; ii++)
+  {
+    _path_headers.push_back(std::string());
+    reader.read_string(_path_headers.back());
+  }
+
+  std::string private_id;
+  reader.read_string(private_id);
+  _private_id = private_id;
+  _emergency_registration = reader.read_bool();
+}
+
 /// Copy constructor.
 // LCOV_EXCL_START
 Subscription::Subscription(const Subscription& other)
@@ -449,8 +631,8 @@ bool Subscription::operator!=(const Subscription& other) const
 }
 // LCOV_EXCL_STOP
 
-void Subscription::
-  to_json(rapidjson::Writer<rapidjson::StringBuffer>& writer) const
+template <class JsonWriter>
+void Subscription::to_json(JsonWriter& writer) const
 {
   writer.StartObject();
   {
@@ -478,6 +660,9 @@ void Subscription::
   writer.EndObject();
 }
 
+template void Subscription::to_json(rapidjson::Writer<rapidjson::StringBuffer>&) const;
+template void Subscription::to_json(JsonStringWriter&) const;
+
 void Subscription::from_json(const rapidjson::Value& s_obj)
 {
   JSON_GET_STRING_MEMBER(s_obj, JSON_REQ_URI, _req_uri);
@@ -502,27 +687,98 @@ void Subscription::from_json(const rapidjson::Value& s_obj)
   JSON_GET_INT_MEMBER(s_obj, JSON_EXPIRES, _expires);
 }
 
-int AoR::get_last_expires() const
+void Subscription::to_binary(BinaryWriter& writer) const
 {
-  // Set a temp int to 0 to compare expiry times to.
+  writer.write_string(_req_uri);
+  writer.write_string(_from_uri);
+  writer.write_string(_from_tag);
+  writer.write_string(_to_uri);
+  writer.write_string(_to_tag);
+  writer.write_string(_cid);
+
+  writer.write_uint(_route_uris.size());
+  for (std::list<std::string>::const_iterator r = _route_uris.begin();
+       r != _route_uris.end();
+       ++r)
+  {
+    writer.write_string(*r);
+  }
+
+  writer.write_int(_expires);
+}
+
+void Subscription::from_binary(BinaryReader& reader)
+{
+  reader.read_string(_req_uri);
+  reader.read_string(_from_uri);
+  reader.read_string(_from_tag);
+  reader.read_string(_to_uri);
+  reader.read_string(_to_tag);
+  reader.read_string(_cid);
+
+  uint64_t num_routes = reader.read_uint();
+  for (uint64_t ii = 0; ii < num_routes; ii++)
+  {
+    _route_uris.push_back(std::string());
+    reader.read_string(_route_uris.back());
+  }
+
+  _expires = reader.read_int();
+}
+
+int Subscription::skip_binary(BinaryReader& reader)
+{
+  for (int ii = 0; ii < 6; ii++)
+  {
+    reader.skip_string();
+  }
+
+  uint64_t num_routes = reader.read_uint();
+  for (uint64_t ii = 0; ii < num_routes; ii++)
+  {
+    reader.skip_string();
+  }
+
+  return reader.read_int();
+}
+
+void AoR::get_expires(int& next_expires_out, int& last_expires_out) const
+{
+  std::lock_guard<std::mutex> lock(_decode_lock);
+
+  // Set temp ints to INT_MAX and 0 to compare expiry times to.
+  int next_expires = INT_MAX;
   int last_expires = 0;
 
-  for (BindingPair b : _bindings)
+  for (const BindingPair& b : _bindings)
   {
-    if (b.second->_expires > last_expires)
-    {
-      last_expires = b.second->_expires;
-    }
+    next_expires = std::min(next_expires, b.second->_expires);
+    last_expires = std::max(last_expires, b.second->_expires);
   }
 
-  for (SubscriptionPair s : _subscriptions)
+  for (const SubscriptionPair& s : _subscriptions)
   {
-    if (s.second->_expires > last_expires)
-    {
-      last_expires = s.second->_expires;
-    }
+    next_expires = std::min(next_expires, s.second->_expires);
+    last_expires = std::max(last_expires, s.second->_expires);
+  }
+
+  if ((!_binary_subscriptions.empty()) && (_binary_subscriptions_count > 0))
+  {
+    next_expires = std::min(next_expires, _binary_subscriptions_next_expires);
+    last_expires = std::max(last_expires, _binary_subscriptions_last_expires);
   }
 
+  // If nothing has altered next_expires, the AoR is empty and invalid.
+  // Use 0 to indicate there is nothing to expire.
+  next_expires_out = (next_expires == INT_MAX) ? 0 : next_expires;
+  last_expires_out = last_expires;
+}
+
+int AoR::get_last_expires() const
+{
+  int next_expires;
+  int last_expires;
+  get_expires(next_expires, last_expires);
   return last_expires;
 }
 
@@ -530,37 +786,147 @@ int AoR::get_last_expires() const
 // to expire next. If the function finds no expiry times in the bindings or
 // subscriptions it returns 0. This function should never be called on an empty AoR,
 // so a 0 is indicative of something wrong with the _expires values of AoR members.
-int AoR::get_next_expires()
+int AoR::get_next_expires() const
 {
-  // Set a temp int to INT_MAX to compare expiry times to.
-  int _next_expires = INT_MAX;
+  int next_expires;
+  int last_expires;
+  get_expires(next_expires, last_expires);
+  return next_expires;
+}
 
-  for (BindingPair b : _bindings)
+void AoR::set_binary_sections(const std::string& subscriptions,
+                              const std::string& associated_uris)
+{
+  // Skim through the subscriptions to check they are well formed, and to find
+  // out how many there are and when they expire.
+  BinaryReader subscriptions_reader(subscriptions.data(), subscriptions.size());
+  BinaryReader subscriptions_section = subscriptions_reader.read_section();
+  uint64_t num_subscriptions = subscriptions_section.read_uint();
+  int next_expires = INT_MAX;
+  int last_expires = 0;
+
+  for (uint64_t ii = 0; ii < num_subscriptions; ii++)
   {
-    if (b.second->_expires <= _next_expires)
-    {
-      _next_expires = b.second->_expires;
-    }
+    subscriptions_section.skip_string();
+    int expires = Subscription::skip_binary(subscriptions_section);
+    next_expires = std::min(next_expires, expires);
+    last_expires = std::max(last_expires, expires);
   }
-  for (SubscriptionPair s : _subscriptions)
+
+  BinaryReader associated_uris_reader(associated_uris.data(),
+                                      associated_uris.size());
+  BinaryReader associated_uris_section = associated_uris_reader.read_section();
+  AssociatedURIs::skip_binary(associated_uris_section);
+
+  clear_subscriptions();
+  _binary_subscriptions = subscriptions;
+  _binary_subscriptions_count = num_subscriptions;
+  _binary_subscriptions_next_expires = next_expires;
+  _binary_subscriptions_last_expires = last_expires;
+
+  _associated_uris.clear_uris();
+  _binary_associated_uris = associated_uris;
+}
+
+uint32_t AoR::get_subscriptions_count() const
+{
+  std::lock_guard<std::mutex> lock(_decode_lock);
+  return _binary_subscriptions.empty() ? _subscriptions.size() :
+                                         _binary_subscriptions_count;
+}
+
+bool AoR::write_binary_subscriptions(BinaryWriter& writer) const
+{
+  std::lock_guard<std::mutex> lock(_decode_lock);
+
+  if (_binary_subscriptions.empty())
+  {
+    return false;
+  }
+
+  writer.write_raw(_binary_subscriptions);
+  return true;
+}
+
+bool AoR::write_binary_associated_uris(BinaryWriter& writer) const
+{
+  std::lock_guard<std::mutex> lock(_decode_lock);
+
+  if (_binary_associated_uris.empty())
   {
-    if (s.second->_expires <= _next_expires)
+    return false;
+  }
+
+  writer.write_raw(_binary_associated_uris);
+  return true;
+}
+
+void AoR::decode_subscriptions() const
+{
+  std::lock_guard<std::mutex> lock(_decode_lock);
+
+  if (_binary_subscriptions.empty())
+  {
+    return;
+  }
+
+  TRC_DEBUG("Decoding the subscriptions for %s", _uri.c_str());
+
+  try
+  {
+    BinaryReader reader(_binary_subscriptions.data(),
+                        _binary_subscriptions.size());
+    BinaryReader section = reader.read_section();
+    uint64_t num_subscriptions = section.read_uint();
+    _subscriptions.reserve(_subscriptions.size() + num_subscriptions);
+
+    for (uint64_t ii = 0; ii < num_subscriptions; ii++)
     {
-      _next_expires = s.second->_expires;
+      std::string to_tag;
+      section.read_string(to_tag);
+      Subscription* s = create<Subscription>();
+      _subscriptions.insert(std::make_pair(to_tag, s));
+      s->from_binary(section);
     }
   }
+  catch (BinaryFormatError err)
+  {
+    // LCOV_EXCL_START - The section was checked in set_binary_sections
+    TRC_WARNING("Failed to decode subscriptions for %s (hit error at %s:%d)",
+                _uri.c_str(), err._file, err._line);
+    // LCOV_EXCL_STOP
+  }
+
+  _binary_subscriptions.clear();
+}
 
-  // If nothing has altered the _next_expires, the AoR is empty and invalid.
-  // Return 0 to indicate there is nothing to expire.
-  if (_next_expires == INT_MAX)
+void AoR::decode_associated_uris() const
+{
+  std::lock_guard<std::mutex> lock(_decode_lock);
+
+  if (_binary_associated_uris.empty())
+  {
+    return;
+  }
+
+  TRC_DEBUG("Decoding the Associated URIs for %s", _uri.c_str());
+
+  try
+  {
+    BinaryReader reader(_binary_associated_uris.data(),
+                        _binary_associated_uris.size());
+    BinaryReader section = reader.read_section();
+    _associated_uris.from_binary(section);
+  }
+  catch (BinaryFormatError err)
   {
-    // LCOV_EXCL_START - No UTs for unhittable code
-    return 0;
+    // LCOV_EXCL_START - The section was checked in set_binary_sections
+    TRC_WARNING("Failed to decode Associated URIs for %s (hit error at %s:%d)",
+                _uri.c_str(), err._file, err._line);
     // LCOV_EXCL_STOP
   }
 
-  // Otherwise we return the value found.
-  return _next_expires;
+  _binary_associated_uris.clear();
 }
 
 void AoR::copy_aor(const AoR& source_aor)
@@ -583,89 +949,110 @@ void AoR::copy_aor(const AoR& source_aor)
     *dst = *src;
   }
 
-  _associated_uris = AssociatedURIs(source_aor._associated_uris);
+  _associated_uris = AssociatedURIs(source_aor.associated_uris());
+  _binary_associated_uris.clear();
   _notify_cseq = source_aor._notify_cseq;
   _timer_id = source_aor._timer_id;
   _uri = source_aor._uri;
   _scscf_uri = source_aor._scscf_uri;
 }
 
-void AoR::patch_aor(const PatchObject& po)
+template <class T>
+void AoR::patch_entries(boost::container::flat_map<std::string, T*>& entries,
+                        const boost::container::flat_map<std::string, T*>& updates,
+                        const std::vector<std::string>& removals,
+                        const char* type)
 {
-  TRC_DEBUG("Patching the AoR for %s", _uri.c_str());
+  // Entries that the AoR already has are updated in place. New entries are
+  // collected up and merged in with a single pass at the end - they are
+  // already in order, as the patch's map is sorted the same way.
+  std::vector<std::pair<std::string, T*>> new_entries;
 
-  for (BindingPair patch_binding : po.get_update_bindings())
+  for (const std::pair<std::string, T*>& update : updates)
   {
-    TRC_DEBUG("Updating the binding %s", patch_binding.first.c_str());
+    TRC_DEBUG("Updating the %s %s", type, update.first.c_str());
+    typename boost::container::flat_map<std::string, T*>::iterator it =
+                                                    entries.find(update.first);
 
-    for (BindingPair aor_binding : _bindings)
+    if (it != entries.end())
     {
-      if (patch_binding.first == aor_binding.first)
-      {
-        _bindings.erase(aor_binding.first);
-        delete aor_binding.second;
-        break;
-      }
+      *(it->second) = *(update.second);
+    }
+    else
+    {
+      new_entries.push_back(std::make_pair(update.first,
+                                           create<T>(*(update.second))));
     }
-
-    Binding* copy_binding = new Binding(*(patch_binding.second));
-    _bindings.insert(std::make_pair(patch_binding.first, copy_binding));
   }
 
-  for (std::string binding_id : po.get_remove_bindings())
+  // Don't use move iterators here - flat_map can't tell that a moved
+  // std::pair is a value_type, and silently inserts nothing.
+  entries.insert(boost::container::ordered_unique_range,
+                 new_entries.begin(),
+                 new_entries.end());
+
+  // Removed entries are destroyed and marked with a NULL pointer, and then
+  // compacted out with a single pass, rather than erasing each one (which
+  // would shift the rest of the map along every time).
+  bool removed = false;
+
+  for (const std::string& id : removals)
   {
-    TRC_DEBUG("Removing the binding %s", binding_id.c_str());
+    TRC_DEBUG("Removing the %s %s", type, id.c_str());
+    typename boost::container::flat_map<std::string, T*>::iterator it =
+                                                              entries.find(id);
 
-    for (BindingPair binding : _bindings)
+    if ((it != entries.end()) && (it->second != NULL))
     {
-      if (binding_id == binding.first)
-      {
-        _bindings.erase(binding.first);
-        delete binding.second;
-        break;
-      }
+      destroy(it->second);
+      it->second = NULL;
+      removed = true;
     }
   }
 
-  for (SubscriptionPair patch_subscription : po.get_update_subscriptions())
+  if (removed)
   {
-    TRC_DEBUG("Updating the subscription %s", patch_subscription.first.c_str());
+    entries.erase(std::remove_if(entries.begin(),
+                                 entries.end(),
+                                 [](const std::pair<std::string, T*>& entry)
+                                 {
+                                   return entry.second == NULL;
+                                 }),
+                  entries.end());
+  }
+}
 
-    for (SubscriptionPair aor_subscription : _subscriptions)
-    {
-      if (patch_subscription.first == aor_subscription.first)
-      {
-        _subscriptions.erase(aor_subscription.first);
-        delete aor_subscription.second;
-        break;
-      }
-    }
+void AoR::patch_aor(const PatchObject& po)
+{
+  TRC_DEBUG("Patching the AoR for %s", _uri.c_str());
 
-    Subscription* copy_subscription =
-                                 new Subscription(*(patch_subscription.second));
-    _subscriptions.insert(std::make_pair(patch_subscription.first,
-                                         copy_subscription));
-  }
+  patch_entries(_bindings,
+                po.get_update_bindings(),
+                po.get_remove_bindings(),
+                "binding");
 
-  for (std::string subscription_id : po.get_remove_subscriptions())
+  if ((!po.get_update_subscriptions().empty()) ||
+      (!po.get_remove_subscriptions().empty()))
   {
-    TRC_DEBUG("Removing the subscription %s", subscription_id.c_str());
-
-    for (SubscriptionPair subscription : _subscriptions)
-    {
-      if (subscription_id == subscription.first)
-      {
-        _subscriptions.erase(subscription.first);
-        delete subscription.second;
-        break;
-      }
-    }
+    decode_subscriptions();
   }
 
+  patch_entries(_subscriptions,
+                po.get_update_subscriptions(),
+                po.get_remove_subscriptions(),
+                "subscription");
+
   if (po.get_associated_uris())
   {
     TRC_DEBUG("Updating the Associated URIs");
     _associated_uris = po.get_associated_uris().get();
+    _binary_associated_uris.clear();
+  }
+
+  if (po.get_timer_id())
+  {
+    TRC_DEBUG("Updating the timer ID to %s", po.get_timer_id().get().c_str());
+    _timer_id = po.get_timer_id().get();
   }
 
   if (po.get_increment_cseq())
@@ -685,6 +1072,7 @@ PatchObject::PatchObject() :
   _update_subscriptions({}),
   _remove_subscriptions({}),
   _associated_uris(boost::optional<AssociatedURIs>{}),
+  _timer_id(),
   _minimum_cseq(0),
   _increment_cseq(false)
 {}
@@ -715,33 +1103,27 @@ PatchObject& PatchObject::operator= (PatchObject const& other)
 
 void PatchObject::common_constructor(const PatchObject& other)
 {
-  for (BindingPair binding : other.get_update_bindings())
+  _update_bindings.reserve(other.get_update_bindings().size());
+
+  for (const BindingPair& binding : other.get_update_bindings())
   {
     _update_bindings.insert(
                  std::make_pair(binding.first, new Binding(*(binding.second))));
   }
 
-  for (std::string binding : other.get_remove_bindings())
-  {
-    _remove_bindings.push_back(binding);
-  }
+  _remove_bindings = other.get_remove_bindings();
+  _update_subscriptions.reserve(other.get_update_subscriptions().size());
 
-  for (SubscriptionPair subscription : other.get_update_subscriptions())
+  for (const SubscriptionPair& subscription : other.get_update_subscriptions())
   {
     _update_subscriptions.insert(
                       std::make_pair(subscription.first,
                                      new Subscription(*(subscription.second))));
   }
 
-  for (std::string subscription : other.get_remove_subscriptions())
-  {
-    _remove_subscriptions.push_back(subscription);
-  }
-
-  if (other.get_associated_uris())
-  {
-    _associated_uris = other.get_associated_uris().get();
-  }
+  _remove_subscriptions = other.get_remove_subscriptions();
+  _associated_uris = other.get_associated_uris();
+  _timer_id = other.get_timer_id();
 
   _minimum_cseq = other.get_minimum_cseq();
   _increment_cseq = other.get_increment_cseq();
@@ -759,6 +1141,121 @@ void PatchObject::clear()
   {
     delete s.second; s.second = NULL;
   }
+
+  _update_bindings.clear();
+  _remove_bindings.clear();
+  _update_subscriptions.clear();
+  _remove_subscriptions.clear();
+  _associated_uris = boost::none;
+  _timer_id = boost::none;
+}
+
+/// Merge a later patch's updates and removals for one type of entry into an
+/// earlier patch's. An entry that the later patch updates replaces the
+/// earlier patch's version, and is no longer removed. An entry that the later
+/// patch removes is no longer updated.
+template <class T>
+static void merge_patch_entries(boost::container::flat_map<std::string, T*>& updates,
+                                std::vector<std::string>& removals,
+                                const boost::container::flat_map<std::string, T*>& later_updates,
+                                const std::vector<std::string>& later_removals)
+{
+  for (const std::pair<std::string, T*>& update : later_updates)
+  {
+    typename boost::container::flat_map<std::string, T*>::iterator it =
+                                                    updates.find(update.first);
+
+    if (it != updates.end())
+    {
+      *(it->second) = *(update.second);
+    }
+    else
+    {
+      updates.insert(std::make_pair(update.first, new T(*(update.second))));
+    }
+
+    removals.erase(std::remove(removals.begin(), removals.end(), update.first),
+                   removals.end());
+  }
+
+  for (const std::string& id : later_removals)
+  {
+    typename boost::container::flat_map<std::string, T*>::iterator it =
+                                                              updates.find(id);
+
+    if (it != updates.end())
+    {
+      delete it->second;
+      updates.erase(it);
+    }
+
+    if (std::find(removals.begin(), removals.end(), id) == removals.end())
+    {
+      removals.push_back(id);
+    }
+  }
+}
+
+void PatchObject::merge(const PatchObject& later)
+{
+  merge_patch_entries(_update_bindings,
+                      _remove_bindings,
+                      later.get_update_bindings(),
+                      later.get_remove_bindings());
+  merge_patch_entries(_update_subscriptions,
+                      _remove_subscriptions,
+                      later.get_update_subscriptions(),
+                      later.get_remove_subscriptions());
+
+  if (later.get_associated_uris())
+  {
+    _associated_uris = later.get_associated_uris();
+  }
+
+  if (later.get_timer_id())
+  {
+    _timer_id = later.get_timer_id();
+  }
+
+  _minimum_cseq = std::max(_minimum_cseq, later.get_minimum_cseq());
+  _increment_cseq = _increment_cseq || later.get_increment_cseq();
+}
+
+/// Move constructor.
+PatchObject::PatchObject(PatchObject&& other) :
+  _update_bindings(std::move(other._update_bindings)),
+  _remove_bindings(std::move(other._remove_bindings)),
+  _update_subscriptions(std::move(other._update_subscriptions)),
+  _remove_subscriptions(std::move(other._remove_subscriptions)),
+  _associated_uris(std::move(other._associated_uris)),
+  _timer_id(std::move(other._timer_id)),
+  _minimum_cseq(other._minimum_cseq),
+  _increment_cseq(other._increment_cseq)
+{
+  // The other PatchObject no longer owns its bindings and subscriptions.
+  other._update_bindings.clear();
+  other._update_subscriptions.clear();
+}
+
+PatchObject& PatchObject::operator= (PatchObject&& other)
+{
+  if (this != &other)
+  {
+    clear();
+    _update_bindings = std::move(other._update_bindings);
+    _remove_bindings = std::move(other._remove_bindings);
+    _update_subscriptions = std::move(other._update_subscriptions);
+    _remove_subscriptions = std::move(other._remove_subscriptions);
+    _associated_uris = std::move(other._associated_uris);
+    _timer_id = std::move(other._timer_id);
+    _minimum_cseq = other._minimum_cseq;
+    _increment_cseq = other._increment_cseq;
+
+    other._update_bindings.clear();
+    other._update_subscriptions.clear();
+  }
+
+  return *this;
 }
 
 /// Convert an AoR to a PatchObject.
@@ -784,11 +1281,45 @@ void convert_aor_to_patch(const AoR& aor, PatchObject& po)
                                      new Subscription(*(subscription.second))));
   }
 
-  AssociatedURIs associated_uris = aor._associated_uris;
+  AssociatedURIs associated_uris = aor.associated_uris();
   int minimum = aor._notify_cseq;
 
-  po.set_update_bindings(patch_bindings);
-  po.set_update_subscriptions(patch_subscriptions);
-  po.set_associated_uris(associated_uris);
+  po.set_update_bindings(std::move(patch_bindings));
+  po.set_update_subscriptions(std::move(patch_subscriptions));
+  po.set_associated_uris(std::move(associated_uris));
   po.set_minimum_cseq(minimum);
 }
+
+void convert_aor_to_patch(AoR&& aor, PatchObject& po)
+{
+  // The AoR's bindings and subscriptions may live in its arena, so the
+  // PatchObject can't take the objects themselves. Move their contents into
+  // new objects instead, which doesn't copy any strings or containers.
+  Bindings patch_bindings;
+  patch_bindings.reserve(aor.get_bindings_count());
+
+  for (BindingPair binding : aor.bindings())
+  {
+    patch_bindings.insert(
+       std::make_pair(binding.first, new Binding(std::move(*(binding.second)))));
+  }
+
+  Subscriptions patch_subscriptions;
+  patch_subscriptions.reserve(aor.get_subscriptions_count());
+
+  for (SubscriptionPair subscription : aor.subscriptions())
+  {
+    patch_subscriptions.insert(
+            std::make_pair(subscription.first,
+                           new Subscription(std::move(*(subscription.second)))));
+  }
+
+  int minimum = aor._notify_cseq;
+
+  po.set_update_bindings(std::move(patch_bindings));
+  po.set_update_subscriptions(std::move(patch_subscriptions));
+  po.set_associated_uris(std::move(aor.associated_uris()));
+  po.set_minimum_cseq(minimum);
+
+  aor.clear(true);
+}
@@ -0,0 +1,65 @@
+/**
+ * @file arena.cpp Monotonic arena allocator.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+#include <cstdint>
+
+#include "arena.h"
+
+Arena::Arena(size_t block_size) :
+  _blocks(),
+  _first_block_size(block_size),
+  _next_block_size(block_size),
+  _next(NULL),
+  _remaining(0)
+{
+}
+
+Arena::~Arena()
+{
+  reset();
+}
+
+void Arena::reset()
+{
+  for (char* block : _blocks)
+  {
+    delete[] block;
+  }
+
+  _blocks.clear();
+  _next_block_size = _first_block_size;
+  _next = NULL;
+  _remaining = 0;
+}
+
+void* Arena::allocate(size_t size, size_t align)
+{
+  size_t padding = (align - ((uintptr_t)_next & (align - 1))) & (align - 1);
+
+  if (padding + size > _remaining)
+  {
+    // The current block is full, so start a new one. This is big enough for
+    // the allocation even if it has to be padded out to the alignment.
+    size_t block_size = std::max(_next_block_size, size + align);
+    _next = new char[block_size];
+    _blocks.push_back(_next);
+    _remaining = block_size;
+    _next_block_size *= 2;
+
+    padding = (align - ((uintptr_t)_next & (align - 1))) & (align - 1);
+  }
+
+  void* ptr = _next + padding;
+  _next += padding + size;
+  _remaining -= padding + size;
+  return ptr;
+}
@@ -10,15 +10,24 @@
  */
 
 #include "associated_uris.h"
+#include "json_string_stream.h"
 #include "log.h"
 
 #include <algorithm>
+#include <functional>
 #include "json_parse_utils.h"
 #include "rapidjson/error/en.h"
 
 AssociatedURIs::AssociatedURIs() :
   _associated_uris({}),
+  _uri_index({}),
+  _barred({}),
+  _first_unbarred(0),
+  _has_duplicate_uris(false),
+  _content_hash(0),
   _barred_map({}),
+  _wildcards({}),
+  _wildcard_matcher(),
   _distinct_to_wildcard({})
 {
 }
@@ -31,12 +40,11 @@ AssociatedURIs::~AssociatedURIs()
 // unbarred URI, we don't return anything unless it is an emergency in which
 // case we return the first URI.
 bool AssociatedURIs::get_default_impu(std::string& uri,
-                                      bool emergency)
+                                      bool emergency) const
 {
-  std::vector<std::string> unbarred_uris = this->get_unbarred_uris();
-  if (!unbarred_uris.empty())
+  if (_first_unbarred < _associated_uris.size())
   {
-    uri = unbarred_uris.front();
+    uri = _associated_uris[_first_unbarred];
     return true;
   }
 
@@ -51,38 +59,129 @@ bool AssociatedURIs::get_default_impu(std::string& uri,
 }
 
 // Checks if the URI is in the list of associated URIs.
-bool AssociatedURIs::contains_uri(std::string uri)
+bool AssociatedURIs::contains_uri(const std::string& uri) const
 {
-  return (std::find(_associated_uris.begin(), _associated_uris.end(), uri) !=
-          _associated_uris.end());
+  return (_uri_index.find(uri) != _uri_index.end());
 }
 
 // Adds a URI and its barring state to the list of associated URIs.
-void AssociatedURIs::add_uri(std::string uri,
+void AssociatedURIs::add_uri(const std::string& uri,
                              bool barred)
 {
+  size_t position = _associated_uris.size();
+
+  if (!_uri_index.insert(std::make_pair(uri, position)).second)
+  {
+    _has_duplicate_uris = true;
+  }
+
   _associated_uris.push_back(uri);
+  _barred.push_back(true);
+  _content_hash += hash_entry(uri, true);
+
+  if (_first_unbarred == position)
+  {
+    // All the existing URIs are barred, so the default IMPU is past the end
+    // of the list. Keep it there until set_barred finds an unbarred URI.
+    _first_unbarred++;
+  }
+
   add_barring_status(uri, barred);
 }
 
 // Adds the barring state of a URI. This map includes URIs that aren't in the
 // associated URI list (e.g. it includes non-distinct IMPUs)
-void AssociatedURIs::add_barring_status(std::string uri,
+void AssociatedURIs::add_barring_status(const std::string& uri,
                                         bool barred)
 {
-  _barred_map[uri] = barred;
+  std::pair<std::unordered_map<std::string, bool>::iterator, bool> result =
+                                    _barred_map.insert(std::make_pair(uri, barred));
+
+  if (!result.second)
+  {
+    result.first->second = barred;
+  }
+  else
+  {
+    for (const std::pair<const std::string, std::string>& mapping :
+           _distinct_to_wildcard)
+    {
+      if (mapping.second == uri)
+      {
+        add_wildcard(uri);
+        break;
+      }
+    }
+  }
+
+  std::unordered_map<std::string, size_t>::const_iterator it =
+                                                          _uri_index.find(uri);
+
+  if (it != _uri_index.end())
+  {
+    set_barred(it->second, barred);
+
+    if (_has_duplicate_uris)
+    {
+      for (size_t ii = it->second + 1; ii < _associated_uris.size(); ii++)
+      {
+        if (_associated_uris[ii] == uri)
+        {
+          set_barred(ii, barred);
+        }
+      }
+    }
+  }
+}
+
+void AssociatedURIs::set_barred(size_t position, bool barred)
+{
+  _content_hash -= hash_entry(_associated_uris[position], _barred[position]);
+  _content_hash += hash_entry(_associated_uris[position], barred);
+  _barred[position] = barred;
+
+  if ((!barred) && (position < _first_unbarred))
+  {
+    _first_unbarred = position;
+  }
+  else if ((barred) && (position == _first_unbarred))
+  {
+    // The default IMPU has been barred, so look for the next unbarred URI.
+    while ((_first_unbarred < _barred.size()) && (_barred[_first_unbarred]))
+    {
+      _first_unbarred++;
+    }
+  }
+}
+
+uint64_t AssociatedURIs::hash_entry(const std::string& uri, bool barred)
+{
+  // Mix the bits up, so that the sum of several entries is unlikely to
+  // collide with that of a different set of entries.
+  uint64_t hash = std::hash<std::string>()(uri) ^ (barred ? 0x9E3779B97F4A7C15 : 0);
+  hash ^= hash >> 33;
+  hash *= 0xFF51AFD7ED558CCD;
+  hash ^= hash >> 33;
+  return hash;
 }
 
 // Removes all URIs.
 void AssociatedURIs::clear_uris()
 {
   _associated_uris.clear();
+  _uri_index.clear();
+  _barred.clear();
+  _first_unbarred = 0;
+  _has_duplicate_uris = false;
+  _content_hash = 0;
   _barred_map.clear();
+  _wildcards.clear();
+  _wildcard_matcher.reset();
   _distinct_to_wildcard.clear();
 }
 
 // Returns if the specified URI is barred.
-bool AssociatedURIs::is_impu_barred(std::string uri)
+bool AssociatedURIs::is_impu_barred(const std::string& uri) const
 {
   // Sometimes we don't have the barring status of the specific URI as it's
   // actually an URI that matches a wildcard - get the wildcard URI before
@@ -90,23 +189,36 @@ bool AssociatedURIs::is_impu_barred(std::string uri)
   // has had its barring indication set specifically in the IMS subscription
   // we got from the HSS then it was directly added to the _barred_map (and
   // not added to the _distinct_to_wildcard map).
-  std::string uri_to_check = uri;
-  if (_distinct_to_wildcard.find(uri) != _distinct_to_wildcard.end())
-  {
-    uri_to_check = _distinct_to_wildcard[uri];
-  }
+  std::map<std::string, std::string>::const_iterator wildcard =
+                                               _distinct_to_wildcard.find(uri);
+  const std::string& uri_to_check = (wildcard != _distinct_to_wildcard.end()) ?
+                                      wildcard->second : uri;
+
+  std::unordered_map<std::string, bool>::const_iterator barred =
+                                                _barred_map.find(uri_to_check);
 
-  if (_barred_map.find(uri_to_check) != _barred_map.end())
+  if (barred != _barred_map.end())
   {
-    return _barred_map[uri_to_check];
+    return barred->second;
   }
-  else
+
+  // We don't have a mapping for this URI, but it may still belong to one of
+  // the wildcarded IMPUs in the IRS.
+  if (_wildcard_matcher != NULL)
   {
-    // We shouldn't ever end up here - return false (we do hit this in UTs
-    // though as we don't always use valid data).
-    TRC_DEBUG("No barring information available for %s", uri.c_str());
-    return false;
+    std::string wildcard;
+
+    if (_wildcard_matcher->match(uri, wildcard))
+    {
+      TRC_DEBUG("%s matches wildcard %s", uri.c_str(), wildcard.c_str());
+      return _barred_map.at(wildcard);
+    }
   }
+
+  // We shouldn't ever end up here - return false (we do hit this in UTs
+  // though as we don't always use valid data).
+  TRC_DEBUG("No barring information available for %s", uri.c_str());
+  return false;
 }
 
 // Returns all unbarred associated URIs.
@@ -114,14 +226,11 @@ std::vector<std::string> AssociatedURIs::get_unbarred_uris() const
 {
   std::vector<std::string> unbarred_uris;
 
-  for (std::string uri : _associated_uris)
+  for (size_t ii = _first_unbarred; ii < _associated_uris.size(); ii++)
   {
-    if (_barred_map.find(uri) != _barred_map.end())
+    if (!_barred[ii])
     {
-      if (!_barred_map.at(uri))
-      {
-        unbarred_uris.push_back(uri);
-      }
+      unbarred_uris.push_back(_associated_uris[ii]);
     }
   }
 
@@ -133,14 +242,11 @@ std::vector<std::string> AssociatedURIs::get_barred_uris() const
 {
   std::vector<std::string> barred_uris;
 
-  for (std::string uri : _associated_uris)
+  for (size_t ii = 0; ii < _associated_uris.size(); ii++)
   {
-    if (_barred_map.find(uri) != _barred_map.end())
+    if (_barred[ii])
     {
-      if (_barred_map.at(uri))
-      {
-        barred_uris.push_back(uri);
-      }
+      barred_uris.push_back(_associated_uris[ii]);
     }
   }
 
@@ -148,34 +254,52 @@ std::vector<std::string> AssociatedURIs::get_barred_uris() const
 }
 
 // Returns all associated URIs.
-std::vector<std::string> AssociatedURIs::get_all_uris()
+const std::vector<std::string>& AssociatedURIs::get_all_uris() const
 {
   return _associated_uris;
 }
 
 // Returns the wildcard mapping
-std::map<std::string, std::string> AssociatedURIs::get_wildcard_mapping()
+const std::map<std::string, std::string>& AssociatedURIs::get_wildcard_mapping() const
 {
   return _distinct_to_wildcard;
 }
 
 // Sets up the link between a distinct IMPU and its wildcard.
-void AssociatedURIs::add_wildcard_mapping(std::string wildcard,
-                                          std::string distinct)
+void AssociatedURIs::add_wildcard_mapping(const std::string& wildcard,
+                                          const std::string& distinct)
 {
   _distinct_to_wildcard.insert(std::make_pair(distinct, wildcard));
+
+  if (_barred_map.find(wildcard) != _barred_map.end())
+  {
+    add_wildcard(wildcard);
+  }
+}
+
+void AssociatedURIs::add_wildcard(const std::string& wildcard)
+{
+  if (std::find(_wildcards.begin(), _wildcards.end(), wildcard) !=
+      _wildcards.end())
+  {
+    return;
+  }
+
+  _wildcards.push_back(wildcard);
+  _wildcard_matcher = std::make_shared<const WildcardMatcher>(_wildcards);
 }
 
 // Expected format of json:
 // {"uris": [{"uri": "sip:uri", "barring": false},.......],
 //  "wildcard-mapping": {"distinct": ".....", "wildcard": "......"}}
-void AssociatedURIs::to_json(rapidjson::Writer<rapidjson::StringBuffer>& writer)
+template <class JsonWriter>
+void AssociatedURIs::to_json(JsonWriter& writer) const
 {
   writer.StartObject();
   {
     writer.String(JSON_URIS);
     writer.StartArray();
-    for (std::vector<std::string>::iterator uris_it = _associated_uris.begin();
+    for (std::vector<std::string>::const_iterator uris_it = _associated_uris.begin();
          uris_it != _associated_uris.end();
          uris_it++)
     {
@@ -192,12 +316,12 @@ void AssociatedURIs::to_json(rapidjson::Writer<rapidjson::StringBuffer>& writer)
     writer.String(JSON_WILDCARD_MAPPING);
     writer.StartObject();
     {
-      if (get_wildcard_mapping().size() != 0)
+      if (!_distinct_to_wildcard.empty())
       {
         writer.String(JSON_DISTINCT);
-        writer.String(get_wildcard_mapping().begin()->first.c_str());
+        writer.String(_distinct_to_wildcard.begin()->first.c_str());
         writer.String(JSON_WILDCARD);
-        writer.String(get_wildcard_mapping().begin()->second.c_str());
+        writer.String(_distinct_to_wildcard.begin()->second.c_str());
       }
     }
     writer.EndObject();
@@ -205,6 +329,10 @@ void AssociatedURIs::to_json(rapidjson::Writer<rapidjson::StringBuffer>& writer)
   writer.EndObject();
 }
 
+// The AoR serializers use a JsonStringWriter.
+template void AssociatedURIs::to_json(rapidjson::Writer<rapidjson::StringBuffer>&) const;
+template void AssociatedURIs::to_json(JsonStringWriter&) const;
+
 void AssociatedURIs::from_json(const rapidjson::Value& au_obj)
 {
   JSON_ASSERT_CONTAINS(au_obj, JSON_URIS);
@@ -236,28 +364,116 @@ void AssociatedURIs::from_json(const rapidjson::Value& au_obj)
     JSON_GET_STRING_MEMBER(wildcard_obj, JSON_DISTINCT, distinct)
     JSON_GET_STRING_MEMBER(wildcard_obj, JSON_WILDCARD, wildcard)
 
-    add_wildcard_mapping(distinct, wildcard);
+    add_wildcard_mapping(wildcard, distinct);
   }
 }
 
-bool AssociatedURIs::operator==(AssociatedURIs other) const
+// The binary format holds the same information as the JSON format: each URI
+// with its barring state, followed by the first wildcard mapping (if any).
+void AssociatedURIs::to_binary(BinaryWriter& writer) const
 {
-  std::vector<std::string> sorted_aus = _associated_uris;
-  std::sort(sorted_aus.begin(), sorted_aus.end());
-  std::vector<std::string> sorted_other_aus = other._associated_uris;
-  std::sort(sorted_other_aus.begin(), sorted_other_aus.end());
+  writer.write_uint(_associated_uris.size());
+  for (std::vector<std::string>::const_iterator uris_it = _associated_uris.begin();
+       uris_it != _associated_uris.end();
+       uris_it++)
+  {
+    writer.write_string(*uris_it);
+    writer.write_bool(is_impu_barred(*uris_it));
+  }
+
+  writer.write_bool(!_distinct_to_wildcard.empty());
+  if (!_distinct_to_wildcard.empty())
+  {
+    writer.write_string(_distinct_to_wildcard.begin()->first);
+    writer.write_string(_distinct_to_wildcard.begin()->second);
+  }
+}
+
+void AssociatedURIs::from_binary(BinaryReader& reader)
+{
+  clear_uris();
+
+  uint64_t num_uris = reader.read_uint();
+  for (uint64_t ii = 0; ii < num_uris; ii++)
+  {
+    std::string uri;
+    reader.read_string(uri);
+    bool barring = reader.read_bool();
+    add_uri(uri, barring);
+  }
+
+  if (reader.read_bool())
+  {
+    std::string distinct;
+    std::string wildcard;
+    reader.read_string(distinct);
+    reader.read_string(wildcard);
+    add_wildcard_mapping(wildcard, distinct);
+  }
+}
+
+void AssociatedURIs::skip_binary(BinaryReader& reader)
+{
+  uint64_t num_uris = reader.read_uint();
+  for (uint64_t ii = 0; ii < num_uris; ii++)
+  {
+    reader.skip_string();
+    reader.read_bool();
+  }
 
-  // Only comparing associated URIs and barring, not wildcard mappings
-  if ((sorted_aus != sorted_other_aus) ||
-      (get_barred_uris() != other.get_barred_uris()))
+  if (reader.read_bool())
+  {
+    reader.skip_string();
+    reader.skip_string();
+  }
+}
+
+bool AssociatedURIs::operator==(const AssociatedURIs& other) const
+{
+  // Only comparing associated URIs and barring, not wildcard mappings. The
+  // content hashes rule out almost all unequal pairs straight away.
+  if ((_associated_uris.size() != other._associated_uris.size()) ||
+      (_content_hash != other._content_hash))
   {
     return false;
   }
 
-  return true;
+  if ((!_has_duplicate_uris) && (!other._has_duplicate_uris))
+  {
+    // Each URI appears once on each side, so the two are the same if every
+    // one of our URIs is in the other's index with the same barring state.
+    for (size_t ii = 0; ii < _associated_uris.size(); ii++)
+    {
+      std::unordered_map<std::string, size_t>::const_iterator it =
+                                    other._uri_index.find(_associated_uris[ii]);
+
+      if ((it == other._uri_index.end()) ||
+          (other._barred[it->second] != _barred[ii]))
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  // Duplicate URIs don't happen in practice, so it's fine for this to be slow.
+  std::vector<std::pair<std::string, bool>> sorted_aus;
+  std::vector<std::pair<std::string, bool>> sorted_other_aus;
+
+  for (size_t ii = 0; ii < _associated_uris.size(); ii++)
+  {
+    sorted_aus.push_back(std::make_pair(_associated_uris[ii], _barred[ii]));
+    sorted_other_aus.push_back(std::make_pair(other._associated_uris[ii],
+                                              other._barred[ii]));
+  }
+
+  std::sort(sorted_aus.begin(), sorted_aus.end());
+  std::sort(sorted_other_aus.begin(), sorted_other_aus.end());
+  return (sorted_aus == sorted_other_aus);
 }
 
-bool AssociatedURIs::operator!=(AssociatedURIs other) const
+bool AssociatedURIs::operator!=(const AssociatedURIs& other) const
 {
   return !(operator==(other));
 }
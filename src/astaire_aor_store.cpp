@@ -10,22 +10,56 @@
  */
 
 
+#include <algorithm>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+
 #include "log.h"
 #include "s4sasevent.h"
 #include "astaire_aor_store.h"
-#include "json_parse_utils.h"
+#include "json_string_stream.h"
+#include "rapidjson/reader.h"
 #include "rapidjson/error/en.h"
 
 
-AstaireAoRStore::AstaireAoRStore(Store* store) : AoRStore()
+AstaireAoRStore::AstaireAoRStore(Store* store,
+                                 SerializationFormat format,
+                                 int num_async_threads,
+                                 bool use_arenas) :
+  AoRStore(),
+  _async_pool(new WorkerPool(num_async_threads, MAX_QUEUED_ASYNC_REQUESTS))
 {
-  JsonSerializerDeserializer* serializer_deserializer = new JsonSerializerDeserializer();
-  _connector = new Connector(store, serializer_deserializer); // Takes ownership of serializer_deserializer
+  SerializerDeserializer* serializer;
+
+  if (format == SerializationFormat::BINARY)
+  {
+    serializer = new BinarySerializerDeserializer();
+  }
+  else
+  {
+    serializer = new JsonSerializerDeserializer();
+  }
+
+  // Always be able to read both formats. The binary deserializer goes first
+  // as it rejects JSON records by looking at a single byte.
+  std::vector<SerializerDeserializer*> deserializers = {
+    new BinarySerializerDeserializer(use_arenas),
+    new JsonSerializerDeserializer(use_arenas)
+  };
+
+  // Takes ownership of the serializer and deserializers.
+  _connector = new Connector(store, serializer, deserializers);
 }
 
 AstaireAoRStore::~AstaireAoRStore()
 {
-  // Ownership of serializer_deserializer passed to _connector
+  // Let the threads finish any requests that are still queued, as their
+  // callers are waiting for the callbacks, and they use the connector.
+  delete _async_pool; _async_pool = NULL;
+
+  // Ownership of the serializer and deserializers passed to _connector
   delete _connector; _connector = NULL;
 }
 
@@ -38,6 +72,45 @@ AoR* AstaireAoRStore::get_aor_data(const std::string& aor_id,
   return _connector->get_aor_data(aor_id, trail);
 }
 
+void AstaireAoRStore::get_aor_data_multi(const std::vector<std::string>& aor_ids,
+                                         std::vector<AoR*>& aors,
+                                         SAS::TrailId trail)
+{
+  if (_async_pool->on_pool_thread())
+  {
+    // We'd be waiting for the threads while holding one of them, so do the
+    // gets here instead.
+    AoRStore::get_aor_data_multi(aor_ids, aors, trail);
+    return;
+  }
+
+  aors.assign(aor_ids.size(), NULL);
+
+  std::mutex lock;
+  std::condition_variable cond;
+  size_t max_in_flight = _async_pool->num_threads();
+  size_t in_flight = 0;
+  std::unique_lock<std::mutex> wait_lock(lock);
+
+  for (size_t ii = 0; ii < aor_ids.size(); ii++)
+  {
+    cond.wait(wait_lock, [&]() { return in_flight < max_in_flight; });
+    in_flight++;
+    wait_lock.unlock();
+
+    get_aor_data_async(aor_ids[ii], trail, [&, ii](AoR* aor)
+    {
+      std::unique_lock<std::mutex> callback_lock(lock);
+      aors[ii] = aor;
+      in_flight--;
+      cond.notify_one();
+    });
+
+    wait_lock.lock();
+  }
+
+  cond.wait(wait_lock, [&]() { return in_flight == 0; });
+}
 
 Store::Status AstaireAoRStore::set_aor_data(const std::string& aor_id,
                                             AoR* aor,
@@ -50,20 +123,64 @@ Store::Status AstaireAoRStore::set_aor_data(const std::string& aor_id,
                                   trail);
 }
 
+void AstaireAoRStore::get_aor_data_async(const std::string& aor_id,
+                                         SAS::TrailId trail,
+                                         GetCallback callback)
+{
+  start_async([this, aor_id, trail, callback]()
+  {
+    callback(_connector->get_aor_data(aor_id, trail));
+  });
+}
+
+void AstaireAoRStore::set_aor_data_async(const std::string& aor_id,
+                                         AoR* aor,
+                                         int expiry,
+                                         SAS::TrailId trail,
+                                         SetCallback callback)
+{
+  start_async([this, aor_id, aor, expiry, trail, callback]()
+  {
+    callback(_connector->set_aor_data(aor_id, aor, expiry, trail));
+  });
+}
+
+void AstaireAoRStore::start_async(std::function<void()> request)
+{
+  // A request made from one of the pool's threads is carried out there and
+  // then, as its caller may be about to wait for it. If too many requests are
+  // queued already, the caller waits for this one rather than adding to the
+  // backlog.
+  if ((_async_pool->on_pool_thread()) || (!_async_pool->submit(request)))
+  {
+    request();
+  }
+}
+
 /// AstaireAoRStore::Connector Methods
 
 AstaireAoRStore::Connector::Connector(Store* data_store,
-                            JsonSerializerDeserializer*& serializer_deserializer) :
+                            SerializerDeserializer*& serializer,
+                            std::vector<SerializerDeserializer*>& deserializers) :
   _data_store(data_store),
-  _serializer_deserializer(serializer_deserializer)
+  _serializer(serializer),
+  _deserializers(deserializers)
 {
-  // We have taken ownership of the serializer_deserializer.
-  serializer_deserializer = NULL;
+  // We have taken ownership of the serializer and deserializers.
+  serializer = NULL;
+  deserializers.clear();
 }
 
 AstaireAoRStore::Connector::~Connector()
 {
-  delete _serializer_deserializer; _serializer_deserializer = NULL;
+  delete _serializer; _serializer = NULL;
+
+  for (SerializerDeserializer* deserializer : _deserializers)
+  {
+    delete deserializer;
+  }
+
+  _deserializers.clear();
 }
 
 /// Retrieve the registration data for a given SIP Address of Record, creating
@@ -84,17 +201,28 @@ AoR* AstaireAoRStore::Connector::get_aor_data(
                                                data,
                                                cas,
                                                trail,
-                                               Store::Format::JSON);
+                                               _serializer->store_format());
 
   if (status == Store::Status::OK)
   {
-    // Retrieved the data, so deserialize it.
+    // Retrieved the data, so deserialize it. Try each deserializer in turn
+    // until one of them recognises the format of the record.
     TRC_DEBUG("Data store returned a record, CAS = %ld", cas);
-    aor_data = _serializer_deserializer->deserialize_aor(aor_id, data);
+
+    for (SerializerDeserializer* deserializer : _deserializers)
+    {
+      aor_data = deserializer->deserialize_aor(aor_id, data);
+
+      if (aor_data != NULL)
+      {
+        break;
+      }
+    }
 
     if (aor_data != NULL)
     {
       aor_data->_cas = cas;
+      aor_data->_serialized_size = data.size();
 
       SAS::Event event(trail, SASEvent::REGSTORE_GET_FOUND, 0);
       event.add_var_param(aor_id);
@@ -138,7 +266,14 @@ Store::Status AstaireAoRStore::Connector::set_aor_data(
                                             int expiry,
                                             SAS::TrailId trail)
 {
-  std::string data = _serializer_deserializer->serialize_aor(aor_data);
+  // Serialize into a buffer that is reused for every write on this thread.
+  // The store only borrows the buffer for the duration of set_data, so once
+  // it has grown to the size of a typical record, writes don't need to
+  // allocate any memory for the serialized data.
+  static thread_local std::string data;
+  _serializer->serialize_aor(aor_data, data);
+  aor_data->_serialized_size = data.size();
+
   SAS::Event event(trail, SASEvent::REGSTORE_SET_START, 0);
   event.add_var_param(aor_id);
   SAS::report_event(event);
@@ -149,10 +284,17 @@ Store::Status AstaireAoRStore::Connector::set_aor_data(
                                                aor_data->_cas,
                                                expiry,
                                                trail,
-                                               Store::Format::JSON);
+                                               _serializer->store_format());
 
   TRC_DEBUG("Data store set_data returned %d", status);
 
+  // Don't hang on to the memory for an unusually large AoR for the life of
+  // the thread.
+  if (data.capacity() > MAX_REUSED_BUFFER_SIZE)
+  {
+    std::string().swap(data);
+  }
+
   if (status == Store::Status::OK)
   {
     SAS::Event event2(trail, SASEvent::REGSTORE_SET_SUCCESS, 0);
@@ -174,77 +316,590 @@ Store::Status AstaireAoRStore::Connector::set_aor_data(
 // (De)serializer for the JSON SubscriberDataManager format.
 //
 
-AoR* AstaireAoRStore::JsonSerializerDeserializer::
-  deserialize_aor(const std::string& aor_id, const std::string& s)
+/// SAX handler that builds an AoR directly from the JSON SubscriberDataManager
+/// format as the document is read, without building a DOM first. Strings are
+/// copied straight from the reader into the AoR's fields.
+///
+/// This accepts exactly the documents that the DOM based from_json methods
+/// accept: required members must be present and of the right type, optional
+/// members may be missing, and unknown members are skipped. Any handler
+/// method returning false stops the parse, and the caller treats the record
+/// as corrupt.
+class AoRJsonSaxHandler :
+  public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, AoRJsonSaxHandler>
 {
-  TRC_DEBUG("Deserialize JSON document: %s", s.c_str());
+public:
+  AoRJsonSaxHandler(AoR* aor) :
+    _aor(aor),
+    _key(KEY_NONE),
+    _skip_depth(0),
+    _binding(NULL),
+    _subscription(NULL),
+    _barring(false)
+  {}
 
-  rapidjson::Document doc;
-  doc.Parse<0>(s.c_str());
+  bool Null() { return other_value(); }
+  bool Double(double /*d*/) { return other_value(); }
+  bool Int64(int64_t /*i*/) { return other_value(); }
+  bool Uint64(uint64_t /*u*/) { return other_value(); }
 
-  if (doc.HasParseError())
+  bool Uint(unsigned u)
   {
-    TRC_DEBUG("Failed to parse document: %s\nError: %s",
-              s.c_str(),
-              rapidjson::GetParseError_En(doc.GetParseError()));
-    return NULL;
+    return (u <= INT_MAX) ? Int((int)u) : other_value();
   }
 
-  AoR* aor = new AoR(aor_id);
+  bool Int(int i)
+  {
+    if (_skip_depth > 0)
+    {
+      return true;
+    }
 
-  try
+    switch (context())
+    {
+    case TOP:
+      if (_key == KEY_NOTIFY_CSEQ) { _aor->_notify_cseq = i; break; }
+      return other_value();
+
+    case BINDING:
+      if (_key == KEY_CSEQ) { _binding->_cseq = i; break; }
+      if (_key == KEY_EXPIRES) { _binding->_expires = i; break; }
+      if (_key == KEY_PRIORITY) { _binding->_priority = i; break; }
+      return other_value();
+
+    case SUBSCRIPTION:
+      if (_key == KEY_EXPIRES) { _subscription->_expires = i; break; }
+      return other_value();
+
+    default:
+      return other_value();
+    }
+
+    return seen_key();
+  }
+
+  bool Bool(bool b)
+  {
+    if (_skip_depth > 0)
+    {
+      return true;
+    }
+
+    if ((context() == BINDING) && (_key == KEY_EMERGENCY_REG))
+    {
+      _binding->_emergency_registration = b;
+    }
+    else if ((context() == ASSOCIATED_URI) && (_key == KEY_BARRING))
+    {
+      _barring = b;
+    }
+    else
+    {
+      return other_value();
+    }
+
+    return seen_key();
+  }
+
+  bool String(const char* str, rapidjson::SizeType length, bool /*copy*/)
+  {
+    if (_skip_depth > 0)
+    {
+      return true;
+    }
+
+    std::string* target = NULL;
+
+    switch (context())
+    {
+    case TOP:
+      if (_key == KEY_TIMER_ID) { target = &_aor->_timer_id; }
+      else if (_key == KEY_SCSCF_URI) { target = &_aor->_scscf_uri; }
+      break;
+
+    case BINDING:
+      if (_key == KEY_URI) { target = &_binding->_uri; }
+      else if (_key == KEY_CID) { target = &_binding->_cid; }
+      else if (_key == KEY_PRIVATE_ID)
+      {
+        _binding->_private_id = std::string(str, length);
+        return seen_key();
+      }
+      break;
+
+    case PARAMS:
+      target = &_binding->_params[_name];
+      break;
+
+    case PATH_HEADERS:
+      _binding->_path_headers.push_back(std::string());
+      target = &_binding->_path_headers.back();
+      break;
+
+    case SUBSCRIPTION:
+      if (_key == KEY_REQ_URI) { target = &_subscription->_req_uri; }
+      else if (_key == KEY_FROM_URI) { target = &_subscription->_from_uri; }
+      else if (_key == KEY_FROM_TAG) { target = &_subscription->_from_tag; }
+      else if (_key == KEY_TO_URI) { target = &_subscription->_to_uri; }
+      else if (_key == KEY_TO_TAG) { target = &_subscription->_to_tag; }
+      else if (_key == KEY_CID) { target = &_subscription->_cid; }
+      break;
+
+    case ROUTES:
+      _subscription->_route_uris.push_back(std::string());
+      target = &_subscription->_route_uris.back();
+      break;
+
+    case ASSOCIATED_URI:
+      if (_key == KEY_URI) { target = &_name; }
+      break;
+
+    case WILDCARD_MAPPING:
+      if (_key == KEY_DISTINCT) { target = &_name; }
+      else if (_key == KEY_WILDCARD) { target = &_wildcard; }
+      break;
+
+    default:
+      break;
+    }
+
+    if (target == NULL)
+    {
+      return other_value();
+    }
+
+    target->assign(str, length);
+    return seen_key();
+  }
+
+  bool Key(const char* str, rapidjson::SizeType length, bool /*copy*/)
   {
-    JSON_ASSERT_OBJECT(doc);
-    JSON_ASSERT_CONTAINS(doc, JSON_BINDINGS);
-    JSON_ASSERT_OBJECT(doc[JSON_BINDINGS]);
-    const rapidjson::Value& bindings_obj = doc[JSON_BINDINGS];
+    if (_skip_depth > 0)
+    {
+      return true;
+    }
 
-    for (rapidjson::Value::ConstMemberIterator bindings_it = bindings_obj.MemberBegin();
-         bindings_it != bindings_obj.MemberEnd();
-         ++bindings_it)
+    switch (context())
     {
-      TRC_DEBUG("  Binding: %s", bindings_it->name.GetString());
-      Binding* b = aor->get_binding(bindings_it->name.GetString());
+    case TOP:
+      _key = (key_is(str, length, JSON_BINDINGS)) ? KEY_BINDINGS :
+             (key_is(str, length, JSON_SUBSCRIPTIONS)) ? KEY_SUBSCRIPTIONS :
+             (key_is(str, length, JSON_ASSOCIATED_URIS)) ? KEY_ASSOCIATED_URIS :
+             (key_is(str, length, JSON_NOTIFY_CSEQ)) ? KEY_NOTIFY_CSEQ :
+             (key_is(str, length, JSON_TIMER_ID)) ? KEY_TIMER_ID :
+             (key_is(str, length, JSON_SCSCF_URI)) ? KEY_SCSCF_URI :
+             KEY_UNKNOWN;
+      break;
+
+    case BINDINGS:
+      TRC_DEBUG("  Binding: %.*s", (int)length, str);
+      _binding = _aor->get_binding(std::string(str, length));
+      _key = KEY_ENTRY;
+      break;
 
-      JSON_ASSERT_OBJECT(bindings_it->value);
-      const rapidjson::Value& b_obj = bindings_it->value;
+    case BINDING:
+      _key = (key_is(str, length, JSON_URI)) ? KEY_URI :
+             (key_is(str, length, JSON_CID)) ? KEY_CID :
+             (key_is(str, length, JSON_CSEQ)) ? KEY_CSEQ :
+             (key_is(str, length, JSON_EXPIRES)) ? KEY_EXPIRES :
+             (key_is(str, length, JSON_PRIORITY)) ? KEY_PRIORITY :
+             (key_is(str, length, JSON_PARAMS)) ? KEY_PARAMS :
+             (key_is(str, length, JSON_PATH_HEADERS)) ? KEY_PATH_HEADERS :
+             (key_is(str, length, JSON_PRIVATE_ID)) ? KEY_PRIVATE_ID :
+             (key_is(str, length, JSON_EMERGENCY_REG)) ? KEY_EMERGENCY_REG :
+             KEY_UNKNOWN;
+      break;
 
-      b->from_json(b_obj);
+    case PARAMS:
+      _name.assign(str, length);
+      _key = KEY_ENTRY;
+      break;
+
+    case SUBSCRIPTIONS:
+      TRC_DEBUG("  Subscription: %.*s", (int)length, str);
+      _subscription = _aor->get_subscription(std::string(str, length));
+      _key = KEY_ENTRY;
+      break;
+
+    case SUBSCRIPTION:
+      _key = (key_is(str, length, JSON_REQ_URI)) ? KEY_REQ_URI :
+             (key_is(str, length, JSON_FROM_URI)) ? KEY_FROM_URI :
+             (key_is(str, length, JSON_FROM_TAG)) ? KEY_FROM_TAG :
+             (key_is(str, length, JSON_TO_URI)) ? KEY_TO_URI :
+             (key_is(str, length, JSON_TO_TAG)) ? KEY_TO_TAG :
+             (key_is(str, length, JSON_CID)) ? KEY_CID :
+             (key_is(str, length, JSON_ROUTES)) ? KEY_ROUTES :
+             (key_is(str, length, JSON_EXPIRES)) ? KEY_EXPIRES :
+             KEY_UNKNOWN;
+      break;
+
+    case ASSOCIATED_URIS:
+      _key = (key_is(str, length, JSON_URIS)) ? KEY_URIS :
+             (key_is(str, length, JSON_WILDCARD_MAPPING)) ? KEY_WILDCARD_MAPPING :
+             KEY_UNKNOWN;
+      break;
+
+    case ASSOCIATED_URI:
+      _key = (key_is(str, length, JSON_URI)) ? KEY_URI :
+             (key_is(str, length, JSON_BARRING)) ? KEY_BARRING :
+             KEY_UNKNOWN;
+      break;
+
+    case WILDCARD_MAPPING:
+      _key = (key_is(str, length, JSON_DISTINCT)) ? KEY_DISTINCT :
+             (key_is(str, length, JSON_WILDCARD)) ? KEY_WILDCARD :
+             KEY_UNKNOWN;
+      break;
+
+    default:
+      return false;
+    }
+
+    return true;
+  }
+
+  bool StartObject()
+  {
+    if (_skip_depth > 0)
+    {
+      _skip_depth++;
+      return true;
     }
 
-    JSON_ASSERT_CONTAINS(doc, JSON_SUBSCRIPTIONS);
-    JSON_ASSERT_OBJECT(doc[JSON_SUBSCRIPTIONS]);
-    const rapidjson::Value& subscriptions_obj = doc[JSON_SUBSCRIPTIONS];
+    Context next;
 
-    for (rapidjson::Value::ConstMemberIterator subscriptions_it = subscriptions_obj.MemberBegin();
-         subscriptions_it != subscriptions_obj.MemberEnd();
-         ++subscriptions_it)
+    if (_stack.empty())
     {
-      TRC_DEBUG("  Subscription: %s", subscriptions_it->name.GetString());
-      Subscription* s = aor->get_subscription(subscriptions_it->name.GetString());
+      next = TOP;
+    }
+    else
+    {
+      switch (context())
+      {
+      case TOP:
+        next = (_key == KEY_BINDINGS) ? BINDINGS :
+               (_key == KEY_SUBSCRIPTIONS) ? SUBSCRIPTIONS :
+               (_key == KEY_ASSOCIATED_URIS) ? ASSOCIATED_URIS :
+               INVALID;
+        break;
+
+      case BINDINGS:
+        next = BINDING;
+        break;
+
+      case BINDING:
+        next = (_key == KEY_PARAMS) ? PARAMS : INVALID;
+        break;
 
-      JSON_ASSERT_OBJECT(subscriptions_it->value);
-      const rapidjson::Value& s_obj = subscriptions_it->value;
+      case SUBSCRIPTIONS:
+        next = SUBSCRIPTION;
+        break;
 
-      s->from_json(s_obj);
+      case ASSOCIATED_URIS:
+        next = (_key == KEY_WILDCARD_MAPPING) ? WILDCARD_MAPPING : INVALID;
+        break;
+
+      case ASSOCIATED_URI_LIST:
+        next = ASSOCIATED_URI;
+        break;
+
+      default:
+        next = INVALID;
+        break;
+      }
     }
 
-    if (doc.HasMember(JSON_ASSOCIATED_URIS))
+    if (next == INVALID)
     {
-      JSON_ASSERT_OBJECT(doc[JSON_ASSOCIATED_URIS]);
-      const rapidjson::Value& au_obj = doc[JSON_ASSOCIATED_URIS];
-      aor->_associated_uris.from_json(au_obj);
+      return skip_value();
     }
 
-    JSON_GET_INT_MEMBER(doc, JSON_NOTIFY_CSEQ, aor->_notify_cseq);
+    if (next == ASSOCIATED_URIS)
+    {
+      _aor->associated_uris().clear_uris();
+    }
 
-    JSON_SAFE_GET_STRING_MEMBER(doc, JSON_TIMER_ID, aor->_timer_id);
-    JSON_SAFE_GET_STRING_MEMBER(doc, JSON_SCSCF_URI, aor->_scscf_uri);
+    return push(next);
   }
-  catch(JsonFormatError err)
+
+  bool StartArray()
   {
-    TRC_INFO("Failed to deserialize JSON document (hit error at %s:%d)",
-             err._file, err._line);
+    if (_skip_depth > 0)
+    {
+      _skip_depth++;
+      return true;
+    }
+
+    if (_stack.empty())
+    {
+      return false;
+    }
+
+    Context next = ((context() == BINDING) && (_key == KEY_PATH_HEADERS)) ? PATH_HEADERS :
+                   ((context() == SUBSCRIPTION) && (_key == KEY_ROUTES)) ? ROUTES :
+                   ((context() == ASSOCIATED_URIS) && (_key == KEY_URIS)) ? ASSOCIATED_URI_LIST :
+                   INVALID;
+
+    if (next == INVALID)
+    {
+      return skip_value();
+    }
+
+    return push(next);
+  }
+
+  bool EndObject(rapidjson::SizeType /*member_count*/)
+  {
+    if (_skip_depth > 0)
+    {
+      _skip_depth--;
+      return true;
+    }
+
+    Frame frame = _stack.back();
+    _stack.pop_back();
+
+    switch (frame._context)
+    {
+    case TOP:
+      return has_keys(frame, {KEY_BINDINGS, KEY_SUBSCRIPTIONS, KEY_NOTIFY_CSEQ});
+
+    case BINDING:
+      return has_keys(frame, {KEY_URI, KEY_CID, KEY_CSEQ, KEY_EXPIRES,
+                              KEY_PRIORITY, KEY_PARAMS, KEY_PRIVATE_ID,
+                              KEY_EMERGENCY_REG});
+
+    case SUBSCRIPTION:
+      return has_keys(frame, {KEY_REQ_URI, KEY_FROM_URI, KEY_FROM_TAG,
+                              KEY_TO_URI, KEY_TO_TAG, KEY_CID, KEY_ROUTES,
+                              KEY_EXPIRES});
+
+    case ASSOCIATED_URIS:
+      return has_keys(frame, {KEY_URIS, KEY_WILDCARD_MAPPING});
+
+    case ASSOCIATED_URI:
+      if (!has_keys(frame, {KEY_URI, KEY_BARRING}))
+      {
+        return false;
+      }
+
+      TRC_DEBUG("From JSON - Adding URI: %s, barring: %d",
+                _name.c_str(), _barring);
+      _aor->associated_uris().add_uri(_name, _barring);
+      return true;
+
+    case WILDCARD_MAPPING:
+      if (has_keys(frame, {KEY_DISTINCT}))
+      {
+        if (!has_keys(frame, {KEY_WILDCARD}))
+        {
+          return false;
+        }
+
+        // _name holds the distinct IMPU.
+        _aor->associated_uris().add_wildcard_mapping(_wildcard, _name);
+      }
+      return true;
+
+    default:
+      return true;
+    }
+  }
+
+  bool EndArray(rapidjson::SizeType /*element_count*/)
+  {
+    if (_skip_depth > 0)
+    {
+      _skip_depth--;
+      return true;
+    }
+
+    _stack.pop_back();
+    return true;
+  }
+
+private:
+  /// The objects and arrays that the handler can be inside.
+  enum Context
+  {
+    INVALID,
+    TOP,
+    BINDINGS,
+    BINDING,
+    PARAMS,
+    PATH_HEADERS,
+    SUBSCRIPTIONS,
+    SUBSCRIPTION,
+    ROUTES,
+    ASSOCIATED_URIS,
+    ASSOCIATED_URI_LIST,
+    ASSOCIATED_URI,
+    WILDCARD_MAPPING
+  };
+
+  /// The member keys that the handler understands. The meaning of a key
+  /// depends on the context it appears in.
+  enum Member
+  {
+    KEY_NONE,
+    KEY_UNKNOWN,
+    KEY_ENTRY,
+    KEY_BINDINGS,
+    KEY_SUBSCRIPTIONS,
+    KEY_ASSOCIATED_URIS,
+    KEY_NOTIFY_CSEQ,
+    KEY_TIMER_ID,
+    KEY_SCSCF_URI,
+    KEY_URI,
+    KEY_CID,
+    KEY_CSEQ,
+    KEY_EXPIRES,
+    KEY_PRIORITY,
+    KEY_PARAMS,
+    KEY_PATH_HEADERS,
+    KEY_PRIVATE_ID,
+    KEY_EMERGENCY_REG,
+    KEY_REQ_URI,
+    KEY_FROM_URI,
+    KEY_FROM_TAG,
+    KEY_TO_URI,
+    KEY_TO_TAG,
+    KEY_ROUTES,
+    KEY_URIS,
+    KEY_WILDCARD_MAPPING,
+    KEY_BARRING,
+    KEY_DISTINCT,
+    KEY_WILDCARD
+  };
+
+  /// An object or array that is being read, and which of its keys have been
+  /// seen so far.
+  struct Frame
+  {
+    Context _context;
+    uint64_t _seen_keys;
+  };
+
+  static bool key_is(const char* str,
+                     rapidjson::SizeType length,
+                     const char* key)
+  {
+    return (strlen(key) == length) && (memcmp(str, key, length) == 0);
+  }
+
+  Context context() const
+  {
+    return _stack.empty() ? INVALID : _stack.back()._context;
+  }
+
+  bool push(Context next)
+  {
+    if (!_stack.empty())
+    {
+      seen_key();
+    }
+
+    _stack.push_back({next, 0});
+    _key = KEY_NONE;
+    return true;
+  }
+
+  bool seen_key()
+  {
+    _stack.back()._seen_keys |= ((uint64_t)1 << _key);
+    return true;
+  }
+
+  static bool has_keys(const Frame& frame, std::initializer_list<Member> keys)
+  {
+    for (Member key : keys)
+    {
+      if ((frame._seen_keys & ((uint64_t)1 << key)) == 0)
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  /// Handle a value that isn't one the handler is expecting. This is fine
+  /// for members we don't understand (which are skipped), and for the
+  /// optional string members of the top level object (where a value of the
+  /// wrong type is ignored). Anything else means the document is invalid.
+  bool other_value()
+  {
+    bool ignorable = (_key == KEY_UNKNOWN) ||
+                     ((context() == TOP) &&
+                      ((_key == KEY_TIMER_ID) || (_key == KEY_SCSCF_URI)));
+
+    return ignorable;
+  }
+
+  /// Start skipping an object or array that the handler isn't expecting.
+  bool skip_value()
+  {
+    if (!other_value())
+    {
+      return false;
+    }
+
+    _skip_depth = 1;
+    return true;
+  }
+
+  AoR* _aor;
+  std::vector<Frame> _stack;
+  Member _key;
+
+  /// Depth of the unknown object or array currently being skipped.
+  int _skip_depth;
+
+  Binding* _binding;
+  Subscription* _subscription;
+
+  /// Scratch space for the parameter name, associated URI and wildcard
+  /// mapping currently being read.
+  std::string _name;
+  std::string _wildcard;
+  bool _barring;
+};
+
+AoR* AstaireAoRStore::JsonSerializerDeserializer::
+  deserialize_aor(const std::string& aor_id, const std::string& s)
+{
+  TRC_DEBUG("Deserialize JSON document: %s", s.c_str());
+
+  // Read the document with a SAX handler that fills in the AoR as it goes,
+  // rather than parsing it into a DOM and then copying out of that.
+  AoR* aor = new AoR(aor_id);
+
+  if (_use_arenas)
+  {
+    // The record is bigger than the bindings and subscriptions it holds, so
+    // its size is plenty for the first block.
+    aor->use_arena(s.size());
+  }
+
+  AoRJsonSaxHandler handler(aor);
+  rapidjson::Reader reader;
+  rapidjson::StringStream ss(s.c_str());
+  reader.Parse<rapidjson::kParseDefaultFlags>(ss, handler);
+
+  if (reader.HasParseError())
+  {
+    if (reader.GetParseErrorCode() == rapidjson::kParseErrorTermination)
+    {
+      TRC_INFO("Failed to deserialize JSON document (invalid content at offset %zu)",
+               reader.GetErrorOffset());
+    }
+    else
+    {
+      TRC_DEBUG("Failed to parse document: %s\nError: %s",
+                s.c_str(),
+                rapidjson::GetParseError_En(reader.GetParseErrorCode()));
+    }
+
     delete aor; aor = NULL;
   }
 
@@ -252,10 +907,19 @@ AoR* AstaireAoRStore::JsonSerializerDeserializer::
 }
 
 
-std::string AstaireAoRStore::JsonSerializerDeserializer::serialize_aor(AoR* aor_data)
+void AstaireAoRStore::JsonSerializerDeserializer::serialize_aor(AoR* aor_data,
+                                                                std::string& data)
 {
-  rapidjson::StringBuffer sb;
-  rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+  // Write the document straight into the caller's buffer. Make room for it
+  // up front, based on how big the AoR was the last time it was read or
+  // written, rather than growing the buffer as we go. The writer is reused
+  // for every AoR serialized on this thread, so that it keeps the memory it
+  // uses to track nesting.
+  data.clear();
+  data.reserve(aor_data->_serialized_size);
+  JsonStringStream stream(data);
+  static thread_local JsonStringWriter writer;
+  writer.Reset(stream);
 
   writer.StartObject();
   {
@@ -293,7 +957,7 @@ std::string AstaireAoRStore::JsonSerializerDeserializer::serialize_aor(AoR* aor_
 
     // Associated URIs
     writer.String(JSON_ASSOCIATED_URIS);
-    aor_data->_associated_uris.to_json(writer);
+    aor_data->associated_uris().to_json(writer);
 
     // Notify Cseq flag
     writer.String(JSON_NOTIFY_CSEQ); writer.Int(aor_data->_notify_cseq);
@@ -301,6 +965,133 @@ std::string AstaireAoRStore::JsonSerializerDeserializer::serialize_aor(AoR* aor_
     writer.String(JSON_SCSCF_URI); writer.String(aor_data->_scscf_uri.c_str());
   }
   writer.EndObject();
+}
+
+
+//
+// (De)serializer for the compact binary SubscriberDataManager format.
+//
+// A record is laid out as follows, where every section is prefixed with its
+// length so that it can be skipped over without decoding it.
+//
+//   format byte (BINARY_FORMAT_V1)
+//   notify CSeq, timer ID, S-CSCF URI
+//   bindings section:      count, then (binding ID, binding) for each binding
+//   subscriptions section: count, then (To tag, subscription) for each one
+//   associated URIs section
+//
+
+AoR* AstaireAoRStore::BinarySerializerDeserializer::
+  deserialize_aor(const std::string& aor_id, const std::string& s)
+{
+  if (s.empty() || ((uint8_t)s[0] != BINARY_FORMAT_V1))
+  {
+    TRC_DEBUG("Data is not in the binary format");
+    return NULL;
+  }
+
+  TRC_DEBUG("Deserialize binary record of %zu bytes", s.size());
+
+  AoR* aor = new AoR(aor_id);
+
+  try
+  {
+    BinaryReader reader(s.data(), s.size());
+    reader.read_byte();
 
-  return sb.GetString();
+    aor->_notify_cseq = reader.read_int();
+    reader.read_string(aor->_timer_id);
+    reader.read_string(aor->_scscf_uri);
+
+    BinaryReader bindings_reader = reader.read_section();
+    uint64_t num_bindings = bindings_reader.read_uint();
+
+    // Don't trust the count enough to reserve space for a corrupt record that
+    // claims to have a huge number of bindings.
+    if (num_bindings > s.size())
+    {
+      BINARY_FORMAT_ERROR();
+    }
+
+    // The subscriptions are decoded later, if at all, so the arena only
+    // needs room for the bindings to start with.
+    if (_use_arenas)
+    {
+      aor->use_arena(AoR::arena_size(num_bindings, 0));
+    }
+
+    aor->_bindings.reserve(num_bindings);
+
+    for (uint64_t ii = 0; ii < num_bindings; ii++)
+    {
+      std::string binding_id;
+      bindings_reader.read_string(binding_id);
+      TRC_DEBUG("  Binding: %s", binding_id.c_str());
+      aor->get_binding(binding_id)->from_binary(bindings_reader);
+    }
+
+    // The subscriptions and Associated URIs aren't needed to handle most
+    // requests, so hold them undecoded until they are used.
+    std::string subscriptions;
+    std::string associated_uris;
+    reader.read_raw_section(subscriptions);
+    reader.read_raw_section(associated_uris);
+    aor->set_binary_sections(subscriptions, associated_uris);
+  }
+  catch(BinaryFormatError err)
+  {
+    TRC_INFO("Failed to deserialize binary record (hit error at %s:%d)",
+             err._file, err._line);
+    delete aor; aor = NULL;
+  }
+
+  return aor;
+}
+
+
+void AstaireAoRStore::BinarySerializerDeserializer::serialize_aor(AoR* aor_data,
+                                                                  std::string& data)
+{
+  data.clear();
+  data.reserve(aor_data->_serialized_size);
+  BinaryWriter writer(data);
+
+  writer.write_byte(BINARY_FORMAT_V1);
+  writer.write_int(aor_data->_notify_cseq);
+  writer.write_string(aor_data->_timer_id);
+  writer.write_string(aor_data->_scscf_uri);
+
+  size_t bindings_start = writer.start_section();
+  writer.write_uint(aor_data->bindings().size());
+  for (Bindings::const_iterator it = aor_data->bindings().begin();
+       it != aor_data->bindings().end();
+       ++it)
+  {
+    writer.write_string(it->first);
+    it->second->to_binary(writer);
+  }
+  writer.end_section(bindings_start);
+
+  // Sections that were never decoded can't have changed, so write them back
+  // exactly as they were read.
+  if (!aor_data->write_binary_subscriptions(writer))
+  {
+    size_t subscriptions_start = writer.start_section();
+    writer.write_uint(aor_data->subscriptions().size());
+    for (Subscriptions::const_iterator it = aor_data->subscriptions().begin();
+         it != aor_data->subscriptions().end();
+         ++it)
+    {
+      writer.write_string(it->first);
+      it->second->to_binary(writer);
+    }
+    writer.end_section(subscriptions_start);
+  }
+
+  if (!aor_data->write_binary_associated_uris(writer))
+  {
+    size_t associated_uris_start = writer.start_section();
+    aor_data->associated_uris().to_binary(writer);
+    writer.end_section(associated_uris_start);
+  }
 }
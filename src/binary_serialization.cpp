@@ -0,0 +1,158 @@
+/**
+ * @file binary_serialization.cpp Helpers for the compact binary AoR format.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "binary_serialization.h"
+
+void BinaryWriter::write_uint(uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    write_byte((uint8_t)(value | 0x80));
+    value >>= 7;
+  }
+
+  write_byte((uint8_t)value);
+}
+
+void BinaryWriter::write_int(int value)
+{
+  // Zig-zag encode the value so that small negative numbers stay small.
+  int64_t wide = value;
+  write_uint(((uint64_t)wide << 1) ^ (uint64_t)(wide >> 63));
+}
+
+void BinaryWriter::write_string(const std::string& value)
+{
+  write_uint(value.size());
+  _buffer.append(value);
+}
+
+size_t BinaryWriter::start_section()
+{
+  size_t start = _buffer.size();
+  _buffer.append(4, '\0');
+  return start;
+}
+
+void BinaryWriter::end_section(size_t start)
+{
+  uint32_t length = _buffer.size() - start - 4;
+
+  for (int ii = 0; ii < 4; ii++)
+  {
+    _buffer[start + ii] = (char)((length >> (8 * ii)) & 0xFF);
+  }
+}
+
+uint8_t BinaryReader::read_byte()
+{
+  if (_offset >= _length)
+  {
+    BINARY_FORMAT_ERROR();
+  }
+
+  return (uint8_t)_data[_offset++];
+}
+
+bool BinaryReader::read_bool()
+{
+  uint8_t value = read_byte();
+
+  if (value > 1)
+  {
+    BINARY_FORMAT_ERROR();
+  }
+
+  return (value == 1);
+}
+
+uint64_t BinaryReader::read_uint()
+{
+  uint64_t value = 0;
+
+  for (int shift = 0; shift < 64; shift += 7)
+  {
+    uint8_t byte = read_byte();
+    value |= (uint64_t)(byte & 0x7F) << shift;
+
+    if ((byte & 0x80) == 0)
+    {
+      return value;
+    }
+  }
+
+  // The varint is longer than any value we could have written.
+  BINARY_FORMAT_ERROR();
+}
+
+int BinaryReader::read_int()
+{
+  uint64_t encoded = read_uint();
+  int64_t value = (int64_t)(encoded >> 1) ^ -(int64_t)(encoded & 1);
+
+  if ((value < INT32_MIN) || (value > INT32_MAX))
+  {
+    BINARY_FORMAT_ERROR();
+  }
+
+  return (int)value;
+}
+
+void BinaryReader::read_string(std::string& value)
+{
+  uint64_t length = read_uint();
+
+  if (length > _length - _offset)
+  {
+    BINARY_FORMAT_ERROR();
+  }
+
+  value.assign(_data + _offset, length);
+  _offset += length;
+}
+
+void BinaryReader::skip_string()
+{
+  uint64_t length = read_uint();
+
+  if (length > _length - _offset)
+  {
+    BINARY_FORMAT_ERROR();
+  }
+
+  _offset += length;
+}
+
+BinaryReader BinaryReader::read_section()
+{
+  uint32_t length = 0;
+
+  for (int ii = 0; ii < 4; ii++)
+  {
+    length |= (uint32_t)read_byte() << (8 * ii);
+  }
+
+  if (length > _length - _offset)
+  {
+    BINARY_FORMAT_ERROR();
+  }
+
+  BinaryReader section(_data + _offset, length);
+  _offset += length;
+  return section;
+}
+
+void BinaryReader::read_raw_section(std::string& raw)
+{
+  size_t start = _offset;
+  read_section();
+  raw.assign(_data + start, _offset - start);
+}
@@ -0,0 +1,324 @@
+/**
+ * @file caching_aor_store.cpp AoRStore that keeps recently used AoRs in
+ * memory.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+#include <functional>
+
+#include "log.h"
+#include "caching_aor_store.h"
+
+CachingAoRStore::CachingAoRStore(AoRStore* store,
+                                 size_t capacity,
+                                 int ttl_ms,
+                                 size_t num_shards) :
+  AoRStore(),
+  _store(store),
+  _shards(),
+  _capacity_per_shard(0),
+  _ttl(ttl_ms),
+  _hits(0),
+  _misses(0),
+  _invalidations(0)
+{
+  num_shards = std::max(num_shards, (size_t)1);
+  _capacity_per_shard = std::max(capacity / num_shards, (size_t)1);
+
+  for (size_t ii = 0; ii < num_shards; ii++)
+  {
+    _shards.push_back(new Shard());
+  }
+}
+
+CachingAoRStore::~CachingAoRStore()
+{
+  for (Shard* shard : _shards)
+  {
+    delete shard;
+  }
+
+  _shards.clear();
+}
+
+AoR* CachingAoRStore::get_aor_data(const std::string& aor_id,
+                                   SAS::TrailId trail)
+{
+  AoR* aor = lookup(aor_id);
+
+  if (aor != NULL)
+  {
+    return aor;
+  }
+
+  _misses.fetch_add(1);
+  start_read(aor_id);
+  aor = _store->get_aor_data(aor_id, trail);
+  got_from_store(aor_id, aor);
+
+  return aor;
+}
+
+void CachingAoRStore::get_aor_data_multi(const std::vector<std::string>& aor_ids,
+                                         std::vector<AoR*>& aors,
+                                         SAS::TrailId trail)
+{
+  aors.assign(aor_ids.size(), NULL);
+
+  // Serve what we can from the cache, and collect up the rest.
+  std::vector<std::string> missed_ids;
+  std::vector<size_t> missed_indexes;
+
+  for (size_t ii = 0; ii < aor_ids.size(); ii++)
+  {
+    aors[ii] = lookup(aor_ids[ii]);
+
+    if (aors[ii] == NULL)
+    {
+      missed_ids.push_back(aor_ids[ii]);
+      missed_indexes.push_back(ii);
+    }
+  }
+
+  if (missed_ids.empty())
+  {
+    return;
+  }
+
+  _misses.fetch_add(missed_ids.size());
+
+  for (const std::string& aor_id : missed_ids)
+  {
+    start_read(aor_id);
+  }
+
+  std::vector<AoR*> missed_aors;
+  _store->get_aor_data_multi(missed_ids, missed_aors, trail);
+
+  for (size_t ii = 0; ii < missed_ids.size(); ii++)
+  {
+    got_from_store(missed_ids[ii], missed_aors[ii]);
+    aors[missed_indexes[ii]] = missed_aors[ii];
+  }
+}
+
+Store::Status CachingAoRStore::set_aor_data(const std::string& aor_id,
+                                            AoR* aor,
+                                            int expiry,
+                                            SAS::TrailId trail)
+{
+  uint64_t old_cas = aor->_cas;
+  Store::Status rc = _store->set_aor_data(aor_id, aor, expiry, trail);
+  set_in_store(aor_id, aor, old_cas, rc);
+
+  return rc;
+}
+
+void CachingAoRStore::get_aor_data_async(const std::string& aor_id,
+                                         SAS::TrailId trail,
+                                         GetCallback callback)
+{
+  AoR* aor = lookup(aor_id);
+
+  if (aor != NULL)
+  {
+    callback(aor);
+    return;
+  }
+
+  _misses.fetch_add(1);
+  start_read(aor_id);
+  _store->get_aor_data_async(aor_id, trail, [this, aor_id, callback](AoR* aor)
+  {
+    got_from_store(aor_id, aor);
+    callback(aor);
+  });
+}
+
+void CachingAoRStore::set_aor_data_async(const std::string& aor_id,
+                                         AoR* aor,
+                                         int expiry,
+                                         SAS::TrailId trail,
+                                         SetCallback callback)
+{
+  uint64_t old_cas = aor->_cas;
+  _store->set_aor_data_async(aor_id,
+                             aor,
+                             expiry,
+                             trail,
+                             [this, aor_id, aor, old_cas, callback](Store::Status rc)
+  {
+    set_in_store(aor_id, aor, old_cas, rc);
+    callback(rc);
+  });
+}
+
+void CachingAoRStore::start_read(const std::string& aor_id)
+{
+  Shard& shard = shard_for(aor_id);
+  std::unique_lock<std::mutex> lock(shard._lock);
+  shard._reads[aor_id]._count++;
+}
+
+void CachingAoRStore::got_from_store(const std::string& aor_id, AoR* aor)
+{
+  // Copy the AoR before taking the lock.
+  std::shared_ptr<const AoR> copy;
+
+  if ((aor != NULL) && (!aor->bindings().empty()))
+  {
+    copy = std::make_shared<const AoR>(*aor);
+  }
+
+  Shard& shard = shard_for(aor_id);
+  std::unique_lock<std::mutex> lock(shard._lock);
+  std::unordered_map<std::string, Read>::iterator read = shard._reads.find(aor_id);
+  bool stale = read->second._stale;
+
+  if (--read->second._count == 0)
+  {
+    shard._reads.erase(read);
+  }
+
+  if (stale)
+  {
+    // The AoR was written while we were reading it, so what we read may be
+    // older than what's in the store (and in the cache) now.
+    TRC_DEBUG("Not caching AoR for %s, as it was written while being read",
+              aor_id.c_str());
+  }
+  else if (copy != NULL)
+  {
+    insert(shard, aor_id, copy);
+  }
+}
+
+void CachingAoRStore::set_in_store(const std::string& aor_id,
+                                   AoR* aor,
+                                   uint64_t old_cas,
+                                   Store::Status rc)
+{
+  std::shared_ptr<const AoR> copy;
+
+  if ((rc == Store::Status::OK) &&
+      (aor->_cas != old_cas) &&
+      (!aor->bindings().empty()))
+  {
+    // The underlying store has given us the new CAS, so the cache can serve
+    // the next read.
+    copy = std::make_shared<const AoR>(*aor);
+  }
+
+  Shard& shard = shard_for(aor_id);
+  std::unique_lock<std::mutex> lock(shard._lock);
+
+  // Any read of the AoR that's in flight may have read it from before this
+  // write, so mustn't be cached.
+  std::unordered_map<std::string, Read>::iterator read = shard._reads.find(aor_id);
+
+  if (read != shard._reads.end())
+  {
+    read->second._stale = true;
+  }
+
+  if (copy != NULL)
+  {
+    insert(shard, aor_id, copy);
+  }
+  else
+  {
+    // Either the write failed (in which case our copy may be out of date), or
+    // it succeeded and we don't know the new CAS.
+    invalidate(shard, aor_id);
+  }
+}
+
+CachingAoRStore::Shard& CachingAoRStore::shard_for(const std::string& aor_id)
+{
+  return *_shards[std::hash<std::string>()(aor_id) % _shards.size()];
+}
+
+AoR* CachingAoRStore::lookup(const std::string& aor_id)
+{
+  std::shared_ptr<const AoR> cached;
+
+  {
+    Shard& shard = shard_for(aor_id);
+    std::unique_lock<std::mutex> lock(shard._lock);
+    std::unordered_map<std::string, std::list<Entry>::iterator>::iterator it =
+                                                        shard._index.find(aor_id);
+
+    if (it == shard._index.end())
+    {
+      return NULL;
+    }
+
+    if (std::chrono::steady_clock::now() >= it->second->_expires)
+    {
+      erase(shard, it->second);
+      return NULL;
+    }
+
+    // Move the entry to the front, as it's now the most recently used.
+    shard._entries.splice(shard._entries.begin(), shard._entries, it->second);
+    cached = it->second->_aor;
+  }
+
+  TRC_DEBUG("Found AoR for %s in the cache, CAS = %ld",
+            aor_id.c_str(), cached->_cas);
+  _hits.fetch_add(1);
+
+  // Copy the AoR after releasing the lock. The cached AoR is never changed,
+  // and this keeps it alive even if the entry is replaced meanwhile.
+  return new AoR(*cached);
+}
+
+void CachingAoRStore::insert(Shard& shard,
+                             const std::string& aor_id,
+                             std::shared_ptr<const AoR> aor)
+{
+  std::unordered_map<std::string, std::list<Entry>::iterator>::iterator it =
+                                                        shard._index.find(aor_id);
+
+  if (it != shard._index.end())
+  {
+    erase(shard, it->second);
+  }
+
+  shard._entries.push_front(Entry{aor_id,
+                                  std::move(aor),
+                                  std::chrono::steady_clock::now() + _ttl});
+  shard._index[aor_id] = shard._entries.begin();
+
+  if (shard._entries.size() > _capacity_per_shard)
+  {
+    // Evict the least recently used entry.
+    erase(shard, std::prev(shard._entries.end()));
+  }
+}
+
+void CachingAoRStore::invalidate(Shard& shard, const std::string& aor_id)
+{
+  std::unordered_map<std::string, std::list<Entry>::iterator>::iterator it =
+                                                        shard._index.find(aor_id);
+
+  if (it != shard._index.end())
+  {
+    TRC_DEBUG("Dropping cached AoR for %s", aor_id.c_str());
+    _invalidations.fetch_add(1);
+    erase(shard, it->second);
+  }
+}
+
+void CachingAoRStore::erase(Shard& shard, std::list<Entry>::iterator entry)
+{
+  shard._index.erase(entry->_aor_id);
+  shard._entries.erase(entry);
+}
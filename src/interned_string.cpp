@@ -0,0 +1,125 @@
+/**
+ * @file interned_string.cpp Reference-counted strings shared through a pool.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
+#include "interned_string.h"
+
+namespace
+{
+/// Hash and compare pooled strings by value, rather than by address.
+struct ValueHash
+{
+  size_t operator()(const std::string* value) const
+  {
+    return std::hash<std::string>()(*value);
+  }
+};
+
+struct ValueEqual
+{
+  bool operator()(const std::string* a, const std::string* b) const
+  {
+    return *a == *b;
+  }
+};
+
+/// The pool is split into shards, each with its own lock, so that threads
+/// interning different strings don't contend with each other.
+struct PoolShard
+{
+  std::mutex _lock;
+
+  /// Maps each pooled string to a weak reference to it. The key points at
+  /// the pooled string itself, so that the value isn't stored twice.
+  std::unordered_map<const std::string*,
+                     std::weak_ptr<const std::string>,
+                     ValueHash,
+                     ValueEqual> _strings;
+};
+
+static const size_t NUM_SHARDS = 64;
+
+PoolShard* pool_shards()
+{
+  // This is never destroyed, as InternedStrings may outlive any other static
+  // object.
+  static PoolShard* shards = new PoolShard[NUM_SHARDS];
+  return shards;
+}
+
+PoolShard& shard_for(const std::string& value)
+{
+  return pool_shards()[std::hash<std::string>()(value) % NUM_SHARDS];
+}
+
+/// Deleter for pooled strings, which takes the string out of the pool.
+struct Unpool
+{
+  void operator()(const std::string* value) const
+  {
+    PoolShard& shard = shard_for(*value);
+
+    {
+      std::lock_guard<std::mutex> guard(shard._lock);
+      auto it = shard._strings.find(value);
+
+      // The string may already have been replaced in the pool, if it was
+      // interned again after this copy's last reference went away.
+      if ((it != shard._strings.end()) && (it->first == value))
+      {
+        shard._strings.erase(it);
+      }
+    }
+
+    delete value;
+  }
+};
+}
+
+std::shared_ptr<const std::string> InternedString::intern(const std::string& value)
+{
+  if (value.empty())
+  {
+    return std::shared_ptr<const std::string>();
+  }
+
+  PoolShard& shard = shard_for(value);
+  std::lock_guard<std::mutex> guard(shard._lock);
+
+  auto it = shard._strings.find(&value);
+
+  if (it != shard._strings.end())
+  {
+    std::shared_ptr<const std::string> pooled = it->second.lock();
+
+    if (pooled != NULL)
+    {
+      return pooled;
+    }
+
+    // The last reference to the pooled copy has just gone, but it hasn't been
+    // removed from the pool yet. Replace it with a new copy.
+    shard._strings.erase(it);
+  }
+
+  std::shared_ptr<const std::string> pooled(new std::string(value), Unpool());
+  shard._strings.insert(std::make_pair(pooled.get(), pooled));
+  return pooled;
+}
+
+const std::string& InternedString::empty_string()
+{
+  static const std::string empty;
+  return empty;
+}
@@ -0,0 +1,213 @@
+/**
+ * @file memory_aor_store.cpp AoRStore that keeps AoRs in local memory.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+#include <functional>
+
+#include "log.h"
+#include "memory_aor_store.h"
+
+MemoryAoRStore::MemoryAoRStore(size_t num_stripes) :
+  AoRStore(),
+  _stripes(),
+  _next_cas(1)
+{
+  num_stripes = std::max(num_stripes, (size_t)1);
+
+  for (size_t ii = 0; ii < num_stripes; ii++)
+  {
+    Stripe* stripe = new Stripe();
+    stripe->_sweep_size = MIN_SWEEP_SIZE;
+    _stripes.push_back(stripe);
+  }
+}
+
+MemoryAoRStore::~MemoryAoRStore()
+{
+  for (Stripe* stripe : _stripes)
+  {
+    delete stripe;
+  }
+
+  _stripes.clear();
+}
+
+AoR* MemoryAoRStore::get_aor_data(const std::string& aor_id,
+                                  SAS::TrailId trail)
+{
+  TRC_DEBUG("Get AoR data for %s", aor_id.c_str());
+  std::shared_ptr<const AoR> stored_aor;
+  uint64_t cas = 0;
+
+  {
+    Stripe& stripe = stripe_for(aor_id);
+    std::unique_lock<std::mutex> lock(stripe._lock);
+    Record* record = find(stripe, aor_id, time(NULL));
+
+    if (record != NULL)
+    {
+      stored_aor = record->_aor;
+      cas = record->_cas;
+    }
+  }
+
+  // Copy the AoR after releasing the lock. The stored AoR is never changed,
+  // only replaced, so this is safe.
+  AoR* aor_data = NULL;
+
+  if (stored_aor != NULL)
+  {
+    aor_data = new AoR(*stored_aor);
+    aor_data->_cas = cas;
+    TRC_DEBUG("Found a record, CAS = %ld", aor_data->_cas);
+  }
+  else
+  {
+    // No record, so create a new blank one.
+    aor_data = new AoR(aor_id);
+    TRC_DEBUG("No record found, so create new record, CAS = %ld",
+              aor_data->_cas);
+  }
+
+  return aor_data;
+}
+
+Store::Status MemoryAoRStore::set_aor_data(const std::string& aor_id,
+                                           AoR* aor,
+                                           int expiry,
+                                           SAS::TrailId trail)
+{
+  time_t now = time(NULL);
+  time_t expires = (expiry > MAX_RELATIVE_EXPIRY) ? expiry : now + expiry;
+
+  // Copy the AoR before taking the lock.
+  std::shared_ptr<const AoR> copy;
+
+  if (expires > now)
+  {
+    copy = std::make_shared<const AoR>(*aor);
+  }
+
+  // The AoR that this replaces, which is freed after releasing the lock.
+  std::shared_ptr<const AoR> old_aor;
+
+  Stripe& stripe = stripe_for(aor_id);
+  std::unique_lock<std::mutex> lock(stripe._lock);
+  Record* record = find(stripe, aor_id, now);
+
+  if (((aor->_cas == 0) && (record != NULL)) ||
+      ((aor->_cas != 0) && ((record == NULL) || (record->_cas != aor->_cas))))
+  {
+    TRC_DEBUG("CAS %ld doesn't match the stored record for %s",
+              aor->_cas, aor_id.c_str());
+    lock.unlock();
+    return Store::Status::DATA_CONTENTION;
+  }
+
+  if (copy == NULL)
+  {
+    // The AoR has already expired, so remove it.
+    TRC_DEBUG("Removing record for %s", aor_id.c_str());
+
+    if (record != NULL)
+    {
+      old_aor = std::move(record->_aor);
+      stripe._records.erase(aor_id);
+    }
+
+    return Store::Status::OK;
+  }
+
+  uint64_t cas = _next_cas.fetch_add(1);
+
+  if (record != NULL)
+  {
+    old_aor = std::move(record->_aor);
+    record->_aor = std::move(copy);
+    record->_cas = cas;
+    record->_expires = expires;
+  }
+  else
+  {
+    stripe._records[aor_id] = Record{std::move(copy), cas, expires};
+    sweep(stripe, now);
+  }
+
+  lock.unlock();
+  TRC_DEBUG("Stored record for %s, CAS = %ld", aor_id.c_str(), cas);
+  aor->_cas = cas;
+
+  return Store::Status::OK;
+}
+
+size_t MemoryAoRStore::size()
+{
+  size_t size = 0;
+
+  for (Stripe* stripe : _stripes)
+  {
+    std::unique_lock<std::mutex> lock(stripe->_lock);
+    size += stripe->_records.size();
+  }
+
+  return size;
+}
+
+MemoryAoRStore::Stripe& MemoryAoRStore::stripe_for(const std::string& aor_id)
+{
+  return *_stripes[std::hash<std::string>()(aor_id) % _stripes.size()];
+}
+
+MemoryAoRStore::Record* MemoryAoRStore::find(Stripe& stripe,
+                                             const std::string& aor_id,
+                                             time_t now)
+{
+  std::unordered_map<std::string, Record>::iterator it =
+                                                stripe._records.find(aor_id);
+
+  if (it == stripe._records.end())
+  {
+    return NULL;
+  }
+
+  if (it->second._expires <= now)
+  {
+    stripe._records.erase(it);
+    return NULL;
+  }
+
+  return &(it->second);
+}
+
+void MemoryAoRStore::sweep(Stripe& stripe, time_t now)
+{
+  if (stripe._records.size() < stripe._sweep_size)
+  {
+    return;
+  }
+
+  for (std::unordered_map<std::string, Record>::iterator it =
+         stripe._records.begin();
+       it != stripe._records.end();)
+  {
+    if (it->second._expires <= now)
+    {
+      it = stripe._records.erase(it);
+    }
+    else
+    {
+      ++it;
+    }
+  }
+
+  stripe._sweep_size = std::max(stripe._records.size() * 2,
+                                (size_t)MIN_SWEEP_SIZE);
+}
@@ -0,0 +1,107 @@
+/**
+ * @file negative_lookup_cache.cpp Short-lived record of subscribers that
+ * weren't found.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+#include <functional>
+
+#include "log.h"
+#include "negative_lookup_cache.h"
+
+NegativeLookupCache::NegativeLookupCache(int ttl_ms, size_t capacity) :
+  _ttl(ttl_ms),
+  _capacity_per_shard(std::max(capacity / NUM_SHARDS, (size_t)1)),
+  _shards(),
+  _hits(0)
+{
+  for (size_t ii = 0; ii < NUM_SHARDS; ii++)
+  {
+    _shards.push_back(new Shard());
+  }
+}
+
+NegativeLookupCache::~NegativeLookupCache()
+{
+  for (Shard* shard : _shards)
+  {
+    delete shard;
+  }
+
+  _shards.clear();
+}
+
+void NegativeLookupCache::add(const std::string& sub_id)
+{
+  Shard& shard = shard_for(sub_id);
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lock(shard._lock);
+
+  if (shard._expiries.size() >= _capacity_per_shard)
+  {
+    // Make room by clearing out expired entries. If they're all still valid,
+    // start again - the cache only saves work, so forgetting is safe.
+    for (std::unordered_map<std::string, std::chrono::steady_clock::time_point>::iterator it =
+           shard._expiries.begin();
+         it != shard._expiries.end();)
+    {
+      if (it->second <= now)
+      {
+        it = shard._expiries.erase(it);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+
+    if (shard._expiries.size() >= _capacity_per_shard)
+    {
+      TRC_DEBUG("Negative lookup cache shard is full, emptying it");
+      shard._expiries.clear();
+    }
+  }
+
+  shard._expiries[sub_id] = now + _ttl;
+}
+
+bool NegativeLookupCache::contains(const std::string& sub_id)
+{
+  Shard& shard = shard_for(sub_id);
+  std::unique_lock<std::mutex> lock(shard._lock);
+  std::unordered_map<std::string, std::chrono::steady_clock::time_point>::iterator it =
+                                                    shard._expiries.find(sub_id);
+
+  if (it == shard._expiries.end())
+  {
+    return false;
+  }
+
+  if (it->second <= std::chrono::steady_clock::now())
+  {
+    shard._expiries.erase(it);
+    return false;
+  }
+
+  _hits.fetch_add(1);
+  return true;
+}
+
+void NegativeLookupCache::remove(const std::string& sub_id)
+{
+  Shard& shard = shard_for(sub_id);
+  std::unique_lock<std::mutex> lock(shard._lock);
+  shard._expiries.erase(sub_id);
+}
+
+NegativeLookupCache::Shard& NegativeLookupCache::shard_for(const std::string& sub_id)
+{
+  return *_shards[std::hash<std::string>()(sub_id) % _shards.size()];
+}
@@ -0,0 +1,279 @@
+/**
+ * @file replication_queue.cpp Queue of updates waiting to be sent to a remote
+ * site.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+
+#include "log.h"
+#include "replication_queue.h"
+#include "s4.h"
+
+ReplicationRequest::ReplicationRequest(Type type,
+                                       const std::string& sub_id,
+                                       SAS::TrailId trail) :
+  _type(type),
+  _sub_id(sub_id),
+  _aor(NULL),
+  _po(NULL),
+  _trail(trail)
+{
+}
+
+ReplicationRequest::~ReplicationRequest()
+{
+  delete _aor; _aor = NULL;
+  delete _po; _po = NULL;
+}
+
+ReplicationQueue::ReplicationQueue(S4* remote_s4,
+                                   int num_workers,
+                                   size_t max_depth,
+                                   size_t max_batch_size,
+                                   int max_retries,
+                                   int retry_interval_ms) :
+  _remote_s4(remote_s4),
+  _workers(),
+  _max_depth(max_depth),
+  _max_batch_size(std::max(max_batch_size, (size_t)1)),
+  _max_retries(max_retries),
+  _retry_interval_ms(retry_interval_ms),
+  _depth(0),
+  _drops(0),
+  _retries(0),
+  _coalesced(0)
+{
+  for (int ii = 0; ii < std::max(num_workers, 1); ii++)
+  {
+    Worker* worker = new Worker();
+    worker->_stopping = false;
+    worker->_thread = std::thread(&ReplicationQueue::worker_thread, this, worker);
+    _workers.push_back(worker);
+  }
+}
+
+ReplicationQueue::~ReplicationQueue()
+{
+  for (Worker* worker : _workers)
+  {
+    {
+      std::unique_lock<std::mutex> lock(worker->_lock);
+      worker->_stopping = true;
+      worker->_cond.notify_one();
+    }
+
+    worker->_thread.join();
+    delete worker;
+  }
+}
+
+void ReplicationQueue::put(const std::string& sub_id,
+                           const AoR& aor,
+                           SAS::TrailId trail)
+{
+  ReplicationRequest* request = new ReplicationRequest(ReplicationRequest::PUT, sub_id, trail);
+  request->_aor = new AoR(aor);
+  enqueue(request);
+}
+
+void ReplicationQueue::patch(const std::string& sub_id,
+                             const PatchObject& po,
+                             const AoR& aor,
+                             SAS::TrailId trail)
+{
+  ReplicationRequest* request = new ReplicationRequest(ReplicationRequest::PATCH, sub_id, trail);
+  request->_po = new PatchObject(po);
+  request->_aor = new AoR(aor);
+  enqueue(request);
+}
+
+void ReplicationQueue::remove(const std::string& sub_id,
+                              SAS::TrailId trail)
+{
+  enqueue(new ReplicationRequest(ReplicationRequest::DELETE, sub_id, trail));
+}
+
+void ReplicationQueue::enqueue(ReplicationRequest* request)
+{
+  Worker* worker =
+            _workers[std::hash<std::string>()(request->_sub_id) % _workers.size()];
+
+  std::unique_lock<std::mutex> lock(worker->_lock);
+
+  // If there's already an update waiting for this subscriber, try to merge
+  // this one into it. This doesn't need a new space in the queue.
+  std::unordered_map<std::string, ReplicationRequest*>::iterator latest =
+                                       worker->_latest.find(request->_sub_id);
+
+  if ((latest != worker->_latest.end()) && (coalesce(latest->second, request)))
+  {
+    TRC_DEBUG("Merged update for %s into the one waiting for %s",
+              request->_sub_id.c_str(), _remote_s4->get_id().c_str());
+    _coalesced.fetch_add(1);
+    delete request; request = NULL;
+    return;
+  }
+
+  // Claim a space in the queue, or drop the request if there isn't one.
+  if (_depth.fetch_add(1) >= _max_depth)
+  {
+    _depth.fetch_sub(1);
+    _drops.fetch_add(1);
+    TRC_WARNING("Replication queue for %s is full, dropping update for %s",
+                _remote_s4->get_id().c_str(), request->_sub_id.c_str());
+    delete request; request = NULL;
+    return;
+  }
+
+  worker->_requests.push_back(request);
+  worker->_latest[request->_sub_id] = request;
+  worker->_cond.notify_one();
+}
+
+bool ReplicationQueue::coalesce(ReplicationRequest* waiting, ReplicationRequest* request)
+{
+  if (request->_type == ReplicationRequest::DELETE)
+  {
+    // Deleting the subscriber makes any earlier update irrelevant.
+    delete waiting->_aor; waiting->_aor = NULL;
+    delete waiting->_po; waiting->_po = NULL;
+    waiting->_type = ReplicationRequest::DELETE;
+    waiting->_trail = request->_trail;
+    return true;
+  }
+
+  if (waiting->_type == ReplicationRequest::DELETE)
+  {
+    // The subscriber must be deleted before it's updated again.
+    return false;
+  }
+
+  if (request->_type == ReplicationRequest::PUT)
+  {
+    // A PUT replaces the whole subscriber, so the waiting update becomes a
+    // PUT of the latest AoR. Merging it into a patch would lose the removal
+    // of any entries that the new AoR no longer has.
+    delete waiting->_po; waiting->_po = NULL;
+    waiting->_type = ReplicationRequest::PUT;
+    std::swap(waiting->_aor, request->_aor);
+    waiting->_trail = request->_trail;
+    return true;
+  }
+
+  // The new update is a PATCH. Turn the waiting update into a PATCH if it
+  // isn't one already (its AoR is about to be replaced, so its contents can be
+  // moved into the patch), then merge in the new update.
+  if (waiting->_type == ReplicationRequest::PUT)
+  {
+    waiting->_po = new PatchObject();
+    convert_aor_to_patch(std::move(*waiting->_aor), *waiting->_po);
+    waiting->_type = ReplicationRequest::PATCH;
+  }
+
+  waiting->_po->merge(*request->_po);
+
+  // The new update has the latest state of the subscriber, which is what
+  // should be PUT if the subscriber doesn't exist on the remote site.
+  std::swap(waiting->_aor, request->_aor);
+  waiting->_trail = request->_trail;
+  return true;
+}
+
+void ReplicationQueue::worker_thread(Worker* worker)
+{
+  std::unique_lock<std::mutex> lock(worker->_lock);
+
+  while (true)
+  {
+    worker->_cond.wait(lock, [worker]()
+    {
+      return (worker->_stopping) || (!worker->_requests.empty());
+    });
+
+    if (worker->_requests.empty())
+    {
+      // We've been asked to stop and there's nothing left to send.
+      break;
+    }
+
+    // Take everything that's waiting (up to the batch size) off the queue.
+    std::vector<ReplicationRequest*> batch;
+
+    while ((!worker->_requests.empty()) && (batch.size() < _max_batch_size))
+    {
+      ReplicationRequest* request = worker->_requests.front();
+      worker->_requests.pop_front();
+      batch.push_back(request);
+
+      // Once an update has been taken off the queue, nothing can be merged
+      // into it.
+      std::unordered_map<std::string, ReplicationRequest*>::iterator latest =
+                                       worker->_latest.find(request->_sub_id);
+
+      if ((latest != worker->_latest.end()) && (latest->second == request))
+      {
+        worker->_latest.erase(latest);
+      }
+    }
+
+    lock.unlock();
+    process(batch);
+
+    for (ReplicationRequest* request : batch)
+    {
+      delete request; request = NULL;
+    }
+
+    _depth.fetch_sub(batch.size());
+    lock.lock();
+  }
+}
+
+void ReplicationQueue::process(const std::vector<ReplicationRequest*>& batch)
+{
+  std::vector<ReplicationRequest*> to_send = batch;
+
+  for (int attempt = 0; ; attempt++)
+  {
+    std::vector<HTTPCode> rcs;
+    _remote_s4->handle_batch(to_send, rcs);
+
+    if (attempt >= _max_retries)
+    {
+      break;
+    }
+
+    // Retry the updates that failed with a server error. The remote S4 fails
+    // every later update for a subscriber once one has failed, so retrying
+    // just the failures still applies each subscriber's updates in order.
+    std::vector<ReplicationRequest*> to_retry;
+
+    for (size_t ii = 0; ii < to_send.size(); ii++)
+    {
+      if (rcs[ii] == HTTP_SERVER_ERROR)
+      {
+        to_retry.push_back(to_send[ii]);
+      }
+    }
+
+    if (to_retry.empty())
+    {
+      break;
+    }
+
+    TRC_DEBUG("Retrying %zu updates on %s",
+              to_retry.size(), _remote_s4->get_id().c_str());
+    _retries.fetch_add(to_retry.size());
+    std::this_thread::sleep_for(std::chrono::milliseconds(_retry_interval_ms));
+    to_send.swap(to_retry);
+  }
+}
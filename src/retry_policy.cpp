@@ -0,0 +1,121 @@
+/**
+ * @file retry_policy.cpp Policy for retrying writes that hit CAS contention.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+#include <random>
+#include <thread>
+
+#include "log.h"
+#include "retry_policy.h"
+
+RetryPolicy::RetryPolicy() :
+  _max_retries(-1),
+  _base_backoff_ms(0),
+  _max_backoff_ms(0),
+  _budget_per_sec(0),
+  _jitter(true),
+  _budget_tokens(0),
+  _budget_refilled(std::chrono::steady_clock::now()),
+  _contentions(0),
+  _retries(0),
+  _exhausted(0)
+{
+  for (int ii = 0; ii < NUM_HISTOGRAM_BUCKETS; ii++)
+  {
+    _histogram[ii] = 0;
+  }
+}
+
+void RetryPolicy::configure(int max_retries,
+                            int base_backoff_ms,
+                            int max_backoff_ms,
+                            int budget_per_sec,
+                            bool jitter)
+{
+  _max_retries = max_retries;
+  _base_backoff_ms = base_backoff_ms;
+  _max_backoff_ms = max_backoff_ms;
+  _budget_per_sec = budget_per_sec;
+  _jitter = jitter;
+  _budget_tokens = budget_per_sec;
+  _budget_refilled = std::chrono::steady_clock::now();
+}
+
+bool RetryPolicy::retry_after_contention(int retries)
+{
+  _contentions.fetch_add(1);
+
+  if (((_max_retries >= 0) && (retries >= _max_retries)) ||
+      (!take_from_budget()))
+  {
+    TRC_DEBUG("Not retrying after contention (%d retries so far)", retries);
+    _exhausted.fetch_add(1);
+    return false;
+  }
+
+  _retries.fetch_add(1);
+
+  if (_base_backoff_ms > 0)
+  {
+    // Wait for a random time up to the backoff for this retry ("full
+    // jitter"), so that requests that collided are spread out.
+    int backoff_ms = _base_backoff_ms;
+
+    for (int ii = 0; (ii < retries) && (backoff_ms < _max_backoff_ms); ii++)
+    {
+      backoff_ms *= 2;
+    }
+
+    backoff_ms = std::min(backoff_ms, _max_backoff_ms);
+
+    if (_jitter)
+    {
+      static thread_local std::minstd_rand generator(std::random_device{}());
+      std::uniform_int_distribution<int> jitter(0, backoff_ms);
+      backoff_ms = jitter(generator);
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(backoff_ms));
+  }
+
+  return true;
+}
+
+void RetryPolicy::record_request(int retries)
+{
+  _histogram[std::min(retries, NUM_HISTOGRAM_BUCKETS - 1)].fetch_add(1);
+}
+
+bool RetryPolicy::take_from_budget()
+{
+  if (_budget_per_sec <= 0)
+  {
+    return true;
+  }
+
+  std::unique_lock<std::mutex> lock(_budget_lock);
+
+  // Top up the budget for the time since it was last topped up.
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  double elapsed_secs =
+             std::chrono::duration<double>(now - _budget_refilled).count();
+  _budget_tokens = std::min((double)_budget_per_sec,
+                            _budget_tokens + (elapsed_secs * _budget_per_sec));
+  _budget_refilled = now;
+
+  if (_budget_tokens < 1)
+  {
+    return false;
+  }
+
+  _budget_tokens -= 1;
+  return true;
+}
@@ -9,6 +9,13 @@
  * Metaswitch Networks in a separate written agreement.
  */
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+
 #include "log.h"
 #include "utils.h"
 #include "s4.h"
@@ -16,6 +23,10 @@
 #include "chronosconnection.h"
 #include "s4_chronoshandlers.h"
 
+/// The number of locks shared between subscribers to serialise updates to
+/// the same subscriber.
+static const size_t NUM_WRITE_LOCK_STRIPES = 1024;
+
 S4::S4(std::string id,
        ChronosConnection* chronos_connection,
        std::string callback_uri,
@@ -26,7 +37,13 @@ S4::S4(std::string id,
   _chronos_callback_uri(callback_uri),
   _aor_store(aor_store),
   _remote_s4s(remote_s4s),
-  _timer_pop_consumer(NULL)
+  _timer_pop_consumer(NULL),
+  _parallel_remote_get_timeouts_ms(),
+  _remote_get_pools(),
+  _replication_queues(),
+  _contention_retry_policy(),
+  _negative_lookup_cache(NULL),
+  _write_locks(NUM_WRITE_LOCK_STRIPES)
 {
 }
 
@@ -37,12 +54,30 @@ S4::S4(std::string id,
   _chronos_callback_uri(""),
   _aor_store(aor_store),
   _remote_s4s({}),
-  _timer_pop_consumer(NULL)
+  _timer_pop_consumer(NULL),
+  _parallel_remote_get_timeouts_ms(),
+  _remote_get_pools(),
+  _replication_queues(),
+  _contention_retry_policy(),
+  _negative_lookup_cache(NULL),
+  _write_locks(NUM_WRITE_LOCK_STRIPES)
 {
 }
 
 S4::~S4()
 {
+  // Wait for any GETs still outstanding on the remote S4s.
+  for (WorkerPool* pool : _remote_get_pools)
+  {
+    delete pool;
+  }
+
+  for (ReplicationQueue* queue : _replication_queues)
+  {
+    delete queue;
+  }
+
+  delete _negative_lookup_cache;
   delete _chronos_timer_request_sender;
 }
 
@@ -61,6 +96,8 @@ HTTPCode S4::handle_get(const std::string& sub_id,
 
   HTTPCode rc;
   bool retry_get = true;
+  int retries = 0;
+  bool contention = false;
 
   while (retry_get == true)
   {
@@ -86,50 +123,74 @@ HTTPCode S4::handle_get(const std::string& sub_id,
       TRC_DEBUG("Subscriber not found when getting subscriber %s on %s",
                 sub_id.c_str(), _s4_id.c_str());
 
-      // If we don't have any bindings, try the remote stores.
+      // If we don't have any bindings, try the remote stores (unless we've
+      // recently found that none of them have the subscriber either).
       rc = HTTP_NOT_FOUND;
+      AoR* remote_aor = NULL;
 
-      for (S4* remote_s4 : _remote_s4s)
+      if ((_negative_lookup_cache != NULL) &&
+          (_negative_lookup_cache->contains(sub_id)))
+      {
+        TRC_DEBUG("Subscriber %s was recently not found on any site",
+                  sub_id.c_str());
+      }
+      else
       {
-        AoR* remote_aor = NULL;
-        uint64_t unused_version;
-        HTTPCode remote_rc = remote_s4->handle_get(sub_id,
-                                                   &remote_aor,
-                                                   unused_version,
-                                                   trail);
+        bool all_not_found;
+        remote_aor = get_from_remote_s4s(sub_id, all_not_found, trail);
 
-        if (remote_rc == HTTP_OK)
+        if ((remote_aor == NULL) &&
+            (all_not_found) &&
+            (_negative_lookup_cache != NULL))
         {
-          // The remote store has an entry for this AoR and it has bindings -
-          // copy the information across.
-          remote_aor->_cas = 0;
+          _negative_lookup_cache->add(sub_id);
+        }
+      }
 
-          Store::Status store_rc = write_aor(sub_id, *remote_aor, trail);
+      if (remote_aor != NULL)
+      {
+        // The remote store has an entry for this AoR and it has bindings -
+        // copy the information across.
+        remote_aor->_cas = 0;
 
-          if (store_rc == Store::Status::ERROR)
-          {
-            TRC_DEBUG("Store error when adding subscriber %s to %s",
-                      sub_id.c_str(), _s4_id.c_str());
-            delete remote_aor; remote_aor = NULL;
-            rc = HTTP_SERVER_ERROR;
-          }
-          else if (store_rc == Store::Status::OK)
+        int next_expires;
+        Store::Status store_rc = write_aor(sub_id,
+                                           *remote_aor,
+                                           next_expires,
+                                           trail);
+
+        if (store_rc == Store::Status::ERROR)
+        {
+          TRC_DEBUG("Store error when adding subscriber %s to %s",
+                    sub_id.c_str(), _s4_id.c_str());
+          delete remote_aor; remote_aor = NULL;
+          rc = HTTP_SERVER_ERROR;
+        }
+        else if (store_rc == Store::Status::OK)
+        {
+          TRC_DEBUG("Successfully added the subscriber %s to %s",
+                    sub_id.c_str(), _s4_id.c_str());
+          update_timers(sub_id, *remote_aor, next_expires, trail);
+          version = remote_aor->_cas;
+          *aor = remote_aor;
+          rc = HTTP_OK;
+        }
+        else if (store_rc == Store::Status::DATA_CONTENTION)
+        {
+          TRC_DEBUG("Contention when adding subscriber %s to %s",
+                    sub_id.c_str(), _s4_id.c_str());
+          delete remote_aor; remote_aor = NULL;
+          contention = true;
+          retry_get = _contention_retry_policy.retry_after_contention(retries);
+
+          if (retry_get)
           {
-            TRC_DEBUG("Successfully added the subscriber %s to %s",
-                      sub_id.c_str(), _s4_id.c_str());
-            version = remote_aor->_cas;
-            *aor = remote_aor;
-            rc = HTTP_OK;
+            retries++;
           }
-          else if (store_rc == Store::Status::DATA_CONTENTION)
+          else
           {
-            TRC_DEBUG("Contention when adding subscriber %s to %s",
-                      sub_id.c_str(), _s4_id.c_str());
-            delete remote_aor; remote_aor = NULL;
-            retry_get = true;
+            rc = HTTP_SERVER_ERROR;
           }
-
-          break;
         }
       }
     }
@@ -142,15 +203,619 @@ HTTPCode S4::handle_get(const std::string& sub_id,
     }
   }
 
+  if (contention)
+  {
+    _contention_retry_policy.record_request(retries);
+  }
+
   return rc;
 }
 
+void S4::set_parallel_remote_gets(const std::vector<int>& timeouts_ms,
+                                  int threads,
+                                  size_t max_outstanding)
+{
+  for (WorkerPool* pool : _remote_get_pools)
+  {
+    delete pool;
+  }
+
+  _remote_get_pools.clear();
+  _parallel_remote_get_timeouts_ms = timeouts_ms;
+
+  if (!timeouts_ms.empty())
+  {
+    for (size_t ii = 0; ii < _remote_s4s.size(); ii++)
+    {
+      _remote_get_pools.push_back(new WorkerPool(threads, max_outstanding));
+    }
+  }
+}
+
+void S4::handle_get_multi(const std::vector<std::string>& sub_ids,
+                          std::vector<AoR*>& aors,
+                          std::vector<uint64_t>& versions,
+                          std::vector<HTTPCode>& rcs,
+                          SAS::TrailId trail)
+{
+  TRC_DEBUG("Handling GET for %zu subscribers on %s",
+            sub_ids.size(), _s4_id.c_str());
+
+  std::vector<AoR*> local_aors;
+  _aor_store->get_aor_data_multi(sub_ids, local_aors, trail);
+
+  aors.assign(sub_ids.size(), NULL);
+  versions.assign(sub_ids.size(), 0);
+  rcs.assign(sub_ids.size(), HTTP_SERVER_ERROR);
+
+  // The subscribers that aren't in the local store, and that we haven't
+  // recently failed to find on any site.
+  std::vector<size_t> misses;
+  std::vector<std::string> miss_sub_ids;
+
+  for (size_t ii = 0; ii < sub_ids.size(); ii++)
+  {
+    AoR* aor = local_aors[ii];
+
+    if (aor == NULL)
+    {
+      TRC_DEBUG("Store error when getting subscriber %s on %s",
+                sub_ids[ii].c_str(), _s4_id.c_str());
+      rcs[ii] = HTTP_SERVER_ERROR;
+    }
+    else if (aor->bindings().empty())
+    {
+      TRC_DEBUG("Subscriber not found when getting subscriber %s on %s",
+                sub_ids[ii].c_str(), _s4_id.c_str());
+      delete aor; aor = NULL;
+      rcs[ii] = HTTP_NOT_FOUND;
+
+      if ((_negative_lookup_cache != NULL) &&
+          (_negative_lookup_cache->contains(sub_ids[ii])))
+      {
+        TRC_DEBUG("Subscriber %s was recently not found on any site",
+                  sub_ids[ii].c_str());
+      }
+      else
+      {
+        misses.push_back(ii);
+        miss_sub_ids.push_back(sub_ids[ii]);
+      }
+    }
+    else
+    {
+      TRC_DEBUG("Successfully retrieved subscriber %s from %s",
+                sub_ids[ii].c_str(), _s4_id.c_str());
+      aors[ii] = aor;
+      versions[ii] = aor->_cas;
+      rcs[ii] = HTTP_OK;
+    }
+  }
+
+  if (misses.empty())
+  {
+    return;
+  }
+
+  std::vector<AoR*> remote_aors;
+  std::vector<bool> all_not_found;
+  get_multi_from_remote_s4s(miss_sub_ids, remote_aors, all_not_found, trail);
+
+  // Copy whatever the remote S4s had to the local store.
+  for (size_t jj = 0; jj < misses.size(); jj++)
+  {
+    if (remote_aors[jj] != NULL)
+    {
+      remote_aors[jj]->_cas = 0;
+    }
+    else if ((all_not_found[jj]) && (_negative_lookup_cache != NULL))
+    {
+      _negative_lookup_cache->add(miss_sub_ids[jj]);
+    }
+  }
+
+  std::vector<Store::Status> store_rcs;
+  std::vector<int> next_expires;
+  write_aors(miss_sub_ids,
+             remote_aors,
+             std::vector<SAS::TrailId>(misses.size(), trail),
+             store_rcs,
+             next_expires);
+
+  for (size_t jj = 0; jj < misses.size(); jj++)
+  {
+    size_t ii = misses[jj];
+    AoR* remote_aor = remote_aors[jj];
+
+    if (remote_aor == NULL)
+    {
+      continue;
+    }
+
+    if (store_rcs[jj] == Store::Status::OK)
+    {
+      TRC_DEBUG("Successfully added the subscriber %s to %s",
+                sub_ids[ii].c_str(), _s4_id.c_str());
+      update_timers(sub_ids[ii], *remote_aor, next_expires[jj], trail);
+      aors[ii] = remote_aor;
+      versions[ii] = remote_aor->_cas;
+      rcs[ii] = HTTP_OK;
+    }
+    else if (store_rcs[jj] == Store::Status::DATA_CONTENTION)
+    {
+      // Something else has added the subscriber to the local store since we
+      // looked, so a normal GET will find it there.
+      TRC_DEBUG("Contention when adding subscriber %s to %s",
+                sub_ids[ii].c_str(), _s4_id.c_str());
+      delete remote_aor; remote_aor = NULL;
+      rcs[ii] = handle_get(sub_ids[ii], &aors[ii], versions[ii], trail);
+    }
+    else
+    {
+      TRC_DEBUG("Store error when adding subscriber %s to %s",
+                sub_ids[ii].c_str(), _s4_id.c_str());
+      delete remote_aor; remote_aor = NULL;
+      rcs[ii] = HTTP_SERVER_ERROR;
+    }
+  }
+}
+
+void S4::set_negative_lookup_cache(int ttl_ms, size_t capacity)
+{
+  delete _negative_lookup_cache;
+  _negative_lookup_cache = new NegativeLookupCache(ttl_ms, capacity);
+}
+
+void S4::set_contention_retry_policy(int max_retries,
+                                     int base_backoff_ms,
+                                     int max_backoff_ms,
+                                     int budget_per_sec,
+                                     bool jitter)
+{
+  _contention_retry_policy.configure(max_retries,
+                                     base_backoff_ms,
+                                     max_backoff_ms,
+                                     budget_per_sec,
+                                     jitter);
+}
+
+void S4::set_async_replication(int num_workers,
+                               size_t max_depth,
+                               size_t max_batch_size,
+                               int max_retries,
+                               int retry_interval_ms)
+{
+  for (ReplicationQueue* queue : _replication_queues)
+  {
+    delete queue;
+  }
+
+  _replication_queues.clear();
+
+  for (S4* remote_s4 : _remote_s4s)
+  {
+    TRC_DEBUG("Replicating to %s with %d workers, queue depth %zu",
+              remote_s4->get_id().c_str(), num_workers, max_depth);
+    _replication_queues.push_back(new ReplicationQueue(remote_s4,
+                                                       num_workers,
+                                                       max_depth,
+                                                       max_batch_size,
+                                                       max_retries,
+                                                       retry_interval_ms));
+  }
+}
+
+AoR* S4::get_from_remote_s4s(const std::string& sub_id,
+                             bool& all_not_found,
+                             SAS::TrailId trail)
+{
+  if (!_parallel_remote_get_timeouts_ms.empty())
+  {
+    return get_from_remote_s4s_in_parallel(sub_id, all_not_found, trail);
+  }
+
+  all_not_found = true;
+
+  for (S4* remote_s4 : _remote_s4s)
+  {
+    AoR* remote_aor = NULL;
+    uint64_t unused_version;
+    HTTPCode remote_rc = remote_s4->handle_get(sub_id,
+                                               &remote_aor,
+                                               unused_version,
+                                               trail);
+
+    if (remote_rc == HTTP_OK)
+    {
+      all_not_found = false;
+      return remote_aor;
+    }
+    else if (remote_rc != HTTP_NOT_FOUND)
+    {
+      all_not_found = false;
+    }
+
+    delete remote_aor; remote_aor = NULL;
+  }
+
+  return NULL;
+}
+
+/// The results of asking the remote S4s for a subscriber in parallel. This is
+/// shared between the thread waiting for the results and the pool threads
+/// asking each remote S4, as the waiting thread may give up before they
+/// finish.
+struct RemoteGetState
+{
+  struct Result
+  {
+    bool _done;
+    HTTPCode _rc;
+    AoR* _aor;
+  };
+
+  std::mutex _lock;
+  std::condition_variable _cond;
+  std::vector<Result> _results;
+
+  /// Set once the waiting thread has stopped waiting. Any AoR returned after
+  /// this is deleted by the thread that got it.
+  bool _abandoned;
+
+  RemoteGetState(size_t num_remotes) :
+    _results(num_remotes, Result{false, HTTP_SERVER_ERROR, NULL}),
+    _abandoned(false)
+  {
+  }
+};
+
+AoR* S4::get_from_remote_s4s_in_parallel(const std::string& sub_id,
+                                         bool& all_not_found,
+                                         SAS::TrailId trail)
+{
+  TRC_DEBUG("Asking %zu remote S4s for %s in parallel",
+            _remote_s4s.size(), sub_id.c_str());
+
+  std::shared_ptr<RemoteGetState> state =
+                       std::make_shared<RemoteGetState>(_remote_s4s.size());
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::vector<std::chrono::steady_clock::time_point> deadlines;
+
+  for (size_t ii = 0; ii < _remote_s4s.size(); ii++)
+  {
+    int timeout_ms = _parallel_remote_get_timeouts_ms[
+                  std::min(ii, _parallel_remote_get_timeouts_ms.size() - 1)];
+    deadlines.push_back(start + std::chrono::milliseconds(timeout_ms));
+
+    S4* remote_s4 = _remote_s4s[ii];
+    WorkerPool* pool = _remote_get_pools[ii];
+    bool submitted = pool->submit([state, remote_s4, ii, sub_id, trail]()
+    {
+      AoR* remote_aor = NULL;
+      uint64_t unused_version;
+      HTTPCode rc = remote_s4->handle_get(sub_id,
+                                          &remote_aor,
+                                          unused_version,
+                                          trail);
+
+      if (rc != HTTP_OK)
+      {
+        delete remote_aor; remote_aor = NULL;
+      }
+
+      std::unique_lock<std::mutex> lock(state->_lock);
+
+      if (state->_abandoned)
+      {
+        delete remote_aor; remote_aor = NULL;
+      }
+
+      state->_results[ii] = {true, rc, remote_aor};
+      state->_cond.notify_all();
+    });
+
+    if (!submitted)
+    {
+      // Too many GETs are already waiting for this remote S4, so don't ask
+      // it. This counts as the remote S4 failing.
+      TRC_WARNING("Too many GETs outstanding on remote S4 %s, not asking it "
+                  "for %s", remote_s4->get_id().c_str(), sub_id.c_str());
+      std::unique_lock<std::mutex> lock(state->_lock);
+      state->_results[ii] = {true, HTTP_SERVER_ERROR, NULL};
+    }
+  }
+
+  // Wait until a remote S4 returns the subscriber, or until every remote S4
+  // has either answered or run out of time.
+  AoR* remote_aor = NULL;
+  std::unique_lock<std::mutex> lock(state->_lock);
+
+  while (true)
+  {
+    bool waiting = false;
+    std::chrono::steady_clock::time_point next_deadline =
+                                       std::chrono::steady_clock::time_point::max();
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+    for (size_t ii = 0; ii < state->_results.size(); ii++)
+    {
+      RemoteGetState::Result& result = state->_results[ii];
+
+      if ((result._done) && (result._aor != NULL) && (remote_aor == NULL))
+      {
+        TRC_DEBUG("Found subscriber %s on remote S4 %s",
+                  sub_id.c_str(), _remote_s4s[ii]->get_id().c_str());
+        remote_aor = result._aor;
+        result._aor = NULL;
+      }
+      else if ((!result._done) && (now < deadlines[ii]))
+      {
+        waiting = true;
+        next_deadline = std::min(next_deadline, deadlines[ii]);
+      }
+    }
+
+    if ((remote_aor != NULL) || (!waiting))
+    {
+      break;
+    }
+
+    state->_cond.wait_until(lock, next_deadline);
+  }
+
+  // Stop waiting for the other remote S4s, and tidy up anything they've
+  // already returned.
+  state->_abandoned = true;
+  all_not_found = true;
+
+  for (RemoteGetState::Result& result : state->_results)
+  {
+    if ((!result._done) || (result._rc != HTTP_NOT_FOUND))
+    {
+      all_not_found = false;
+    }
+
+    delete result._aor; result._aor = NULL;
+  }
+
+  return remote_aor;
+}
+
+void S4::get_multi_from_remote_s4s(const std::vector<std::string>& sub_ids,
+                                   std::vector<AoR*>& remote_aors,
+                                   std::vector<bool>& all_not_found,
+                                   SAS::TrailId trail)
+{
+  if (!_parallel_remote_get_timeouts_ms.empty())
+  {
+    get_multi_from_remote_s4s_in_parallel(sub_ids,
+                                          remote_aors,
+                                          all_not_found,
+                                          trail);
+    return;
+  }
+
+  remote_aors.assign(sub_ids.size(), NULL);
+  all_not_found.assign(sub_ids.size(), true);
+
+  for (S4* remote_s4 : _remote_s4s)
+  {
+    // Only ask for the subscribers that we haven't found yet.
+    std::vector<size_t> outstanding;
+    std::vector<std::string> outstanding_sub_ids;
+
+    for (size_t ii = 0; ii < sub_ids.size(); ii++)
+    {
+      if (remote_aors[ii] == NULL)
+      {
+        outstanding.push_back(ii);
+        outstanding_sub_ids.push_back(sub_ids[ii]);
+      }
+    }
+
+    if (outstanding.empty())
+    {
+      break;
+    }
+
+    std::vector<AoR*> aors;
+    std::vector<uint64_t> unused_versions;
+    std::vector<HTTPCode> rcs;
+    remote_s4->handle_get_multi(outstanding_sub_ids,
+                                aors,
+                                unused_versions,
+                                rcs,
+                                trail);
+
+    for (size_t jj = 0; jj < outstanding.size(); jj++)
+    {
+      size_t ii = outstanding[jj];
+
+      if (rcs[jj] == HTTP_OK)
+      {
+        all_not_found[ii] = false;
+        remote_aors[ii] = aors[jj];
+      }
+      else
+      {
+        if (rcs[jj] != HTTP_NOT_FOUND)
+        {
+          all_not_found[ii] = false;
+        }
+
+        delete aors[jj]; aors[jj] = NULL;
+      }
+    }
+  }
+}
+
+/// The results of asking the remote S4s for several subscribers in parallel.
+/// As with RemoteGetState, this is shared with the pool threads.
+struct RemoteGetMultiState
+{
+  struct Result
+  {
+    bool _done;
+    std::vector<AoR*> _aors;
+    std::vector<HTTPCode> _rcs;
+  };
+
+  std::mutex _lock;
+  std::condition_variable _cond;
+  std::vector<Result> _results;
+  bool _abandoned;
+
+  RemoteGetMultiState(size_t num_remotes) :
+    _results(num_remotes, Result{false, {}, {}}),
+    _abandoned(false)
+  {
+  }
+};
+
+void S4::get_multi_from_remote_s4s_in_parallel(
+                                       const std::vector<std::string>& sub_ids,
+                                       std::vector<AoR*>& remote_aors,
+                                       std::vector<bool>& all_not_found,
+                                       SAS::TrailId trail)
+{
+  TRC_DEBUG("Asking %zu remote S4s for %zu subscribers in parallel",
+            _remote_s4s.size(), sub_ids.size());
+
+  std::shared_ptr<RemoteGetMultiState> state =
+                  std::make_shared<RemoteGetMultiState>(_remote_s4s.size());
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::vector<std::chrono::steady_clock::time_point> deadlines;
+
+  for (size_t ii = 0; ii < _remote_s4s.size(); ii++)
+  {
+    int timeout_ms = _parallel_remote_get_timeouts_ms[
+                  std::min(ii, _parallel_remote_get_timeouts_ms.size() - 1)];
+    deadlines.push_back(start + std::chrono::milliseconds(timeout_ms));
+
+    S4* remote_s4 = _remote_s4s[ii];
+    WorkerPool* pool = _remote_get_pools[ii];
+    bool submitted = pool->submit([state, remote_s4, ii, sub_ids, trail]()
+    {
+      std::vector<AoR*> aors;
+      std::vector<uint64_t> unused_versions;
+      std::vector<HTTPCode> rcs;
+      remote_s4->handle_get_multi(sub_ids, aors, unused_versions, rcs, trail);
+
+      std::unique_lock<std::mutex> lock(state->_lock);
+
+      for (size_t jj = 0; jj < aors.size(); jj++)
+      {
+        if ((state->_abandoned) || (rcs[jj] != HTTP_OK))
+        {
+          delete aors[jj]; aors[jj] = NULL;
+        }
+      }
+
+      state->_results[ii] = {true, std::move(aors), std::move(rcs)};
+      state->_cond.notify_all();
+    });
+
+    if (!submitted)
+    {
+      TRC_WARNING("Too many GETs outstanding on remote S4 %s, not asking it "
+                  "for %zu subscribers",
+                  remote_s4->get_id().c_str(), sub_ids.size());
+      std::unique_lock<std::mutex> lock(state->_lock);
+      state->_results[ii] = {true,
+                             std::vector<AoR*>(sub_ids.size(), NULL),
+                             std::vector<HTTPCode>(sub_ids.size(),
+                                                   HTTP_SERVER_ERROR)};
+    }
+  }
+
+  // Wait until every subscriber has been found, or until every remote S4 has
+  // either answered or run out of time.
+  std::unique_lock<std::mutex> lock(state->_lock);
+
+  while (true)
+  {
+    bool waiting = false;
+    std::chrono::steady_clock::time_point next_deadline =
+                                       std::chrono::steady_clock::time_point::max();
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::vector<bool> found(sub_ids.size(), false);
+
+    for (size_t ii = 0; ii < state->_results.size(); ii++)
+    {
+      RemoteGetMultiState::Result& result = state->_results[ii];
+
+      if (result._done)
+      {
+        for (size_t jj = 0; jj < sub_ids.size(); jj++)
+        {
+          if (result._aors[jj] != NULL)
+          {
+            found[jj] = true;
+          }
+        }
+      }
+      else if (now < deadlines[ii])
+      {
+        waiting = true;
+        next_deadline = std::min(next_deadline, deadlines[ii]);
+      }
+    }
+
+    if ((!waiting) ||
+        (std::find(found.begin(), found.end(), false) == found.end()))
+    {
+      break;
+    }
+
+    state->_cond.wait_until(lock, next_deadline);
+  }
+
+  // Take each subscriber from the first remote S4 that had it, stop waiting
+  // for the others, and tidy up anything else they've already returned.
+  state->_abandoned = true;
+  remote_aors.assign(sub_ids.size(), NULL);
+  all_not_found.assign(sub_ids.size(), true);
+
+  for (size_t ii = 0; ii < state->_results.size(); ii++)
+  {
+    RemoteGetMultiState::Result& result = state->_results[ii];
+
+    for (size_t jj = 0; jj < sub_ids.size(); jj++)
+    {
+      if ((!result._done) || (result._rcs[jj] != HTTP_NOT_FOUND))
+      {
+        all_not_found[jj] = false;
+      }
+
+      if (!result._done)
+      {
+        continue;
+      }
+
+      if ((result._aors[jj] != NULL) && (remote_aors[jj] == NULL))
+      {
+        TRC_DEBUG("Found subscriber %s on remote S4 %s",
+                  sub_ids[jj].c_str(), _remote_s4s[ii]->get_id().c_str());
+        remote_aors[jj] = result._aors[jj];
+      }
+      else
+      {
+        delete result._aors[jj];
+      }
+
+      result._aors[jj] = NULL;
+    }
+  }
+}
+
 HTTPCode S4::handle_delete(const std::string& sub_id,
                            uint64_t version,
                            SAS::TrailId trail)
 {
   TRC_DEBUG("Handling local DELETE for %s on %s", sub_id.c_str(), _s4_id.c_str());
 
+  std::unique_lock<std::recursive_mutex> lock(_write_locks.get(sub_id));
+
   // Get the AoR from the data store - this only looks in the local store.
   AoR* aor = NULL;
   Store::Status store_rc = get_aor(sub_id, &aor, trail);
@@ -177,7 +842,8 @@ HTTPCode S4::handle_delete(const std::string& sub_id,
       aor->clear(false);
 
       // Write the empty AoR back to the store.
-      Store::Status store_rc = write_aor(sub_id, *aor, trail);
+      int next_expires;
+      Store::Status store_rc = write_aor(sub_id, *aor, next_expires, trail);
 
       if (store_rc == Store::Status::OK)
       {
@@ -188,7 +854,8 @@ HTTPCode S4::handle_delete(const std::string& sub_id,
         // Subscriber has been deleted from the local site, so send the DELETE
         // out to the remote sites. The response to the SM is always going to be
         // OK independently of whether any remote DELETEs are successful.
-        replicate_delete_cross_site(sub_id, trail);
+        replicate_delete_cross_site(sub_id, lock, trail);
+        update_timers(sub_id, *aor, next_expires, trail);
       }
       else if (store_rc == Store::Status::DATA_CONTENTION)
       {
@@ -225,6 +892,8 @@ void S4::handle_remote_delete(const std::string& sub_id,
 
   // Get the AoR from the data store - this only looks in the local store.
   bool retry_delete = true;
+  int retries = 0;
+  bool contention = false;
 
   while (retry_delete)
   {
@@ -232,6 +901,7 @@ void S4::handle_remote_delete(const std::string& sub_id,
     // data contention on the write.
     retry_delete = false;
 
+    std::unique_lock<std::recursive_mutex> lock(_write_locks.get(sub_id));
     AoR* aor = NULL;
     Store::Status store_rc = get_aor(sub_id, &aor, trail);
 
@@ -251,18 +921,30 @@ void S4::handle_remote_delete(const std::string& sub_id,
       aor->clear(false);
 
       // Write the empty AoR back to the store.
-      Store::Status store_rc = write_aor(sub_id, *aor, trail);
+      int next_expires;
+      Store::Status store_rc = write_aor(sub_id, *aor, next_expires, trail);
 
       if (store_rc == Store::Status::OK)
       {
         TRC_DEBUG("Successfully deleted subscriber %s from %s",
                    sub_id.c_str(), _s4_id.c_str());
+        lock.unlock();
+        update_timers(sub_id, *aor, next_expires, trail);
       }
       else if (store_rc == Store::Status::DATA_CONTENTION)
       {
         TRC_DEBUG("Contention when deleting subscriber %s from %s",
                   sub_id.c_str(), _s4_id.c_str());
-        retry_delete = true;
+        contention = true;
+
+        // Let whatever beat us finish while we wait to retry.
+        lock.unlock();
+        retry_delete = _contention_retry_policy.retry_after_contention(retries);
+
+        if (retry_delete)
+        {
+          retries++;
+        }
       }
       else
       {
@@ -273,6 +955,11 @@ void S4::handle_remote_delete(const std::string& sub_id,
 
     delete aor; aor = NULL;
   }
+
+  if (contention)
+  {
+    _contention_retry_policy.record_request(retries);
+  }
 }
 
 HTTPCode S4::handle_put(const std::string& sub_id,
@@ -282,11 +969,38 @@ HTTPCode S4::handle_put(const std::string& sub_id,
   TRC_DEBUG("Adding subscriber %s to %s", sub_id.c_str(), _s4_id.c_str());
 
   HTTPCode rc = HTTP_OK;
+  AoR& put_aor = (AoR&)aor;
+
+  // Send the timer to Chronos before writing the subscriber, and before
+  // taking its write lock, as it's a round trip to Chronos. A new subscriber
+  // normally needs a new timer, and this way the new timer's ID is written to
+  // the local store and replicated along with the rest of the subscriber.
+  tidy_aor(put_aor);
+  int next_expires;
+  int last_expires;
+  put_aor.get_expires(next_expires, last_expires);
+  std::string old_timer_id = put_aor._timer_id;
+
+  if (_chronos_timer_request_sender)
+  {
+    TRC_DEBUG("Sending Chronos timer requests for local store");
+    _chronos_timer_request_sender->send_timers(sub_id,
+                                               _chronos_callback_uri,
+                                               &put_aor,
+                                               next_expires,
+                                               time(NULL),
+                                               trail);
+  }
+
+  std::unique_lock<std::recursive_mutex> lock(_write_locks.get(sub_id));
 
   // Attempt to write the data to the local store. We don't do a get first as
   // we expect the subscriber shouldn't exist. If the subscriber already
   // exists this will fail with data contention, and we'll return an error code
-  Store::Status store_rc = write_aor(sub_id, (AoR&)aor, trail);
+  Store::Status store_rc = write_tidied_aor(sub_id,
+                                            put_aor,
+                                            last_expires,
+                                            trail);
 
   if (store_rc == Store::Status::OK)
   {
@@ -294,102 +1008,377 @@ HTTPCode S4::handle_put(const std::string& sub_id,
               sub_id.c_str(), _s4_id.c_str());
     rc = HTTP_OK;
 
+    if (_negative_lookup_cache != NULL)
+    {
+      _negative_lookup_cache->remove(sub_id);
+    }
+
     // Subscriber has been added on the local site, so send the PUTs
     // out to the remote sites. The response to the SM is always going to be
     // OK independently of whether any remote PUTs are successful.
-    replicate_put_cross_site(sub_id, aor, trail);
+    replicate_put_cross_site(sub_id, aor, lock, trail);
+    mimic_timer_pop_if_expired(sub_id, aor, next_expires, time(NULL), trail);
   }
   else
   {
     // Failed to add data - we don't try and add the subscriber to any remote
     // sites.
     TRC_DEBUG("Failed to add subscriber %s to %s", sub_id.c_str(), _s4_id.c_str());
+    lock.unlock();
+
+    if (put_aor._timer_id != old_timer_id)
+    {
+      // The timer created for the subscriber isn't needed after all.
+      TRC_DEBUG("Deleting unused timer %s for %s",
+                put_aor._timer_id.c_str(), sub_id.c_str());
+      _chronos_timer_request_sender->_chronos_conn->send_delete(put_aor._timer_id,
+                                                                trail);
+      put_aor._timer_id = old_timer_id;
+    }
+
+    if (store_rc == Store::Status::ERROR)
+    {
+      rc = HTTP_SERVER_ERROR;
+    }
+    else if (store_rc == Store::Status::DATA_CONTENTION)
+    {
+      rc = HTTP_PRECONDITION_FAILED;
+    }
+  }
+
+  return rc;
+}
+
+HTTPCode S4::handle_patch(const std::string& sub_id,
+                          const PatchObject& po,
+                          AoR** aor,
+                          SAS::TrailId trail)
+{
+  TRC_DEBUG("Updating subscriber %s on %s", sub_id.c_str(), _s4_id.c_str());
+
+  HTTPCode rc = HTTP_OK;
+  bool retry_patch = true;
+  int retries = 0;
+  bool contention = false;
+
+  while (retry_patch)
+  {
+    // Delete the AoR on each iteration, and set the retry flag to false.
+    // The flag is only set to true if there's data contention on the write.
+    retry_patch = false;
+    delete *aor; *aor = NULL;
+
+    // Only one thread in this process updates the subscriber at a time, so
+    // they don't make each other retry.
+    std::unique_lock<std::recursive_mutex> lock(_write_locks.get(sub_id));
+
+    Store::Status store_rc = get_aor(sub_id, aor, trail);
 
     if (store_rc == Store::Status::ERROR)
     {
+      TRC_DEBUG("Store error when getting subscriber %s on %s during a PATCH",
+                 sub_id.c_str(), _s4_id.c_str());
       rc = HTTP_SERVER_ERROR;
     }
-    else if (store_rc == Store::Status::DATA_CONTENTION)
+    else if (store_rc == Store::Status::NOT_FOUND)
+    {
+      // The subscriber can't be found - it's not valid to PATCH a non-existent
+      // subscriber.
+      TRC_DEBUG("Subscriber %s not found on %s during a PATCH",
+                 sub_id.c_str(), _s4_id.c_str());
+      rc = HTTP_NOT_FOUND;
+    }
+    else
+    {
+      // Update the AoR with the requested changes.
+      (*aor)->patch_aor(po);
+      int next_expires;
+      Store::Status store_rc = write_aor(sub_id, *(*aor), next_expires, trail);
+
+      if (store_rc == Store::Status::OK)
+      {
+        TRC_DEBUG("Updated subscriber %s on %s", sub_id.c_str(), _s4_id.c_str());
+        rc = HTTP_OK;
+
+        if (_negative_lookup_cache != NULL)
+        {
+          _negative_lookup_cache->remove(sub_id);
+        }
+
+        // Subscriber has been updated on the local site, so send the PATCHs
+        // out to the remote sites. The response to the SM is always going to be
+        // OK independently of whether any remote PATCHs are successful.
+        replicate_patch_cross_site(sub_id, po, **aor, lock, trail);
+        update_timers(sub_id, **aor, next_expires, trail);
+      }
+      else if (store_rc == Store::Status::DATA_CONTENTION)
+      {
+        // Failed to update the subscriber due to data contention. Retry the
+        // update.
+        TRC_DEBUG("Failed to update subscriber %s on %s due to contention",
+                  sub_id.c_str(),
+                  _s4_id.c_str());
+        contention = true;
+
+        // Contention means another process has updated the subscriber, so
+        // don't hold up updates from this process while we wait to retry.
+        lock.unlock();
+        retry_patch = _contention_retry_policy.retry_after_contention(retries);
+
+        if (retry_patch)
+        {
+          retries++;
+        }
+        else
+        {
+          // We've given up retrying. Delete the retrieved AoR to clean it up.
+          delete *aor; *aor = NULL;
+          rc = HTTP_SERVER_ERROR;
+        }
+      }
+      else
+      {
+        // Failed to update the subscriber due to a store error. There's no
+        // point in retrying. Delete the retrieved AoR to clean it up.
+        TRC_DEBUG("Failed to update subscriber %s on %s due to a store error",
+                  sub_id.c_str(),
+                  _s4_id.c_str());
+        delete *aor; *aor = NULL;
+        rc = HTTP_SERVER_ERROR;
+      }
+    }
+  }
+
+  if (contention)
+  {
+    _contention_retry_policy.record_request(retries);
+  }
+
+  return rc;
+}
+
+void S4::handle_batch(const std::vector<ReplicationRequest*>& requests,
+                      std::vector<HTTPCode>& rcs)
+{
+  TRC_DEBUG("Handling a batch of %zu updates on %s",
+            requests.size(), _s4_id.c_str());
+
+  rcs.assign(requests.size(), HTTP_SERVER_ERROR);
+  std::vector<bool> done(requests.size(), false);
+  int retries = 0;
+  bool contention = false;
+
+  // The updates are applied in rounds. Each round applies the first update
+  // that's still outstanding for each subscriber, so a subscriber's updates
+  // are applied in order, but updates to different subscribers share a
+  // multi-get and have their writes in flight together. An update that hits
+  // contention is tried again in the next round; nothing else is redone.
+  while (true)
+  {
+    std::vector<size_t> round;
+    std::vector<std::string> sub_ids;
+    std::unordered_set<std::string> round_sub_ids;
+
+    for (size_t ii = 0; ii < requests.size(); ii++)
+    {
+      if ((!done[ii]) && (round_sub_ids.insert(requests[ii]->_sub_id).second))
+      {
+        round.push_back(ii);
+        sub_ids.push_back(requests[ii]->_sub_id);
+      }
+    }
+
+    if (round.empty())
+    {
+      break;
+    }
+
+    // Take the write locks of the round's subscribers, as local requests do,
+    // so that local requests for them don't race the batch for the CAS. The
+    // stripes are taken in a fixed order, so two batches can't deadlock.
+    std::vector<std::recursive_mutex*> stripes;
+
+    for (const std::string& sub_id : sub_ids)
+    {
+      stripes.push_back(&_write_locks.get(sub_id));
+    }
+
+    std::sort(stripes.begin(), stripes.end());
+    stripes.erase(std::unique(stripes.begin(), stripes.end()), stripes.end());
+    std::vector<std::unique_lock<std::recursive_mutex>> locks;
+
+    for (std::recursive_mutex* stripe : stripes)
+    {
+      locks.emplace_back(*stripe);
+    }
+
+    std::vector<AoR*> aors;
+    _aor_store->get_aor_data_multi(sub_ids, aors, requests[round[0]]->_trail);
+
+    // Work out what to write for each update, and write them all at once.
+    std::vector<AoR*> to_write(round.size(), NULL);
+    std::vector<SAS::TrailId> trails;
+
+    for (size_t jj = 0; jj < round.size(); jj++)
+    {
+      const ReplicationRequest* request = requests[round[jj]];
+      trails.push_back(request->_trail);
+
+      if (aors[jj] == NULL)
+      {
+        TRC_DEBUG("Store error when getting subscriber %s on %s during a batch",
+                  request->_sub_id.c_str(), _s4_id.c_str());
+      }
+      else if (apply_replicated_update(*request, &aors[jj]))
+      {
+        to_write[jj] = aors[jj];
+      }
+    }
+
+    std::vector<Store::Status> store_rcs;
+    std::vector<int> next_expires;
+    write_aors(sub_ids, to_write, trails, store_rcs, next_expires);
+
+    // The timers must be updated (and any backoff waited for) without the
+    // write locks held.
+    locks.clear();
+
+    std::vector<size_t> contended;
+
+    for (size_t jj = 0; jj < round.size(); jj++)
+    {
+      size_t ii = round[jj];
+      const ReplicationRequest* request = requests[ii];
+
+      if (aors[jj] == NULL)
+      {
+        fail_batch_updates(requests, ii, done, rcs);
+      }
+      else if (store_rcs[jj] == Store::Status::OK)
+      {
+        done[ii] = true;
+
+        if (request->_type == ReplicationRequest::DELETE)
+        {
+          rcs[ii] = HTTP_NO_CONTENT;
+        }
+        else
+        {
+          rcs[ii] = HTTP_OK;
+
+          if (_negative_lookup_cache != NULL)
+          {
+            _negative_lookup_cache->remove(request->_sub_id);
+          }
+        }
+
+        if (to_write[jj] != NULL)
+        {
+          TRC_DEBUG("Applied update to subscriber %s on %s",
+                    request->_sub_id.c_str(), _s4_id.c_str());
+          update_timers(request->_sub_id,
+                        *aors[jj],
+                        next_expires[jj],
+                        request->_trail);
+        }
+      }
+      else if (store_rcs[jj] == Store::Status::DATA_CONTENTION)
+      {
+        TRC_DEBUG("Contention when updating subscriber %s on %s during a batch",
+                  request->_sub_id.c_str(), _s4_id.c_str());
+        contended.push_back(ii);
+      }
+      else
+      {
+        TRC_DEBUG("Store error when updating subscriber %s on %s during a batch",
+                  request->_sub_id.c_str(), _s4_id.c_str());
+        fail_batch_updates(requests, ii, done, rcs);
+      }
+
+      delete aors[jj]; aors[jj] = NULL;
+    }
+
+    if (!contended.empty())
     {
-      rc = HTTP_PRECONDITION_FAILED;
+      contention = true;
+
+      if (_contention_retry_policy.retry_after_contention(retries))
+      {
+        retries++;
+      }
+      else
+      {
+        for (size_t ii : contended)
+        {
+          fail_batch_updates(requests, ii, done, rcs);
+        }
+      }
     }
   }
 
-  return rc;
+  if (contention)
+  {
+    _contention_retry_policy.record_request(retries);
+  }
 }
 
-HTTPCode S4::handle_patch(const std::string& sub_id,
-                          const PatchObject& po,
-                          AoR** aor,
-                          SAS::TrailId trail)
+bool S4::apply_replicated_update(const ReplicationRequest& request,
+                                 AoR** aor)
 {
-  TRC_DEBUG("Updating subscriber %s on %s", sub_id.c_str(), _s4_id.c_str());
+  bool exists = !(*aor)->bindings().empty();
 
-  HTTPCode rc = HTTP_OK;
-  bool retry_patch = true;
-
-  while (retry_patch)
+  if (request._type == ReplicationRequest::DELETE)
   {
-    // Delete the AoR on each iteration, and set the retry flag to false.
-    // The flag is only set to true if there's data contention on the write.
-    retry_patch = false;
-    delete *aor; *aor = NULL;
-
-    Store::Status store_rc = get_aor(sub_id, aor, trail);
-
-    if (store_rc == Store::Status::ERROR)
+    if (!exists)
     {
-      TRC_DEBUG("Store error when getting subscriber %s on %s during a PATCH",
-                 sub_id.c_str(), _s4_id.c_str());
-      rc = HTTP_SERVER_ERROR;
+      TRC_DEBUG("Subscriber %s isn't on %s, no need to delete it",
+                request._sub_id.c_str(), _s4_id.c_str());
+      return false;
     }
-    else if (store_rc == Store::Status::NOT_FOUND)
+
+    (*aor)->clear(false);
+  }
+  else if (exists)
+  {
+    // A PUT of a subscriber that already exists is applied as a PATCH.
+    if (request._type == ReplicationRequest::PUT)
     {
-      // The subscriber can't be found - it's not valid to PATCH a non-existent
-      // subscriber.
-      TRC_DEBUG("Subscriber %s not found on %s during a PATCH",
-                 sub_id.c_str(), _s4_id.c_str());
-      rc = HTTP_NOT_FOUND;
+      PatchObject po;
+      convert_aor_to_patch(*request._aor, po);
+      (*aor)->patch_aor(po);
     }
     else
     {
-      // Update the AoR with the requested changes.
-      (*aor)->patch_aor(po);
-      Store::Status store_rc = write_aor(sub_id, *(*aor), trail);
+      (*aor)->patch_aor(*request._po);
+    }
+  }
+  else
+  {
+    // The subscriber doesn't exist, so a PATCH is applied as a PUT. Either
+    // way, the write must only succeed if the subscriber still doesn't exist,
+    // so keep the CAS we read.
+    AoR* new_aor = new AoR(request._sub_id);
+    new_aor->copy_aor(*request._aor);
+    new_aor->_cas = (*aor)->_cas;
+    delete *aor; *aor = new_aor;
+  }
 
-      if (store_rc == Store::Status::OK)
-      {
-        TRC_DEBUG("Updated subscriber %s on %s", sub_id.c_str(), _s4_id.c_str());
-        rc = HTTP_OK;
+  return true;
+}
 
-        // Subscriber has been updated on the local site, so send the PATCHs
-        // out to the remote sites. The response to the SM is always going to be
-        // OK independently of whether any remote PATCHs are successful.
-        replicate_patch_cross_site(sub_id, po, **aor, trail);
-      }
-      else if (store_rc == Store::Status::DATA_CONTENTION)
-      {
-        // Failed to update the subscriber due to data contention. Retry the
-        // update.
-        TRC_DEBUG("Failed to update subscriber %s on %s due to contention",
-                  sub_id.c_str(),
-                  _s4_id.c_str());
-        retry_patch = true;
-      }
-      else
-      {
-        // Failed to update the subscriber due to a store error. There's no
-        // point in retrying. Delete the retrieved AoR to clean it up.
-        TRC_DEBUG("Failed to update subscriber %s on %s due to a store error",
-                  sub_id.c_str(),
-                  _s4_id.c_str());
-        delete *aor; *aor = NULL;
-        rc = HTTP_SERVER_ERROR;
-      }
+void S4::fail_batch_updates(const std::vector<ReplicationRequest*>& requests,
+                            size_t failed,
+                            std::vector<bool>& done,
+                            std::vector<HTTPCode>& rcs)
+{
+  for (size_t ii = failed; ii < requests.size(); ii++)
+  {
+    if ((!done[ii]) && (requests[ii]->_sub_id == requests[failed]->_sub_id))
+    {
+      done[ii] = true;
+      rcs[ii] = HTTP_SERVER_ERROR;
     }
   }
-
-  return rc;
 }
 
 void S4::handle_timer_pop(const std::string& sub_id,
@@ -409,8 +1398,22 @@ void S4::mimic_timer_pop(const std::string& sub_id,
 }
 
 void S4::replicate_delete_cross_site(const std::string& sub_id,
+                                     std::unique_lock<std::recursive_mutex>& lock,
                                      SAS::TrailId trail)
 {
+  if (!_replication_queues.empty())
+  {
+    for (ReplicationQueue* queue : _replication_queues)
+    {
+      queue->remove(sub_id, trail);
+    }
+
+    lock.unlock();
+    return;
+  }
+
+  lock.unlock();
+
   for (S4* remote_s4 : _remote_s4s)
   {
     remote_s4->handle_remote_delete(sub_id, trail);
@@ -419,27 +1422,50 @@ void S4::replicate_delete_cross_site(const std::string& sub_id,
 
 void S4::replicate_put_cross_site(const std::string& sub_id,
                                   const AoR& aor,
+                                  std::unique_lock<std::recursive_mutex>& lock,
                                   SAS::TrailId trail)
 {
+  if (!_replication_queues.empty())
+  {
+    for (ReplicationQueue* queue : _replication_queues)
+    {
+      queue->put(sub_id, aor, trail);
+    }
+
+    lock.unlock();
+    return;
+  }
+
+  lock.unlock();
+
   for (S4* remote_s4 : _remote_s4s)
   {
-    HTTPCode rc = remote_s4->handle_put(sub_id, aor, trail);
+    remote_s4->handle_replicated_put(sub_id, aor, trail);
+  }
+}
 
-    if (rc == HTTP_PRECONDITION_FAILED)
-    {
-      // We've tried to do a PUT to a remote site that already has data. We need
-      // to send a PATCH instead.
-      TRC_DEBUG("Need to convert PUT to PATCH for %s on %s",
-                sub_id.c_str(), _s4_id.c_str());
+HTTPCode S4::handle_replicated_put(const std::string& sub_id,
+                                   const AoR& aor,
+                                   SAS::TrailId trail)
+{
+  HTTPCode rc = handle_put(sub_id, aor, trail);
 
-      PatchObject po;
-      convert_aor_to_patch(aor, po);
+  if (rc == HTTP_PRECONDITION_FAILED)
+  {
+    // We've tried to do a PUT to a remote site that already has data. We need
+    // to send a PATCH instead.
+    TRC_DEBUG("Need to convert PUT to PATCH for %s on %s",
+              sub_id.c_str(), _s4_id.c_str());
 
-      AoR* remote_aor = NULL;
-      remote_s4->handle_patch(sub_id, po, &remote_aor, trail);
-      delete remote_aor; remote_aor = NULL;
-    }
+    PatchObject po;
+    convert_aor_to_patch(aor, po);
+
+    AoR* remote_aor = NULL;
+    rc = handle_patch(sub_id, po, &remote_aor, trail);
+    delete remote_aor; remote_aor = NULL;
   }
+
+  return rc;
 }
 
 // Replicate the PATCH to each remote site. We don't care about the return code
@@ -448,29 +1474,60 @@ void S4::replicate_put_cross_site(const std::string& sub_id,
 void S4::replicate_patch_cross_site(const std::string& sub_id,
                                     const PatchObject& po,
                                     const AoR& aor,
+                                    std::unique_lock<std::recursive_mutex>& lock,
                                     SAS::TrailId trail)
 {
+  // Don't copy the patch if there's nowhere to send it.
+  if (_remote_s4s.empty())
+  {
+    lock.unlock();
+    return;
+  }
+
   PatchObject remote_po = PatchObject(po);
   remote_po.set_increment_cseq(false);
   remote_po.set_minimum_cseq(aor._notify_cseq);
 
-  for (S4* remote_s4 : _remote_s4s)
+  if (!_replication_queues.empty())
   {
-    AoR* remote_aor = NULL;
-    HTTPCode rc = remote_s4->handle_patch(sub_id, remote_po, &remote_aor, trail);
-    delete remote_aor; remote_aor = NULL;
-
-    if (rc == HTTP_NOT_FOUND)
+    for (ReplicationQueue* queue : _replication_queues)
     {
-      // We've tried to do a PATCH to a remote site that doesn't have any data.
-      // We need to send a PUT.
-      TRC_DEBUG("Need to convert PATCH to PUT for %s", _s4_id.c_str());
-      AoR* aor_for_put = new AoR(sub_id);
-      aor_for_put->copy_aor(aor);
-      remote_s4->handle_put(sub_id, *aor_for_put, trail);
-      delete aor_for_put; aor_for_put = NULL;
+      queue->patch(sub_id, remote_po, aor, trail);
     }
+
+    lock.unlock();
+    return;
   }
+
+  lock.unlock();
+
+  for (S4* remote_s4 : _remote_s4s)
+  {
+    remote_s4->handle_replicated_patch(sub_id, remote_po, aor, trail);
+  }
+}
+
+HTTPCode S4::handle_replicated_patch(const std::string& sub_id,
+                                     const PatchObject& po,
+                                     const AoR& aor,
+                                     SAS::TrailId trail)
+{
+  AoR* remote_aor = NULL;
+  HTTPCode rc = handle_patch(sub_id, po, &remote_aor, trail);
+  delete remote_aor; remote_aor = NULL;
+
+  if (rc == HTTP_NOT_FOUND)
+  {
+    // We've tried to do a PATCH to a remote site that doesn't have any data.
+    // We need to send a PUT.
+    TRC_DEBUG("Need to convert PATCH to PUT for %s", _s4_id.c_str());
+    AoR* aor_for_put = new AoR(sub_id);
+    aor_for_put->copy_aor(aor);
+    rc = handle_put(sub_id, *aor_for_put, trail);
+    delete aor_for_put; aor_for_put = NULL;
+  }
+
+  return rc;
 }
 
 Store::Status S4::get_aor(const std::string& sub_id,
@@ -507,13 +1564,92 @@ Store::Status S4::get_aor(const std::string& sub_id,
 
 Store::Status S4::write_aor(const std::string& sub_id,
                             AoR& aor,
+                            int& next_expires,
                             SAS::TrailId trail)
+{
+  tidy_aor(aor);
+  int last_expires;
+  aor.get_expires(next_expires, last_expires);
+  return write_tidied_aor(sub_id, aor, last_expires, trail);
+}
+
+Store::Status S4::write_tidied_aor(const std::string& sub_id,
+                                   AoR& aor,
+                                   int last_expires,
+                                   SAS::TrailId trail)
 {
   TRC_DEBUG("Writing AoR to store");
+  Store::Status rc = _aor_store->set_aor_data(sub_id,
+                                              &aor,
+                                              get_store_expiry(last_expires),
+                                              trail);
+  if (rc == Store::Status::OK)
+  {
+    TRC_DEBUG("Successfully written AoR for %s to %s",
+              sub_id.c_str(), _s4_id.c_str());
+  }
+  else
+  {
+    TRC_DEBUG("Failed to write AoR for %s to %s",
+              sub_id.c_str(), _s4_id.c_str());
+  }
+
+  return rc;
+}
+
+void S4::write_aors(const std::vector<std::string>& sub_ids,
+                    const std::vector<AoR*>& aors,
+                    const std::vector<SAS::TrailId>& trails,
+                    std::vector<Store::Status>& rcs,
+                    std::vector<int>& next_expires)
+{
+  rcs.assign(aors.size(), Store::Status::OK);
+  next_expires.assign(aors.size(), 0);
+
+  std::mutex lock;
+  std::condition_variable cond;
+  size_t outstanding = std::count_if(aors.begin(),
+                                     aors.end(),
+                                     [](AoR* aor) { return (aor != NULL); });
+
+  for (size_t ii = 0; ii < aors.size(); ii++)
+  {
+    AoR* aor = aors[ii];
+
+    if (aor == NULL)
+    {
+      continue;
+    }
+
+    tidy_aor(*aor);
+    int last_expires;
+    aor->get_expires(next_expires[ii], last_expires);
+    _aor_store->set_aor_data_async(sub_ids[ii],
+                                   aor,
+                                   get_store_expiry(last_expires),
+                                   trails[ii],
+                                   [&, ii](Store::Status rc)
+    {
+      std::unique_lock<std::mutex> callback_lock(lock);
+      rcs[ii] = rc;
+      outstanding--;
+
+      if (outstanding == 0)
+      {
+        cond.notify_all();
+      }
+    });
+  }
+
+  std::unique_lock<std::mutex> wait_lock(lock);
+  cond.wait(wait_lock, [&]() { return (outstanding == 0); });
+}
 
+void S4::tidy_aor(AoR& aor)
+{
   // If the AoR has no bindings then it should be deleted. Clear up any
   // subscriptions.
-  if (aor.bindings().empty() && !aor.subscriptions().empty())
+  if (aor.bindings().empty() && (aor.get_subscriptions_count() != 0))
   {
     TRC_DEBUG("Cleaning up AoR");
     aor.clear(false);
@@ -535,53 +1671,160 @@ Store::Status S4::write_aor(const std::string& sub_id,
   {
     TRC_DEBUG("Remove any subscriptions when there's only emergency bindings");
 
-    for (SubscriptionPair subscription : aor._subscriptions)
-    {
-      delete subscription.second;
-    }
-
-    aor._subscriptions.clear();
+    aor.clear_subscriptions();
   }
+}
+
+int S4::get_store_expiry(int last_expires)
+{
+  // If we have a non-zero expiry, set the expiry in memcached to 10s later than
+  // when the data is due to expire. This prevents a window condition where
+  // Chronos can return a binding to expire, but memcached has already deleted
+  // the AoR data (meaning that no NOTIFYs can be sent). If the expiry is 0, we
+  // want to expire this data immediately so set the expiry to 0.
+  return (last_expires != 0) ? last_expires + 10 : 0;
+}
 
+void S4::update_timers(const std::string& sub_id,
+                       AoR& aor,
+                       int next_expires,
+                       SAS::TrailId trail)
+{
   int now = time(NULL);
 
   // Send Chronos timer requests if it's a local store.
   if (_chronos_timer_request_sender)
   {
     TRC_DEBUG("Sending Chronos timer requests for local store");
-    _chronos_timer_request_sender->send_timers(sub_id, _chronos_callback_uri, &aor, now, trail);
+    std::string old_timer_id = aor._timer_id;
+    _chronos_timer_request_sender->send_timers(sub_id,
+                                               _chronos_callback_uri,
+                                               &aor,
+                                               next_expires,
+                                               now,
+                                               trail);
+
+    if (aor._timer_id != old_timer_id)
+    {
+      store_timer_id(sub_id, old_timer_id, aor, trail);
+    }
   }
 
+  mimic_timer_pop_if_expired(sub_id, aor, next_expires, now, trail);
+}
+
+void S4::mimic_timer_pop_if_expired(const std::string& sub_id,
+                                    const AoR& aor,
+                                    int next_expires,
+                                    int now,
+                                    SAS::TrailId trail)
+{
   // Check if any binding has expired and send mimic timer pop.
-  if (!aor.bindings().empty() && aor.get_next_expires() <= now)
+  if (!aor.bindings().empty() && next_expires <= now)
   {
     TRC_DEBUG("Some binding has expired");
     mimic_timer_pop(sub_id, trail);
   }
+}
 
-  // If we have a non-zero expiry, set the expiry in memcached to 10s later than
-  // when the data is due to expire. This prevents a window condition where
-  // Chronos can return a binding to expire, but memcached has already deleted
-  // the AoR data (meaning that no NOTIFYs can be sent). If the expiry is 0, we
-  // want to expire this data immediately so set the expiry to 0.
-  Store::Status rc = _aor_store->set_aor_data(sub_id,
-                                              &aor,
-                                              (aor.get_last_expires() != 0) ?
-                                                aor.get_last_expires() + 10 :
-                                                0,
-                                              trail);
-  if (rc == Store::Status::OK)
+void S4::store_timer_id(const std::string& sub_id,
+                        const std::string& old_timer_id,
+                        AoR& aor,
+                        SAS::TrailId trail)
+{
+  TRC_DEBUG("Storing new timer %s for %s", aor._timer_id.c_str(), sub_id.c_str());
+
+  bool retry_store = true;
+  int retries = 0;
+  bool contention = false;
+
+  // Set if another update has already stored a different timer for the
+  // subscriber, or has deleted the subscriber, so the new timer isn't needed.
+  bool duplicate = false;
+  AoR* stored_aor = NULL;
+
+  while (retry_store)
   {
-    TRC_DEBUG("Successfully written AoR for %s to %s",
-              sub_id.c_str(), _s4_id.c_str());
+    retry_store = false;
+    delete stored_aor; stored_aor = NULL;
+
+    std::unique_lock<std::recursive_mutex> lock(_write_locks.get(sub_id));
+    Store::Status store_rc = get_aor(sub_id, &stored_aor, trail);
+
+    if (store_rc == Store::Status::ERROR)
+    {
+      TRC_DEBUG("Store error when getting subscriber %s on %s to store timer %s",
+                sub_id.c_str(), _s4_id.c_str(), aor._timer_id.c_str());
+    }
+    else if ((store_rc == Store::Status::NOT_FOUND) ||
+             (stored_aor->_timer_id != old_timer_id))
+    {
+      duplicate = true;
+    }
+    else
+    {
+      stored_aor->_timer_id = aor._timer_id;
+      int next_expires;
+      store_rc = write_aor(sub_id, *stored_aor, next_expires, trail);
+
+      if (store_rc == Store::Status::OK)
+      {
+        aor._cas = stored_aor->_cas;
+
+        // Send the new timer ID to the remote sites, as they would have been
+        // sent it with the rest of the AoR if the timer had been created
+        // before the write.
+        PatchObject po;
+        po.set_timer_id(aor._timer_id);
+        replicate_patch_cross_site(sub_id, po, *stored_aor, lock, trail);
+      }
+      else if (store_rc == Store::Status::DATA_CONTENTION)
+      {
+        contention = true;
+        lock.unlock();
+        retry_store = _contention_retry_policy.retry_after_contention(retries);
+
+        if (retry_store)
+        {
+          retries++;
+        }
+      }
+
+      if ((store_rc != Store::Status::OK) && (!retry_store))
+      {
+        TRC_DEBUG("Failed to store timer %s for %s on %s",
+                  aor._timer_id.c_str(), sub_id.c_str(), _s4_id.c_str());
+      }
+    }
   }
-  else
+
+  if (contention)
   {
-    TRC_DEBUG("Failed to write AoR for %s to %s",
-              sub_id.c_str(), _s4_id.c_str());
+    _contention_retry_policy.record_request(retries);
   }
 
-  return rc;
+  if (duplicate)
+  {
+    // Another update got its timer in first. Delete ours, and make sure the
+    // stored timer matches the latest data for the subscriber, as it may have
+    // been set for older data than ours.
+    TRC_DEBUG("Deleting duplicate timer %s for %s",
+              aor._timer_id.c_str(), sub_id.c_str());
+    _chronos_timer_request_sender->_chronos_conn->send_delete(aor._timer_id,
+                                                              trail);
+    aor._timer_id = (stored_aor != NULL) ? stored_aor->_timer_id : "";
+
+    if (stored_aor != NULL)
+    {
+      _chronos_timer_request_sender->send_timers(sub_id,
+                                                 _chronos_callback_uri,
+                                                 stored_aor,
+                                                 time(NULL),
+                                                 trail);
+    }
+  }
+
+  delete stored_aor; stored_aor = NULL;
 }
 
 S4::ChronosTimerRequestSender::
@@ -609,12 +1852,21 @@ void S4::ChronosTimerRequestSender::send_timers(const std::string& sub_id,
                                                 AoR* aor,
                                                 int now,
                                                 SAS::TrailId trail)
+{
+  send_timers(sub_id, callback_uri, aor, aor->get_next_expires(), now, trail);
+}
+
+void S4::ChronosTimerRequestSender::send_timers(const std::string& sub_id,
+                                                const std::string& callback_uri,
+                                                AoR* aor,
+                                                int next_expires,
+                                                int now,
+                                                SAS::TrailId trail)
 {
   std::map<std::string, uint32_t> tags;
   std::string& timer_id = aor->_timer_id;
 
   // An AoR with no bindings is invalid, and the timer should be deleted.
-  // We do this before getting next_expires to save on processing.
   if (aor->get_bindings_count() == 0)
   {
     if (timer_id != "")
@@ -625,15 +1877,14 @@ void S4::ChronosTimerRequestSender::send_timers(const std::string& sub_id,
   }
 
   build_tag_info(aor, tags);
-  int next_expires = aor->get_next_expires();
 
   if (next_expires == 0)
   {
     // LCOV_EXCL_START - No UTs for unhittable code
 
     // This should never happen, as an empty AoR should never reach
-    // get_next_expires
-    TRC_DEBUG("get_next_expires returned 0. The expiry of AoR members "
+    // here
+    TRC_DEBUG("next_expires is 0. The expiry of AoR members "
               "is corrupt, or an empty (invalid) AoR was passed in.");
 
     // LCOV_EXCL_STOP
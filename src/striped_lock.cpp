@@ -0,0 +1,25 @@
+/**
+ * @file striped_lock.cpp Fixed-size table of locks shared between keys.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+#include <functional>
+
+#include "striped_lock.h"
+
+StripedLock::StripedLock(size_t num_stripes) :
+  _stripes(std::max(num_stripes, (size_t)1))
+{
+}
+
+std::recursive_mutex& StripedLock::get(const std::string& key)
+{
+  return _stripes[std::hash<std::string>()(key) % _stripes.size()];
+}
@@ -0,0 +1,475 @@
+/**
+ * @file aor_test.cpp UT for the AoR class.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "aor.h"
+#include "astaire_aor_store.h"
+
+static const std::string AOR_ID = "sip:6505550231@homedomain";
+
+/// Fixture for AoR tests.
+class AoRTest : public ::testing::Test
+{
+public:
+  /// Build an AoR with a binding, two subscriptions and an Associated URI.
+  static AoR* build_aor()
+  {
+    AoR* aor = new AoR(AOR_ID);
+
+    Binding* b = aor->get_binding("binding1");
+    b->_uri = "sip:6505550231@192.91.191.29:59934;transport=tcp";
+    b->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+    b->_cseq = 17038;
+    b->_expires = 300;
+    b->_priority = 0;
+    b->_private_id = "6505550231";
+
+    for (int ii = 1; ii <= 2; ii++)
+    {
+      std::string to_tag = "to_tag" + std::to_string(ii);
+      Subscription* s = aor->get_subscription(to_tag);
+      s->_req_uri = "sip:6505550231@192.91.191.29:59934";
+      s->_from_uri = AOR_ID;
+      s->_from_tag = "from_tag";
+      s->_to_uri = AOR_ID;
+      s->_to_tag = to_tag;
+      s->_cid = "xyzabc@192.91.191.29";
+      s->_route_uris.push_back("sip:abcdefgh@bono1.homedomain;lr");
+      s->_expires = 100 * ii;
+    }
+
+    aor->associated_uris().add_uri(AOR_ID, false);
+    aor->_notify_cseq = 5;
+    aor->_timer_id = "timer1";
+    aor->_scscf_uri = "sip:scscf.homedomain";
+
+    return aor;
+  }
+
+  /// Write an AoR in the binary format and read it back, so that the
+  /// subscriptions and Associated URIs are held undecoded.
+  static AoR* binary_round_trip(AoR* aor, std::string& data)
+  {
+    AstaireAoRStore::BinarySerializerDeserializer serializer;
+    serializer.serialize_aor(aor, data);
+    return serializer.deserialize_aor(AOR_ID, data);
+  }
+};
+
+// Sections that are held undecoded are written back exactly as they were
+// read, and give the same contents as the original AoR once decoded.
+TEST_F(AoRTest, BinaryLazyDecode)
+{
+  AoR* aor = build_aor();
+  std::string data;
+  AoR* lazy_aor = binary_round_trip(aor, data);
+  ASSERT_TRUE(lazy_aor != NULL);
+
+  // The summary of the undecoded subscriptions is available without decoding
+  // them.
+  EXPECT_EQ(2u, lazy_aor->get_subscriptions_count());
+  EXPECT_EQ(100, lazy_aor->get_next_expires());
+  EXPECT_EQ(300, lazy_aor->get_last_expires());
+
+  std::string rewritten;
+  AstaireAoRStore::BinarySerializerDeserializer serializer;
+  serializer.serialize_aor(lazy_aor, rewritten);
+  EXPECT_EQ(data, rewritten);
+
+  EXPECT_EQ(*aor, *lazy_aor);
+  EXPECT_EQ(2u, lazy_aor->get_subscriptions_count());
+
+  delete lazy_aor; lazy_aor = NULL;
+  delete aor; aor = NULL;
+}
+
+// Changes made to sections that were held undecoded are written out, rather
+// than the sections as they were read.
+TEST_F(AoRTest, BinaryLazyDecodeThenChange)
+{
+  AoR* aor = build_aor();
+  std::string data;
+  AoR* lazy_aor = binary_round_trip(aor, data);
+  ASSERT_TRUE(lazy_aor != NULL);
+
+  lazy_aor->remove_subscription("to_tag1");
+  lazy_aor->get_subscription("to_tag2")->_expires = 250;
+  lazy_aor->get_subscription("to_tag3")->_expires = 400;
+  lazy_aor->associated_uris().add_uri("sip:6505550232@homedomain", true);
+
+  std::string rewritten;
+  AoR* changed_aor = binary_round_trip(lazy_aor, rewritten);
+  ASSERT_TRUE(changed_aor != NULL);
+  EXPECT_NE(data, rewritten);
+
+  EXPECT_EQ(2u, changed_aor->get_subscriptions_count());
+  EXPECT_EQ(250, changed_aor->get_next_expires());
+  EXPECT_EQ(400, changed_aor->get_last_expires());
+  EXPECT_TRUE(changed_aor->subscriptions().find("to_tag1") ==
+              changed_aor->subscriptions().end());
+  EXPECT_EQ(2u, changed_aor->associated_uris().get_all_uris().size());
+  EXPECT_TRUE(changed_aor->associated_uris().is_impu_barred(
+                                                "sip:6505550232@homedomain"));
+  EXPECT_EQ(*lazy_aor, *changed_aor);
+
+  delete changed_aor; changed_aor = NULL;
+  delete lazy_aor; lazy_aor = NULL;
+  delete aor; aor = NULL;
+}
+
+// Several threads can read (and copy) the same undecoded AoR at once. Only
+// one of them decodes each section, and they all see the decoded contents.
+TEST_F(AoRTest, BinaryLazyDecodeConcurrentReaders)
+{
+  AoR* aor = build_aor();
+
+  for (int ii = 0; ii < 20; ii++)
+  {
+    std::string data;
+    AoR* lazy_aor = binary_round_trip(aor, data);
+    ASSERT_TRUE(lazy_aor != NULL);
+    const AoR* shared_aor = lazy_aor;
+
+    std::vector<std::thread> threads;
+    std::vector<int> results(8, 0);
+
+    for (size_t jj = 0; jj < results.size(); jj++)
+    {
+      threads.push_back(std::thread([shared_aor, aor, &results, jj]()
+      {
+        if (jj % 2 == 0)
+        {
+          AoR copy(*shared_aor);
+          results[jj] = ((copy == *aor) &&
+                         (copy.get_subscriptions_count() == 2)) ? 1 : 0;
+        }
+        else
+        {
+          results[jj] = ((shared_aor->subscriptions().size() == 2) &&
+                         (shared_aor->associated_uris().get_all_uris().size() == 1) &&
+                         (shared_aor->get_subscriptions_count() == 2)) ? 1 : 0;
+        }
+      }));
+    }
+
+    for (std::thread& thread : threads)
+    {
+      thread.join();
+    }
+
+    for (size_t jj = 0; jj < results.size(); jj++)
+    {
+      EXPECT_EQ(1, results[jj]) << "Reader " << jj;
+    }
+
+    delete lazy_aor; lazy_aor = NULL;
+  }
+
+  delete aor; aor = NULL;
+}
+
+// An AoR that uses an arena can be cleared, refilled, copied and assigned.
+TEST_F(AoRTest, Arena)
+{
+  AoR* aor = build_aor();
+  AoR arena_aor(AOR_ID);
+  arena_aor.use_arena(AoR::arena_size(1, 2));
+  arena_aor.copy_aor(*aor);
+  EXPECT_EQ(*aor, arena_aor);
+
+  // Clearing the AoR frees the arena's memory, and the AoR can be refilled.
+  arena_aor.clear(true);
+  EXPECT_EQ(0u, arena_aor.get_bindings_count());
+  EXPECT_EQ(0u, arena_aor.get_subscriptions_count());
+  arena_aor.copy_aor(*aor);
+  EXPECT_EQ(*aor, arena_aor);
+
+  AoR copy(arena_aor);
+  EXPECT_EQ(arena_aor, copy);
+
+  AoR assigned(AOR_ID);
+  assigned.get_binding("old_binding");
+  assigned = arena_aor;
+  EXPECT_EQ(arena_aor, assigned);
+
+  delete aor; aor = NULL;
+}
+
+// AoRs read from the store only use an arena if the serializer is asked to.
+TEST_F(AoRTest, DeserializeWithArena)
+{
+  AoR* aor = build_aor();
+
+  AstaireAoRStore::BinarySerializerDeserializer binary(true);
+  std::string data;
+  binary.serialize_aor(aor, data);
+  AoR* read_aor = binary.deserialize_aor(AOR_ID, data);
+  ASSERT_TRUE(read_aor != NULL);
+  EXPECT_EQ(*aor, *read_aor);
+  read_aor->get_subscription("to_tag3")->_expires = 50;
+  EXPECT_EQ(50, read_aor->get_next_expires());
+  delete read_aor; read_aor = NULL;
+
+  AstaireAoRStore::JsonSerializerDeserializer json(true);
+  json.serialize_aor(aor, data);
+  read_aor = json.deserialize_aor(AOR_ID, data);
+  ASSERT_TRUE(read_aor != NULL);
+  EXPECT_EQ(*aor, *read_aor);
+  delete read_aor; read_aor = NULL;
+
+  delete aor; aor = NULL;
+}
+
+// A patch with a mix of new entries and updates to existing entries (with new
+// entries sorting both before and after the existing ones) adds and updates
+// all of them, and removes the entries it lists.
+TEST_F(AoRTest, PatchNewAndUpdatedEntries)
+{
+  AoR aor(AOR_ID);
+  aor.get_binding("b2")->_expires = 200;
+  aor.get_binding("b4")->_expires = 400;
+  aor.get_binding("b6")->_expires = 600;
+  aor.get_subscription("s2")->_expires = 200;
+  aor.get_subscription("s4")->_expires = 400;
+
+  Bindings update_bindings;
+  const char* binding_ids[] = {"b1", "b2", "b3", "b5", "b6", "b7"};
+
+  for (const char* id : binding_ids)
+  {
+    Binding* b = new Binding(AOR_ID);
+    b->_uri = std::string("sip:") + id;
+    b->_expires = 1000;
+    update_bindings.insert(std::make_pair(std::string(id), b));
+  }
+
+  Subscriptions update_subscriptions;
+  const char* subscription_ids[] = {"s1", "s3", "s4"};
+
+  for (const char* id : subscription_ids)
+  {
+    Subscription* s = new Subscription();
+    s->_to_tag = id;
+    s->_expires = 1000;
+    update_subscriptions.insert(std::make_pair(std::string(id), s));
+  }
+
+  PatchObject po;
+  po.set_update_bindings(std::move(update_bindings));
+  po.set_remove_bindings({"b4"});
+  po.set_update_subscriptions(std::move(update_subscriptions));
+  po.set_remove_subscriptions({"s2"});
+  aor.patch_aor(po);
+
+  ASSERT_EQ(6u, aor.get_bindings_count());
+  Bindings::const_iterator it = aor.bindings().begin();
+
+  for (const char* id : binding_ids)
+  {
+    ASSERT_TRUE(it != aor.bindings().end());
+    EXPECT_EQ(id, it->first);
+    EXPECT_EQ(std::string("sip:") + id, it->second->_uri);
+    EXPECT_EQ(1000, it->second->_expires);
+    ++it;
+  }
+
+  EXPECT_EQ(3u, aor.get_subscriptions_count());
+
+  for (const char* id : subscription_ids)
+  {
+    Subscriptions::const_iterator s = aor.subscriptions().find(id);
+    ASSERT_TRUE(s != aor.subscriptions().end()) << id;
+    EXPECT_EQ(id, s->second->_to_tag);
+    EXPECT_EQ(1000, s->second->_expires);
+  }
+
+  EXPECT_EQ(1000, aor.get_next_expires());
+}
+
+// A patch can remove several entries at once, and removals of entries that
+// the AoR doesn't have (or that are listed twice) are ignored.
+TEST_F(AoRTest, PatchRemovesEntries)
+{
+  AoR aor(AOR_ID);
+  const char* binding_ids[] = {"b1", "b2", "b3", "b4", "b5"};
+
+  for (const char* id : binding_ids)
+  {
+    aor.get_binding(id)->_uri = std::string("sip:") + id;
+  }
+
+  aor.get_subscription("s1")->_to_tag = "s1";
+
+  PatchObject po;
+  po.set_remove_bindings({"b5", "b2", "b9", "b1", "b2"});
+  po.set_remove_subscriptions({"s1"});
+  aor.patch_aor(po);
+
+  ASSERT_EQ(2u, aor.get_bindings_count());
+  Bindings::const_iterator it = aor.bindings().begin();
+  EXPECT_EQ("b3", it->first);
+  EXPECT_EQ("sip:b3", it->second->_uri);
+  ++it;
+  EXPECT_EQ("b4", it->first);
+  EXPECT_EQ("sip:b4", it->second->_uri);
+  EXPECT_EQ(0u, aor.get_subscriptions_count());
+}
+
+// The next and last expiry times always reflect the current bindings and
+// subscriptions, including changes made through pointers to them.
+TEST_F(AoRTest, ExpiryTimes)
+{
+  AoR aor(AOR_ID);
+  EXPECT_EQ(0, aor.get_next_expires());
+  EXPECT_EQ(0, aor.get_last_expires());
+
+  Binding* b = aor.get_binding("binding1");
+  b->_expires = 300;
+  Subscription* s = aor.get_subscription("to_tag1");
+  s->_expires = 200;
+  EXPECT_EQ(200, aor.get_next_expires());
+  EXPECT_EQ(300, aor.get_last_expires());
+
+  b->_expires = 100;
+  EXPECT_EQ(100, aor.get_next_expires());
+  EXPECT_EQ(200, aor.get_last_expires());
+
+  aor._bindings.begin()->second->_expires = 400;
+  EXPECT_EQ(200, aor.get_next_expires());
+  EXPECT_EQ(400, aor.get_last_expires());
+
+  aor.remove_subscription("to_tag1");
+  EXPECT_EQ(400, aor.get_next_expires());
+  EXPECT_EQ(400, aor.get_last_expires());
+}
+
+/// Build a patch's bindings or subscriptions, with the given IDs and URIs.
+static Bindings make_bindings(std::vector<std::pair<std::string, std::string>> uris)
+{
+  Bindings bindings;
+
+  for (const std::pair<std::string, std::string>& uri : uris)
+  {
+    Binding* b = new Binding(AOR_ID);
+    b->_uri = uri.second;
+    b->_expires = 300;
+    bindings.insert(std::make_pair(uri.first, b));
+  }
+
+  return bindings;
+}
+
+static Subscriptions make_subscriptions(std::vector<std::string> to_tags)
+{
+  Subscriptions subscriptions;
+
+  for (const std::string& to_tag : to_tags)
+  {
+    Subscription* s = new Subscription();
+    s->_to_tag = to_tag;
+    s->_expires = 300;
+    subscriptions.insert(std::make_pair(to_tag, s));
+  }
+
+  return subscriptions;
+}
+
+// An entry that is updated and then removed is only removed by the merged
+// patch.
+TEST_F(AoRTest, MergeUpdateThenRemove)
+{
+  PatchObject po;
+  po.set_update_bindings(make_bindings({{"b1", "sip:b1"}, {"b2", "sip:b2"}}));
+  po.set_update_subscriptions(make_subscriptions({"s1"}));
+
+  PatchObject later;
+  later.set_remove_bindings({"b1"});
+  later.set_remove_subscriptions({"s1"});
+  po.merge(later);
+
+  ASSERT_EQ(1u, po.get_update_bindings().size());
+  EXPECT_EQ("sip:b2", po.get_update_bindings().begin()->second->_uri);
+  EXPECT_EQ(std::vector<std::string>({"b1"}), po.get_remove_bindings());
+  EXPECT_TRUE(po.get_update_subscriptions().empty());
+  EXPECT_EQ(std::vector<std::string>({"s1"}), po.get_remove_subscriptions());
+
+  // Applying the merged patch removes the entries if they were there
+  // already.
+  AoR aor(AOR_ID);
+  aor.get_binding("b1")->_expires = 300;
+  aor.get_subscription("s1")->_expires = 300;
+  aor.patch_aor(po);
+  EXPECT_EQ(1u, aor.get_bindings_count());
+  EXPECT_EQ("sip:b2", aor.get_binding("b2")->_uri);
+  EXPECT_EQ(0u, aor.get_subscriptions_count());
+}
+
+// An entry that is removed and then updated is only updated by the merged
+// patch, and an entry updated twice takes the later update.
+TEST_F(AoRTest, MergeRemoveThenUpdate)
+{
+  PatchObject po;
+  po.set_remove_bindings({"b1"});
+  po.set_update_bindings(make_bindings({{"b2", "sip:old"}}));
+  po.set_remove_subscriptions({"s1"});
+
+  PatchObject later;
+  later.set_update_bindings(make_bindings({{"b1", "sip:b1"}, {"b2", "sip:new"}}));
+  later.set_update_subscriptions(make_subscriptions({"s1"}));
+  po.merge(later);
+
+  ASSERT_EQ(2u, po.get_update_bindings().size());
+  EXPECT_EQ("sip:b1", po.get_update_bindings().find("b1")->second->_uri);
+  EXPECT_EQ("sip:new", po.get_update_bindings().find("b2")->second->_uri);
+  EXPECT_TRUE(po.get_remove_bindings().empty());
+  EXPECT_EQ(1u, po.get_update_subscriptions().size());
+  EXPECT_TRUE(po.get_remove_subscriptions().empty());
+
+  // The merged patch has its own copies of the later patch's entries.
+  EXPECT_NE(later.get_update_bindings().find("b1")->second,
+            po.get_update_bindings().find("b1")->second);
+}
+
+// The merged patch sets the CSeq to at least the larger minimum, increments
+// it if either patch did, and takes the later Associated URIs.
+TEST_F(AoRTest, MergeCSeqAndAssociatedURIs)
+{
+  PatchObject po;
+  po.set_minimum_cseq(5);
+  po.set_increment_cseq(false);
+
+  PatchObject later;
+  later.set_minimum_cseq(3);
+  later.set_increment_cseq(true);
+  AssociatedURIs uris;
+  uris.add_uri(AOR_ID, false);
+  later.set_associated_uris(uris);
+  po.merge(later);
+
+  EXPECT_EQ(5, po.get_minimum_cseq());
+  EXPECT_TRUE(po.get_increment_cseq());
+  ASSERT_TRUE(po.get_associated_uris());
+  EXPECT_TRUE(po.get_associated_uris()->contains_uri(AOR_ID));
+
+  // A later patch without Associated URIs or an increment leaves them.
+  PatchObject last;
+  last.set_minimum_cseq(7);
+  last.set_increment_cseq(false);
+  po.merge(last);
+
+  EXPECT_EQ(7, po.get_minimum_cseq());
+  EXPECT_TRUE(po.get_increment_cseq());
+  ASSERT_TRUE(po.get_associated_uris());
+  EXPECT_TRUE(po.get_associated_uris()->contains_uri(AOR_ID));
+}
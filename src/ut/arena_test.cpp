@@ -0,0 +1,76 @@
+/**
+ * @file arena_test.cpp UT for the Arena class.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "gtest/gtest.h"
+#include "arena.h"
+
+// Allocations are aligned and don't overlap, including ones that don't fit
+// in the current block or are bigger than a whole block.
+TEST(ArenaTest, Allocate)
+{
+  Arena arena(64);
+  char* last_end = NULL;
+
+  for (size_t ii = 1; ii < 200; ii++)
+  {
+    size_t align = (size_t)1 << (ii % 4);
+    char* ptr = (char*)arena.allocate(ii, align);
+    EXPECT_EQ(0u, (uintptr_t)ptr % align);
+
+    // Fill the memory so that ASan spots any overlap or overrun.
+    memset(ptr, (int)ii, ii);
+    EXPECT_NE(last_end, ptr + ii);
+    last_end = ptr + ii;
+  }
+}
+
+// Objects created in the arena are constructed and can be destroyed.
+TEST(ArenaTest, CreateAndDestroy)
+{
+  Arena arena;
+  std::string* first = arena.create<std::string>(100, 'a');
+  std::string* second = arena.create<std::string>("second");
+  EXPECT_EQ(std::string(100, 'a'), *first);
+  EXPECT_EQ("second", *second);
+  Arena::destroy(first);
+  Arena::destroy(second);
+}
+
+// The arena can be reused after it is reset.
+TEST(ArenaTest, Reset)
+{
+  Arena arena(32);
+
+  for (int ii = 0; ii < 3; ii++)
+  {
+    std::string* strings[50];
+
+    for (int jj = 0; jj < 50; jj++)
+    {
+      strings[jj] = arena.create<std::string>(jj, 'x');
+    }
+
+    for (int jj = 0; jj < 50; jj++)
+    {
+      EXPECT_EQ(std::string(jj, 'x'), *strings[jj]);
+      Arena::destroy(strings[jj]);
+    }
+
+    arena.reset();
+  }
+
+  // Resetting an empty arena is fine too.
+  arena.reset();
+}
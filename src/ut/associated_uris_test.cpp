@@ -0,0 +1,166 @@
+/**
+ * @file associated_uris_test.cpp UT for AssociatedURIs.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "gtest/gtest.h"
+#include "associated_uris.h"
+
+/// Builds associated URIs from a list of URIs and their barring states.
+static AssociatedURIs make_uris(
+                       const std::vector<std::pair<std::string, bool>>& uris)
+{
+  AssociatedURIs associated_uris;
+
+  for (const std::pair<std::string, bool>& uri : uris)
+  {
+    associated_uris.add_uri(uri.first, uri.second);
+  }
+
+  return associated_uris;
+}
+
+/// Gets the default IMPU, or "" if there isn't one.
+static std::string default_impu(const AssociatedURIs& associated_uris,
+                                bool emergency = false)
+{
+  std::string uri;
+  return associated_uris.get_default_impu(uri, emergency) ? uri : "";
+}
+
+// The URIs are compared regardless of order, but their barring states must
+// match.
+TEST(AssociatedURIsTest, EqualityIgnoresOrder)
+{
+  AssociatedURIs uris = make_uris({{"sip:1", false},
+                                   {"sip:2", true},
+                                   {"sip:3", false}});
+
+  EXPECT_TRUE(uris == make_uris({{"sip:3", false},
+                                 {"sip:1", false},
+                                 {"sip:2", true}}));
+  EXPECT_TRUE(uris != make_uris({{"sip:3", false},
+                                 {"sip:1", true},
+                                 {"sip:2", true}}));
+  EXPECT_TRUE(uris != make_uris({{"sip:3", false},
+                                 {"sip:1", false},
+                                 {"sip:4", true}}));
+  EXPECT_TRUE(uris != make_uris({{"sip:1", false},
+                                 {"sip:2", true}}));
+
+  // Changing the barring state afterwards gives the same result as adding
+  // the URI with that state.
+  AssociatedURIs rebarred = make_uris({{"sip:2", false},
+                                       {"sip:3", false},
+                                       {"sip:1", true}});
+  EXPECT_TRUE(uris != rebarred);
+  rebarred.add_barring_status("sip:2", true);
+  rebarred.add_barring_status("sip:1", false);
+  EXPECT_TRUE(uris == rebarred);
+}
+
+// The default IMPU is the first unbarred URI, and follows changes to the
+// barring states.
+TEST(AssociatedURIsTest, DefaultIMPU)
+{
+  AssociatedURIs uris = make_uris({{"sip:1", true},
+                                   {"sip:2", false},
+                                   {"sip:3", false}});
+  EXPECT_EQ("sip:2", default_impu(uris));
+
+  uris.add_barring_status("sip:2", true);
+  EXPECT_EQ("sip:3", default_impu(uris));
+  EXPECT_EQ(std::vector<std::string>({"sip:3"}), uris.get_unbarred_uris());
+  EXPECT_EQ(std::vector<std::string>({"sip:1", "sip:2"}),
+            uris.get_barred_uris());
+
+  uris.add_barring_status("sip:1", false);
+  EXPECT_EQ("sip:1", default_impu(uris));
+  EXPECT_EQ(std::vector<std::string>({"sip:1", "sip:3"}),
+            uris.get_unbarred_uris());
+
+  // Barring a URI that isn't the default IMPU doesn't change it.
+  uris.add_barring_status("sip:3", true);
+  EXPECT_EQ("sip:1", default_impu(uris));
+
+  // With every URI barred there's only a default IMPU for emergencies.
+  uris.add_barring_status("sip:1", true);
+  EXPECT_EQ("", default_impu(uris));
+  EXPECT_EQ("sip:1", default_impu(uris, true));
+  EXPECT_TRUE(uris.get_unbarred_uris().empty());
+}
+
+// A URI added after all the others were barred becomes the default IMPU.
+TEST(AssociatedURIsTest, AddAfterAllBarred)
+{
+  AssociatedURIs uris = make_uris({{"sip:1", true},
+                                   {"sip:2", true}});
+  EXPECT_EQ("", default_impu(uris));
+
+  uris.add_uri("sip:3", false);
+  EXPECT_EQ("sip:3", default_impu(uris));
+
+  uris.add_uri("sip:4", false);
+  EXPECT_EQ("sip:3", default_impu(uris));
+}
+
+// Barring a URI that's in the list more than once bars every copy of it.
+TEST(AssociatedURIsTest, DuplicateURIs)
+{
+  AssociatedURIs uris = make_uris({{"sip:1", false},
+                                   {"sip:2", false},
+                                   {"sip:1", false}});
+  EXPECT_TRUE(uris.contains_uri("sip:1"));
+  EXPECT_EQ("sip:1", default_impu(uris));
+
+  uris.add_barring_status("sip:1", true);
+  EXPECT_EQ("sip:2", default_impu(uris));
+  EXPECT_EQ(std::vector<std::string>({"sip:1", "sip:1"}),
+            uris.get_barred_uris());
+  EXPECT_EQ(std::vector<std::string>({"sip:2"}), uris.get_unbarred_uris());
+
+  EXPECT_TRUE(uris == make_uris({{"sip:1", true},
+                                 {"sip:1", true},
+                                 {"sip:2", false}}));
+  EXPECT_TRUE(uris != make_uris({{"sip:1", true},
+                                 {"sip:2", false},
+                                 {"sip:2", false}}));
+}
+
+// A copy has its own index and barring states.
+TEST(AssociatedURIsTest, CopyIsIndependent)
+{
+  AssociatedURIs uris = make_uris({{"sip:1", false},
+                                   {"sip:2", false}});
+  AssociatedURIs copy = uris;
+
+  copy.add_barring_status("sip:1", true);
+  copy.add_uri("sip:3", false);
+  EXPECT_EQ("sip:2", default_impu(copy));
+  EXPECT_TRUE(copy.contains_uri("sip:3"));
+
+  EXPECT_EQ("sip:1", default_impu(uris));
+  EXPECT_FALSE(uris.is_impu_barred("sip:1"));
+  EXPECT_FALSE(uris.contains_uri("sip:3"));
+}
+
+// Clearing the URIs resets the default IMPU and the index.
+TEST(AssociatedURIsTest, Clear)
+{
+  AssociatedURIs uris = make_uris({{"sip:1", true},
+                                   {"sip:2", false}});
+  uris.clear_uris();
+
+  EXPECT_EQ("", default_impu(uris, true));
+  EXPECT_FALSE(uris.contains_uri("sip:2"));
+  EXPECT_TRUE(uris == AssociatedURIs());
+
+  uris.add_uri("sip:3", false);
+  EXPECT_EQ("sip:3", default_impu(uris));
+}
@@ -0,0 +1,173 @@
+/**
+ * @file astaire_aor_store_test.cpp UT for the asynchronous requests of
+ * AstaireAoRStore.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "localstore.h"
+#include "astaire_aor_store.h"
+
+/// LocalStore that takes a while to answer each get.
+class SlowStore : public LocalStore
+{
+public:
+  SlowStore() : LocalStore(), _get_delay_ms(0) {}
+
+  virtual Store::Status get_data(const std::string& table,
+                                 const std::string& key,
+                                 std::string& data,
+                                 uint64_t& cas,
+                                 SAS::TrailId trail = 0,
+                                 Store::Format data_format = Store::Format::JSON) override
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(_get_delay_ms));
+    return LocalStore::get_data(table, key, data, cas, trail, data_format);
+  }
+
+  std::atomic<int> _get_delay_ms;
+};
+
+/// Fixture for AstaireAoRStore tests. The store has two threads for
+/// asynchronous requests, and holds ten subscribers.
+class AstaireAoRStoreTest : public ::testing::Test
+{
+public:
+  AstaireAoRStoreTest() :
+    _aor_store(&_store, AstaireAoRStore::SerializationFormat::BINARY, 2)
+  {
+    for (int ii = 0; ii < 10; ii++)
+    {
+      std::string aor_id = "sip:" + std::to_string(ii) + "@example.com";
+      AoR aor(aor_id);
+      Binding* binding = aor.get_binding("binding1");
+      binding->_uri = aor_id;
+      binding->_expires = time(NULL) + 300;
+      EXPECT_EQ(Store::Status::OK,
+                _aor_store.set_aor_data(aor_id, &aor, 310, 0));
+      _aor_ids.push_back(aor_id);
+    }
+  }
+
+  /// Checks the results of a multi-get of all the subscribers.
+  void check_aors(std::vector<AoR*>& aors)
+  {
+    ASSERT_EQ(_aor_ids.size(), aors.size());
+
+    for (size_t ii = 0; ii < aors.size(); ii++)
+    {
+      ASSERT_TRUE(aors[ii] != NULL);
+      EXPECT_EQ(_aor_ids[ii], aors[ii]->get_binding("binding1")->_uri);
+      delete aors[ii]; aors[ii] = NULL;
+    }
+  }
+
+  SlowStore _store;
+  AstaireAoRStore _aor_store;
+  std::vector<std::string> _aor_ids;
+};
+
+// A multi-get can be made from the callback of an asynchronous request, even
+// when every thread is running such a callback.
+TEST_F(AstaireAoRStoreTest, MultiGetFromCallback)
+{
+  std::promise<void> done[2];
+  std::atomic<int> started(0);
+
+  for (int ii = 0; ii < 2; ii++)
+  {
+    std::promise<void>* callback_done = &done[ii];
+    _aor_store.get_aor_data_async(_aor_ids[0],
+                                  0,
+                                  [this, callback_done, &started](AoR* aor)
+    {
+      delete aor; aor = NULL;
+
+      // Wait until both threads are running a callback.
+      started++;
+
+      while (started < 2)
+      {
+        std::this_thread::yield();
+      }
+
+      std::vector<AoR*> aors;
+      _aor_store.get_aor_data_multi(_aor_ids, aors, 0);
+      check_aors(aors);
+      callback_done->set_value();
+    });
+  }
+
+  for (int ii = 0; ii < 2; ii++)
+  {
+    ASSERT_EQ(std::future_status::ready,
+              done[ii].get_future().wait_for(std::chrono::seconds(5)));
+  }
+}
+
+// A large multi-get only has as many gets in flight as there are threads, so
+// a request made while it's running doesn't wait for the whole multi-get.
+TEST_F(AstaireAoRStoreTest, MultiGetSharesThreads)
+{
+  _store._get_delay_ms = 20;
+
+  std::thread multi_get([this]()
+  {
+    std::vector<AoR*> aors;
+    _aor_store.get_aor_data_multi(_aor_ids, aors, 0);
+    check_aors(aors);
+  });
+
+  // Let the multi-get start, then time a single get.
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  std::promise<void> done;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  _aor_store.get_aor_data_async(_aor_ids[0], 0, [&done](AoR* aor)
+  {
+    delete aor; aor = NULL;
+    done.set_value();
+  });
+
+  done.get_future().wait();
+  EXPECT_LT(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(80));
+
+  multi_get.join();
+}
+
+// Destroying the store waits for the asynchronous requests that have been
+// made.
+TEST_F(AstaireAoRStoreTest, AsyncRequestsFinish)
+{
+  std::atomic<int> ok(0);
+
+  {
+    AstaireAoRStore aor_store(&_store, AstaireAoRStore::SerializationFormat::JSON, 2);
+
+    for (const std::string& aor_id : _aor_ids)
+    {
+      aor_store.get_aor_data_async(aor_id, 0, [&ok](AoR* aor)
+      {
+        if ((aor != NULL) && (!aor->bindings().empty()))
+        {
+          ok++;
+        }
+
+        delete aor; aor = NULL;
+      });
+    }
+  }
+
+  EXPECT_EQ(10, ok);
+}
@@ -0,0 +1,235 @@
+/**
+ * @file binary_serialization_test.cpp UT for the binary AoR format.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <climits>
+
+#include "gtest/gtest.h"
+#include "binary_serialization.h"
+#include "aor.h"
+#include "astaire_aor_store.h"
+
+// Values written by a BinaryWriter are read back unchanged.
+TEST(BinarySerializationTest, RoundTrip)
+{
+  std::string buffer;
+  BinaryWriter writer(buffer);
+  writer.write_byte(0xAB);
+  writer.write_bool(true);
+  writer.write_bool(false);
+  writer.write_uint(0);
+  writer.write_uint(127);
+  writer.write_uint(128);
+  writer.write_uint(UINT64_MAX);
+  writer.write_int(0);
+  writer.write_int(-1);
+  writer.write_int(INT_MIN);
+  writer.write_int(INT_MAX);
+  writer.write_string("");
+  writer.write_string(std::string("a\0b", 3));
+
+  BinaryReader reader(buffer.data(), buffer.size());
+  EXPECT_EQ(0xAB, reader.read_byte());
+  EXPECT_TRUE(reader.read_bool());
+  EXPECT_FALSE(reader.read_bool());
+  EXPECT_EQ(0u, reader.read_uint());
+  EXPECT_EQ(127u, reader.read_uint());
+  EXPECT_EQ(128u, reader.read_uint());
+  EXPECT_EQ(UINT64_MAX, reader.read_uint());
+  EXPECT_EQ(0, reader.read_int());
+  EXPECT_EQ(-1, reader.read_int());
+  EXPECT_EQ(INT_MIN, reader.read_int());
+  EXPECT_EQ(INT_MAX, reader.read_int());
+
+  std::string value = "not empty";
+  reader.read_string(value);
+  EXPECT_EQ("", value);
+  reader.read_string(value);
+  EXPECT_EQ(std::string("a\0b", 3), value);
+  EXPECT_TRUE(reader.at_end());
+}
+
+// Small values take a single byte.
+TEST(BinarySerializationTest, VarintSize)
+{
+  std::string buffer;
+  BinaryWriter writer(buffer);
+  writer.write_uint(127);
+  EXPECT_EQ(1u, buffer.size());
+  writer.write_int(-64);
+  EXPECT_EQ(2u, buffer.size());
+  writer.write_uint(128);
+  EXPECT_EQ(4u, buffer.size());
+}
+
+// Sections can be read, skipped over or copied out raw.
+TEST(BinarySerializationTest, Sections)
+{
+  std::string buffer;
+  BinaryWriter writer(buffer);
+  size_t start = writer.start_section();
+  writer.write_string("inside");
+  writer.write_int(42);
+  writer.end_section(start);
+  writer.write_string("after");
+
+  BinaryReader reader(buffer.data(), buffer.size());
+  BinaryReader section = reader.read_section();
+  std::string value;
+  section.read_string(value);
+  EXPECT_EQ("inside", value);
+  EXPECT_EQ(42, section.read_int());
+  EXPECT_TRUE(section.at_end());
+  reader.read_string(value);
+  EXPECT_EQ("after", value);
+  EXPECT_TRUE(reader.at_end());
+
+  // A raw copy of the section can be written back unchanged.
+  BinaryReader raw_reader(buffer.data(), buffer.size());
+  std::string raw;
+  raw_reader.read_raw_section(raw);
+  std::string copy;
+  BinaryWriter copy_writer(copy);
+  copy_writer.write_raw(raw);
+  EXPECT_EQ(buffer.substr(0, raw.size()), copy);
+
+  BinaryReader skip_reader(buffer.data(), buffer.size());
+  skip_reader.read_section();
+  skip_reader.skip_string();
+  EXPECT_TRUE(skip_reader.at_end());
+}
+
+// Truncated or malformed data throws BinaryFormatError rather than reading
+// off the end of the buffer.
+TEST(BinarySerializationTest, MalformedData)
+{
+  std::string buffer;
+  BinaryWriter writer(buffer);
+  writer.write_string("a string");
+
+  for (size_t length = 0; length < buffer.size(); length++)
+  {
+    BinaryReader reader(buffer.data(), length);
+    std::string value;
+    EXPECT_THROW(reader.read_string(value), BinaryFormatError);
+  }
+
+  // A bool that isn't 0 or 1.
+  std::string bad_bool(1, '\x02');
+  BinaryReader bool_reader(bad_bool.data(), bad_bool.size());
+  EXPECT_THROW(bool_reader.read_bool(), BinaryFormatError);
+
+  // A varint that never ends.
+  std::string long_varint(11, '\xFF');
+  BinaryReader varint_reader(long_varint.data(), long_varint.size());
+  EXPECT_THROW(varint_reader.read_uint(), BinaryFormatError);
+
+  // An int that doesn't fit in 32 bits.
+  std::string big_int;
+  BinaryWriter big_writer(big_int);
+  big_writer.write_uint((uint64_t)1 << 40);
+  BinaryReader int_reader(big_int.data(), big_int.size());
+  EXPECT_THROW(int_reader.read_int(), BinaryFormatError);
+
+  // A section that claims to be longer than the buffer.
+  std::string bad_section("\x10\x00\x00\x00", 4);
+  BinaryReader section_reader(bad_section.data(), bad_section.size());
+  EXPECT_THROW(section_reader.read_section(), BinaryFormatError);
+}
+
+// An AoR written in the binary format is read back unchanged, and corrupt
+// records are rejected.
+TEST(BinarySerializationTest, AoRRoundTrip)
+{
+  AoR aor("sip:6505550231@homedomain");
+  Binding* b = aor.get_binding("binding1");
+  b->_uri = "sip:6505550231@192.91.191.29:59934;transport=tcp";
+  b->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+  b->_cseq = 17038;
+  b->_expires = 300;
+  b->_params["+sip.instance"] = "<urn:uuid:00000000-0000-0000-0000-b4dd32817622>";
+  b->_path_headers.push_back("<sip:abcdefgh@bono1.homedomain;lr>");
+  b->_private_id = "6505550231";
+  b->_emergency_registration = true;
+  Subscription* s = aor.get_subscription("to_tag");
+  s->_req_uri = "sip:6505550231@192.91.191.29:59934";
+  s->_to_tag = "to_tag";
+  s->_route_uris.push_back("sip:abcdefgh@bono1.homedomain;lr");
+  s->_expires = 200;
+  aor.associated_uris().add_uri("sip:6505550231@homedomain", false);
+  aor.associated_uris().add_uri("sip:6505550232@homedomain", true);
+  aor.associated_uris().add_wildcard_mapping("sip:!.*!@homedomain",
+                                             "sip:6505550233@homedomain");
+  aor._notify_cseq = 7;
+  aor._timer_id = "timer1";
+  aor._scscf_uri = "sip:scscf.homedomain";
+
+  AstaireAoRStore::BinarySerializerDeserializer serializer;
+  std::string data;
+  serializer.serialize_aor(&aor, data);
+  EXPECT_EQ(BINARY_FORMAT_V1, (uint8_t)data[0]);
+
+  AoR* read_aor = serializer.deserialize_aor("sip:6505550231@homedomain", data);
+  ASSERT_TRUE(read_aor != NULL);
+  EXPECT_EQ(aor, *read_aor);
+  EXPECT_TRUE(read_aor->associated_uris().is_impu_barred("sip:6505550232@homedomain"));
+  EXPECT_EQ(aor.associated_uris().get_wildcard_mapping(),
+            read_aor->associated_uris().get_wildcard_mapping());
+  delete read_aor; read_aor = NULL;
+
+  // Every truncation of the record is spotted.
+  for (size_t length = 1; length < data.size(); length++)
+  {
+    AoR* bad_aor = serializer.deserialize_aor("sip:6505550231@homedomain",
+                                              data.substr(0, length));
+    EXPECT_TRUE(bad_aor == NULL) << "Truncated to " << length;
+    delete bad_aor; bad_aor = NULL;
+  }
+
+  // JSON records aren't mistaken for binary ones.
+  EXPECT_TRUE(serializer.deserialize_aor("sip:6505550231@homedomain", "{}") == NULL);
+}
+
+// The JSON and binary formats give back the same AoR, including the
+// wildcard mapping (which AoR comparison ignores).
+TEST(BinarySerializationTest, SameAoRAsJson)
+{
+  AoR aor("sip:6505550231@homedomain");
+  Binding* b = aor.get_binding("binding1");
+  b->_uri = "sip:6505550231@192.91.191.29:59934;transport=tcp";
+  b->_expires = 300;
+  aor.associated_uris().add_uri("sip:6505550231@homedomain", false);
+  aor.associated_uris().add_uri("sip:!.*!@homedomain", true);
+  aor.associated_uris().add_wildcard_mapping("sip:!.*!@homedomain",
+                                             "sip:6505550233@homedomain");
+
+  AstaireAoRStore::JsonSerializerDeserializer json_serializer;
+  std::string json_data;
+  json_serializer.serialize_aor(&aor, json_data);
+  AoR* json_aor = json_serializer.deserialize_aor("sip:6505550231@homedomain",
+                                                  json_data);
+  ASSERT_TRUE(json_aor != NULL);
+
+  AstaireAoRStore::BinarySerializerDeserializer binary_serializer;
+  std::string binary_data;
+  binary_serializer.serialize_aor(&aor, binary_data);
+  AoR* binary_aor = binary_serializer.deserialize_aor("sip:6505550231@homedomain",
+                                                      binary_data);
+  ASSERT_TRUE(binary_aor != NULL);
+
+  EXPECT_EQ(*json_aor, *binary_aor);
+  EXPECT_EQ(aor.associated_uris().get_wildcard_mapping(),
+            json_aor->associated_uris().get_wildcard_mapping());
+  EXPECT_EQ(aor.associated_uris().get_wildcard_mapping(),
+            binary_aor->associated_uris().get_wildcard_mapping());
+
+  delete json_aor; json_aor = NULL;
+  delete binary_aor; binary_aor = NULL;
+}
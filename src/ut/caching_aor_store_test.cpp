@@ -0,0 +1,240 @@
+/**
+ * @file caching_aor_store_test.cpp UT for CachingAoRStore.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <chrono>
+#include <functional>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "caching_aor_store.h"
+#include "memory_aor_store.h"
+
+/// MemoryAoRStore that can run a function between reading an AoR and
+/// returning it, to act as a write that overlaps the read. It can also be
+/// made to leave the AoR's CAS alone on a write, as AstaireAoRStore does.
+class HookedAoRStore : public MemoryAoRStore
+{
+public:
+  HookedAoRStore() : MemoryAoRStore(), _keep_cas(false) {}
+
+  virtual AoR* get_aor_data(const std::string& aor_id,
+                            SAS::TrailId trail) override
+  {
+    AoR* aor = MemoryAoRStore::get_aor_data(aor_id, trail);
+
+    if (_after_get)
+    {
+      std::function<void()> after_get = _after_get;
+      _after_get = nullptr;
+      after_get();
+    }
+
+    return aor;
+  }
+
+  virtual Store::Status set_aor_data(const std::string& aor_id,
+                                     AoR* aor,
+                                     int expiry,
+                                     SAS::TrailId trail) override
+  {
+    uint64_t old_cas = aor->_cas;
+    Store::Status rc = MemoryAoRStore::set_aor_data(aor_id, aor, expiry, trail);
+
+    if (_keep_cas)
+    {
+      aor->_cas = old_cas;
+    }
+
+    return rc;
+  }
+
+  std::function<void()> _after_get;
+  bool _keep_cas;
+};
+
+/// Fixture for CachingAoRStore tests. The cache has a single shard, so that
+/// its capacity is exact.
+class CachingAoRStoreTest : public ::testing::Test
+{
+public:
+  CachingAoRStoreTest() : _cache(&_store, 2, 60000, 1) {}
+
+  virtual ~CachingAoRStoreTest() {}
+
+  /// Stores an AoR with the given bindings straight into the backing store.
+  void store_aor(const std::string& aor_id,
+                 const std::vector<std::string>& binding_ids)
+  {
+    AoR* aor = _store.MemoryAoRStore::get_aor_data(aor_id, 0);
+    add_bindings(aor, binding_ids);
+    EXPECT_EQ(Store::Status::OK,
+              _store.MemoryAoRStore::set_aor_data(aor_id, aor, 300, 0));
+    delete aor; aor = NULL;
+  }
+
+  static void add_bindings(AoR* aor, const std::vector<std::string>& binding_ids)
+  {
+    for (const std::string& binding_id : binding_ids)
+    {
+      Binding* binding = aor->get_binding(binding_id);
+      binding->_uri = "sip:" + binding_id + "@192.91.191.29:59934";
+      binding->_expires = time(NULL) + 300;
+    }
+  }
+
+  /// Reads an AoR through the cache, and returns the number of bindings.
+  size_t cached_bindings(const std::string& aor_id)
+  {
+    AoR* aor = _cache.get_aor_data(aor_id, 0);
+    size_t num_bindings = aor->bindings().size();
+    delete aor; aor = NULL;
+    return num_bindings;
+  }
+
+  HookedAoRStore _store;
+  CachingAoRStore _cache;
+};
+
+// The second read of an AoR is served from the cache.
+TEST_F(CachingAoRStoreTest, HitAndMiss)
+{
+  store_aor("sub1", {"b1"});
+
+  EXPECT_EQ(1u, cached_bindings("sub1"));
+  EXPECT_EQ(1u, cached_bindings("sub1"));
+  EXPECT_EQ(1u, _cache.hits());
+  EXPECT_EQ(1u, _cache.misses());
+}
+
+// Reads of an AoR that isn't stored always go to the backing store.
+TEST_F(CachingAoRStoreTest, EmptyAoRNotCached)
+{
+  EXPECT_EQ(0u, cached_bindings("sub1"));
+  EXPECT_EQ(0u, cached_bindings("sub1"));
+  EXPECT_EQ(0u, _cache.hits());
+  EXPECT_EQ(2u, _cache.misses());
+}
+
+// Once an entry's TTL has passed, the AoR is read from the backing store
+// again.
+TEST_F(CachingAoRStoreTest, TTLExpiry)
+{
+  CachingAoRStore cache(&_store, 2, 10, 1);
+  store_aor("sub1", {"b1"});
+
+  delete cache.get_aor_data("sub1", 0);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  delete cache.get_aor_data("sub1", 0);
+
+  EXPECT_EQ(0u, cache.hits());
+  EXPECT_EQ(2u, cache.misses());
+}
+
+// When the cache is full, the least recently used AoR is evicted.
+TEST_F(CachingAoRStoreTest, LRUEviction)
+{
+  store_aor("sub1", {"b1"});
+  store_aor("sub2", {"b1"});
+  store_aor("sub3", {"b1"});
+
+  cached_bindings("sub1");
+  cached_bindings("sub2");
+  cached_bindings("sub1");
+  cached_bindings("sub3");
+  EXPECT_EQ(1u, _cache.hits());
+  EXPECT_EQ(3u, _cache.misses());
+
+  // sub2 was the least recently used, so was evicted for sub3.
+  cached_bindings("sub1");
+  cached_bindings("sub3");
+  EXPECT_EQ(3u, _cache.hits());
+  cached_bindings("sub2");
+  EXPECT_EQ(4u, _cache.misses());
+}
+
+// A write based on a cached copy that is out of date fails, and the copy is
+// dropped so that the next read sees the backing store's AoR.
+TEST_F(CachingAoRStoreTest, InvalidateOnContention)
+{
+  store_aor("sub1", {"b1"});
+  AoR* aor = _cache.get_aor_data("sub1", 0);
+
+  // Write the AoR without going through the cache.
+  store_aor("sub1", {"b2"});
+
+  add_bindings(aor, {"b3"});
+  EXPECT_EQ(Store::Status::DATA_CONTENTION,
+            _cache.set_aor_data("sub1", aor, 300, 0));
+  delete aor; aor = NULL;
+  EXPECT_EQ(1u, _cache.invalidations());
+
+  EXPECT_EQ(2u, cached_bindings("sub1"));
+  EXPECT_EQ(0u, _cache.hits());
+  EXPECT_EQ(2u, _cache.misses());
+}
+
+// A successful write is cached when the backing store gives the new CAS.
+TEST_F(CachingAoRStoreTest, CacheWriteWithNewCAS)
+{
+  AoR* aor = _cache.get_aor_data("sub1", 0);
+  add_bindings(aor, {"b1"});
+  EXPECT_EQ(Store::Status::OK, _cache.set_aor_data("sub1", aor, 300, 0));
+  delete aor; aor = NULL;
+
+  aor = _cache.get_aor_data("sub1", 0);
+  EXPECT_EQ(1u, _cache.hits());
+  EXPECT_EQ(1u, aor->bindings().size());
+
+  // The cached CAS is the new one, so a write based on it succeeds.
+  add_bindings(aor, {"b2"});
+  EXPECT_EQ(Store::Status::OK, _cache.set_aor_data("sub1", aor, 300, 0));
+  delete aor; aor = NULL;
+}
+
+// A successful write isn't cached when the backing store doesn't give the new
+// CAS, and drops any cached copy.
+TEST_F(CachingAoRStoreTest, DontCacheWriteWithOldCAS)
+{
+  _store._keep_cas = true;
+  store_aor("sub1", {"b1"});
+
+  AoR* aor = _cache.get_aor_data("sub1", 0);
+  add_bindings(aor, {"b2"});
+  EXPECT_EQ(Store::Status::OK, _cache.set_aor_data("sub1", aor, 300, 0));
+  delete aor; aor = NULL;
+  EXPECT_EQ(1u, _cache.invalidations());
+
+  EXPECT_EQ(2u, cached_bindings("sub1"));
+  EXPECT_EQ(0u, _cache.hits());
+  EXPECT_EQ(2u, _cache.misses());
+}
+
+// A read that overlaps a write through the cache isn't cached, as it may have
+// read the AoR from before the write.
+TEST_F(CachingAoRStoreTest, DontCacheReadOverlappingWrite)
+{
+  store_aor("sub1", {"b1"});
+
+  _store._after_get = [this]()
+  {
+    AoR* aor = _store.MemoryAoRStore::get_aor_data("sub1", 0);
+    add_bindings(aor, {"b2"});
+    EXPECT_EQ(Store::Status::OK, _cache.set_aor_data("sub1", aor, 300, 0));
+    delete aor; aor = NULL;
+  };
+
+  // This read returns the AoR from before the write.
+  EXPECT_EQ(1u, cached_bindings("sub1"));
+
+  // The cache has the written AoR, not the one that was read.
+  EXPECT_EQ(2u, cached_bindings("sub1"));
+  EXPECT_EQ(1u, _cache.hits());
+}
@@ -0,0 +1,109 @@
+/**
+ * @file interned_string_test.cpp UT for the InternedString class.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "interned_string.h"
+
+// Equal values share storage, and different values don't.
+TEST(InternedStringTest, Pooling)
+{
+  std::string value = "sip:6505550231@homedomain";
+  InternedString first(value);
+  InternedString second(value.c_str());
+  InternedString other("sip:6505550232@homedomain");
+
+  EXPECT_EQ(first.c_str(), second.c_str());
+  EXPECT_NE(first.c_str(), other.c_str());
+  EXPECT_TRUE(first == second);
+  EXPECT_FALSE(first != second);
+  EXPECT_TRUE(first != other);
+  EXPECT_EQ(value, first.str());
+  EXPECT_EQ(value.size(), first.size());
+
+  // A value is interned again after every holder of it has gone.
+  first = other;
+  second = other;
+  InternedString again(value);
+  EXPECT_EQ(value, again.str());
+}
+
+// The empty string isn't pooled, but behaves like any other value.
+TEST(InternedStringTest, Empty)
+{
+  InternedString empty;
+  InternedString also_empty("");
+  EXPECT_TRUE(empty.empty());
+  EXPECT_EQ(0u, empty.size());
+  EXPECT_TRUE(empty == also_empty);
+  EXPECT_TRUE(empty == "");
+  EXPECT_EQ(std::string(), empty.str());
+}
+
+// InternedStrings can be compared with and appended to std::strings and C
+// strings on either side.
+TEST(InternedStringTest, Operators)
+{
+  InternedString value("abc");
+  std::string str = "abc";
+  std::string other = "xyz";
+
+  EXPECT_TRUE(value == str);
+  EXPECT_TRUE(str == value);
+  EXPECT_TRUE(value == "abc");
+  EXPECT_TRUE("abc" == value);
+  EXPECT_TRUE(value != other);
+  EXPECT_TRUE(other != value);
+  EXPECT_TRUE(value != "xyz");
+  EXPECT_TRUE("xyz" != value);
+  EXPECT_FALSE(str != value);
+  EXPECT_FALSE("abc" != value);
+
+  EXPECT_EQ("abcxyz", value + other);
+  EXPECT_EQ("xyzabc", other + value);
+  EXPECT_EQ("abc!", value + "!");
+  EXPECT_EQ("!abc", "!" + value);
+  EXPECT_EQ("abcabc", value + value);
+
+  const std::string& ref = value;
+  EXPECT_EQ(str, ref);
+
+  std::ostringstream oss;
+  oss << value;
+  EXPECT_EQ("abc", oss.str());
+}
+
+// Threads can intern and drop the same values at once.
+TEST(InternedStringTest, Concurrency)
+{
+  std::vector<std::thread> threads;
+
+  for (int ii = 0; ii < 8; ii++)
+  {
+    threads.push_back(std::thread([]()
+    {
+      for (int jj = 0; jj < 2000; jj++)
+      {
+        InternedString value("value" + std::to_string(jj % 10));
+        InternedString copy(value);
+        EXPECT_EQ("value" + std::to_string(jj % 10), copy.str());
+      }
+    }));
+  }
+
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+}
@@ -0,0 +1,125 @@
+/**
+ * @file json_serialization_test.cpp UT for the JSON AoR format.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "gtest/gtest.h"
+#include "rapidjson/stringbuffer.h"
+#include "aor.h"
+#include "astaire_aor_store.h"
+#include "json_string_stream.h"
+
+static const std::string AOR_ID = "sip:6505550231@homedomain";
+
+/// Fixture for JSON serialization tests.
+class JsonSerializationTest : public ::testing::Test
+{
+public:
+  static void fill_aor(AoR& aor)
+  {
+    Binding* b = aor.get_binding("binding1");
+    b->_uri = "sip:6505550231@192.91.191.29:59934;transport=tcp";
+    b->_cid = "gfYHoZGaFaRNxhlV0WIwoS-f91NoJ2gq";
+    b->_cseq = 17038;
+    b->_expires = 300;
+    b->_params["+sip.instance"] = "\"<urn:uuid:00000000-0000-0000-0000-b4dd32817622>\"";
+    b->_path_headers.push_back("<sip:abcdefgh@bono1.homedomain;lr>");
+    b->_private_id = "6505550231";
+    Subscription* s = aor.get_subscription("to_tag");
+    s->_req_uri = "sip:6505550231@192.91.191.29:59934";
+    s->_to_tag = "to_tag";
+    s->_route_uris.push_back("sip:abcdefgh@bono1.homedomain;lr");
+    s->_expires = 200;
+    aor.associated_uris().add_uri(AOR_ID, false);
+    aor.associated_uris().add_uri("sip:6505550232@homedomain", true);
+    aor._notify_cseq = 7;
+    aor._timer_id = "timer1";
+    aor._scscf_uri = "sip:scscf.homedomain";
+  }
+};
+
+// An AoR written as JSON is read back unchanged.
+TEST_F(JsonSerializationTest, RoundTrip)
+{
+  AoR aor(AOR_ID);
+  fill_aor(aor);
+
+  AstaireAoRStore::JsonSerializerDeserializer serializer;
+  std::string data;
+  serializer.serialize_aor(&aor, data);
+  EXPECT_EQ('{', data[0]);
+
+  AoR* read_aor = serializer.deserialize_aor(AOR_ID, data);
+  ASSERT_TRUE(read_aor != NULL);
+  EXPECT_EQ(aor, *read_aor);
+  delete read_aor; read_aor = NULL;
+}
+
+// The document replaces anything already in the caller's buffer, and a
+// smaller AoR written into a buffer used for a larger one isn't left with
+// any of the larger AoR's document.
+TEST_F(JsonSerializationTest, ReplacesBufferContents)
+{
+  AoR big_aor(AOR_ID);
+  fill_aor(big_aor);
+  AoR small_aor(AOR_ID);
+
+  AstaireAoRStore::JsonSerializerDeserializer serializer;
+  std::string data = "existing contents";
+  serializer.serialize_aor(&big_aor, data);
+  EXPECT_EQ('{', data[0]);
+
+  std::string small_data;
+  serializer.serialize_aor(&small_aor, small_data);
+  serializer.serialize_aor(&small_aor, data);
+  EXPECT_EQ(small_data, data);
+}
+
+// Writing through a JsonStringStream gives the same document as writing to a
+// rapidjson::StringBuffer.
+TEST_F(JsonSerializationTest, StringStreamMatchesStringBuffer)
+{
+  AoR aor(AOR_ID);
+  fill_aor(aor);
+  const Binding* b = aor.bindings().begin()->second;
+
+  rapidjson::StringBuffer sb;
+  rapidjson::Writer<rapidjson::StringBuffer> sb_writer(sb);
+  b->to_json(sb_writer);
+
+  std::string data;
+  JsonStringStream stream(data);
+  JsonStringWriter writer(stream);
+  b->to_json(writer);
+
+  EXPECT_EQ(std::string(sb.GetString(), sb.GetSize()), data);
+}
+
+// Documents that are missing required members or have members of the wrong
+// type are rejected, but unknown members are skipped.
+TEST_F(JsonSerializationTest, InvalidDocuments)
+{
+  AstaireAoRStore::JsonSerializerDeserializer serializer;
+
+  AoR* aor = serializer.deserialize_aor(AOR_ID,
+    "{\"bindings\":{},\"subscriptions\":{},\"notify_cseq\":3,"
+    "\"unknown\":{\"nested\":[1,2,{\"a\":true}]}}");
+  ASSERT_TRUE(aor != NULL);
+  EXPECT_EQ(3, aor->_notify_cseq);
+  delete aor; aor = NULL;
+
+  EXPECT_TRUE(serializer.deserialize_aor(AOR_ID,
+    "{\"bindings\":{},\"subscriptions\":{}}") == NULL);
+  EXPECT_TRUE(serializer.deserialize_aor(AOR_ID,
+    "{\"bindings\":{},\"subscriptions\":{},\"notify_cseq\":\"3\"}") == NULL);
+  EXPECT_TRUE(serializer.deserialize_aor(AOR_ID,
+    "{\"bindings\":{\"b1\":{\"uri\":\"sip:a\"}},\"subscriptions\":{},"
+    "\"notify_cseq\":3}") == NULL);
+  EXPECT_TRUE(serializer.deserialize_aor(AOR_ID, "{\"bindings\":") == NULL);
+}
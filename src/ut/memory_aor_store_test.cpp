@@ -0,0 +1,163 @@
+/**
+ * @file memory_aor_store_test.cpp UT for MemoryAoRStore.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <chrono>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "memory_aor_store.h"
+
+/// Fixture for MemoryAoRStore tests. The store has a single stripe, so that
+/// when it's swept is predictable.
+class MemoryAoRStoreTest : public ::testing::Test
+{
+public:
+  MemoryAoRStoreTest() : _store(1) {}
+
+  virtual ~MemoryAoRStoreTest() {}
+
+  /// Builds an AoR with a single binding. The caller must delete the AoR.
+  static AoR* make_aor(const std::string& aor_id)
+  {
+    AoR* aor = new AoR(aor_id);
+    Binding* binding = aor->get_binding("binding1");
+    binding->_uri = "sip:binding1@192.91.191.29:59934";
+    binding->_expires = time(NULL) + 300;
+    return aor;
+  }
+
+  /// Writes a new AoR, and returns the result.
+  Store::Status write_new(const std::string& aor_id, int expiry)
+  {
+    AoR* aor = make_aor(aor_id);
+    Store::Status rc = _store.set_aor_data(aor_id, aor, expiry, 0);
+    delete aor; aor = NULL;
+    return rc;
+  }
+
+  /// Whether the store has an AoR.
+  bool stored(const std::string& aor_id)
+  {
+    AoR* aor = _store.get_aor_data(aor_id, 0);
+    bool stored = (aor->_cas != 0);
+    delete aor; aor = NULL;
+    return stored;
+  }
+
+  MemoryAoRStore _store;
+};
+
+// A successful write gives the AoR its new CAS, which a read then returns.
+TEST_F(MemoryAoRStoreTest, WriteUpdatesCAS)
+{
+  AoR* aor = make_aor("sub1");
+  EXPECT_EQ(Store::Status::OK, _store.set_aor_data("sub1", aor, 300, 0));
+  EXPECT_NE(0u, aor->_cas);
+
+  AoR* stored_aor = _store.get_aor_data("sub1", 0);
+  EXPECT_EQ(aor->_cas, stored_aor->_cas);
+  EXPECT_EQ(1u, stored_aor->bindings().size());
+
+  EXPECT_EQ(Store::Status::OK, _store.set_aor_data("sub1", stored_aor, 300, 0));
+  EXPECT_NE(aor->_cas, stored_aor->_cas);
+
+  delete stored_aor; stored_aor = NULL;
+  delete aor; aor = NULL;
+}
+
+// Reading an AoR that isn't stored gives an empty AoR with a CAS of 0.
+TEST_F(MemoryAoRStoreTest, ReadMissing)
+{
+  AoR* aor = _store.get_aor_data("sub1", 0);
+  EXPECT_EQ(0u, aor->_cas);
+  EXPECT_TRUE(aor->bindings().empty());
+  delete aor; aor = NULL;
+}
+
+// A write with a CAS of 0 fails if the AoR is already stored.
+TEST_F(MemoryAoRStoreTest, ZeroCASFailsIfStored)
+{
+  EXPECT_EQ(Store::Status::OK, write_new("sub1", 300));
+  EXPECT_EQ(Store::Status::DATA_CONTENTION, write_new("sub1", 300));
+}
+
+// A write with an out of date CAS fails.
+TEST_F(MemoryAoRStoreTest, StaleCASFails)
+{
+  EXPECT_EQ(Store::Status::OK, write_new("sub1", 300));
+  AoR* aor1 = _store.get_aor_data("sub1", 0);
+  AoR* aor2 = _store.get_aor_data("sub1", 0);
+
+  EXPECT_EQ(Store::Status::OK, _store.set_aor_data("sub1", aor1, 300, 0));
+  EXPECT_EQ(Store::Status::DATA_CONTENTION,
+            _store.set_aor_data("sub1", aor2, 300, 0));
+
+  // A non-zero CAS also fails if the AoR isn't stored.
+  EXPECT_EQ(Store::Status::DATA_CONTENTION,
+            _store.set_aor_data("sub2", aor2, 300, 0));
+
+  delete aor1; aor1 = NULL;
+  delete aor2; aor2 = NULL;
+}
+
+// A write with an expiry of 0, or one in the past, removes the AoR.
+TEST_F(MemoryAoRStoreTest, ExpiredWriteRemoves)
+{
+  EXPECT_EQ(Store::Status::OK, write_new("sub1", 300));
+  AoR* aor = _store.get_aor_data("sub1", 0);
+  EXPECT_EQ(Store::Status::OK, _store.set_aor_data("sub1", aor, 0, 0));
+  delete aor; aor = NULL;
+  EXPECT_FALSE(stored("sub1"));
+  EXPECT_EQ(0u, _store.size());
+
+  EXPECT_EQ(Store::Status::OK, write_new("sub2", 300));
+  aor = _store.get_aor_data("sub2", 0);
+  EXPECT_EQ(Store::Status::OK, _store.set_aor_data("sub2", aor, -10, 0));
+  delete aor; aor = NULL;
+  EXPECT_FALSE(stored("sub2"));
+  EXPECT_EQ(0u, _store.size());
+}
+
+// An expiry of more than 30 days is an absolute time, so one just over 30
+// days is long in the past, while one of exactly 30 days is relative.
+TEST_F(MemoryAoRStoreTest, AbsoluteExpiry)
+{
+  const int thirty_days = 60 * 60 * 24 * 30;
+
+  EXPECT_EQ(Store::Status::OK, write_new("sub1", thirty_days));
+  EXPECT_TRUE(stored("sub1"));
+
+  EXPECT_EQ(Store::Status::OK, write_new("sub2", thirty_days + 1));
+  EXPECT_FALSE(stored("sub2"));
+
+  EXPECT_EQ(Store::Status::OK, write_new("sub3", time(NULL) + 300));
+  EXPECT_TRUE(stored("sub3"));
+}
+
+// Once a stripe has grown enough, writing to it clears out the records that
+// have expired.
+TEST_F(MemoryAoRStoreTest, SweepDropsExpired)
+{
+  for (int ii = 0; ii < 10; ii++)
+  {
+    EXPECT_EQ(Store::Status::OK, write_new("old" + std::to_string(ii), 1));
+  }
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+  EXPECT_EQ(10u, _store.size());
+
+  for (int ii = 0; ii < 64; ii++)
+  {
+    EXPECT_EQ(Store::Status::OK, write_new("new" + std::to_string(ii), 300));
+  }
+
+  EXPECT_EQ(64u, _store.size());
+}
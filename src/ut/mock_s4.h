@@ -26,6 +26,12 @@ class MockS4 : public S4
                                     uint64_t& version,
                                     SAS::TrailId trail));
 
+  MOCK_METHOD5(handle_get_multi, void(const std::vector<std::string>& ids,
+                                      std::vector<AoR*>& aors,
+                                      std::vector<uint64_t>& versions,
+                                      std::vector<HTTPCode>& rcs,
+                                      SAS::TrailId trail));
+
   MOCK_METHOD3(handle_delete, HTTPCode(const std::string& id,
                                        uint64_t version,
                                        SAS::TrailId trail));
@@ -39,6 +45,9 @@ class MockS4 : public S4
                                       AoR** aor,
                                       SAS::TrailId trail));
 
+  MOCK_METHOD2(handle_batch, void(const std::vector<ReplicationRequest*>& requests,
+                                  std::vector<HTTPCode>& rcs));
+
   MOCK_METHOD2(handle_timer_pop, void(const std::string& aor_id,
                                       SAS::TrailId trail));
 
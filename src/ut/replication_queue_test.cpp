@@ -0,0 +1,229 @@
+/**
+ * @file replication_queue_test.cpp UT for ReplicationQueue.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "memory_aor_store.h"
+#include "replication_queue.h"
+#include "s4.h"
+
+/// MemoryAoRStore whose gets can be held up, so that updates wait on the
+/// replication queue while the worker is busy.
+class BlockingAoRStore : public MemoryAoRStore
+{
+public:
+  BlockingAoRStore() : MemoryAoRStore(), _gets(0), _blocked(false) {}
+
+  virtual AoR* get_aor_data(const std::string& aor_id,
+                            SAS::TrailId trail) override
+  {
+    _gets++;
+
+    {
+      std::unique_lock<std::mutex> lock(_lock);
+      _cond.wait(lock, [this]() { return !_blocked; });
+    }
+
+    return MemoryAoRStore::get_aor_data(aor_id, trail);
+  }
+
+  void set_blocked(bool blocked)
+  {
+    {
+      std::unique_lock<std::mutex> lock(_lock);
+      _blocked = blocked;
+    }
+
+    _cond.notify_all();
+  }
+
+  std::atomic<int> _gets;
+
+private:
+  std::mutex _lock;
+  std::condition_variable _cond;
+  bool _blocked;
+};
+
+/// Fixture for ReplicationQueue tests. The queue sends to a remote S4 with
+/// its own store, from a single worker. Updates queued between hold_worker
+/// and release_worker wait on the queue while the worker is busy, so they
+/// can be merged.
+class ReplicationQueueTest : public ::testing::Test
+{
+public:
+  ReplicationQueueTest() :
+    _remote("remote", &_store),
+    _queue(new ReplicationQueue(&_remote, 1, 100, 100, 0, 0)),
+    _coalesced(0)
+  {
+  }
+
+  virtual ~ReplicationQueueTest()
+  {
+    _store.set_blocked(false);
+    delete _queue; _queue = NULL;
+  }
+
+  /// Builds an AoR with a binding for each of the given IDs.
+  static AoR make_aor(const std::vector<std::string>& binding_ids)
+  {
+    AoR aor("sub1");
+
+    for (const std::string& binding_id : binding_ids)
+    {
+      Binding* binding = aor.get_binding(binding_id);
+      binding->_uri = "sip:" + binding_id + "@192.91.191.29:59934";
+      binding->_expires = time(NULL) + 300;
+    }
+
+    return aor;
+  }
+
+  /// Builds a patch that adds the given binding and removes others.
+  static PatchObject make_patch(const std::string& binding_id,
+                                std::vector<std::string> remove_ids = {})
+  {
+    AoR aor = make_aor({binding_id});
+    PatchObject po;
+    convert_aor_to_patch(std::move(aor), po);
+    po.set_remove_bindings(std::move(remove_ids));
+    return po;
+  }
+
+  /// Stores sub1 on the remote site.
+  void store_remote(const std::vector<std::string>& binding_ids)
+  {
+    AoR aor = make_aor(binding_ids);
+    EXPECT_EQ(Store::Status::OK,
+              _store.set_aor_data("sub1", &aor, 310, 0));
+  }
+
+  /// Occupies the worker with an update to another subscriber.
+  void hold_worker()
+  {
+    _store.set_blocked(true);
+    _queue->put("other", make_aor({"binding1"}), 0);
+
+    while (_store._gets == 0)
+    {
+      std::this_thread::yield();
+    }
+  }
+
+  /// Lets the worker go, and waits for it to send everything that's queued.
+  void release_worker()
+  {
+    _store.set_blocked(false);
+    _coalesced = _queue->coalesced();
+    delete _queue; _queue = NULL;
+  }
+
+  /// The IDs of sub1's bindings on the remote site.
+  std::vector<std::string> remote_binding_ids()
+  {
+    std::vector<std::string> ids;
+    AoR* aor = _store.get_aor_data("sub1", 0);
+
+    for (const BindingPair& binding : aor->bindings())
+    {
+      ids.push_back(binding.first);
+    }
+
+    delete aor; aor = NULL;
+    return ids;
+  }
+
+  BlockingAoRStore _store;
+  S4 _remote;
+  ReplicationQueue* _queue;
+  uint64_t _coalesced;
+};
+
+// A PATCH after a waiting PUT is merged into it, turning it into a PATCH that
+// has the effect of both.
+TEST_F(ReplicationQueueTest, PutThenPatch)
+{
+  store_remote({"b0"});
+
+  hold_worker();
+  _queue->put("sub1", make_aor({"b1"}), 0);
+  _queue->patch("sub1", make_patch("b2"), make_aor({"b1", "b2"}), 0);
+  EXPECT_EQ(2u, _queue->depth());
+  release_worker();
+
+  EXPECT_EQ(1u, _coalesced);
+  EXPECT_EQ(std::vector<std::string>({"b0", "b1", "b2"}), remote_binding_ids());
+}
+
+// A PUT after a waiting PATCH replaces it, so the bindings that the PATCH
+// added but the PUT's AoR doesn't have aren't sent.
+TEST_F(ReplicationQueueTest, PatchThenPut)
+{
+  store_remote({"b0"});
+
+  hold_worker();
+  _queue->patch("sub1", make_patch("b1"), make_aor({"b0", "b1"}), 0);
+  _queue->put("sub1", make_aor({"b2"}), 0);
+  EXPECT_EQ(2u, _queue->depth());
+  release_worker();
+
+  EXPECT_EQ(1u, _coalesced);
+  EXPECT_EQ(std::vector<std::string>({"b0", "b2"}), remote_binding_ids());
+}
+
+// If the subscriber isn't on the remote site, the merged PATCH is sent as a
+// PUT of the latest AoR.
+TEST_F(ReplicationQueueTest, MergedPatchFallsBackToLatestAoR)
+{
+  hold_worker();
+  _queue->patch("sub1", make_patch("b1"), make_aor({"b1"}), 0);
+  _queue->patch("sub1", make_patch("b2", {"b1"}), make_aor({"b2"}), 0);
+  release_worker();
+
+  EXPECT_EQ(1u, _coalesced);
+  EXPECT_EQ(std::vector<std::string>({"b2"}), remote_binding_ids());
+}
+
+// A DELETE replaces the waiting update.
+TEST_F(ReplicationQueueTest, DeleteReplacesUpdate)
+{
+  store_remote({"b0"});
+
+  hold_worker();
+  _queue->patch("sub1", make_patch("b1"), make_aor({"b0", "b1"}), 0);
+  _queue->remove("sub1", 0);
+  EXPECT_EQ(2u, _queue->depth());
+  release_worker();
+
+  EXPECT_EQ(1u, _coalesced);
+  EXPECT_TRUE(remote_binding_ids().empty());
+}
+
+// An update after a waiting DELETE is queued separately, so the subscriber is
+// deleted before it's added again.
+TEST_F(ReplicationQueueTest, UpdateAfterDelete)
+{
+  store_remote({"b0"});
+
+  hold_worker();
+  _queue->remove("sub1", 0);
+  _queue->put("sub1", make_aor({"b1"}), 0);
+  EXPECT_EQ(3u, _queue->depth());
+  release_worker();
+
+  EXPECT_EQ(0u, _coalesced);
+  EXPECT_EQ(std::vector<std::string>({"b1"}), remote_binding_ids());
+}
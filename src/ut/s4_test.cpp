@@ -0,0 +1,815 @@
+/**
+ * @file s4_test.cpp UT for S4.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "mock_chronos_connection.h"
+#include "memory_aor_store.h"
+#include "s4.h"
+
+using ::testing::_;
+using ::testing::DoAll;
+using ::testing::Eq;
+using ::testing::InvokeWithoutArgs;
+using ::testing::NiceMock;
+using ::testing::Return;
+using ::testing::SetArgReferee;
+
+/// MemoryAoRStore that can be made slow, to stand in for a remote site that
+/// is slow to answer, and that records the order in which a binding's URI is
+/// written.
+class TestAoRStore : public MemoryAoRStore
+{
+public:
+  TestAoRStore() :
+    MemoryAoRStore(),
+    _get_delay_ms(0),
+    _gets(0),
+    _contended_sets(0),
+    _contentions(0),
+    _failed_sets(0)
+  {
+  }
+
+  virtual AoR* get_aor_data(const std::string& aor_id,
+                            SAS::TrailId trail) override
+  {
+    _gets++;
+
+    {
+      std::unique_lock<std::mutex> lock(_lock);
+      _get_cond.wait_for(lock,
+                         std::chrono::milliseconds(_get_delay_ms),
+                         [this]() { return _get_delay_ms == 0; });
+    }
+
+    return MemoryAoRStore::get_aor_data(aor_id, trail);
+  }
+
+  /// Lets any slow gets finish now, and stops gets being slow.
+  void release_gets()
+  {
+    {
+      std::unique_lock<std::mutex> lock(_lock);
+      _get_delay_ms = 0;
+    }
+
+    _get_cond.notify_all();
+  }
+
+  virtual Store::Status set_aor_data(const std::string& aor_id,
+                                     AoR* aor,
+                                     int expiry,
+                                     SAS::TrailId trail) override
+  {
+    if (_contended_sets.fetch_sub(1) > 0)
+    {
+      _contentions++;
+      return Store::Status::DATA_CONTENTION;
+    }
+
+    _contended_sets = 0;
+
+    if (_failed_sets.fetch_sub(1) > 0)
+    {
+      return Store::Status::ERROR;
+    }
+
+    _failed_sets = 0;
+    Store::Status rc = MemoryAoRStore::set_aor_data(aor_id, aor, expiry, trail);
+    Bindings::const_iterator binding = aor->bindings().find(RECORDED_BINDING);
+
+    if ((rc == Store::Status::OK) && (binding != aor->bindings().end()))
+    {
+      std::unique_lock<std::mutex> lock(_lock);
+      _written_uris.push_back(binding->second->_uri);
+    }
+
+    return rc;
+  }
+
+  /// The URIs written for this binding, in the order they were written.
+  static const std::string RECORDED_BINDING;
+  std::vector<std::string> _written_uris;
+
+  std::atomic<int> _get_delay_ms;
+  std::atomic<int> _gets;
+
+  /// The number of writes to fail with contention before writes succeed
+  /// again.
+  std::atomic<int> _contended_sets;
+  std::atomic<int> _contentions;
+
+  /// The number of writes to fail with a store error before writes succeed
+  /// again.
+  std::atomic<int> _failed_sets;
+
+private:
+  std::mutex _lock;
+  std::condition_variable _get_cond;
+};
+
+const std::string TestAoRStore::RECORDED_BINDING = "binding1";
+
+/// Fixture for S4 tests. There's a local S4 and two remote S4s, each with
+/// their own store.
+class S4Test : public ::testing::Test
+{
+public:
+  S4Test() :
+    _chronos("chronos"),
+    _remote1("remote1", &_remote_store1),
+    _remote2("remote2", &_remote_store2),
+    _local("local", &_chronos, "callback", &_local_store, {&_remote1, &_remote2})
+  {
+  }
+
+  /// Builds an AoR with a binding that expires in five minutes. The caller
+  /// must delete the AoR.
+  static AoR* make_aor(const std::string& sub_id,
+                       const std::string& binding_id)
+  {
+    AoR* aor = new AoR(sub_id);
+    Binding* binding = aor->get_binding(binding_id);
+    binding->_uri = "sip:" + binding_id + "@192.91.191.29:59934";
+    binding->_cid = "cid";
+    binding->_expires = time(NULL) + 300;
+    return aor;
+  }
+
+  /// Writes an AoR straight into a store, bypassing S4.
+  static void store_aor(AoRStore& store,
+                        const std::string& sub_id,
+                        const std::string& binding_id)
+  {
+    AoR* aor = make_aor(sub_id, binding_id);
+    EXPECT_EQ(Store::Status::OK, store.set_aor_data(sub_id, aor, 310, 0));
+    delete aor; aor = NULL;
+  }
+
+  NiceMock<MockChronosConnection> _chronos;
+  TestAoRStore _local_store;
+  TestAoRStore _remote_store1;
+  TestAoRStore _remote_store2;
+  S4 _remote1;
+  S4 _remote2;
+  S4 _local;
+};
+
+// With parallel GETs, the subscriber is found on whichever remote S4 has it,
+// and is written back to the local store.
+TEST_F(S4Test, ParallelRemoteGet)
+{
+  _local.set_parallel_remote_gets({1000});
+  store_aor(_remote_store2, "sub1", "binding1");
+
+  AoR* aor = NULL;
+  uint64_t version;
+  EXPECT_EQ(HTTP_OK, _local.handle_get("sub1", &aor, version, 0));
+  ASSERT_TRUE(aor != NULL);
+  EXPECT_EQ(1u, aor->bindings().size());
+  delete aor; aor = NULL;
+
+  EXPECT_EQ(HTTP_NOT_FOUND, _local.handle_get("sub2", &aor, version, 0));
+  EXPECT_TRUE(aor == NULL);
+
+  AoR* local_aor = _local_store.get_aor_data("sub1", 0);
+  EXPECT_EQ(1u, local_aor->bindings().size());
+  delete local_aor; local_aor = NULL;
+}
+
+// A slow remote S4 doesn't hold up the GET past its timeout, and once it has
+// as many GETs outstanding as allowed, it isn't asked again until it answers.
+TEST_F(S4Test, ParallelRemoteGetBounded)
+{
+  _local.set_parallel_remote_gets({100}, 1, 2);
+  _remote_store1._get_delay_ms = 60000;
+  store_aor(_remote_store2, "sub1", "binding1");
+
+  AoR* aor = NULL;
+  uint64_t version;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  EXPECT_EQ(HTTP_NOT_FOUND, _local.handle_get("sub2", &aor, version, 0));
+  EXPECT_EQ(HTTP_NOT_FOUND, _local.handle_get("sub3", &aor, version, 0));
+  EXPECT_EQ(HTTP_OK, _local.handle_get("sub1", &aor, version, 0));
+  delete aor; aor = NULL;
+  EXPECT_LT(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(30000));
+
+  // The slow remote S4 is still answering the first GET, with the second
+  // waiting behind it, so it wasn't asked for the third.
+  EXPECT_EQ(1, _remote_store1._gets);
+  EXPECT_EQ(3, _remote_store2._gets);
+
+  _remote_store1.release_gets();
+}
+
+// A single remote S4 is also asked from its pool, so a slow one doesn't hold
+// up the GET past its timeout.
+TEST_F(S4Test, ParallelRemoteGetSingleRemote)
+{
+  TestAoRStore local_store;
+  S4 local("local2", &_chronos, "callback", &local_store, {&_remote1});
+  local.set_parallel_remote_gets({100}, 1, 1);
+  _remote_store1._get_delay_ms = 60000;
+
+  AoR* aor = NULL;
+  uint64_t version;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  EXPECT_EQ(HTTP_NOT_FOUND, local.handle_get("sub1", &aor, version, 0));
+  EXPECT_EQ(HTTP_NOT_FOUND, local.handle_get("sub2", &aor, version, 0));
+  EXPECT_LT(std::chrono::steady_clock::now() - start,
+            std::chrono::milliseconds(30000));
+
+  // The remote S4 is still answering the first GET, so wasn't asked for the
+  // second.
+  EXPECT_EQ(1, _remote_store1._gets);
+
+  _remote_store1.release_gets();
+}
+
+// Destroying the local S4 waits for the GETs still outstanding on the remote
+// S4s.
+TEST_F(S4Test, ParallelRemoteGetShutdown)
+{
+  TestAoRStore local_store;
+  S4* local = new S4("local2",
+                     &_chronos,
+                     "callback",
+                     &local_store,
+                     {&_remote1, &_remote2});
+  local->set_parallel_remote_gets({10});
+  _remote_store1._get_delay_ms = 100;
+
+  AoR* aor = NULL;
+  uint64_t version;
+  EXPECT_EQ(HTTP_NOT_FOUND, local->handle_get("sub1", &aor, version, 0));
+  delete local; local = NULL;
+
+  EXPECT_EQ(1, _remote_store1._gets);
+}
+
+/// Checks a multi-GET of four subscribers: one in the local store, one on
+/// each remote S4, and one that isn't anywhere.
+static void check_get_multi(S4& local, AoRStore& local_store)
+{
+  std::vector<std::string> sub_ids = {"sub1", "sub2", "sub3", "sub4"};
+  std::vector<AoR*> aors;
+  std::vector<uint64_t> versions;
+  std::vector<HTTPCode> rcs;
+  local.handle_get_multi(sub_ids, aors, versions, rcs, 0);
+
+  std::vector<HTTPCode> expected_rcs = {HTTP_OK,
+                                        HTTP_OK,
+                                        HTTP_OK,
+                                        HTTP_NOT_FOUND};
+  EXPECT_EQ(expected_rcs, rcs);
+
+  for (size_t ii = 0; ii < sub_ids.size(); ii++)
+  {
+    if (rcs[ii] == HTTP_OK)
+    {
+      EXPECT_EQ(1u, aors[ii]->bindings().size());
+      EXPECT_NE(0u, versions[ii]);
+    }
+
+    delete aors[ii]; aors[ii] = NULL;
+  }
+
+  // The subscribers found on the remote S4s have been copied locally.
+  for (size_t ii = 1; ii <= 2; ii++)
+  {
+    AoR* local_aor = local_store.get_aor_data(sub_ids[ii], 0);
+    EXPECT_EQ(1u, local_aor->bindings().size());
+    delete local_aor; local_aor = NULL;
+  }
+}
+
+// The subscribers missing from the local store are asked for together from
+// each remote S4, which is only asked for the ones not found yet. Subscribers
+// that no site has are remembered.
+TEST_F(S4Test, GetMultiFromRemotes)
+{
+  _local.set_negative_lookup_cache(60000, 100);
+  store_aor(_local_store, "sub1", "binding1");
+  store_aor(_remote_store1, "sub2", "binding1");
+  store_aor(_remote_store2, "sub3", "binding1");
+
+  check_get_multi(_local, _local_store);
+  EXPECT_EQ(3, _remote_store1._gets);
+  EXPECT_EQ(2, _remote_store2._gets);
+
+  // Everything found is now local, and the missing subscriber isn't asked
+  // for again.
+  check_get_multi(_local, _local_store);
+  EXPECT_EQ(3, _remote_store1._gets);
+  EXPECT_EQ(2, _remote_store2._gets);
+}
+
+// With parallel GETs, every remote S4 is asked for all the missing
+// subscribers at once.
+TEST_F(S4Test, GetMultiFromRemotesInParallel)
+{
+  _local.set_parallel_remote_gets({1000});
+  _local.set_negative_lookup_cache(60000, 100);
+  store_aor(_local_store, "sub1", "binding1");
+  store_aor(_remote_store1, "sub2", "binding1");
+  store_aor(_remote_store2, "sub3", "binding1");
+
+  check_get_multi(_local, _local_store);
+  EXPECT_EQ(3, _remote_store1._gets);
+  EXPECT_EQ(3, _remote_store2._gets);
+
+  check_get_multi(_local, _local_store);
+  EXPECT_EQ(3, _remote_store1._gets);
+  EXPECT_EQ(3, _remote_store2._gets);
+}
+
+// PATCHes to the same subscriber from several threads reach the remote sites
+// in the order they were applied locally, so the remote sites never go back
+// to older data, and end up with the same data as the local site.
+TEST_F(S4Test, InterleavedPatchesReplicatedInOrder)
+{
+  S4* local = new S4("local2",
+                     &_chronos,
+                     "callback",
+                     &_local_store,
+                     {&_remote1, &_remote2});
+  local->set_async_replication(1, 1000, 4, 0, 0);
+  store_aor(_local_store, "sub1", TestAoRStore::RECORDED_BINDING);
+
+  std::vector<std::thread> threads;
+
+  for (int ii = 0; ii < 4; ii++)
+  {
+    threads.push_back(std::thread([local, ii]()
+    {
+      for (int jj = 0; jj < 100; jj++)
+      {
+        Binding* binding = new Binding("sub1");
+        binding->_uri = "sip:" + std::to_string(ii) + "-" + std::to_string(jj);
+        binding->_cid = "cid";
+        binding->_expires = time(NULL) + 300;
+        PatchObject po;
+        po.set_update_bindings({{TestAoRStore::RECORDED_BINDING, binding}});
+        po.set_increment_cseq(true);
+
+        AoR* aor = NULL;
+        EXPECT_EQ(HTTP_OK, local->handle_patch("sub1", po, &aor, 0));
+        delete aor; aor = NULL;
+      }
+    }));
+  }
+
+  for (std::thread& thread : threads)
+  {
+    thread.join();
+  }
+
+  // Destroying the S4 sends everything still queued.
+  delete local; local = NULL;
+
+  // Updates may have been merged on the queue, so the remote site may not
+  // have seen every one, but the ones it saw must be in the local order.
+  const std::vector<std::string>& local_uris = _local_store._written_uris;
+  const std::vector<std::string>& remote_uris = _remote_store1._written_uris;
+  ASSERT_FALSE(remote_uris.empty());
+  std::vector<std::string>::const_iterator local_it = local_uris.begin();
+
+  for (const std::string& uri : remote_uris)
+  {
+    local_it = std::find(local_it, local_uris.end(), uri);
+    ASSERT_TRUE(local_it != local_uris.end()) << "Out of order: " << uri;
+  }
+
+  EXPECT_EQ(local_uris.back(), remote_uris.back());
+
+  AoR* local_aor = _local_store.get_aor_data("sub1", 0);
+  AoR* remote_aor = _remote_store1.get_aor_data("sub1", 0);
+  EXPECT_EQ(local_aor->_notify_cseq, remote_aor->_notify_cseq);
+  delete local_aor; local_aor = NULL;
+  delete remote_aor; remote_aor = NULL;
+}
+
+// Setting up async replication again replaces the queues, rather than adding
+// to them.
+TEST_F(S4Test, AsyncReplicationReconfigured)
+{
+  _local.set_async_replication(1, 1000, 4, 0, 0);
+  _local.set_async_replication(2, 1000, 4, 0, 0);
+  EXPECT_EQ(2u, _local.get_replication_queues().size());
+
+  PatchObject po;
+  po.set_increment_cseq(true);
+  store_aor(_local_store, "sub1", "binding1");
+
+  AoR* aor = NULL;
+  EXPECT_EQ(HTTP_OK, _local.handle_patch("sub1", po, &aor, 0));
+  delete aor; aor = NULL;
+}
+
+// A PATCH that is waiting to retry after contention doesn't hold up other
+// PATCHes to the same subscriber.
+TEST_F(S4Test, ContentionBackoffReleasesLock)
+{
+  store_aor(_local_store, "sub1", "binding1");
+  _local.set_contention_retry_policy(-1, 2000, 2000, 0, false);
+
+  PatchObject po;
+  po.set_increment_cseq(true);
+  _local_store._contended_sets = 1;
+  std::atomic<bool> waiting_done(false);
+
+  std::thread waiting([this, &po, &waiting_done]()
+  {
+    AoR* aor = NULL;
+    EXPECT_EQ(HTTP_OK, _local.handle_patch("sub1", po, &aor, 0));
+    delete aor; aor = NULL;
+    waiting_done = true;
+  });
+
+  // Wait for the first PATCH to hit contention, then send another. It
+  // finishes while the first PATCH is still backing off.
+  while (_local_store._contentions == 0)
+  {
+    std::this_thread::yield();
+  }
+
+  AoR* aor = NULL;
+  EXPECT_EQ(HTTP_OK, _local.handle_patch("sub1", po, &aor, 0));
+  EXPECT_FALSE(waiting_done);
+  delete aor; aor = NULL;
+
+  waiting.join();
+  EXPECT_EQ(1u, _local.get_contention_retry_policy().retries());
+}
+
+// A DELETE from another site that hits contention retries until it succeeds.
+TEST_F(S4Test, RemoteDeleteRetriesContention)
+{
+  store_aor(_remote_store1, "sub1", "binding1");
+  _remote_store1._contended_sets = 2;
+
+  S4* local = new S4("local2", &_chronos, "callback", &_local_store, {&_remote1});
+  store_aor(_local_store, "sub1", "binding1");
+
+  AoR* aor = NULL;
+  uint64_t version;
+  EXPECT_EQ(HTTP_OK, local->handle_get("sub1", &aor, version, 0));
+  EXPECT_EQ(HTTP_NO_CONTENT, local->handle_delete("sub1", version, 0));
+  delete aor; aor = NULL;
+  delete local; local = NULL;
+
+  AoR* remote_aor = _remote_store1.get_aor_data("sub1", 0);
+  EXPECT_TRUE(remote_aor->bindings().empty());
+  delete remote_aor; remote_aor = NULL;
+  EXPECT_EQ(2u, _remote1.get_contention_retry_policy().retries());
+}
+
+/// Builds a PUT for a batch, of an AoR whose binding has the given URI.
+static ReplicationRequest* make_put(const std::string& sub_id,
+                                    const std::string& uri)
+{
+  ReplicationRequest* request =
+    new ReplicationRequest(ReplicationRequest::PUT, sub_id, 0);
+  request->_aor = S4Test::make_aor(sub_id, TestAoRStore::RECORDED_BINDING);
+  request->_aor->get_binding(TestAoRStore::RECORDED_BINDING)->_uri = uri;
+  return request;
+}
+
+/// Builds a PATCH for a batch, that sets the URI of the binding.
+static ReplicationRequest* make_patch(const std::string& sub_id,
+                                      const std::string& uri)
+{
+  ReplicationRequest* request = make_put(sub_id, uri);
+  request->_type = ReplicationRequest::PATCH;
+  request->_po = new PatchObject();
+  convert_aor_to_patch(*request->_aor, *request->_po);
+  return request;
+}
+
+/// Gets the URI of a subscriber's binding from a store, or "" if there isn't
+/// one.
+static std::string stored_uri(AoRStore& store, const std::string& sub_id)
+{
+  AoR* aor = store.get_aor_data(sub_id, 0);
+  Binding* binding = aor->get_binding(TestAoRStore::RECORDED_BINDING);
+  std::string uri = binding->_uri;
+  delete aor; aor = NULL;
+  return uri;
+}
+
+// A batch applies each subscriber's updates in order. PUTs of subscribers
+// that exist are applied as PATCHes, and PATCHes of subscribers that don't
+// exist as PUTs.
+TEST_F(S4Test, BatchAppliedInOrder)
+{
+  store_aor(_remote_store1, "sub2", TestAoRStore::RECORDED_BINDING);
+
+  std::vector<ReplicationRequest*> requests;
+  requests.push_back(make_put("sub1", "sip:a@example.com"));
+  requests.push_back(make_patch("sub1", "sip:b@example.com"));
+  requests.push_back(make_put("sub2", "sip:c@example.com"));
+  requests.push_back(new ReplicationRequest(ReplicationRequest::DELETE, "sub3", 0));
+  requests.push_back(make_patch("sub4", "sip:d@example.com"));
+  requests.push_back(new ReplicationRequest(ReplicationRequest::DELETE, "sub1", 0));
+  requests.push_back(make_put("sub1", "sip:e@example.com"));
+
+  std::vector<HTTPCode> rcs;
+  _remote1.handle_batch(requests, rcs);
+
+  std::vector<HTTPCode> expected_rcs = {HTTP_OK,
+                                        HTTP_OK,
+                                        HTTP_OK,
+                                        HTTP_NO_CONTENT,
+                                        HTTP_OK,
+                                        HTTP_NO_CONTENT,
+                                        HTTP_OK};
+  EXPECT_EQ(expected_rcs, rcs);
+  EXPECT_EQ("sip:e@example.com", stored_uri(_remote_store1, "sub1"));
+  EXPECT_EQ("sip:c@example.com", stored_uri(_remote_store1, "sub2"));
+  EXPECT_EQ("sip:d@example.com", stored_uri(_remote_store1, "sub4"));
+
+  std::vector<std::string> expected_sub1_uris = {"sip:a@example.com",
+                                                 "sip:b@example.com",
+                                                 "sip:e@example.com"};
+  std::vector<std::string> sub1_uris;
+
+  for (const std::string& uri : _remote_store1._written_uris)
+  {
+    if (std::find(expected_sub1_uris.begin(), expected_sub1_uris.end(), uri) !=
+        expected_sub1_uris.end())
+    {
+      sub1_uris.push_back(uri);
+    }
+  }
+
+  EXPECT_EQ(expected_sub1_uris, sub1_uris);
+
+  for (ReplicationRequest* request : requests)
+  {
+    delete request; request = NULL;
+  }
+}
+
+// Only the update that hits contention is tried again.
+TEST_F(S4Test, BatchRetriesContendedUpdate)
+{
+  _remote1.set_contention_retry_policy(-1, 1, 1, 0);
+  _remote_store1._contended_sets = 1;
+
+  std::vector<ReplicationRequest*> requests;
+  requests.push_back(make_put("sub1", "sip:a@example.com"));
+  requests.push_back(make_put("sub2", "sip:b@example.com"));
+
+  std::vector<HTTPCode> rcs;
+  _remote1.handle_batch(requests, rcs);
+
+  std::vector<HTTPCode> expected_rcs = {HTTP_OK, HTTP_OK};
+  EXPECT_EQ(expected_rcs, rcs);
+  EXPECT_EQ(1, _remote_store1._contentions);
+  EXPECT_EQ(2u, _remote_store1._written_uris.size());
+  EXPECT_EQ("sip:a@example.com", stored_uri(_remote_store1, "sub1"));
+  EXPECT_EQ("sip:b@example.com", stored_uri(_remote_store1, "sub2"));
+  EXPECT_EQ(1u, _remote1.get_contention_retry_policy().retries());
+
+  for (ReplicationRequest* request : requests)
+  {
+    delete request; request = NULL;
+  }
+}
+
+// If an update fails, later updates for the same subscriber fail without
+// being applied, but updates for other subscribers go ahead.
+TEST_F(S4Test, BatchErrorFailsLaterUpdates)
+{
+  _remote_store1._failed_sets = 1;
+
+  std::vector<ReplicationRequest*> requests;
+  requests.push_back(make_put("sub1", "sip:a@example.com"));
+  requests.push_back(make_put("sub2", "sip:b@example.com"));
+  requests.push_back(make_patch("sub1", "sip:c@example.com"));
+
+  std::vector<HTTPCode> rcs;
+  _remote1.handle_batch(requests, rcs);
+
+  std::vector<HTTPCode> expected_rcs = {HTTP_SERVER_ERROR,
+                                        HTTP_OK,
+                                        HTTP_SERVER_ERROR};
+  EXPECT_EQ(expected_rcs, rcs);
+  EXPECT_EQ("", stored_uri(_remote_store1, "sub1"));
+  EXPECT_EQ("sip:b@example.com", stored_uri(_remote_store1, "sub2"));
+
+  for (ReplicationRequest* request : requests)
+  {
+    delete request; request = NULL;
+  }
+}
+
+/// Timer pop consumer that runs a function on each pop.
+class TestTimerPopConsumer : public S4::TimerPopConsumer
+{
+public:
+  TestTimerPopConsumer(std::function<void()> on_pop) : _on_pop(on_pop) {}
+
+  virtual void handle_timer_pop(const std::string& aor_id,
+                                SAS::TrailId trail) override
+  {
+    _on_pop();
+  }
+
+  std::function<void()> _on_pop;
+};
+
+// Chronos is sent the timer after the subscriber's write lock is released, so
+// other updates to the subscriber can go ahead meanwhile. If both updates
+// create a timer, only the first one to be stored is kept.
+TEST_F(S4Test, TimersSentWithoutLock)
+{
+  store_aor(_local_store, "sub1", "binding1");
+  PatchObject po;
+  po.set_increment_cseq(true);
+
+  bool other_patch_done = false;
+  std::future<void> other_patch;
+
+  EXPECT_CALL(_chronos, send_post(_, _, _, _, _, _))
+    .WillOnce(DoAll(SetArgReferee<0>("timer1"),
+                    InvokeWithoutArgs([&]()
+                    {
+                      // Update the subscriber on another thread, which can
+                      // only finish if the lock has been released.
+                      other_patch = std::async(std::launch::async, [&]()
+                      {
+                        AoR* aor = NULL;
+                        EXPECT_EQ(HTTP_OK,
+                                  _local.handle_patch("sub1", po, &aor, 0));
+                        delete aor; aor = NULL;
+                      });
+                      other_patch_done = (other_patch.wait_for(
+                                            std::chrono::seconds(5)) ==
+                                          std::future_status::ready);
+                    }),
+                    Return(HTTP_OK)))
+    .WillOnce(DoAll(SetArgReferee<0>("timer2"), Return(HTTP_OK)));
+  EXPECT_CALL(_chronos, send_delete("timer1", _)).WillOnce(Return(HTTP_OK));
+  EXPECT_CALL(_chronos, send_put(Eq(std::string("timer2")), _, _, _, _, _))
+    .WillOnce(Return(HTTP_OK));
+
+  AoR* aor = NULL;
+  EXPECT_EQ(HTTP_OK, _local.handle_patch("sub1", po, &aor, 0));
+  EXPECT_TRUE(other_patch_done);
+  EXPECT_EQ("timer2", aor->_timer_id);
+  delete aor; aor = NULL;
+  other_patch.wait();
+
+  AoR* stored_aor = _local_store.get_aor_data("sub1", 0);
+  EXPECT_EQ("timer2", stored_aor->_timer_id);
+  delete stored_aor; stored_aor = NULL;
+}
+
+// A new timer's ID is stored with the subscriber, so later updates move the
+// same timer rather than creating another.
+TEST_F(S4Test, NewTimerStored)
+{
+  store_aor(_local_store, "sub1", "binding1");
+  PatchObject po;
+  po.set_increment_cseq(true);
+
+  EXPECT_CALL(_chronos, send_post(_, _, _, _, _, _))
+    .WillOnce(DoAll(SetArgReferee<0>("timer1"), Return(HTTP_OK)));
+  EXPECT_CALL(_chronos, send_put(Eq(std::string("timer1")), _, _, _, _, _))
+    .WillOnce(Return(HTTP_OK));
+
+  for (int ii = 0; ii < 2; ii++)
+  {
+    AoR* aor = NULL;
+    EXPECT_EQ(HTTP_OK, _local.handle_patch("sub1", po, &aor, 0));
+    EXPECT_EQ("timer1", aor->_timer_id);
+    delete aor; aor = NULL;
+  }
+
+  // The version returned by a GET is the current one.
+  AoR* aor = NULL;
+  uint64_t version;
+  EXPECT_EQ(HTTP_OK, _local.handle_get("sub1", &aor, version, 0));
+  delete aor; aor = NULL;
+  EXPECT_CALL(_chronos, send_delete("timer1", _)).WillOnce(Return(HTTP_OK));
+  EXPECT_EQ(HTTP_NO_CONTENT, _local.handle_delete("sub1", version, 0));
+}
+
+// A new subscriber's timer is created before it's written, so its ID is
+// written to the local store and replicated to the remote sites in the same
+// write as the rest of the subscriber.
+TEST_F(S4Test, PutReplicatesTimerId)
+{
+  EXPECT_CALL(_chronos, send_post(_, _, _, _, _, _))
+    .WillOnce(DoAll(SetArgReferee<0>("timer1"), Return(HTTP_OK)));
+
+  AoR* aor = make_aor("sub1", TestAoRStore::RECORDED_BINDING);
+  EXPECT_EQ(HTTP_OK, _local.handle_put("sub1", *aor, 0));
+  delete aor; aor = NULL;
+
+  for (TestAoRStore* store : {&_local_store, &_remote_store1, &_remote_store2})
+  {
+    AoR* stored_aor = store->get_aor_data("sub1", 0);
+    EXPECT_EQ("timer1", stored_aor->_timer_id);
+    delete stored_aor; stored_aor = NULL;
+  }
+
+  // The timer ID didn't need a second write.
+  EXPECT_EQ(1u, _local_store._written_uris.size());
+}
+
+// A timer created after a PATCH is written has its ID stored by a second
+// write, which is replicated to the remote sites too.
+TEST_F(S4Test, PatchReplicatesNewTimerId)
+{
+  store_aor(_local_store, "sub1", "binding1");
+  store_aor(_remote_store1, "sub1", "binding1");
+  PatchObject po;
+  po.set_increment_cseq(true);
+
+  EXPECT_CALL(_chronos, send_post(_, _, _, _, _, _))
+    .WillOnce(DoAll(SetArgReferee<0>("timer1"), Return(HTTP_OK)));
+
+  AoR* aor = NULL;
+  EXPECT_EQ(HTTP_OK, _local.handle_patch("sub1", po, &aor, 0));
+  EXPECT_EQ("timer1", aor->_timer_id);
+  delete aor; aor = NULL;
+
+  // The first remote site is patched, and the second is sent the whole
+  // subscriber, as it didn't have it.
+  for (TestAoRStore* store : {&_local_store, &_remote_store1, &_remote_store2})
+  {
+    AoR* stored_aor = store->get_aor_data("sub1", 0);
+    EXPECT_EQ("timer1", stored_aor->_timer_id);
+    delete stored_aor; stored_aor = NULL;
+  }
+}
+
+// If a PUT fails because the subscriber already exists, the timer created
+// for it is deleted.
+TEST_F(S4Test, FailedPutDeletesTimer)
+{
+  store_aor(_local_store, "sub1", "binding1");
+
+  EXPECT_CALL(_chronos, send_post(_, _, _, _, _, _))
+    .WillOnce(DoAll(SetArgReferee<0>("timer1"), Return(HTTP_OK)));
+  EXPECT_CALL(_chronos, send_delete("timer1", _)).WillOnce(Return(HTTP_OK));
+
+  AoR* aor = make_aor("sub1", "binding2");
+  EXPECT_EQ(HTTP_PRECONDITION_FAILED, _local.handle_put("sub1", *aor, 0));
+  EXPECT_EQ("", aor->_timer_id);
+  delete aor; aor = NULL;
+}
+
+// A timer pop for an expired binding is mimicked after the subscriber's write
+// lock is released, so the subscriber manager can update the subscriber.
+TEST_F(S4Test, MimicTimerPopWithoutLock)
+{
+  AoR* expired_aor = make_aor("sub1", "binding1");
+  expired_aor->get_binding("binding1")->_expires = time(NULL) - 1;
+  Binding* binding = expired_aor->get_binding("binding2");
+  binding->_uri = "sip:binding2@192.91.191.29:59934";
+  binding->_expires = time(NULL) + 300;
+
+  bool pop_handled = false;
+  TestTimerPopConsumer consumer([&]()
+  {
+    std::future<void> remove = std::async(std::launch::async, [&]()
+    {
+      PatchObject po;
+      po.set_remove_bindings({"binding1"});
+      AoR* aor = NULL;
+      EXPECT_EQ(HTTP_OK, _local.handle_patch("sub1", po, &aor, 0));
+      delete aor; aor = NULL;
+    });
+    pop_handled = (remove.wait_for(std::chrono::seconds(5)) ==
+                   std::future_status::ready);
+  });
+  _local.register_timer_pop_consumer(&consumer);
+
+  EXPECT_EQ(HTTP_OK, _local.handle_put("sub1", *expired_aor, 0));
+  delete expired_aor; expired_aor = NULL;
+  EXPECT_TRUE(pop_handled);
+
+  AoR* stored_aor = _local_store.get_aor_data("sub1", 0);
+  EXPECT_EQ(1u, stored_aor->bindings().size());
+  delete stored_aor; stored_aor = NULL;
+}
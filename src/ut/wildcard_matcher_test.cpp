@@ -0,0 +1,186 @@
+/**
+ * @file wildcard_matcher_test.cpp UT for wildcarded IMPU matching.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "gtest/gtest.h"
+#include "rapidjson/stringbuffer.h"
+#include "wildcard_matcher.h"
+#include "associated_uris.h"
+#include "aor.h"
+#include "astaire_aor_store.h"
+
+// An IMPU matches a wildcard if it has the wildcard's prefix and suffix, and
+// the part in between matches the regular expression.
+TEST(WildcardMatcherTest, Match)
+{
+  WildcardMatcher matcher({"sip:!65055502.*!@homedomain",
+                           "sip:!.*!@otherdomain",
+                           "tel:!\\+1650555.*!"});
+  std::string wildcard;
+
+  EXPECT_TRUE(matcher.match("sip:6505550231@homedomain", wildcard));
+  EXPECT_EQ("sip:!65055502.*!@homedomain", wildcard);
+  EXPECT_TRUE(matcher.match("sip:anyone@otherdomain", wildcard));
+  EXPECT_EQ("sip:!.*!@otherdomain", wildcard);
+  EXPECT_TRUE(matcher.match("tel:+16505550231", wildcard));
+  EXPECT_EQ("tel:!\\+1650555.*!", wildcard);
+
+  wildcard = "unchanged";
+  EXPECT_FALSE(matcher.match("sip:6505550331@homedomain", wildcard));
+  EXPECT_FALSE(matcher.match("sip:6505550231@homedomain.other", wildcard));
+  EXPECT_FALSE(matcher.match("sips:6505550231@homedomain", wildcard));
+  EXPECT_FALSE(matcher.match("tel:+16505560231", wildcard));
+  EXPECT_FALSE(matcher.match("", wildcard));
+  EXPECT_EQ("unchanged", wildcard);
+}
+
+// The literal suffix is matched exactly, not as a regular expression.
+TEST(WildcardMatcherTest, LiteralSuffix)
+{
+  WildcardMatcher matcher({"sip:!.*!@home.domain"});
+  std::string wildcard;
+  EXPECT_TRUE(matcher.match("sip:a@home.domain", wildcard));
+  EXPECT_FALSE(matcher.match("sip:a@homexdomain", wildcard));
+}
+
+// The prefix and suffix can't overlap.
+TEST(WildcardMatcherTest, ShortIMPU)
+{
+  WildcardMatcher matcher({"sip:a!.*!a"});
+  std::string wildcard;
+  EXPECT_FALSE(matcher.match("sip:a", wildcard));
+  EXPECT_TRUE(matcher.match("sip:aa", wildcard));
+}
+
+// If an IMPU matches several wildcards, the first one wins, whatever the
+// length of their suffixes.
+TEST(WildcardMatcherTest, FirstMatchWins)
+{
+  WildcardMatcher matcher({"sip:!.*!n",
+                           "sip:!.*!@homedomain",
+                           "sip:!6505.*!@homedomain"});
+  std::string wildcard;
+  EXPECT_TRUE(matcher.match("sip:6505550231@homedomain", wildcard));
+  EXPECT_EQ("sip:!.*!n", wildcard);
+
+  WildcardMatcher reversed({"sip:!6505.*!@homedomain",
+                            "sip:!.*!@homedomain"});
+  EXPECT_TRUE(reversed.match("sip:6505550231@homedomain", wildcard));
+  EXPECT_EQ("sip:!6505.*!@homedomain", wildcard);
+  EXPECT_TRUE(reversed.match("sip:7505550231@homedomain", wildcard));
+  EXPECT_EQ("sip:!.*!@homedomain", wildcard);
+}
+
+// Wildcards without a regular expression, or with an invalid one, are
+// ignored.
+TEST(WildcardMatcherTest, InvalidWildcards)
+{
+  WildcardMatcher matcher({"sip:nowildcard@homedomain",
+                           "sip:!onlyone@homedomain",
+                           "sip:![!@homedomain"});
+  std::string wildcard;
+  EXPECT_FALSE(matcher.match("sip:nowildcard@homedomain", wildcard));
+  EXPECT_FALSE(matcher.match("sip:!onlyone@homedomain", wildcard));
+  EXPECT_FALSE(matcher.match("sip:[@homedomain", wildcard));
+}
+
+// A URI is only treated as a wildcard for barring if it is the wildcard in a
+// wildcard mapping - '!' is allowed in an ordinary SIP URI.
+TEST(WildcardMatcherTest, AssociatedURIsBarring)
+{
+  AssociatedURIs uris;
+  uris.add_uri("sip:6505550231@homedomain", false);
+  uris.add_barring_status("sip:!.*!@homedomain", true);
+  uris.add_barring_status("sip:!a!b@otherdomain", true);
+
+  EXPECT_FALSE(uris.is_impu_barred("sip:6505550231@homedomain"));
+  EXPECT_FALSE(uris.is_impu_barred("sip:6505550232@homedomain"));
+  EXPECT_FALSE(uris.is_impu_barred("sip:ab@otherdomain"));
+  EXPECT_TRUE(uris.is_impu_barred("sip:!a!b@otherdomain"));
+
+  uris.add_wildcard_mapping("sip:!.*!@homedomain", "sip:6505550233@homedomain");
+  EXPECT_TRUE(uris.is_impu_barred("sip:6505550232@homedomain"));
+  EXPECT_TRUE(uris.is_impu_barred("sip:6505550233@homedomain"));
+  EXPECT_FALSE(uris.is_impu_barred("sip:6505550231@homedomain"));
+  EXPECT_FALSE(uris.is_impu_barred("sip:ab@otherdomain"));
+
+  // Copies share the matcher.
+  AssociatedURIs copy(uris);
+  EXPECT_TRUE(copy.is_impu_barred("sip:6505550232@homedomain"));
+
+  uris.clear_uris();
+  EXPECT_FALSE(uris.is_impu_barred("sip:6505550232@homedomain"));
+  EXPECT_TRUE(copy.is_impu_barred("sip:6505550232@homedomain"));
+}
+
+// The mapping can be added before the wildcard's barring state.
+TEST(WildcardMatcherTest, AssociatedURIsMappingFirst)
+{
+  AssociatedURIs uris;
+  uris.add_wildcard_mapping("sip:!.*!@homedomain", "sip:6505550233@homedomain");
+  EXPECT_FALSE(uris.is_impu_barred("sip:6505550232@homedomain"));
+
+  uris.add_uri("sip:!.*!@homedomain", true);
+  EXPECT_TRUE(uris.is_impu_barred("sip:6505550232@homedomain"));
+}
+
+/// Checks that an IRS read back from the store still resolves the barring of
+/// IMPUs in its wildcarded range.
+static void check_wildcard_barring(const AssociatedURIs& uris)
+{
+  EXPECT_FALSE(uris.is_impu_barred("sip:6505550231@homedomain"));
+  EXPECT_TRUE(uris.is_impu_barred("sip:6505550232@homedomain"));
+  EXPECT_TRUE(uris.is_impu_barred("sip:6505550233@homedomain"));
+  ASSERT_EQ(1u, uris.get_wildcard_mapping().size());
+  EXPECT_EQ("sip:6505550233@homedomain",
+            uris.get_wildcard_mapping().begin()->first);
+  EXPECT_EQ("sip:!.*!@homedomain",
+            uris.get_wildcard_mapping().begin()->second);
+}
+
+// The wildcard mapping survives being written to the store in either format
+// and read back, so barring still resolves through the wildcard.
+TEST(WildcardMatcherTest, AssociatedURIsSerialized)
+{
+  AoR aor("sip:6505550231@homedomain");
+  aor.associated_uris().add_uri("sip:6505550231@homedomain", false);
+  aor.associated_uris().add_uri("sip:!.*!@homedomain", true);
+  aor.associated_uris().add_wildcard_mapping("sip:!.*!@homedomain",
+                                             "sip:6505550233@homedomain");
+  check_wildcard_barring(aor.associated_uris());
+
+  AstaireAoRStore::JsonSerializerDeserializer json_serializer;
+  AstaireAoRStore::BinarySerializerDeserializer binary_serializer;
+  AstaireAoRStore::SerializerDeserializer* serializers[] = {&json_serializer,
+                                                            &binary_serializer};
+
+  for (AstaireAoRStore::SerializerDeserializer* serializer : serializers)
+  {
+    std::string data;
+    serializer->serialize_aor(&aor, data);
+    AoR* read_aor = serializer->deserialize_aor("sip:6505550231@homedomain",
+                                                data);
+    ASSERT_TRUE(read_aor != NULL);
+    check_wildcard_barring(read_aor->associated_uris());
+    delete read_aor; read_aor = NULL;
+  }
+
+  // The same goes for AssociatedURIs::from_json.
+  rapidjson::StringBuffer buffer;
+  rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+  aor.associated_uris().to_json(writer);
+  rapidjson::Document doc;
+  doc.Parse<0>(buffer.GetString());
+  ASSERT_FALSE(doc.HasParseError());
+
+  AssociatedURIs read_uris;
+  read_uris.from_json(doc);
+  check_wildcard_barring(read_uris);
+}
@@ -0,0 +1,98 @@
+/**
+ * @file worker_pool_test.cpp UT for the WorkerPool class.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "worker_pool.h"
+
+// Submitted work runs on the pool's threads.
+TEST(WorkerPoolTest, RunsWork)
+{
+  std::atomic<int> count(0);
+  std::atomic<int> on_pool(0);
+
+  {
+    WorkerPool pool(4, 100);
+    EXPECT_FALSE(pool.on_pool_thread());
+
+    for (int ii = 0; ii < 50; ii++)
+    {
+      EXPECT_TRUE(pool.submit([&]()
+      {
+        count++;
+
+        if (pool.on_pool_thread())
+        {
+          on_pool++;
+        }
+      }));
+    }
+  }
+
+  // The destructor waits for all the work to run.
+  EXPECT_EQ(50, count);
+  EXPECT_EQ(50, on_pool);
+}
+
+// Work is refused once max_outstanding pieces of work are queued or running,
+// and accepted again once some of it finishes.
+TEST(WorkerPoolTest, Bounded)
+{
+  std::mutex lock;
+  std::condition_variable cond;
+  bool release = false;
+  std::atomic<int> count(0);
+
+  WorkerPool pool(1, 3);
+  std::function<void()> blocked = [&]()
+  {
+    std::unique_lock<std::mutex> wait_lock(lock);
+    cond.wait(wait_lock, [&]() { return release; });
+    count++;
+  };
+
+  EXPECT_TRUE(pool.submit(blocked));
+  EXPECT_TRUE(pool.submit(blocked));
+  EXPECT_TRUE(pool.submit(blocked));
+  EXPECT_FALSE(pool.submit(blocked));
+
+  {
+    std::unique_lock<std::mutex> release_lock(lock);
+    release = true;
+  }
+
+  cond.notify_all();
+
+  while (count < 3)
+  {
+    std::this_thread::yield();
+  }
+
+  // The last piece of work has run, but the thread may not have marked it as
+  // finished yet.
+  bool submitted = false;
+
+  while (!submitted)
+  {
+    submitted = pool.submit([&]() { count++; });
+  }
+}
+
+// A pool that is never used can be destroyed.
+TEST(WorkerPoolTest, Unused)
+{
+  WorkerPool pool(8, 10);
+  EXPECT_EQ(8, pool.num_threads());
+}
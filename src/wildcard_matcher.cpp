@@ -0,0 +1,108 @@
+/**
+ * @file wildcard_matcher.cpp Matches IMPUs against wildcarded IMPUs.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include "log.h"
+#include "wildcard_matcher.h"
+
+WildcardMatcher::WildcardMatcher(const std::vector<std::string>& wildcards)
+{
+  for (const std::string& wildcard : wildcards)
+  {
+    size_t start = wildcard.find('!');
+    size_t end = (start != std::string::npos) ? wildcard.find('!', start + 1) :
+                                                std::string::npos;
+
+    if (end == std::string::npos)
+    {
+      TRC_DEBUG("Ignoring wildcard %s with no regex", wildcard.c_str());
+      continue;
+    }
+
+    Entry entry;
+    entry._wildcard = wildcard;
+    entry._prefix = wildcard.substr(0, start);
+
+    try
+    {
+      entry._middle = std::regex(wildcard.substr(start + 1, end - start - 1));
+    }
+    catch (const std::regex_error& e)
+    {
+      TRC_DEBUG("Ignoring wildcard %s with invalid regex", wildcard.c_str());
+      continue;
+    }
+
+    // Add the entry to the trie under its suffix, read backwards.
+    Node* node = &_root;
+
+    for (size_t ii = wildcard.size(); ii > end + 1; ii--)
+    {
+      std::unique_ptr<Node>& child = node->_children[wildcard[ii - 1]];
+
+      if (child == NULL)
+      {
+        child.reset(new Node());
+      }
+
+      node = child.get();
+    }
+
+    node->_entries.push_back(_entries.size());
+    _entries.push_back(std::move(entry));
+  }
+}
+
+bool WildcardMatcher::match(const std::string& impu,
+                            std::string& wildcard) const
+{
+  const Entry* best = NULL;
+  const Node* node = &_root;
+
+  // The IMPU from here to the end matches the suffix of the entries at the
+  // current node.
+  size_t suffix_start = impu.size();
+
+  while (node != NULL)
+  {
+    for (size_t index : node->_entries)
+    {
+      const Entry* entry = &_entries[index];
+
+      if (((best == NULL) || (entry < best)) &&
+          (entry->_prefix.size() <= suffix_start) &&
+          (impu.compare(0, entry->_prefix.size(), entry->_prefix) == 0) &&
+          (std::regex_match(impu.begin() + entry->_prefix.size(),
+                            impu.begin() + suffix_start,
+                            entry->_middle)))
+      {
+        best = entry;
+      }
+    }
+
+    if (suffix_start == 0)
+    {
+      break;
+    }
+
+    suffix_start--;
+    std::map<char, std::unique_ptr<Node>>::const_iterator child =
+                                   node->_children.find(impu[suffix_start]);
+    node = (child != node->_children.end()) ? child->second.get() : NULL;
+  }
+
+  if (best != NULL)
+  {
+    wildcard = best->_wildcard;
+    return true;
+  }
+
+  return false;
+}
@@ -0,0 +1,105 @@
+/**
+ * @file worker_pool.cpp Bounded pool of threads that run queued work.
+ *
+ * Copyright (C) Metaswitch Networks 2018
+ * If license terms are provided to you in a COPYING file in the root directory
+ * of the source code repository by which you are accessing this code, then
+ * the license outlined in that COPYING file applies to your use.
+ * Otherwise no rights are granted except for those provided to you by
+ * Metaswitch Networks in a separate written agreement.
+ */
+
+#include <algorithm>
+
+#include "log.h"
+#include "worker_pool.h"
+
+thread_local const WorkerPool* WorkerPool::_current_pool = NULL;
+
+WorkerPool::WorkerPool(int num_threads, size_t max_outstanding) :
+  _num_threads(std::max(num_threads, 1)),
+  _max_outstanding(std::max(max_outstanding, (size_t)1)),
+  _outstanding(0),
+  _stopping(false)
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+    _stopping = true;
+  }
+
+  _cond.notify_all();
+
+  for (std::thread& thread : _threads)
+  {
+    thread.join();
+  }
+
+  _threads.clear();
+}
+
+bool WorkerPool::submit(std::function<void()> work)
+{
+  {
+    std::unique_lock<std::mutex> lock(_lock);
+
+    if ((_stopping) || (_outstanding >= _max_outstanding))
+    {
+      TRC_DEBUG("Worker pool is full (%zu outstanding), refusing work",
+                _outstanding);
+      return false;
+    }
+
+    if (_threads.empty())
+    {
+      for (int ii = 0; ii < _num_threads; ii++)
+      {
+        _threads.push_back(std::thread(&WorkerPool::worker_thread, this));
+      }
+    }
+
+    _work.push_back(std::move(work));
+    _outstanding++;
+  }
+
+  _cond.notify_one();
+  return true;
+}
+
+bool WorkerPool::on_pool_thread() const
+{
+  return (_current_pool == this);
+}
+
+void WorkerPool::worker_thread()
+{
+  _current_pool = this;
+  std::unique_lock<std::mutex> lock(_lock);
+
+  while (true)
+  {
+    _cond.wait(lock, [this]()
+    {
+      return (_stopping || !_work.empty());
+    });
+
+    if (_work.empty())
+    {
+      // We're stopping, and there's nothing left to do.
+      break;
+    }
+
+    std::function<void()> work = std::move(_work.front());
+    _work.pop_front();
+
+    lock.unlock();
+    work();
+    work = nullptr;
+    lock.lock();
+
+    _outstanding--;
+  }
+}